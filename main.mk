@@ -36,17 +36,23 @@ TCCX += -DSQLITE_THREADSAFE=0
 
 # Object files for the XJD1 library.
 #
-LIBOBJ+= complete.o conn.o context.o
-LIBOBJ+= datasrc.o delete.o
+LIBOBJ+= arena.o
+LIBOBJ+= catalog.o complete.o conn.o context.o
+LIBOBJ+= datasrc.o delete.o doccache.o
 LIBOBJ+= expr.o
 LIBOBJ+= func.o
-LIBOBJ+= json.o
+LIBOBJ+= group.o
+LIBOBJ+= index.o
+LIBOBJ+= join.o json.o
+LIBOBJ+= label.o
 LIBOBJ+= memory.o
-LIBOBJ+= parse.o pragma.o
+LIBOBJ+= number.o
+LIBOBJ+= parse.o pragma.o pushdown.o
 LIBOBJ+= query.o
-LIBOBJ+= sqlite3.o stmt.o string.o
-LIBOBJ+= tokenize.o trace.o
+LIBOBJ+= sqlite3.o stmt.o storage.o string.o subquery.o
+LIBOBJ+= thread.o tokenize.o trace.o
 LIBOBJ+= update.o
+LIBOBJ+= valueset.o
 
 # All of the source code files.
 #
@@ -79,6 +85,17 @@ all:	xjd1
 #
 test:	xjd1
 	./xjd1 $(TOP)/test/all.test
+	./xjd1 --memsys $(TOP)/test/memsys01.test
+
+# Build another shell with XJD1_ENABLE_THREADS in subdirectory threads
+# and run all tests with it, including those that use several threads
+# and are skipped by "make test".
+#
+threadtest:
+	mkdir -p threads
+	$(MAKE) -C threads -f $(abspath $(TOP))/main.mk TOP=$(abspath $(TOP)) \
+	  BCC="$(BCC)" TCC="$(TCC)" AR="$(AR)" RANLIB="$(RANLIB)" \
+	  OPTS="$(OPTS) -DXJD1_ENABLE_THREADS" AUXLIB="$(AUXLIB) -lpthread" test
 
 # The shell program
 #
@@ -130,3 +147,4 @@ sqlite3.o:	$(TOP)/src/sqlite3.c $(TOP)/src/sqlite3.h
 clean:	
 	rm -f *.o lib*.a
 	rm -f lemon xjd1 parse.* parse_txt.h lempar.c
+	rm -rf threads
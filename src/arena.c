@@ -0,0 +1,187 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains code used to allocate the documents read by a scan
+** of a collection.
+**
+** Each document is decoded into a DocArena: a memory pool that holds all
+** of its nodes, struct elements and strings, usually in a single chunk.
+** Like the literals of a statement, the nodes of the document have a
+** reference count of XJD1_POOL_NREF, so xjd1JsonFree() never frees them.
+**
+** When the scan moves to the next row it releases the arena. If nothing
+** else holds a reference to any node of the document, every reference
+** count is back to XJD1_POOL_NREF and the arena is rewound, so that the
+** next document reuses its memory. Otherwise the arena is moved to a list
+** kept by the database connection, and is freed by a later sweep of that
+** list once the last reference has gone.
+**
+** Code that keeps values for much longer than a row, such as a sort,
+** uses xjd1JsonPromote() to take its own copy on the heap instead, so
+** that the arena can be rewound.
+*/
+#include "xjd1Int.h"
+
+/*
+** The retained arenas of a connection are not swept until there are at
+** least ARENA_SWEEP_MIN of them.
+*/
+#define ARENA_SWEEP_MIN  64
+
+/*
+** Memory for a single document.
+*/
+struct DocArena {
+  Pool sPool;                     /* Memory for the document */
+  JsonNode *pDoc;                 /* The document, or NULL */
+  DocArena *pNext;                /* Next on xjd1.pArenaRetained */
+};
+
+/*
+** Return a new, empty, arena, or NULL on OOM.
+*/
+DocArena *xjd1ArenaNew(void){
+  return xjd1MallocZero(sizeof(DocArena));
+}
+
+/*
+** Free an arena and its document. There must be no references to the
+** document.
+*/
+void xjd1ArenaFree(DocArena *p){
+  if( p ){
+    xjd1PoolClear(&p->sPool);
+    xjd1_free(p);
+  }
+}
+
+/*
+** Decode a document into arena p. The arguments that follow p are the
+** same as those of xjd1StorageRead(). If p is NULL, the document is
+** decoded using xjd1_malloc() instead.
+**
+** The arena must be empty, as returned by xjd1ArenaNew() or
+** xjd1ArenaRelease(). xjd1JsonRef() has been called on the returned
+** document. The caller must invoke xjd1JsonFree() before releasing
+** the arena.
+*/
+JsonNode *xjd1ArenaRead(
+  DocArena *p,
+  const void *a,
+  int n,
+  int isBinary,
+  const JsonNode *pProj,
+  LabelTable *pLabels
+){
+  if( p==0 ) return xjd1StorageRead(a, n, isBinary, pProj, pLabels, 0);
+  assert( p->pDoc==0 );
+  if( p->sPool.pChunk==0 ){
+    /* Size the first chunk so that it is likely to hold the whole
+    ** document. If it does, the chunk is reused by the next document. */
+    p->sPool.szChunk = n*4 + 256;
+  }
+  p->pDoc = xjd1StorageRead(a, n, isBinary, pProj, pLabels, &p->sPool);
+  return xjd1JsonRef(p->pDoc);
+}
+
+/*
+** Decode the document held in column iCol of the current row of pStmt
+** into arena p. See xjd1ArenaRead().
+*/
+JsonNode *xjd1ArenaColumn(
+  DocArena *p,
+  sqlite3_stmt *pStmt,
+  int iCol,
+  const JsonNode *pProj,
+  LabelTable *pLabels
+){
+  if( sqlite3_column_type(pStmt, iCol)==SQLITE_BLOB ){
+    const void *a = sqlite3_column_blob(pStmt, iCol);
+    int n = sqlite3_column_bytes(pStmt, iCol);
+    return xjd1ArenaRead(p, a, n, 1, pProj, pLabels);
+  }else{
+    const char *zJson = (const char*)sqlite3_column_text(pStmt, iCol);
+    int n = sqlite3_column_bytes(pStmt, iCol);
+    return xjd1ArenaRead(p, zJson, n, 0, pProj, pLabels);
+  }
+}
+
+/*
+** Return true if anything holds a reference to node p of an arena, or
+** to any node below it.
+*/
+static int arenaInUse(const JsonNode *p){
+  if( p->nRef!=XJD1_POOL_NREF ) return 1;
+  switch( p->eJType ){
+    case XJD1_ARRAY: {
+      int i;
+      for(i=0; i<p->u.ar.nElem; i++){
+        if( arenaInUse(p->u.ar.apElem[i]) ) return 1;
+      }
+      break;
+    }
+    case XJD1_STRUCT: {
+      JsonStructElem *pElem;
+      for(pElem=p->u.st.pFirst; pElem; pElem=pElem->pNext){
+        if( arenaInUse(pElem->pValue) ) return 1;
+      }
+      break;
+    }
+  }
+  return 0;
+}
+
+/*
+** Release arena p once its owner has freed its reference to the
+** document. If no references to the document remain, empty the arena
+** and return it for reuse. Otherwise, add it to the retained arenas of
+** connection pConn and return NULL.
+*/
+DocArena *xjd1ArenaRelease(xjd1 *pConn, DocArena *p){
+  if( p==0 ) return 0;
+  if( p->pDoc && arenaInUse(p->pDoc) ){
+    p->pNext = pConn->pArenaRetained;
+    pConn->pArenaRetained = p;
+    pConn->nArenaRetained++;
+    if( pConn->nArenaRetained>=pConn->nArenaSweep ){
+      xjd1ArenaSweep(pConn, 0);
+    }
+    return 0;
+  }
+  p->pDoc = 0;
+  xjd1PoolRewind(&p->sPool);
+  return p;
+}
+
+/*
+** Free the retained arenas of connection pConn that are no longer in
+** use, or all of them if freeAll is true.
+*/
+void xjd1ArenaSweep(xjd1 *pConn, int freeAll){
+  DocArena **pp = &pConn->pArenaRetained;
+  DocArena *p;
+  while( (p = *pp)!=0 ){
+    if( freeAll || arenaInUse(p->pDoc)==0 ){
+      *pp = p->pNext;
+      xjd1ArenaFree(p);
+      pConn->nArenaRetained--;
+    }else{
+      pp = &p->pNext;
+    }
+  }
+  pConn->nArenaSweep = pConn->nArenaRetained*2;
+  if( pConn->nArenaSweep<ARENA_SWEEP_MIN ) pConn->nArenaSweep = ARENA_SWEEP_MIN;
+}
@@ -0,0 +1,165 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains the cache of collection metadata that each
+** database connection keeps, so that statements that write to a
+** collection do not query the catalog again for every document.
+**
+** For each collection used, the cache records its storage format, the
+** list of its indices, with their lazily prepared statements, and a
+** prepared statement that inserts a document.
+**
+** Everything that changes this metadata (CREATE and DROP of collections
+** and of indices) changes the SQLite schema. The cache is emptied
+** whenever the "PRAGMA schema_version" value differs from the value it
+** was loaded under, which is checked each time an entry is looked up.
+** Entries, and the index lists they hold, therefore stay valid for the
+** whole of a statement, because the schema cannot change while the
+** statement holds its read transaction.
+*/
+#include "xjd1Int.h"
+
+typedef struct CatalogEntry CatalogEntry;
+
+/*
+** Metadata for a single collection.
+*/
+struct CatalogEntry {
+  char *zColl;                    /* Name of the collection */
+  int isBinary;                   /* True for the binary storage format */
+  int bIdxLoaded;                 /* True once pIdx has been loaded */
+  Index *pIdx;                    /* Indices on the collection */
+  sqlite3_stmt *pInsert;          /* Insert a document.  Lazily prepared */
+  CatalogEntry *pNext;            /* Next entry of the same connection */
+};
+
+/*
+** The collection metadata cache of a database connection.
+*/
+struct Catalog {
+  CatalogEntry *pFirst;           /* All entries */
+  sqlite3_stmt *pVersion;         /* "PRAGMA schema_version", or NULL */
+  int iVersion;                   /* schema_version of the entries */
+};
+
+/*
+** Free all entries of cache p.
+*/
+static void catalogClear(Catalog *p){
+  while( p->pFirst ){
+    CatalogEntry *pEntry = p->pFirst;
+    p->pFirst = pEntry->pNext;
+    xjd1IndexListFree(pEntry->pIdx);
+    sqlite3_finalize(pEntry->pInsert);
+    xjd1_free(pEntry->zColl);
+    xjd1_free(pEntry);
+  }
+}
+
+/*
+** Return the cache entry for collection zColl, creating it if needed.
+** Return NULL on OOM.
+*/
+static CatalogEntry *catalogFind(xjd1 *pConn, const char *zColl){
+  Catalog *p = pConn->pCatalog;
+  CatalogEntry *pEntry;
+  int iVersion = -1;
+
+  if( p==0 ){
+    p = pConn->pCatalog = xjd1MallocZero(sizeof(*p));
+    if( p==0 ) return 0;
+  }
+  if( p->pVersion==0 ){
+    sqlite3_prepare_v2(pConn->db, "PRAGMA schema_version", -1,&p->pVersion,0);
+  }
+  if( p->pVersion ){
+    if( sqlite3_step(p->pVersion)==SQLITE_ROW ){
+      iVersion = sqlite3_column_int(p->pVersion, 0);
+    }
+    sqlite3_reset(p->pVersion);
+  }
+  if( iVersion<0 || iVersion!=p->iVersion ){
+    catalogClear(p);
+    p->iVersion = iVersion;
+  }
+
+  for(pEntry=p->pFirst; pEntry; pEntry=pEntry->pNext){
+    if( strcmp(pEntry->zColl, zColl)==0 ) return pEntry;
+  }
+  pEntry = xjd1MallocZero(sizeof(*pEntry));
+  if( pEntry==0 ) return 0;
+  pEntry->zColl = xjd1PoolDup(0, zColl, -1);
+  if( pEntry->zColl==0 ){
+    xjd1_free(pEntry);
+    return 0;
+  }
+  pEntry->isBinary = xjd1StorageCollIsBinary(pConn->db, zColl);
+  pEntry->pNext = p->pFirst;
+  p->pFirst = pEntry;
+  return pEntry;
+}
+
+/*
+** Return the list of indices on collection zColl, or NULL if there are
+** none. The list belongs to the cache and must not be freed by the
+** caller. It remains valid until the end of the current statement.
+*/
+Index *xjd1CatalogIndices(xjd1 *pConn, const char *zColl){
+  CatalogEntry *pEntry = catalogFind(pConn, zColl);
+  if( pEntry==0 ) return 0;
+  if( pEntry->bIdxLoaded==0 ){
+    pEntry->pIdx = xjd1IndexLoad(pConn, zColl);
+    pEntry->bIdxLoaded = 1;
+  }
+  return pEntry->pIdx;
+}
+
+/*
+** Return a prepared statement that inserts the document bound to its
+** parameter ?1 into collection zColl, and set *pIsBinary to true if the
+** document must be bound in the binary format. Return NULL if the
+** statement cannot be prepared. The statement belongs to the cache and
+** must be reset, but not finalized, by the caller.
+*/
+sqlite3_stmt *xjd1CatalogInsertStmt(
+  xjd1 *pConn,
+  const char *zColl,
+  int *pIsBinary
+){
+  CatalogEntry *pEntry = catalogFind(pConn, zColl);
+  *pIsBinary = 0;
+  if( pEntry==0 ) return 0;
+  if( pEntry->pInsert==0 ){
+    char *zSql = sqlite3_mprintf("INSERT INTO \"%w\"(x) VALUES(?1)", zColl);
+    sqlite3_prepare_v2(pConn->db, zSql, -1, &pEntry->pInsert, 0);
+    sqlite3_free(zSql);
+  }
+  *pIsBinary = pEntry->isBinary;
+  return pEntry->pInsert;
+}
+
+/*
+** Free the collection metadata cache of connection pConn.
+*/
+void xjd1CatalogFree(xjd1 *pConn){
+  Catalog *p = pConn->pCatalog;
+  if( p ){
+    catalogClear(p);
+    sqlite3_finalize(p->pVersion);
+    xjd1_free(p);
+    pConn->pCatalog = 0;
+  }
+}
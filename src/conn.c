@@ -30,6 +30,12 @@ int xjd1_open_with_db(xjd1_context *pContext, sqlite3 *db, xjd1 **ppNewConn){
   pConn->pContext = pContext;
   pConn->db = db;
   pConn->isSQLite3Borrowed = 1;
+  pConn->mxJoinBuffer = XJD1_DEFAULT_JOINBUFFER;
+  pConn->mxSortBuffer = XJD1_DEFAULT_SORTBUFFER;
+  pConn->nParallelSort = XJD1_DEFAULT_PARALLELSORT;
+  pConn->mxInternString = XJD1_DEFAULT_INTERNSTRINGS;
+  pConn->pLabels = xjd1LabelTableNew();
+  xjd1PushdownRegister(db);
   return XJD1_OK;
 }
 
@@ -64,6 +70,41 @@ int xjd1_config(xjd1 *pConn, int op, ...){
       rc = XJD1_OK;
       break;
     }
+    case XJD1_CONFIG_DOCCACHE: {
+      rc = xjd1DocCacheConfig(pConn, va_arg(ap, int));
+      break;
+    }
+    case XJD1_CONFIG_DOCCACHE_STATS: {
+      int *pnHit = va_arg(ap, int*);
+      int *pnMiss = va_arg(ap, int*);
+      xjd1DocCacheStats(pConn, pnHit, pnMiss);
+      rc = XJD1_OK;
+      break;
+    }
+    case XJD1_CONFIG_THREADS: {
+      rc = xjd1ThreadConfig(pConn, va_arg(ap, int));
+      break;
+    }
+    case XJD1_CONFIG_JOINBUFFER: {
+      pConn->mxJoinBuffer = va_arg(ap, int);
+      rc = XJD1_OK;
+      break;
+    }
+    case XJD1_CONFIG_SORTBUFFER: {
+      pConn->mxSortBuffer = va_arg(ap, int);
+      rc = XJD1_OK;
+      break;
+    }
+    case XJD1_CONFIG_PARALLELSORT: {
+      pConn->nParallelSort = va_arg(ap, int);
+      rc = XJD1_OK;
+      break;
+    }
+    case XJD1_CONFIG_INTERNSTRINGS: {
+      pConn->mxInternString = va_arg(ap, int);
+      rc = XJD1_OK;
+      break;
+    }
     default: {
       break;
     }
@@ -81,6 +122,11 @@ int xjd1_close(xjd1 *pConn){
   pConn->isDying = 1;
   if( pConn->nRef>0 ) return XJD1_OK;
   xjd1ContextUnref(pConn->pContext);
+  xjd1DocCacheFree(pConn);
+  xjd1CatalogFree(pConn);
+  xjd1ThreadFree(pConn);
+  xjd1ArenaSweep(pConn, 1);
+  xjd1LabelTableFree(pConn->pLabels);
   if(!pConn->isSQLite3Borrowed) sqlite3_close(pConn->db);
   xjd1StringClear(&pConn->errMsg);
   xjd1_free(pConn);
@@ -29,6 +29,7 @@ int xjd1DataSrcInit(DataSrc *p, Query *pQuery, void *pOuterCtx){
     case TK_COMMA: {
       xjd1DataSrcInit(p->u.join.pLeft, pQuery, pOuterCtx);
       xjd1DataSrcInit(p->u.join.pRight, pQuery, pOuterCtx);
+      p->u.join.pBuffer = xjd1JoinBufferNew(p);
       break;
     }
     case TK_SELECT: {
@@ -36,10 +37,29 @@ int xjd1DataSrcInit(DataSrc *p, Query *pQuery, void *pOuterCtx){
       break;
     }
     case TK_ID: {
-      char *zSql = sqlite3_mprintf("SELECT x FROM \"%w\"", p->u.tab.zName);
-      sqlite3_prepare_v2(pQuery->pStmt->pConn->db, zSql, -1, 
-                         &p->u.tab.pStmt, 0);
+      xjd1 *pConn = pQuery->pStmt->pConn;
+      Expr *pWhere = pQuery->u.simple.pWhere;
+      Index *pIdx = xjd1CatalogIndices(pConn, p->u.tab.zName);
+      JsonNode *pVal = 0;
+      char *zWhere = xjd1IndexScan(pIdx, p, pWhere, &pVal);
+      char *zPush = xjd1PushdownWhere(pWhere, p);
+      char *zSql = sqlite3_mprintf("SELECT rowid, x FROM \"%w\"%s%s%s%s", 
+                                   p->u.tab.zName,
+                                   (zWhere || zPush) ? " WHERE " : "",
+                                   zWhere ? zWhere : "",
+                                   (zWhere && zPush) ? " AND " : "",
+                                   zPush ? zPush : "");
+      sqlite3_prepare_v2(pConn->db, zSql, -1, &p->u.tab.pStmt, 0);
+      if( p->u.tab.pStmt && pVal ){
+        if( pVal->eJType==XJD1_REAL ){
+          sqlite3_bind_double(p->u.tab.pStmt, 1, pVal->u.r);
+        }else{
+          sqlite3_bind_text(p->u.tab.pStmt, 1, pVal->u.z, -1, SQLITE_TRANSIENT);
+        }
+      }
       sqlite3_free(zSql);
+      sqlite3_free(zWhere);
+      sqlite3_free(zPush);
       break;
     }
     case TK_FLATTENOP: {
@@ -91,12 +111,14 @@ static JsonStructElem *findStructElem(JsonNode *pVal, Expr *pPath, int bCreate){
   if( pVal && pVal->eJType==XJD1_STRUCT ){
     JsonNode *p = 0;
     const char *zAs;
+    int *piSlot = 0;
     if( pPath->eType==TK_DOT ){
       JsonStructElem *pElem;
       pElem = findStructElem(pVal, pPath->u.lvalue.pLeft, bCreate);
       if( pElem ){
         p = pElem->pValue;
         zAs = pPath->u.lvalue.zId;
+        piSlot = &pPath->u.lvalue.iSlot;
       }
     }else{
       p = pVal;
@@ -104,12 +126,10 @@ static JsonStructElem *findStructElem(JsonNode *pVal, Expr *pPath, int bCreate){
     }
 
     if( p && p->eJType==XJD1_STRUCT ){
-      for(pRet=p->u.st.pFirst; pRet; pRet=pRet->pNext){
-        if( 0==strcmp(pRet->zLabel, zAs) ) break;
-      }
+      pRet = xjd1JsonFindElem(p, zAs, piSlot);
       if( pRet==0 && bCreate ){
         pRet = xjd1MallocZero(sizeof(*pRet));
-        pRet->zLabel = xjd1PoolDup(0, zAs, -1);
+        pRet->zLabel = xjd1LabelNew(0, 0, zAs, -1);
         if( p->u.st.pLast ){
           p->u.st.pLast->pNext = pRet;
         }else{
@@ -233,6 +253,7 @@ static int flattenIterNext(FlattenIter **ppIter){
         if( p->current.pElem ){
           rc = XJD1_ROW;
         }else{
+          xjd1JsonFree(p->pVal);
           pIter->nIter--;
         }
       }else{
@@ -241,6 +262,7 @@ static int flattenIterNext(FlattenIter **ppIter){
         if( p->current.iElem<=p->pVal->u.ar.nElem ){
           rc = XJD1_ROW;
         }else{
+          xjd1JsonFree(p->pVal);
           pIter->nIter--;
         }
       }
@@ -265,6 +287,8 @@ static int flattenIterNext(FlattenIter **ppIter){
           pIter->aIter[pIter->nIter].current.iElem = 0;
           pIter->nIter++;
           rc = XJD1_DONE;
+        }else{
+          xjd1JsonFree(pVal);
         }
       }
     }
@@ -335,6 +359,183 @@ static JsonNode *flattenedObject(
   return pRet;
 }
 
+/*
+** When a connection has more than one thread (see xjd1ThreadCount()), a
+** collection scan reads rows ahead in batches. The content of each row
+** in a batch is copied out of SQLite on the calling thread, then the
+** documents are decoded in parallel by xjd1ThreadRun(). Rows are still
+** returned, and the WHERE clause evaluated, in order on the calling
+** thread.
+**
+** Batches start small, so that a scan that is abandoned early does not
+** read far ahead, and double in size up to SCANBATCH_MX_ROW rows.
+**
+** Each row of a batch has its own DocArena. When a row is returned, its
+** arena is exchanged for the arena of the row the scan has just left.
+*/
+#define SCANBATCH_TASK_ROW   16   /* Rows decoded by each task */
+#define SCANBATCH_MX_ROW   1024   /* Maximum rows in a batch */
+
+struct ScanBatch {
+  int nRow;                       /* Number of rows in aRow[] */
+  int iNext;                      /* Index in aRow[] of next row to return */
+  int mxRow;                      /* Number of rows to read in next batch */
+  int isEof;                      /* True once the scan has reached EOF */
+  const JsonNode *pProj;          /* Projection used to decode documents */
+  LabelTable *pLabels;            /* Labels of decoded documents */
+  int useArena;                   /* True to decode into aRow[].pArena */
+  struct ScanBatchRow {
+    sqlite3_int64 iRowid;         /* Rowid of the row */
+    char *aData;                  /* Copy of the stored document, or NULL */
+    int nData;                    /* Size of aData[] in bytes */
+    int isBinary;                 /* True if aData[] is in binary format */
+    int isCached;                 /* True if pDoc is from the document cache */
+    JsonNode *pDoc;               /* The decoded document */
+    DocArena *pArena;             /* Memory for pDoc, or NULL */
+  } *aRow;                        /* Rows of the current batch */
+};
+
+/*
+** Free the content of a row of a batch that has not been returned.
+*/
+static void scanBatchRowClear(xjd1 *pConn, struct ScanBatchRow *pRow){
+  xjd1_free(pRow->aData);
+  pRow->aData = 0;
+  xjd1JsonFree(pRow->pDoc);
+  pRow->pDoc = 0;
+  pRow->pArena = xjd1ArenaRelease(pConn, pRow->pArena);
+}
+
+/*
+** Free the rows of pBatch that have not been returned.
+*/
+static void scanBatchClear(xjd1 *pConn, ScanBatch *pBatch){
+  int i;
+  for(i=pBatch->iNext; i<pBatch->nRow; i++){
+    scanBatchRowClear(pConn, &pBatch->aRow[i]);
+  }
+  pBatch->nRow = 0;
+  pBatch->iNext = 0;
+}
+
+/*
+** Release the current document of collection scan p, and the arena that
+** holds it.
+*/
+static void scanRelease(DataSrc *p){
+  xjd1JsonFree(p->pValue);
+  p->pValue = 0;
+  if( p->u.tab.pArena ){
+    p->u.tab.pArena = xjd1ArenaRelease(p->pQuery->pStmt->pConn,
+                                       p->u.tab.pArena);
+  }
+}
+
+/*
+** Task for xjd1ThreadRun(). Decode the documents of the iTask'th group
+** of SCANBATCH_TASK_ROW rows of a batch.
+*/
+static void scanBatchDecode(void *pArg, int iTask){
+  ScanBatch *pBatch = (ScanBatch*)pArg;
+  int i = iTask*SCANBATCH_TASK_ROW;
+  int iEnd = i+SCANBATCH_TASK_ROW;
+  if( iEnd>pBatch->nRow ) iEnd = pBatch->nRow;
+  for(; i<iEnd; i++){
+    struct ScanBatchRow *pRow = &pBatch->aRow[i];
+    if( pRow->aData ){
+      pRow->pDoc = xjd1ArenaRead(pBatch->useArena ? pRow->pArena : 0,
+                                 pRow->aData, pRow->nData, pRow->isBinary,
+                                 pBatch->pProj, pBatch->pLabels);
+      xjd1_free(pRow->aData);
+      pRow->aData = 0;
+    }
+  }
+}
+
+/*
+** Read the next batch of rows for collection scan p and decode them.
+*/
+static void scanBatchFill(DataSrc *p){
+  ScanBatch *pBatch = p->u.tab.pBatch;
+  sqlite3_stmt *pStmt = p->u.tab.pStmt;
+  xjd1 *pConn = p->pQuery->pStmt->pConn;
+  int nTask;
+
+  scanBatchClear(pConn, pBatch);
+  if( pBatch->aRow==0 ){
+    pBatch->aRow = xjd1MallocZero(SCANBATCH_MX_ROW*sizeof(pBatch->aRow[0]));
+    if( pBatch->aRow==0 ) return;
+  }
+  pBatch->useArena = p->u.tab.pProj || xjd1DocCacheIsEnabled(pConn)==0;
+  while( pBatch->isEof==0 && pBatch->nRow<pBatch->mxRow ){
+    struct ScanBatchRow *pRow;
+    DocArena *pArena;
+    if( sqlite3_step(pStmt)!=SQLITE_ROW ){
+      pBatch->isEof = 1;
+      break;
+    }
+    if( p->u.tab.isStarted==0 ){
+      xjd1DocCacheSync(pConn);
+      p->u.tab.isStarted = 1;
+    }
+    pRow = &pBatch->aRow[pBatch->nRow];
+    pArena = pRow->pArena;
+    memset(pRow, 0, sizeof(*pRow));
+    pRow->pArena = pArena;
+    pRow->iRowid = sqlite3_column_int64(pStmt, 0);
+    pRow->pDoc = xjd1DocCacheFetch(pConn, p->u.tab.zName, pRow->iRowid);
+    if( pRow->pDoc ){
+      pRow->isCached = 1;
+    }else{
+      const void *a;
+      pRow->isBinary = sqlite3_column_type(pStmt, 1)==SQLITE_BLOB;
+      a = pRow->isBinary ? sqlite3_column_blob(pStmt, 1)
+                         : (const void*)sqlite3_column_text(pStmt, 1);
+      pRow->nData = sqlite3_column_bytes(pStmt, 1);
+      pRow->aData = xjd1_malloc(pRow->nData+1);
+      if( pRow->aData==0 ) break;
+      if( pRow->pArena==0 && pBatch->useArena ){
+        pRow->pArena = xjd1ArenaNew();
+      }
+      memcpy(pRow->aData, a, pRow->nData);
+      pRow->aData[pRow->nData] = 0;
+    }
+    pBatch->nRow++;
+  }
+  pBatch->pProj = p->u.tab.pProj;
+  pBatch->pLabels = pConn->pLabels;
+  nTask = (pBatch->nRow+SCANBATCH_TASK_ROW-1)/SCANBATCH_TASK_ROW;
+  xjd1ThreadRun(pConn, nTask, scanBatchDecode, (void*)pBatch);
+  if( pBatch->mxRow<SCANBATCH_MX_ROW ) pBatch->mxRow *= 2;
+}
+
+/*
+** Advance collection scan p, which reads rows in batches, to the next row.
+*/
+static int scanBatchStep(DataSrc *p){
+  ScanBatch *pBatch = p->u.tab.pBatch;
+  struct ScanBatchRow *pRow;
+  DocArena *pArena;
+  if( pBatch->iNext>=pBatch->nRow ){
+    scanBatchFill(p);
+    if( pBatch->nRow==0 ){
+      p->u.tab.eofSeen = 1;
+      return XJD1_DONE;
+    }
+  }
+  pRow = &pBatch->aRow[pBatch->iNext++];
+  p->pValue = pRow->pDoc;
+  pRow->pDoc = 0;
+  pArena = pRow->pArena;
+  pRow->pArena = p->u.tab.pArena;
+  p->u.tab.pArena = pArena;
+  if( pRow->isCached==0 && pBatch->pProj==0 ){
+    xjd1DocCacheStore(p->pQuery->pStmt->pConn, p->u.tab.zName,
+                      pRow->iRowid, p->pValue);
+  }
+  return XJD1_ROW;
+}
+
 /*
 ** Advance a data source to the next row. Return XJD1_DONE if the data 
 ** source is at EOF or XJD1_ROW if the step results in a row of content 
@@ -345,6 +546,10 @@ int xjd1DataSrcStep(DataSrc *p){
   if( p==0 ) return XJD1_DONE;
   switch( p->eDSType ){
     case TK_COMMA: {
+      if( p->u.join.pBuffer ){
+        rc = xjd1JoinBufferStep(p);
+        break;
+      }
 
       if( p->u.join.bStart==0 ){
         p->u.join.bStart = 1;
@@ -367,17 +572,33 @@ int xjd1DataSrcStep(DataSrc *p){
       xjd1JsonFree(p->pValue);
       p->pValue = 0;
       rc = xjd1QueryStep(p->u.subq.q);
-      p->pValue = xjd1QueryDoc(p->u.subq.q, 0);
+      if( rc==XJD1_ROW ) p->pValue = xjd1QueryDoc(p->u.subq.q, 0);
       break;
     }
 
     case TK_ID: {
+      scanRelease(p);
+      if( p->u.tab.pBatch==0 && p->u.tab.isStarted==0
+       && xjd1ThreadCount(p->pQuery->pStmt->pConn)>1
+      ){
+        p->u.tab.pBatch = xjd1MallocZero(sizeof(ScanBatch));
+        if( p->u.tab.pBatch ) p->u.tab.pBatch->mxRow = SCANBATCH_TASK_ROW;
+      }
+      if( p->u.tab.pBatch ){
+        rc = scanBatchStep(p);
+        break;
+      }
       rc = sqlite3_step(p->u.tab.pStmt);
-      xjd1JsonFree(p->pValue);
-      p->pValue = 0;
       if( rc==SQLITE_ROW ){
-        const char *zJson = (const char*)sqlite3_column_text(p->u.tab.pStmt, 0);
-        p->pValue = xjd1JsonParse(zJson, -1);
+        xjd1 *pConn = p->pQuery->pStmt->pConn;
+        if( p->u.tab.isStarted==0 ){
+          xjd1DocCacheSync(pConn);
+          p->u.tab.isStarted = 1;
+        }
+        if( p->u.tab.pArena==0 ) p->u.tab.pArena = xjd1ArenaNew();
+        p->pValue = xjd1DocCacheColumn(pConn, p->u.tab.zName,
+                                       p->u.tab.pStmt, p->u.tab.pProj,
+                                       p->u.tab.pArena);
         rc = XJD1_ROW;
       }else{
         p->u.tab.eofSeen = 1;
@@ -446,6 +667,78 @@ int xjd1DataSrcStep(DataSrc *p){
   return rc;
 }
 
+/*
+** Advance data source p past the next *pnSkip rows, decrementing *pnSkip
+** for each. Rows of collection scans and of arrays are skipped without
+** being read. Return XJD1_OK if all the rows were skipped, XJD1_DONE if
+** EOF was reached first, or an error code.
+**
+** The data source does not point at a row after this returns. It must
+** be stepped before its document is read.
+*/
+int xjd1DataSrcSkip(DataSrc *p, int *pnSkip){
+  int rc = XJD1_OK;
+  if( p==0 ) return XJD1_DONE;
+  switch( p->eDSType ){
+    case TK_ID: {
+      ScanBatch *pBatch = p->u.tab.pBatch;
+      scanRelease(p);
+      if( pBatch ){
+        while( *pnSkip>0 && pBatch->iNext<pBatch->nRow ){
+          struct ScanBatchRow *pRow = &pBatch->aRow[pBatch->iNext++];
+          scanBatchRowClear(p->pQuery->pStmt->pConn, pRow);
+          (*pnSkip)--;
+        }
+        if( pBatch->isEof && *pnSkip>0 ) rc = XJD1_DONE;
+      }
+      while( rc==XJD1_OK && *pnSkip>0 ){
+        if( sqlite3_step(p->u.tab.pStmt)!=SQLITE_ROW ){
+          if( pBatch ) pBatch->isEof = 1;
+          p->u.tab.eofSeen = 1;
+          rc = XJD1_DONE;
+        }else{
+          (*pnSkip)--;
+        }
+      }
+      break;
+    }
+
+    case TK_DOT: {
+      JsonNode *pArray;
+      int nLeft = 0;
+      xjd1JsonFree(p->pValue);
+      p->pValue = 0;
+      if( p->u.path.pArray==0 ){
+        p->u.path.pArray = xjd1ExprEval(p->u.path.pPath);
+      }
+      pArray = p->u.path.pArray;
+      if( pArray && pArray->eJType==XJD1_ARRAY ){
+        nLeft = pArray->u.ar.nElem - p->u.path.iNext;
+      }
+      if( nLeft<*pnSkip ){
+        p->u.path.iNext += nLeft;
+        *pnSkip -= nLeft;
+        rc = XJD1_DONE;
+      }else{
+        p->u.path.iNext += *pnSkip;
+        *pnSkip = 0;
+      }
+      break;
+    }
+
+    default: {
+      while( *pnSkip>0 ){
+        rc = xjd1DataSrcStep(p);
+        if( rc!=XJD1_ROW ) break;
+        (*pnSkip)--;
+        rc = XJD1_OK;
+      }
+      break;
+    }
+  }
+  return rc;
+}
+
 /*
 ** Return the document that this data source is current pointing to
 ** if the AS name of the document is zDocName or if zDocName==0.
@@ -498,6 +791,7 @@ int xjd1DataSrcRewind(DataSrc *p){
   switch( p->eDSType ){
     case TK_COMMA: {
       p->u.join.bStart = 0;
+      xjd1JoinBufferRewind(p->u.join.pBuffer);
       xjd1DataSrcRewind(p->u.join.pLeft);
       xjd1DataSrcRewind(p->u.join.pRight);
       break;
@@ -507,7 +801,14 @@ int xjd1DataSrcRewind(DataSrc *p){
       break;
     }
     case TK_ID: {
+      scanRelease(p);
       sqlite3_reset(p->u.tab.pStmt);
+      p->u.tab.isStarted = 0;
+      if( p->u.tab.pBatch ){
+        scanBatchClear(p->pQuery->pStmt->pConn, p->u.tab.pBatch);
+        p->u.tab.pBatch->isEof = 0;
+        p->u.tab.pBatch->mxRow = SCANBATCH_TASK_ROW;
+      }
       break;
     }
     case TK_DOT: {
@@ -537,8 +838,37 @@ int xjd1DataSrcClose(DataSrc *p){
   if( p==0 ) return XJD1_OK;
   xjd1JsonFree(p->pValue);  p->pValue = 0;
   switch( p->eDSType ){
+    case TK_COMMA: {
+      xjd1JoinBufferFree(p->u.join.pBuffer);
+      p->u.join.pBuffer = 0;
+      xjd1DataSrcClose(p->u.join.pLeft);
+      xjd1DataSrcClose(p->u.join.pRight);
+      break;
+    }
+    case TK_SELECT: {
+      xjd1QueryClose(p->u.subq.q);
+      break;
+    }
     case TK_ID: {
+      ScanBatch *pBatch = p->u.tab.pBatch;
       sqlite3_finalize(p->u.tab.pStmt);
+      xjd1JsonFree(p->u.tab.pProj);
+      p->u.tab.pProj = 0;
+      scanRelease(p);
+      xjd1ArenaFree(p->u.tab.pArena);
+      p->u.tab.pArena = 0;
+      if( pBatch ){
+        scanBatchClear(p->pQuery->pStmt->pConn, pBatch);
+        if( pBatch->aRow ){
+          int i;
+          for(i=0; i<SCANBATCH_MX_ROW; i++){
+            xjd1ArenaFree(pBatch->aRow[i].pArena);
+          }
+        }
+        xjd1_free(p->u.tab.pBatch->aRow);
+        xjd1_free(p->u.tab.pBatch);
+        p->u.tab.pBatch = 0;
+      }
       break;
     }
     case TK_FLATTENOP: {
@@ -578,6 +908,26 @@ void xjd1DataSrcCacheSave(DataSrc *p, JsonNode **apNode){
   cacheSaveRecursive(p, &pp);
 }
 
+static void cacheRestoreRecursive(DataSrc *p, JsonNode ***papNode){
+  if( p->eDSType==TK_COMMA ){
+    cacheRestoreRecursive(p->u.join.pLeft, papNode);
+    cacheRestoreRecursive(p->u.join.pRight, papNode);
+  }else{
+    xjd1JsonFree(p->pValue);
+    p->pValue = xjd1JsonRef(**papNode);
+    (*papNode)++;
+  }
+}
+
+/*
+** Set the current document of each leaf of data source p to the values
+** saved in apNode[] by an earlier call to xjd1DataSrcCacheSave().
+*/
+void xjd1DataSrcCacheRestore(DataSrc *p, JsonNode **apNode){
+  JsonNode **pp = apNode;
+  cacheRestoreRecursive(p, &pp);
+}
+
 static int datasrcResolveRecursive(
   DataSrc *p, 
   int *piEntry, 
@@ -630,3 +980,125 @@ JsonNode *xjd1DataSrcRead(DataSrc *p, int iDoc){
   assert( iDoc>=1 );
   return datasrcReadRecursive(p, &iEntry, iDoc);
 }
+
+/*
+** Return the data source that xjd1DataSrcRead(p, iDoc) reads from.
+*/
+static DataSrc *datasrcLeafRecursive(DataSrc *p, int *piEntry, int iDoc){
+  DataSrc *pRet = 0;
+  if( p->eDSType==TK_COMMA ){
+    pRet = datasrcLeafRecursive(p->u.join.pLeft, piEntry, iDoc);
+    if( 0==pRet ){
+      pRet = datasrcLeafRecursive(p->u.join.pRight, piEntry, iDoc);
+    }
+  }else{
+    if( *piEntry==iDoc ) pRet = p;
+    (*piEntry)++;
+  }
+  return pRet;
+}
+DataSrc *xjd1DataSrcLeaf(DataSrc *p, int iDoc){
+  int iEntry = 1;
+  assert( iDoc>=1 );
+  return datasrcLeafRecursive(p, &iEntry, iDoc);
+}
+
+/*
+** Begin building projections for the collections scanned by FROM clause
+** p. Each collection starts with an empty projection, so that nothing
+** but the outline of each document is parsed until xjd1DataSrcProjectPath()
+** adds the parts that are used. The collection scanned by a FLATTEN or
+** EACH is parsed in full, as the whole document is copied into each row.
+*/
+void xjd1DataSrcProjectStart(DataSrc *p){
+  switch( p->eDSType ){
+    case TK_COMMA: {
+      xjd1DataSrcProjectStart(p->u.join.pLeft);
+      xjd1DataSrcProjectStart(p->u.join.pRight);
+      break;
+    }
+    case TK_ID: {
+      xjd1JsonFree(p->u.tab.pProj);
+      p->u.tab.pProj = xjd1JsonNew(0);
+      if( p->u.tab.pProj ) p->u.tab.pProj->eJType = XJD1_STRUCT;
+      break;
+    }
+  }
+}
+
+/*
+** Return the node of projection pProj for path pPath, adding it to
+** the projection if it is not already present. Return NULL if the
+** projection already requires the whole of a value that contains the
+** path.
+*/
+static JsonNode *projectNode(JsonNode *pProj, Expr *pPath){
+  JsonNode *pParent;
+  JsonStructElem *pElem;
+  if( pPath->eType!=TK_DOT ) return pProj;
+  pParent = projectNode(pProj, pPath->u.lvalue.pLeft);
+  if( pParent==0 || pParent->eJType!=XJD1_STRUCT ) return 0;
+  for(pElem=pParent->u.st.pFirst; pElem; pElem=pElem->pNext){
+    if( strcmp(pElem->zLabel, pPath->u.lvalue.zId)==0 ) return pElem->pValue;
+  }
+  pElem = xjd1MallocZero(sizeof(*pElem));
+  if( pElem==0 ) return 0;
+  pElem->zLabel = xjd1LabelNew(0, 0, pPath->u.lvalue.zId, -1);
+  pElem->pValue = xjd1JsonNew(0);
+  if( pElem->pValue ) pElem->pValue->eJType = XJD1_STRUCT;
+  if( pParent->u.st.pLast ){
+    pParent->u.st.pLast->pNext = pElem;
+  }else{
+    pParent->u.st.pFirst = pElem;
+  }
+  pParent->u.st.pLast = pElem;
+  return pElem->pValue;
+}
+
+/*
+** Path pPath, a TK_ID optionally followed by one or more TK_DOT labels,
+** refers to the iDoc'th document of FROM clause p. Arrange for the value
+** at that path to be parsed in full whenever the document is read. If
+** pPath is NULL, the whole document is parsed.
+*/
+void xjd1DataSrcProjectPath(DataSrc *p, int iDoc, Expr *pPath){
+  DataSrc *pLeaf = xjd1DataSrcLeaf(p, iDoc);
+  JsonNode *pNode;
+  if( pLeaf==0 || pLeaf->eDSType!=TK_ID || pLeaf->u.tab.pProj==0 ) return;
+  if( pPath==0 || pPath->eType!=TK_DOT ){
+    xjd1JsonFree(pLeaf->u.tab.pProj);
+    pLeaf->u.tab.pProj = 0;
+    return;
+  }
+  pNode = projectNode(pLeaf->u.tab.pProj, pPath);
+  if( pNode ){
+    xjd1JsonToNull(pNode);
+    pNode->eJType = XJD1_TRUE;
+  }
+}
+
+/*
+** Call xjd1ExprProject() on each expression in FROM clause p.
+*/
+void xjd1DataSrcProject(DataSrc *p, Query *pQuery){
+  if( p==0 ) return;
+  switch( p->eDSType ){
+    case TK_COMMA: {
+      xjd1DataSrcProject(p->u.join.pLeft, pQuery);
+      xjd1DataSrcProject(p->u.join.pRight, pQuery);
+      break;
+    }
+    case TK_SELECT: {
+      xjd1QueryProject(p->u.subq.q, pQuery);
+      break;
+    }
+    case TK_FLATTENOP: {
+      xjd1DataSrcProject(p->u.flatten.pNext, pQuery);
+      break;
+    }
+    case TK_DOT: {
+      xjd1ExprProject(p->u.path.pPath, pQuery);
+      break;
+    }
+  }
+}
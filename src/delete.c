@@ -18,6 +18,35 @@
 */
 #include "xjd1Int.h"
 
+/*
+** End a DELETE that has written with result code rc. If the DELETE began
+** the transaction it wrote in, commit it or, after an error, roll it
+** back, so that the documents and their index entries are deleted
+** together or not at all. Return rc, or XJD1_ERROR if the commit fails.
+**
+** nChange is the value of sqlite3_total_changes() when the DELETE began.
+*/
+static int deleteFinish(
+  xjd1_stmt *pStmt,
+  int rc,
+  int inAutocommit,
+  int nChange
+){
+  sqlite3 *db = pStmt->pConn->db;
+  if( inAutocommit ){
+    if( rc==XJD1_OK && sqlite3_exec(db, "COMMIT", 0, 0, 0)!=SQLITE_OK ){
+      xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", sqlite3_errmsg(db));
+      rc = XJD1_ERROR;
+    }
+    if( rc!=XJD1_OK ){
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    }else if( sqlite3_total_changes(db)!=nChange ){
+      xjd1DocCacheCommit(pStmt->pConn);
+    }
+  }
+  return rc;
+}
+
 /*
 ** Evaluate a pragma.
 **
@@ -30,46 +59,77 @@ int xjd1DeleteStep(xjd1_stmt *pStmt){
   sqlite3 *db;
   sqlite3_stmt *pQuery = 0;
   sqlite3_stmt *pIns = 0;
+  DocArena *pArena;
+  Index *pIdx;
   char *zSql;
+  char *zPush;
+  int nRow = 0;
+  int nChange;
 
   assert( pCmd!=0 );
   assert( pCmd->eCmdType==TK_DELETE );
   db = pStmt->pConn->db;
   inAutocommit = sqlite3_get_autocommit(db);
+  nChange = sqlite3_total_changes(db);
+  pIdx = xjd1CatalogIndices(pStmt->pConn, pCmd->u.del.zName);
   if( pCmd->u.del.pWhere==0 ){
+    if( inAutocommit ) sqlite3_exec(db, "BEGIN", 0, 0, 0);
     zSql = sqlite3_mprintf("DELETE FROM \"%w\"", pCmd->u.del.zName);
-    sqlite3_exec(db, zSql, 0, 0, 0);
+    if( sqlite3_exec(db, zSql, 0, 0, 0)!=SQLITE_OK ) rc = XJD1_ERROR;
     sqlite3_free(zSql);
-    return XJD1_OK;
+    xjd1DocCacheInvalidate(pStmt->pConn, pCmd->u.del.zName, 0);
+    if( rc==XJD1_OK ) rc = xjd1IndexClear(pStmt->pConn, pIdx);
+    if( rc!=XJD1_OK ){
+      xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", sqlite3_errmsg(db));
+    }
+    return deleteFinish(pStmt, rc, inAutocommit, nChange);
   }
   zSql = sqlite3_mprintf("%sCREATE TEMP TABLE _t1(x INTEGER PRIMARY KEY)",
             inAutocommit ? "BEGIN;" : "");
   sqlite3_exec(db, zSql, 0, 0, 0);
   sqlite3_free(zSql);
-  zSql = sqlite3_mprintf("SELECT rowid, x FROM \"%w\"", pCmd->u.del.zName);
+  zPush = xjd1PushdownWhere(pCmd->u.del.pWhere, 0);
+  zSql = sqlite3_mprintf("SELECT rowid, x FROM \"%w\"%s%s",
+                         pCmd->u.del.zName,
+                         zPush ? " WHERE " : "", zPush ? zPush : "");
+  sqlite3_free(zPush);
   sqlite3_prepare_v2(db, zSql, -1, &pQuery, 0);
   sqlite3_prepare_v2(db, "INSERT INTO _t1(x) VALUES(?1)", -1, &pIns, 0);
+  pArena = xjd1ArenaNew();
   if( pQuery ){
-    while( SQLITE_ROW==sqlite3_step(pQuery) ){
-      const char *zJson = (const char*)sqlite3_column_text(pQuery, 1);
-      pStmt->pDoc = xjd1JsonParse(zJson, -1);
+    while( rc==XJD1_OK && SQLITE_ROW==sqlite3_step(pQuery) ){
+      if( nRow++==0 ) xjd1DocCacheSync(pStmt->pConn);
+      pStmt->pDoc = xjd1DocCacheColumn(pStmt->pConn, pCmd->u.del.zName,
+                                       pQuery, 0, pArena);
       if( xjd1ExprTrue(pCmd->u.del.pWhere) ){
-        sqlite3_bind_int64(pIns, 1, sqlite3_column_int64(pQuery, 0));
+        sqlite3_int64 iRowid = sqlite3_column_int64(pQuery, 0);
+        sqlite3_bind_int64(pIns, 1, iRowid);
         sqlite3_step(pIns);
         sqlite3_reset(pIns);
+        xjd1DocCacheInvalidate(pStmt->pConn, pCmd->u.del.zName, iRowid);
+        if( xjd1IndexErase(pIdx, iRowid)!=XJD1_OK ){
+          xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", sqlite3_errmsg(db));
+          rc = XJD1_ERROR;
+        }
       }
       xjd1JsonFree(pStmt->pDoc);
       pStmt->pDoc = 0;
+      pArena = xjd1ArenaRelease(pStmt->pConn, pArena);
     }
   }
+  xjd1ArenaFree(pArena);
   sqlite3_finalize(pQuery);
   sqlite3_finalize(pIns);
   sqlite3_free(zSql);
-  zSql = sqlite3_mprintf(
-            "DELETE FROM \"%w\" WHERE rowid IN _t1;"
-            "DROP TABLE _t1;%s", pCmd->u.del.zName,
-            inAutocommit ? "COMMIT;" : "");
-  sqlite3_exec(db, zSql, 0, 0, 0);
-  sqlite3_free(zSql);
-  return rc;
+  if( rc==XJD1_OK ){
+    zSql = sqlite3_mprintf("DELETE FROM \"%w\" WHERE rowid IN _t1",
+                           pCmd->u.del.zName);
+    if( sqlite3_exec(db, zSql, 0, 0, 0)!=SQLITE_OK ){
+      xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", sqlite3_errmsg(db));
+      rc = XJD1_ERROR;
+    }
+    sqlite3_free(zSql);
+  }
+  sqlite3_exec(db, "DROP TABLE _t1", 0, 0, 0);
+  return deleteFinish(pStmt, rc, inAutocommit, nChange);
 }
@@ -0,0 +1,411 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains the cache of parsed documents that each database
+** connection keeps.
+**
+** Documents are cached by collection name and rowid, so that statements
+** that read the same documents do not parse them again. Each entry holds
+** a reference to a complete parsed document. Cached documents are never
+** modified: code that changes a document obtains its own copy with
+** xjd1JsonEdit() first, as for any other shared JsonNode.
+**
+** The least recently used entries are discarded to keep the total size
+** of the cache within the budget set by XJD1_CONFIG_DOCCACHE. The budget
+** is zero, and the cache is disabled, by default.
+**
+** INSERT, UPDATE and DELETE statements remove the documents they change.
+** Changes made by other connections are detected whenever a scan of a
+** collection begins, using the "PRAGMA data_version" value. That pragma
+** needs SQLite 3.8.8 or later. With older versions, the file change
+** counter in the database header is read instead. SQLite increments it
+** once for each transaction that changes the database, including those
+** of this connection, so the transactions that this connection commits
+** are counted, and the cache is kept only if the counter has moved by
+** exactly that many. The counter is not updated in WAL mode, where the
+** cache is cleared at the start of each scan instead. Changes made
+** directly through the SQLite handle passed to xjd1_open_with_db() are
+** not detected when the pragma is available, and clear the cache when
+** it is not.
+*/
+#include "xjd1Int.h"
+
+typedef struct DocCacheEntry DocCacheEntry;
+
+/*
+** A cached document.
+*/
+struct DocCacheEntry {
+  char *zColl;                    /* Collection the document belongs to */
+  sqlite3_int64 iRowid;           /* Rowid of the document */
+  JsonNode *pDoc;                 /* The parsed document */
+  int nByte;                      /* Bytes charged to the budget */
+  DocCacheEntry *pHashNext;       /* Next entry in the same hash bucket */
+  DocCacheEntry *pNewer;          /* Next more recently used entry */
+  DocCacheEntry *pOlder;          /* Next less recently used entry */
+};
+
+/*
+** The document cache for a database connection.
+*/
+struct DocCache {
+  int mxByte;                     /* Budget in bytes */
+  int nByte;                      /* Bytes currently used */
+  int nEntry;                     /* Number of entries */
+  int nHash;                      /* Number of slots in aHash[] */
+  DocCacheEntry **aHash;          /* Hash table of entries */
+  DocCacheEntry *pNewest;         /* Most recently used entry */
+  DocCacheEntry *pOldest;         /* Least recently used entry */
+  sqlite3_stmt *pVersion;         /* "PRAGMA data_version", or NULL */
+  sqlite3_int64 iVersion;         /* Version when last checked, or -1 */
+  int nCommit;                    /* Transactions committed since then */
+  int nHit;                       /* Number of lookups that hit */
+  int nMiss;                      /* Number of lookups that missed */
+};
+
+/*
+** Return the hash of key (zColl, iRowid).
+*/
+static unsigned int cacheHash(const char *zColl, sqlite3_int64 iRowid){
+  unsigned int h = (unsigned int)iRowid ^ (unsigned int)(iRowid>>32);
+  while( *zColl ) h = (h<<3) ^ h ^ (unsigned char)*(zColl++);
+  return h;
+}
+
+/*
+** Remove entry pEntry from the LRU list of cache p.
+*/
+static void cacheUnlink(DocCache *p, DocCacheEntry *pEntry){
+  if( pEntry->pNewer ){
+    pEntry->pNewer->pOlder = pEntry->pOlder;
+  }else{
+    p->pNewest = pEntry->pOlder;
+  }
+  if( pEntry->pOlder ){
+    pEntry->pOlder->pNewer = pEntry->pNewer;
+  }else{
+    p->pOldest = pEntry->pNewer;
+  }
+  pEntry->pNewer = pEntry->pOlder = 0;
+}
+
+/*
+** Add entry pEntry to the most recently used end of the LRU list.
+*/
+static void cacheLinkNewest(DocCache *p, DocCacheEntry *pEntry){
+  pEntry->pOlder = p->pNewest;
+  pEntry->pNewer = 0;
+  if( p->pNewest ){
+    p->pNewest->pNewer = pEntry;
+  }else{
+    p->pOldest = pEntry;
+  }
+  p->pNewest = pEntry;
+}
+
+/*
+** Remove entry pEntry from cache p and free it.
+*/
+static void cacheRemove(DocCache *p, DocCacheEntry *pEntry){
+  DocCacheEntry **pp;
+  unsigned int h = cacheHash(pEntry->zColl, pEntry->iRowid) % p->nHash;
+  for(pp=&p->aHash[h]; *pp!=pEntry; pp=&(*pp)->pHashNext){}
+  *pp = pEntry->pHashNext;
+  cacheUnlink(p, pEntry);
+  p->nByte -= pEntry->nByte;
+  p->nEntry--;
+  xjd1JsonFree(pEntry->pDoc);
+  xjd1_free(pEntry->zColl);
+  xjd1_free(pEntry);
+}
+
+/*
+** Return the entry for (zColl, iRowid) in cache p, or NULL.
+*/
+static DocCacheEntry *cacheFind(
+  DocCache *p,
+  const char *zColl,
+  sqlite3_int64 iRowid
+){
+  DocCacheEntry *pEntry = 0;
+  if( p->nHash ){
+    unsigned int h = cacheHash(zColl, iRowid) % p->nHash;
+    for(pEntry=p->aHash[h]; pEntry; pEntry=pEntry->pHashNext){
+      if( pEntry->iRowid==iRowid && strcmp(pEntry->zColl, zColl)==0 ) break;
+    }
+  }
+  return pEntry;
+}
+
+/*
+** Make the hash table of cache p large enough for its entries.
+*/
+static void cacheRehash(DocCache *p){
+  DocCacheEntry **aNew;
+  DocCacheEntry *pEntry;
+  int nNew = p->nHash ? p->nHash*2 : 64;
+  aNew = xjd1MallocZero(nNew*sizeof(DocCacheEntry*));
+  if( aNew==0 ) return;
+  for(pEntry=p->pOldest; pEntry; pEntry=pEntry->pNewer){
+    unsigned int h = cacheHash(pEntry->zColl, pEntry->iRowid) % nNew;
+    pEntry->pHashNext = aNew[h];
+    aNew[h] = pEntry;
+  }
+  xjd1_free(p->aHash);
+  p->aHash = aNew;
+  p->nHash = nNew;
+}
+
+/*
+** Discard the least recently used entries of cache p until it is
+** within its budget.
+*/
+static void cacheShrink(DocCache *p){
+  while( p->pOldest && p->nByte>p->mxByte ){
+    cacheRemove(p, p->pOldest);
+  }
+}
+
+/*
+** Set the budget of the document cache of connection pConn to mxByte
+** bytes. A budget of zero or less disables the cache.
+*/
+int xjd1DocCacheConfig(xjd1 *pConn, int mxByte){
+  DocCache *p = pConn->pDocCache;
+  if( mxByte<0 ) mxByte = 0;
+  if( p==0 ){
+    if( mxByte==0 ) return XJD1_OK;
+    p = pConn->pDocCache = xjd1MallocZero(sizeof(*p));
+    if( p==0 ) return XJD1_NOMEM;
+    p->iVersion = -1;
+  }
+  p->mxByte = mxByte;
+  cacheShrink(p);
+  return XJD1_OK;
+}
+
+/*
+** Write the number of lookups that have hit and missed the document cache
+** of connection pConn into *pnHit and *pnMiss.
+*/
+void xjd1DocCacheStats(xjd1 *pConn, int *pnHit, int *pnMiss){
+  DocCache *p = pConn->pDocCache;
+  *pnHit = p ? p->nHit : 0;
+  *pnMiss = p ? p->nMiss : 0;
+}
+
+/*
+** Remove from the document cache of connection pConn the document with
+** rowid iRowid in collection zColl. If iRowid is zero, remove all the
+** documents of collection zColl.  If zColl is NULL, remove everything.
+*/
+void xjd1DocCacheInvalidate(xjd1 *pConn, const char *zColl, sqlite3_int64 iRowid){
+  DocCache *p = pConn->pDocCache;
+  DocCacheEntry *pEntry, *pNext;
+  if( p==0 ) return;
+  if( zColl && iRowid ){
+    pEntry = cacheFind(p, zColl, iRowid);
+    if( pEntry ) cacheRemove(p, pEntry);
+    return;
+  }
+  for(pEntry=p->pOldest; pEntry; pEntry=pNext){
+    pNext = pEntry->pNewer;
+    if( zColl==0 || strcmp(pEntry->zColl, zColl)==0 ){
+      cacheRemove(p, pEntry);
+    }
+  }
+}
+
+/*
+** Return the file change counter of the main database of db, 0 if the
+** database is not a file, or -1 if the counter cannot be read or is not
+** maintained. The caller holds a lock on the database.
+*/
+static sqlite3_int64 cacheChangeCounter(sqlite3 *db){
+  sqlite3_file *pFile = 0;
+  unsigned char aHdr[10];         /* Bytes 18 to 27 of the header */
+  sqlite3_file_control(db, "main", SQLITE_FCNTL_FILE_POINTER, &pFile);
+  if( pFile==0 ) return -1;
+  if( pFile->pMethods==0 ) return 0;
+  if( pFile->pMethods->xRead(pFile, aHdr, sizeof(aHdr), 18)!=SQLITE_OK ){
+    return -1;
+  }
+  if( aHdr[0]==2 ) return -1;     /* WAL mode */
+  return ((sqlite3_int64)aHdr[6]<<24) | (aHdr[7]<<16)
+       | (aHdr[8]<<8) | aHdr[9];
+}
+
+/*
+** Check whether the database has been changed by another connection since
+** the document cache of pConn was last used, and clear the cache if it
+** has. This is called once a scan of a collection has started, so that
+** the value read is that of the transaction the scan is part of.
+*/
+void xjd1DocCacheSync(xjd1 *pConn){
+  DocCache *p = pConn->pDocCache;
+  sqlite3_int64 iVersion = -1;
+  sqlite3_int64 iExpect;
+  if( p==0 || p->mxByte==0 ) return;
+  if( p->pVersion==0 ){
+    sqlite3_prepare_v2(pConn->db, "PRAGMA data_version", -1, &p->pVersion, 0);
+  }
+  if( p->pVersion ){
+    if( sqlite3_step(p->pVersion)==SQLITE_ROW ){
+      iVersion = sqlite3_column_int(p->pVersion, 0);
+    }
+    sqlite3_reset(p->pVersion);
+  }
+  if( iVersion>=0 ){
+    /* data_version does not change for commits of this connection */
+    iExpect = p->iVersion;
+  }else{
+    iVersion = cacheChangeCounter(pConn->db);
+    iExpect = (p->iVersion + p->nCommit) & 0xffffffff;
+  }
+  if( iVersion<0 || p->iVersion<0 || iVersion!=iExpect ){
+    xjd1DocCacheInvalidate(pConn, 0, 0);
+  }
+  p->iVersion = iVersion;
+  p->nCommit = 0;
+}
+
+/*
+** Record that connection pConn has committed a transaction that changed
+** the database. See xjd1DocCacheSync().
+*/
+void xjd1DocCacheCommit(xjd1 *pConn){
+  DocCache *p = pConn->pDocCache;
+  if( p ) p->nCommit++;
+}
+
+/*
+** Return true if the document cache of connection pConn is enabled.
+*/
+int xjd1DocCacheIsEnabled(xjd1 *pConn){
+  DocCache *p = pConn->pDocCache;
+  return p!=0 && p->mxByte>0;
+}
+
+/*
+** Return the document with rowid iRowid in collection zColl from the
+** document cache of connection pConn, or NULL if it is not cached.
+**
+** xjd1JsonRef() has been called on the returned value.  The caller must
+** invoke xjd1JsonFree().
+*/
+JsonNode *xjd1DocCacheFetch(xjd1 *pConn, const char *zColl, sqlite3_int64 iRowid){
+  DocCache *p = pConn->pDocCache;
+  DocCacheEntry *pEntry;
+  if( p==0 || p->mxByte==0 ) return 0;
+  pEntry = cacheFind(p, zColl, iRowid);
+  if( pEntry==0 ){
+    p->nMiss++;
+    return 0;
+  }
+  p->nHit++;
+  cacheUnlink(p, pEntry);
+  cacheLinkNewest(p, pEntry);
+  return xjd1JsonRef(pEntry->pDoc);
+}
+
+/*
+** Add complete document pDoc, the document with rowid iRowid in
+** collection zColl, to the document cache of connection pConn.
+*/
+void xjd1DocCacheStore(
+  xjd1 *pConn,
+  const char *zColl,
+  sqlite3_int64 iRowid,
+  JsonNode *pDoc
+){
+  DocCache *p = pConn->pDocCache;
+  DocCacheEntry *pEntry;
+  unsigned int h;
+
+  if( p==0 || p->mxByte==0 || pDoc==0 ) return;
+  if( p->nEntry>=p->nHash ) cacheRehash(p);
+  if( p->nHash==0 ) return;
+  pEntry = xjd1MallocZero(sizeof(*pEntry));
+  if( pEntry==0 ) return;
+  pEntry->nByte = sizeof(*pEntry) + xjd1Strlen30(zColl) + 1
+                + xjd1JsonSizeof(pDoc);
+  pEntry->zColl = xjd1PoolDup(0, zColl, -1);
+  if( pEntry->nByte>p->mxByte || pEntry->zColl==0 ){
+    xjd1_free(pEntry->zColl);
+    xjd1_free(pEntry);
+    return;
+  }
+  pEntry->iRowid = iRowid;
+  pEntry->pDoc = xjd1JsonRef(pDoc);
+  h = cacheHash(zColl, iRowid) % p->nHash;
+  pEntry->pHashNext = p->aHash[h];
+  p->aHash[h] = pEntry;
+  cacheLinkNewest(p, pEntry);
+  p->nEntry++;
+  p->nByte += pEntry->nByte;
+  cacheShrink(p);
+}
+
+/*
+** Return the document in column 1 of the current row of pStmt, which is
+** a scan of collection zColl with the rowid in column 0. The document is
+** taken from the document cache of pConn if it is there. Otherwise it is
+** read using projection pProj, and if it is complete it is added to the
+** cache. A document that is not added to the cache is decoded into
+** arena pArena, if it is not NULL. See xjd1ArenaRead().
+**
+** xjd1JsonRef() has been called on the returned value.  The caller must
+** invoke xjd1JsonFree().
+*/
+JsonNode *xjd1DocCacheColumn(
+  xjd1 *pConn,                    /* Database connection */
+  const char *zColl,              /* Collection being scanned */
+  sqlite3_stmt *pStmt,            /* Scan.  Columns are rowid and x */
+  const JsonNode *pProj,          /* Parts of the document needed */
+  DocArena *pArena                /* Memory for the document, or NULL */
+){
+  sqlite3_int64 iRowid;
+  JsonNode *pDoc;
+
+  if( xjd1DocCacheIsEnabled(pConn)==0 ){
+    return xjd1ArenaColumn(pArena, pStmt, 1, pProj, pConn->pLabels);
+  }
+  iRowid = sqlite3_column_int64(pStmt, 0);
+  pDoc = xjd1DocCacheFetch(pConn, zColl, iRowid);
+  if( pDoc==0 ){
+    if( pProj ){
+      pDoc = xjd1ArenaColumn(pArena, pStmt, 1, pProj, pConn->pLabels);
+    }else{
+      pDoc = xjd1StorageColumn(pStmt, 1, 0, pConn->pLabels, 0);
+      xjd1DocCacheStore(pConn, zColl, iRowid, pDoc);
+    }
+  }
+  return pDoc;
+}
+
+/*
+** Free the document cache of connection pConn.
+*/
+void xjd1DocCacheFree(xjd1 *pConn){
+  DocCache *p = pConn->pDocCache;
+  if( p ){
+    xjd1DocCacheInvalidate(pConn, 0, 0);
+    sqlite3_finalize(p->pVersion);
+    xjd1_free(p->aHash);
+    xjd1_free(p);
+    pConn->pDocCache = 0;
+  }
+}
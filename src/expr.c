@@ -32,8 +32,12 @@ struct ResolveCtx {
   ResolveCtx *pParent;            /* NULL or parent of pQuery */
 };
 
-/* forward reference */
+/* forward references */
 static int walkExpr(Expr*, int (*)(Expr *,void *), void *);
+static int exprFold(Expr*, int);
+static void exprListFold(ExprList*);
+static void exprCompile(Expr*);
+static void exprListCompile(ExprList*);
 
 /*
 ** Walk an expression list
@@ -154,6 +158,9 @@ static int exprResolve(Expr *p, ResolveCtx *pCtx){
       break;
     }
 
+    case TK_CREATECOLLECTION:
+      break;
+
     default:
       assert( 0 );
       break;
@@ -163,6 +170,20 @@ static int exprResolve(Expr *p, ResolveCtx *pCtx){
   return XJD1_ERROR;
 }
 
+/*
+** Replace *pz, a label from the text of statement pStmt, with a label
+** obtained from xjd1LabelNew(). Once the label is interned, the same
+** label in the documents read by the connection is the same pointer.
+*/
+static int exprInitLabel(xjd1_stmt *pStmt, char **pz){
+  char *z;
+  if( *pz==0 ) return XJD1_OK;
+  z = xjd1LabelNew(&pStmt->sPool, pStmt->pConn->pLabels, *pz, -1);
+  if( z==0 ) return XJD1_NOMEM;
+  *pz = z;
+  return XJD1_OK;
+}
+
 /*
 ** Callback for query expressions
 */
@@ -175,6 +196,7 @@ static int walkInitCallback(Expr *p, void *pArg){
   switch( p->eClass ){
     case XJD1_EXPR_Q:
       rc = xjd1QueryInit(p->u.subq.p, pCtx->pStmt, pArg);
+      if( rc==XJD1_OK ) p->u.subq.pCache = xjd1SubqueryCacheNew(p);
       break;
 
     case XJD1_EXPR_FUNC: {
@@ -187,6 +209,20 @@ static int walkInitCallback(Expr *p, void *pArg){
       break;
     }
 
+    case XJD1_EXPR_LVALUE: {
+      rc = exprInitLabel(pCtx->pStmt, &p->u.lvalue.zId);
+      break;
+    }
+
+    case XJD1_EXPR_STRUCT: {
+      ExprList *pList = p->u.st;
+      int i;
+      for(i=0; rc==XJD1_OK && i<pList->nEItem; i++){
+        rc = exprInitLabel(pCtx->pStmt, &pList->apEItem[i].zAs);
+      }
+      break;
+    }
+
     default:
       break;
   }
@@ -197,7 +233,8 @@ static int walkInitCallback(Expr *p, void *pArg){
 
 /*
 ** Initialize an expression in preparation for evaluation of a
-** statement.
+** statement. Fold its constant subexpressions, then compile it into a
+** program for the virtual machine.
 */
 int xjd1ExprInit(
   Expr *p,                        /* Expression to initialize */
@@ -207,12 +244,18 @@ int xjd1ExprInit(
   void *pCtx                      /* Parent resolution context */
 ){
   ResolveCtx sCtx;
+  int rc;
   assert( pQuery==0 || pQuery->pStmt==pStmt );
   sCtx.pStmt = pStmt;
   sCtx.pQuery = pQuery;
   sCtx.eExpr = eExpr;
   sCtx.pParent = (ResolveCtx *)pCtx;
-  return walkExpr(p, walkInitCallback, (void *)&sCtx);
+  rc = walkExpr(p, walkInitCallback, (void *)&sCtx);
+  if( rc==XJD1_OK ){
+    exprFold(p, (eExpr==XJD1_EXPR_WHERE || eExpr==XJD1_EXPR_HAVING));
+    exprCompile(p);
+  }
+  return rc;
 }
 
 /*
@@ -227,12 +270,18 @@ int xjd1ExprListInit(
   void *pCtx                      /* Parent resolution context */
 ){
   ResolveCtx sCtx;
+  int rc;
   assert( pQuery==0 || pQuery->pStmt==pStmt );
   sCtx.pStmt = pStmt;
   sCtx.pQuery = pQuery;
   sCtx.eExpr = eExpr;
   sCtx.pParent = (ResolveCtx *)pCtx;
-  return walkExprList(p, walkInitCallback, (void *)&sCtx);
+  rc = walkExprList(p, walkInitCallback, (void *)&sCtx);
+  if( rc==XJD1_OK ){
+    exprListFold(p);
+    exprListCompile(p);
+  }
+  return rc;
 }
 
 
@@ -241,6 +290,8 @@ static int walkCloseQueryCallback(Expr *p, void *pCtx){
   int rc = XJD1_OK;
   if( p->eType==TK_SELECT ){
     rc = xjd1QueryClose(p->u.subq.p);
+    xjd1SubqueryCacheFree(p->u.subq.pCache);
+    p->u.subq.pCache = 0;
   }
   return rc;
 }
@@ -259,6 +310,71 @@ int xjd1ExprListClose(ExprList *p){
   return walkExprList(p, walkCloseQueryCallback, 0);
 }
 
+/*
+** Record in the projections of the collections scanned by query pQuery
+** the parts of their documents that expression p refers to.  See
+** xjd1QueryProject() for details.
+*/
+void xjd1ExprProject(Expr *p, Query *pQuery){
+  if( p==0 ) return;
+  switch( p->eClass ){
+    case XJD1_EXPR_BI: {
+      xjd1ExprProject(p->u.bi.pLeft, pQuery);
+      xjd1ExprProject(p->u.bi.pRight, pQuery);
+      break;
+    }
+    case XJD1_EXPR_TRI: {
+      xjd1ExprProject(p->u.tri.pTest, pQuery);
+      xjd1ExprProject(p->u.tri.pIfTrue, pQuery);
+      xjd1ExprProject(p->u.tri.pIfFalse, pQuery);
+      break;
+    }
+    case XJD1_EXPR_TK:
+    case XJD1_EXPR_LVALUE: {
+      /* A path such as "c.a.b" requires only the "a.b" part of document
+      ** "c". Other expressions that use a document require all of it. */
+      Expr *pBase = p;
+      while( pBase->eType==TK_DOT ) pBase = pBase->u.lvalue.pLeft;
+      if( pBase->eType==TK_ID ){
+        if( pBase->u.id.pQuery==pQuery ){
+          xjd1QueryProjectPath(pQuery, pBase->u.id.iDatasrc, p);
+        }
+      }else if( pBase!=p ){
+        xjd1ExprProject(pBase, pQuery);
+      }
+      break;
+    }
+    case XJD1_EXPR_FUNC: {
+      xjd1ExprListProject(p->u.func.args, pQuery);
+      break;
+    }
+    case XJD1_EXPR_Q: {
+      xjd1QueryProject(p->u.subq.p, pQuery);
+      break;
+    }
+    case XJD1_EXPR_ARRAY: {
+      xjd1ExprListProject(p->u.ar, pQuery);
+      break;
+    }
+    case XJD1_EXPR_STRUCT: {
+      xjd1ExprListProject(p->u.st, pQuery);
+      break;
+    }
+  }
+}
+
+/*
+** Call xjd1ExprProject() on each expression in a list.
+*/
+void xjd1ExprListProject(ExprList *p, Query *pQuery){
+  if( p ){
+    int i;
+    for(i=0; i<p->nEItem; i++){
+      xjd1ExprProject(p->apEItem[i].pExpr, pQuery);
+    }
+  }
+}
+
 /*
 ** Return true if the JSON object is a string
 */
@@ -317,6 +433,24 @@ static JsonNode *nullJson(void){
   return pRes;
 }
 
+/*
+** If the JSON node passed as the first argument is of type XJD1_STRUCT,
+** return a pointer to the value of property zProperty. The caller does
+** not hold a reference to the value returned.
+**
+** If zProperty is not defined, or if pStruct is not of type XJD1_STRUCT,
+** return NULL. piSlot is the inline cache passed to xjd1JsonFindElem(),
+** or NULL.
+*/
+static JsonNode *findProperty(
+  JsonNode *pStruct,
+  const char *zProperty,
+  int *piSlot
+){
+  JsonStructElem *pElem = xjd1JsonFindElem(pStruct, zProperty, piSlot);
+  return pElem ? pElem->pValue : 0;
+}
+
 /*
 ** If the JSON node passed as the first argument is of type XJD1_STRUCT,
 ** attempt to return a pointer to property zProperty.
@@ -324,19 +458,12 @@ static JsonNode *nullJson(void){
 ** If zProperty is not defined, or if pStruct is not of type XJD1_STRUCT,
 ** return a pointer to a NULL value.
 */
-static JsonNode *getProperty(JsonNode *pStruct, const char *zProperty){
-  JsonStructElem *pElem;
-  JsonNode *pRes = 0;
-
-  if( pStruct && pStruct->eJType==XJD1_STRUCT ){
-    for(pElem=pStruct->u.st.pFirst; pElem; pElem=pElem->pNext){
-      if( strcmp(pElem->zLabel, zProperty)==0 ){
-        pRes = xjd1JsonRef(pElem->pValue);
-        break;
-      }
-    }
-  }
-
+static JsonNode *getProperty(
+  JsonNode *pStruct,
+  const char *zProperty,
+  int *piSlot
+){
+  JsonNode *pRes = xjd1JsonRef(findProperty(pStruct, zProperty, piSlot));
   if( pRes==0 ){
     pRes = nullJson();
   }
@@ -446,6 +573,964 @@ static int withinOperator(JsonNode *pA, JsonNode *pB){
     }                                                  \
 }
 
+/*
+** The x[y] operator. The result depends on the type of value x.
+**
+** If x is of type XJD1_STRUCT, then expression y is converted to
+** a string. The value returned is the value of property y of
+** object x.
+**
+** If x is of type XJD1_ARRAY, then expression y is converted to
+** a number. If that number is an integer, then it is the index of
+** the array element to return.
+**
+** If x is of type XJD1_STRING, then it is treated as an array of
+** characters. Processing proceeds as for XJD1_ARRAY.
+**
+** Return NULL if there is no such value. The caller must free the
+** returned JSON by a call xjdJsonFree().
+*/
+static JsonNode *indexOperator(JsonNode *pJLeft, JsonNode *pJRight){
+  JsonNode *pRes = 0;
+  double rRight;
+
+  if( pJLeft==0 ) return 0;
+  switch( pJLeft->eJType ){
+    case XJD1_STRUCT: {
+      String idx;
+      xjd1StringInit(&idx, 0, 0);
+      xjd1JsonToString(pJRight, &idx);
+      pRes = getProperty(pJLeft, idx.zBuf, 0);
+      xjd1StringClear(&idx);
+      break;
+    }
+
+    case XJD1_ARRAY: {
+      int iIdx;
+      if( xjd1JsonToReal(pJRight, &rRight) ) break;
+      iIdx = (int)rRight;
+      if( (double)iIdx==rRight && iIdx>=0 && iIdx<pJLeft->u.ar.nElem ){
+        pRes = xjd1JsonRef(pJLeft->u.ar.apElem[iIdx]);
+      }
+      break;
+    }
+
+    case XJD1_STRING: {
+      int iIdx;
+      if( xjd1JsonToReal(pJRight, &rRight) ) break;
+      iIdx = (int)rRight;
+      if( (double)iIdx==rRight && iIdx>=0 ){
+        unsigned char *z = (unsigned char*)pJLeft->u.z;
+        for(; *z && iIdx!=0; iIdx--){
+          XJD1_SKIP_UTF8(z);
+        }
+        if( *z ){
+          String x;
+          unsigned char *zEnd = (unsigned char*)z;
+          pRes = xjd1JsonNew(0);
+          if( pRes ){
+            XJD1_SKIP_UTF8(zEnd);
+            xjd1StringInit(&x, 0, 0);
+            xjd1StringAppend(&x, (char*)z, zEnd-(unsigned char*)z);
+            pRes->eJType = XJD1_STRING;
+            pRes->u.z = xjd1StringGet(&x);
+          }
+        }
+      }
+      break;
+    }
+
+    default:
+      break;
+  }
+  return pRes;
+}
+
+
+/*
+** The following code implements a small register-based virtual machine
+** that expressions are compiled into when a statement is prepared, so
+** that evaluating them does not walk the expression tree.
+**
+** Each register holds a pointer to its value. The value is either a
+** REAL, TRUE, FALSE or NULL stored unboxed in the register itself, a
+** borrowed pointer to a literal or to part of another register's value,
+** or a reference held by the register, such as the document returned by
+** xjd1QueryDoc(). A JsonNode is only allocated when a value is created
+** that is not part of any other value (the result of "+" on strings, or
+** an array or struct literal), or when a scalar leaves the machine as
+** the result of xjd1ExprEval(). So a WHERE clause that compares fields
+** of the documents with literals runs without allocating memory.
+**
+** Every register is written at most once by each run of a program, apart
+** from the destination of OP_Copy, which never holds a reference. So no
+** register is released until the program has finished, and a borrowed
+** pointer is valid until then.
+*/
+
+/*
+** The opcodes of the virtual machine. In the descriptions, r[X] is
+** register X and P4 is the pointer operand of the instruction.
+*/
+#define OP_Null        1    /* r[P1] = NULL */
+#define OP_Value       2    /* r[P1] = literal P4 */
+#define OP_Eval        3    /* r[P1] = xjd1ExprEval(P4) */
+#define OP_Copy        4    /* r[P1] = r[P2] */
+#define OP_Goto        5    /* Jump to instruction P2 */
+#define OP_IfTrue      6    /* Jump to instruction P2 if r[P1] is true */
+#define OP_IfFalse     7    /* Jump to instruction P2 if r[P1] is false */
+#define OP_Array       8    /* r[P1] = [r[P2], ... r[P2+P3-1]] */
+#define OP_Struct      9    /* r[P1] = struct of r[P2]... labelled by list P4 */
+
+/* Opcodes from here on read their operands from registers P2 and P3.
+** The unary ones set P3 to P2. */
+#define OP_Field      10    /* r[P1] = r[P2].zId of TK_DOT P4 */
+#define OP_Index      11    /* r[P1] = r[P2][r[P3]] */
+#define OP_Eq         12    /* r[P1] = r[P2] == r[P3] */
+#define OP_Ne         13    /* r[P1] = r[P2] != r[P3] */
+#define OP_Lt         14    /* r[P1] = r[P2] < r[P3] */
+#define OP_Le         15    /* r[P1] = r[P2] <= r[P3] */
+#define OP_Gt         16    /* r[P1] = r[P2] > r[P3] */
+#define OP_Ge         17    /* r[P1] = r[P2] >= r[P3] */
+#define OP_Like       18    /* r[P1] = r[P2] LIKE r[P3] */
+#define OP_ILike      19    /* r[P1] = r[P2] ILIKE r[P3] */
+#define OP_Add        20    /* r[P1] = r[P2] + r[P3] */
+#define OP_Subtract   21    /* r[P1] = r[P2] - r[P3] */
+#define OP_Multiply   22    /* r[P1] = r[P2] * r[P3] */
+#define OP_Divide     23    /* r[P1] = r[P2] / r[P3] */
+#define OP_Remainder  24    /* r[P1] = r[P2] % r[P3] */
+#define OP_ShiftLeft  25    /* r[P1] = r[P2] << r[P3] */
+#define OP_ShiftRight 26    /* r[P1] = r[P2] >> r[P3] */
+#define OP_BitAnd     27    /* r[P1] = r[P2] & r[P3] */
+#define OP_BitOr      28    /* r[P1] = r[P2] | r[P3] */
+#define OP_In         29    /* r[P1] = r[P2] IN r[P3] */
+#define OP_Within     30    /* r[P1] = r[P2] WITHIN r[P3] */
+#define OP_Negate     31    /* r[P1] = -r[P2] */
+#define OP_BitNot     32    /* r[P1] = ~r[P2] */
+#define OP_Not        33    /* r[P1] = !r[P2] */
+
+/*
+** A single instruction.
+*/
+typedef struct VmOp VmOp;
+struct VmOp {
+  int eOp;                        /* One of the OP_* codes */
+  int p1, p2, p3;                 /* Register or instruction operands */
+  void *p4;                       /* Literal, Expr or ExprList */
+};
+
+/*
+** A single register.
+*/
+typedef struct VmReg VmReg;
+struct VmReg {
+  JsonNode *pVal;                 /* Value, or NULL */
+  int bOwn;                       /* True if the register holds a ref on pVal */
+  JsonNode sScalar;               /* Unboxed scalar pVal may point to */
+};
+
+/*
+** A compiled expression.
+*/
+struct ExprProg {
+  int nOp;                        /* Number of instructions */
+  VmOp *aOp;                      /* The instructions */
+  int nReg;                       /* Number of registers */
+  VmReg *aReg;                    /* The registers */
+  int iResult;                    /* Register holding the result */
+  int isRunning;                  /* True while the program is running */
+};
+
+/*
+** State of the compiler while an expression is compiled.
+*/
+typedef struct VmCompiler VmCompiler;
+struct VmCompiler {
+  int nOp;                        /* Number of instructions */
+  int nOpAlloc;                   /* Slots allocated in aOp[] */
+  VmOp *aOp;                      /* The instructions */
+  int nReg;                       /* Number of registers used */
+  int rc;                         /* XJD1_NOMEM after an allocation fails */
+};
+
+/*
+** Add an instruction to the program. Return its address, or -1 if a
+** memory allocation fails.
+*/
+static int vmAddOp(VmCompiler *p, int eOp, int p1, int p2, int p3, void *p4){
+  VmOp *pOp;
+  if( p->rc!=XJD1_OK ) return -1;
+  if( p->nOp>=p->nOpAlloc ){
+    int nNew = p->nOpAlloc*2 + 16;
+    VmOp *aNew = xjd1_realloc(p->aOp, nNew*sizeof(VmOp));
+    if( aNew==0 ){
+      p->rc = XJD1_NOMEM;
+      return -1;
+    }
+    p->aOp = aNew;
+    p->nOpAlloc = nNew;
+  }
+  pOp = &p->aOp[p->nOp];
+  pOp->eOp = eOp;
+  pOp->p1 = p1;
+  pOp->p2 = p2;
+  pOp->p3 = p3;
+  pOp->p4 = p4;
+  return p->nOp++;
+}
+
+/*
+** Make the jump instruction at address addr jump to the next instruction
+** added to the program.
+*/
+static void vmJumpHere(VmCompiler *p, int addr){
+  if( addr>=0 ) p->aOp[addr].p2 = p->nOp;
+}
+
+/*
+** Return the opcode for binary operator eType, or 0 if it is not a binary
+** operator that the virtual machine implements.
+*/
+static int vmBinaryOp(int eType){
+  switch( eType ){
+    case TK_LB:      return OP_Index;
+    case TK_EQEQ:    return OP_Eq;
+    case TK_NE:      return OP_Ne;
+    case TK_LT:      return OP_Lt;
+    case TK_LE:      return OP_Le;
+    case TK_GT:      return OP_Gt;
+    case TK_GE:      return OP_Ge;
+    case TK_LIKEOP:  return OP_Like;
+    case TK_ILIKEOP: return OP_ILike;
+    case TK_PLUS:    return OP_Add;
+    case TK_MINUS:   return OP_Subtract;
+    case TK_STAR:    return OP_Multiply;
+    case TK_SLASH:   return OP_Divide;
+    case TK_REM:     return OP_Remainder;
+    case TK_LSHIFT:  return OP_ShiftLeft;
+    case TK_RSHIFT:  return OP_ShiftRight;
+    case TK_BITAND:  return OP_BitAnd;
+    case TK_BITOR:   return OP_BitOr;
+    case TK_IN:      return OP_In;
+    case TK_WITHIN:  return OP_Within;
+  }
+  return 0;
+}
+
+/*
+** Add code to evaluate expression pExpr to the program. Return the
+** register that holds the value.
+**
+** Identifiers, function calls and subqueries are evaluated by calling
+** xjd1ExprEval() on them. The arguments of a function are compiled into
+** programs of their own, as they are evaluated by func.c.
+*/
+static int vmCode(VmCompiler *p, Expr *pExpr){
+  int iReg = p->nReg++;
+  int eOp;
+  int r1, r2, r3;
+  int addr1, addr2;
+  int i;
+
+  if( pExpr==0 ){
+    vmAddOp(p, OP_Null, iReg, 0, 0, 0);
+    return iReg;
+  }
+  switch( pExpr->eType ){
+    case TK_JVALUE: {
+      vmAddOp(p, OP_Value, iReg, 0, 0, (void*)pExpr->u.json.p);
+      break;
+    }
+
+    case TK_DOT: {
+      r1 = vmCode(p, pExpr->u.lvalue.pLeft);
+      vmAddOp(p, OP_Field, iReg, r1, r1, (void*)pExpr);
+      break;
+    }
+
+    /* "x AND y" is "x ? y : x" and "x OR y" is "x ? x : y". */
+    case TK_AND:
+    case TK_OR: {
+      r1 = vmCode(p, pExpr->u.bi.pLeft);
+      vmAddOp(p, OP_Copy, iReg, r1, 0, 0);
+      addr1 = vmAddOp(p, (pExpr->eType==TK_AND ? OP_IfFalse : OP_IfTrue),
+                      r1, 0, 0, 0);
+      r2 = vmCode(p, pExpr->u.bi.pRight);
+      vmAddOp(p, OP_Copy, iReg, r2, 0, 0);
+      vmJumpHere(p, addr1);
+      break;
+    }
+
+    case TK_QM: {
+      r1 = vmCode(p, pExpr->u.tri.pTest);
+      addr1 = vmAddOp(p, OP_IfFalse, r1, 0, 0, 0);
+      r2 = vmCode(p, pExpr->u.tri.pIfTrue);
+      vmAddOp(p, OP_Copy, iReg, r2, 0, 0);
+      addr2 = vmAddOp(p, OP_Goto, 0, 0, 0, 0);
+      vmJumpHere(p, addr1);
+      r3 = vmCode(p, pExpr->u.tri.pIfFalse);
+      vmAddOp(p, OP_Copy, iReg, r3, 0, 0);
+      vmJumpHere(p, addr2);
+      break;
+    }
+
+    case TK_BITNOT:
+    case TK_BANG: {
+      r1 = vmCode(p, pExpr->u.bi.pLeft);
+      eOp = (pExpr->eType==TK_BANG ? OP_Not : OP_BitNot);
+      vmAddOp(p, eOp, iReg, r1, r1, 0);
+      break;
+    }
+
+    /* The elements of an array or struct literal are copied to a block of
+    ** consecutive registers. */
+    case TK_ARRAY:
+    case TK_STRUCT: {
+      ExprList *pList = pExpr->u.st;
+      int iBase = p->nReg;
+      p->nReg += pList->nEItem;
+      for(i=0; i<pList->nEItem; i++){
+        r1 = vmCode(p, pList->apEItem[i].pExpr);
+        vmAddOp(p, OP_Copy, iBase+i, r1, 0, 0);
+      }
+      if( pExpr->eType==TK_ARRAY ){
+        vmAddOp(p, OP_Array, iReg, iBase, pList->nEItem, 0);
+      }else{
+        vmAddOp(p, OP_Struct, iReg, iBase, pList->nEItem, (void*)pList);
+      }
+      break;
+    }
+
+    case TK_FUNCTION: {
+      ExprList *pArgs = pExpr->u.func.args;
+      if( pArgs ){
+        for(i=0; i<pArgs->nEItem; i++) exprCompile(pArgs->apEItem[i].pExpr);
+      }
+      vmAddOp(p, OP_Eval, iReg, 0, 0, (void*)pExpr);
+      break;
+    }
+
+    case TK_MINUS: {
+      if( pExpr->u.bi.pRight==0 ){
+        r1 = vmCode(p, pExpr->u.bi.pLeft);
+        vmAddOp(p, OP_Negate, iReg, r1, r1, 0);
+        break;
+      }
+      /* Fall through */
+    }
+    default: {
+      eOp = vmBinaryOp(pExpr->eType);
+      if( eOp ){
+        r1 = vmCode(p, pExpr->u.bi.pLeft);
+        r2 = vmCode(p, pExpr->u.bi.pRight);
+        vmAddOp(p, eOp, iReg, r1, r2, 0);
+      }else{
+        vmAddOp(p, OP_Eval, iReg, 0, 0, (void*)pExpr);
+      }
+      break;
+    }
+  }
+  return iReg;
+}
+
+/*
+** Compile expression p into a program, and attach the program to p. The
+** program is allocated from the memory pool of the statement, so it is
+** freed along with the expression tree.
+**
+** If p would be evaluated by a single OP_Eval instruction, or if a memory
+** allocation fails, no program is attached and p is evaluated by walking
+** the tree as before.
+*/
+static void exprCompile(Expr *p){
+  VmCompiler s;
+  int iResult;
+
+  if( p==0 ) return;
+  memset(&s, 0, sizeof(s));
+  iResult = vmCode(&s, p);
+  if( s.rc==XJD1_OK && (s.nOp>1 || s.aOp[0].eOp!=OP_Eval) ){
+    Pool *pPool = &p->pStmt->sPool;
+    ExprProg *pProg = xjd1PoolMallocZero(pPool, sizeof(ExprProg));
+    if( pProg ){
+      pProg->aOp = xjd1PoolMalloc(pPool, s.nOp*sizeof(VmOp));
+      pProg->aReg = xjd1PoolMallocZero(pPool, s.nReg*sizeof(VmReg));
+      if( pProg->aOp && pProg->aReg ){
+        memcpy(pProg->aOp, s.aOp, s.nOp*sizeof(VmOp));
+        pProg->nOp = s.nOp;
+        pProg->nReg = s.nReg;
+        pProg->iResult = iResult;
+        p->pProg = pProg;
+      }
+    }
+  }
+  xjd1_free(s.aOp);
+}
+
+/*
+** Compile each expression in a list.
+*/
+static void exprListCompile(ExprList *p){
+  if( p ){
+    int i;
+    for(i=0; i<p->nEItem; i++){
+      exprCompile(p->apEItem[i].pExpr);
+    }
+  }
+}
+
+/*
+** Set register pReg to an unboxed scalar of type eJType.
+*/
+static void vmSetScalar(VmReg *pReg, int eJType){
+  pReg->sScalar.eJType = eJType;
+  pReg->pVal = &pReg->sScalar;
+}
+
+/*
+** Set register pReg to the REAL value r.
+*/
+static void vmSetReal(VmReg *pReg, double r){
+  pReg->sScalar.u.r = r;
+  vmSetScalar(pReg, XJD1_REAL);
+}
+
+/*
+** Set register pReg to value pVal. If pVal is NULL, set it to a JSON
+** null instead. The register takes over the caller's reference to pVal.
+*/
+static void vmSetOwned(VmReg *pReg, JsonNode *pVal){
+  assert( pReg->bOwn==0 );
+  if( pVal ){
+    pReg->pVal = pVal;
+    pReg->bOwn = 1;
+  }else{
+    vmSetScalar(pReg, XJD1_NULL);
+  }
+}
+
+/*
+** Copy the value of register pFrom to register pTo, without taking a
+** reference to it.
+*/
+static void vmCopy(VmReg *pTo, VmReg *pFrom){
+  if( pFrom->pVal==&pFrom->sScalar ){
+    pTo->sScalar = pFrom->sScalar;
+    pTo->pVal = &pTo->sScalar;
+  }else{
+    pTo->pVal = pFrom->pVal;
+  }
+}
+
+/*
+** Return true if the value of register pReg is TRUE in a boolean context.
+*/
+static int vmTrue(VmReg *pReg){
+  return pReg->pVal ? isTrue(pReg->pVal) : 0;
+}
+
+/*
+** Return the value of register pReg as a JSON object that outlives the
+** program. The caller must free the returned JSON by a call
+** xjd1JsonFree().
+*/
+static JsonNode *vmEscape(VmReg *pReg){
+  JsonNode *pRes;
+  if( pReg->pVal!=&pReg->sScalar ) return xjd1JsonRef(pReg->pVal);
+  pRes = xjd1JsonNew(0);
+  if( pRes ){
+    pRes->eJType = pReg->sScalar.eJType;
+    pRes->u = pReg->sScalar.u;
+  }
+  return pRes;
+}
+
+/*
+** Run program p. Return the register that holds the result. The
+** registers are valid until vmReset() is called.
+*/
+static VmReg *vmExec(ExprProg *p){
+  VmOp *aOp = p->aOp;
+  VmReg *aReg = p->aReg;
+  int pc;
+
+  p->isRunning = 1;
+  for(pc=0; pc<p->nOp; pc++){
+    VmOp *pOp = &aOp[pc];
+    VmReg *pOut = &aReg[pOp->p1];
+    JsonNode *pLeft = 0;
+    JsonNode *pRight = 0;
+    double rLeft, rRight;
+
+    if( pOp->eOp>=OP_Field ){
+      pLeft = aReg[pOp->p2].pVal;
+      pRight = aReg[pOp->p3].pVal;
+    }
+
+    switch( pOp->eOp ){
+      case OP_Null: {
+        vmSetScalar(pOut, XJD1_NULL);
+        break;
+      }
+      case OP_Value: {
+        pOut->pVal = (JsonNode*)pOp->p4;
+        break;
+      }
+      case OP_Eval: {
+        vmSetOwned(pOut, xjd1ExprEval((Expr*)pOp->p4));
+        break;
+      }
+      case OP_Field: {
+        Expr *pDot = (Expr*)pOp->p4;
+        pOut->pVal = findProperty(pLeft, pDot->u.lvalue.zId,
+                                  &pDot->u.lvalue.iSlot);
+        if( pOut->pVal==0 ) vmSetScalar(pOut, XJD1_NULL);
+        break;
+      }
+      case OP_Index: {
+        vmSetOwned(pOut, indexOperator(pLeft, pRight));
+        break;
+      }
+      case OP_Copy: {
+        vmCopy(pOut, &aReg[pOp->p2]);
+        break;
+      }
+      case OP_Goto: {
+        pc = pOp->p2 - 1;
+        break;
+      }
+      case OP_IfTrue:
+      case OP_IfFalse: {
+        if( vmTrue(pOut)==(pOp->eOp==OP_IfTrue) ) pc = pOp->p2 - 1;
+        break;
+      }
+      case OP_Eq:
+      case OP_Ne:
+      case OP_Lt:
+      case OP_Le:
+      case OP_Gt:
+      case OP_Ge:
+      case OP_Like:
+      case OP_ILike: {
+        int c = xjd1JsonCompare(pLeft, pRight, pOp->eOp==OP_ILike);
+        switch( pOp->eOp ){
+          case OP_Ne: c = c!=0;   break;
+          case OP_Lt: c = c<0;    break;
+          case OP_Le: c = c<=0;   break;
+          case OP_Gt: c = c>0;    break;
+          case OP_Ge: c = c>=0;   break;
+          default:    c = c==0;   break;
+        }
+        vmSetScalar(pOut, c ? XJD1_TRUE : XJD1_FALSE);
+        break;
+      }
+      case OP_Add: {
+        if( isStr(pLeft) || isStr(pRight) ){
+          JsonNode *pRes = xjd1JsonNew(0);
+          if( pRes ){
+            String x;
+            xjd1StringInit(&x, 0, 0);
+            xjd1JsonToString(pLeft, &x);
+            xjd1JsonToString(pRight, &x);
+            pRes->eJType = XJD1_STRING;
+            pRes->u.z = xjd1StringGet(&x);
+          }
+          vmSetOwned(pOut, pRes);
+        }else{
+          xjd1JsonToReal(pLeft, &rLeft);
+          xjd1JsonToReal(pRight, &rRight);
+          vmSetReal(pOut, rLeft+rRight);
+        }
+        break;
+      }
+      case OP_Subtract:
+      case OP_Multiply:
+      case OP_Divide: {
+        xjd1JsonToReal(pLeft, &rLeft);
+        xjd1JsonToReal(pRight, &rRight);
+        switch( pOp->eOp ){
+          case OP_Subtract: vmSetReal(pOut, rLeft-rRight); break;
+          case OP_Multiply: vmSetReal(pOut, rLeft*rRight); break;
+          default: vmSetReal(pOut, rRight!=0.0 ? rLeft/rRight : 0.0); break;
+        }
+        break;
+      }
+      case OP_Negate: {
+        xjd1JsonToReal(pLeft, &rLeft);
+        vmSetReal(pOut, -1.0 * rLeft);
+        break;
+      }
+      case OP_Remainder:
+      case OP_ShiftLeft:
+      case OP_ShiftRight:
+      case OP_BitAnd:
+      case OP_BitOr: {
+        int iLeft, iRight;
+        xjd1JsonToReal(pLeft, &rLeft);
+        xjd1JsonToReal(pRight, &rRight);
+        iLeft = rLeft;
+        iRight = rRight;
+        switch( pOp->eOp ){
+          case OP_ShiftRight:
+            if( iRight>=32 ){
+              vmSetReal(pOut, (double)(iLeft<0 ? -1 : 0));
+            }else{
+              vmSetReal(pOut, (double)(iLeft >> iRight));
+            }
+            break;
+          case OP_ShiftLeft:
+            if( iRight>=32 ){
+              vmSetReal(pOut, 0.0);
+            }else{
+              vmSetReal(pOut, (double)(iLeft << iRight));
+            }
+            break;
+          case OP_BitAnd: vmSetReal(pOut, (double)(iLeft & iRight)); break;
+          case OP_BitOr:  vmSetReal(pOut, (double)(iLeft | iRight)); break;
+          default:        vmSetReal(pOut, (double)(iLeft % iRight)); break;
+        }
+        break;
+      }
+      case OP_BitNot: {
+        xjd1JsonToReal(pLeft, &rLeft);
+        vmSetReal(pOut, (double)(~((int)rLeft)));
+        break;
+      }
+      case OP_Not: {
+        vmSetScalar(pOut, vmTrue(&aReg[pOp->p2]) ? XJD1_FALSE : XJD1_TRUE);
+        break;
+      }
+      case OP_In: {
+        vmSetScalar(pOut, inOperator(pLeft, pRight) ? XJD1_TRUE : XJD1_FALSE);
+        break;
+      }
+      case OP_Within: {
+        int c = withinOperator(pLeft, pRight);
+        vmSetScalar(pOut, c ? XJD1_TRUE : XJD1_FALSE);
+        break;
+      }
+      case OP_Array: {
+        JsonNode *pRes = nullJson();
+        int i;
+        if( pRes ){
+          pRes->u.ar.apElem = xjd1_malloc( pOp->p3*sizeof(JsonNode*) );
+          if( pRes->u.ar.apElem ){
+            pRes->u.ar.nElem = pOp->p3;
+            pRes->eJType = XJD1_ARRAY;
+            for(i=0; i<pOp->p3; i++){
+              pRes->u.ar.apElem[i] = vmEscape(&aReg[pOp->p2+i]);
+            }
+          }
+        }
+        vmSetOwned(pOut, pRes);
+        break;
+      }
+      case OP_Struct: {
+        ExprList *pList = (ExprList*)pOp->p4;
+        JsonNode *pRes = nullJson();
+        int i;
+        if( pRes ){
+          JsonStructElem *pElem, **ppPrev = &pRes->u.st.pFirst;
+          pRes->eJType = XJD1_STRUCT;
+          for(i=0; i<pOp->p3; i++){
+            pElem = xjd1_malloc( sizeof(*pElem) );
+            if( pElem==0 ) break;
+            *ppPrev = pRes->u.st.pLast = pElem;
+            ppPrev = &pElem->pNext;
+            memset(pElem, 0, sizeof(*pElem));
+            pElem->zLabel = xjd1LabelDup(0, pList->apEItem[i].zAs);
+            pElem->pValue = vmEscape(&aReg[pOp->p2+i]);
+          }
+        }
+        vmSetOwned(pOut, pRes);
+        break;
+      }
+    }
+  }
+  return &aReg[p->iResult];
+}
+
+/*
+** Release the values held by the registers of program p after a run.
+*/
+static void vmReset(ExprProg *p){
+  int i;
+  for(i=0; i<p->nReg; i++){
+    VmReg *pReg = &p->aReg[i];
+    if( pReg->bOwn ){
+      xjd1JsonFree(pReg->pVal);
+      pReg->bOwn = 0;
+    }
+    pReg->pVal = 0;
+  }
+  p->isRunning = 0;
+}
+
+/*
+** Run program p and return its result. The caller must free the returned
+** JSON by a call xjd1JsonFree().
+*/
+static JsonNode *exprProgEval(ExprProg *p){
+  JsonNode *pRes = vmEscape(vmExec(p));
+  vmReset(p);
+  return pRes;
+}
+
+/*
+** Run program p and return true if its result is TRUE in a boolean
+** context.
+*/
+static int exprProgTrue(ExprProg *p){
+  int rc = vmTrue(vmExec(p));
+  vmReset(p);
+  return rc;
+}
+
+/*
+** Constant folding. When a statement is prepared, each subexpression
+** whose value does not depend on the documents being processed is
+** evaluated once and replaced by a TK_JVALUE node holding the value, so
+** that it is not evaluated again for every row. The value is copied to
+** the memory pool of the statement, like the literals of the statement.
+**
+** Operands of AND, OR and ?: that can never be evaluated are removed,
+** along with any subqueries they contain, without being folded. In a
+** boolean context, such as a WHERE clause, "x AND y" and "x OR y" are
+** also simplified when y is constant, as only the truth of the result
+** matters there.
+**
+** An operation that would trap if it were evaluated, such as an integer
+** remainder by zero, is never folded. It is left to be evaluated when,
+** and only if, a row needs it.
+*/
+
+/*
+** Return true if expression p, a TK_JVALUE, is TRUE in a boolean context.
+*/
+static int exprConstTrue(Expr *p){
+  assert( p->eType==TK_JVALUE );
+  return p->u.json.p ? isTrue(p->u.json.p) : 0;
+}
+
+/*
+** Return true if the constant value pVal cannot be converted to a 32-bit
+** integer, as the bitwise and remainder operators do, or converts to iBad.
+*/
+static int exprBadInt(const JsonNode *pVal, int iBad){
+  double r;
+  xjd1JsonToReal(pVal, &r);
+  return !(r>-2147483649.0 && r<2147483648.0) || (int)r==iBad;
+}
+
+/*
+** Return true if evaluating expression p, whose operands are all
+** constants, might trap: an integer remainder by zero, or of the smallest
+** integer by -1.
+*/
+static int exprMayTrap(Expr *p){
+  if( p->eType==TK_REM ){
+    Expr *pLeft = p->u.bi.pLeft;
+    Expr *pRight = p->u.bi.pRight;
+    assert( pLeft->eType==TK_JVALUE && pRight->eType==TK_JVALUE );
+    if( exprBadInt(pRight->u.json.p, 0) ) return 1;
+    if( !exprBadInt(pRight->u.json.p, -1) ) return 0;
+    return exprBadInt(pLeft->u.json.p, (int)0x80000000);
+  }
+  return 0;
+}
+
+/*
+** Replace expression p with a copy of pWith. Close any subqueries in
+** pDrop, an operand of p that has been removed from the tree.
+*/
+static void exprReplace(Expr *p, Expr *pWith, Expr *pDrop){
+  xjd1ExprClose(pDrop);
+  *p = *pWith;
+}
+
+/*
+** Replace expression p with a TK_JVALUE node for value pVal. Return true
+** if successful, or false if a memory allocation fails.
+*/
+static int exprSetValue(Expr *p, JsonNode *pVal){
+  JsonNode *pCopy = xjd1JsonPoolCopy(&p->pStmt->sPool, pVal);
+  if( pCopy==0 ) return 0;
+  p->eType = TK_JVALUE;
+  p->eClass = XJD1_EXPR_JSON;
+  p->u.json.p = pCopy;
+  return 1;
+}
+
+/*
+** Expression p is a scalar subquery. If its result is constant, because
+** it has no FROM clause and its other clauses are all constant, replace
+** p with the result and return true. Otherwise return false.
+*/
+static int exprFoldSubquery(Expr *p){
+  Query *pSub = p->u.subq.p;
+  Expr *pRes, *pWhere;
+  JsonNode sNull;
+  JsonNode *pVal;
+
+  if( pSub->eQType!=TK_SELECT ) return 0;
+  if( pSub->u.simple.pFrom || pSub->u.simple.pGroupBy
+   || pSub->u.simple.pHaving || pSub->u.simple.pAgg
+   || pSub->pLimit || pSub->pOffset
+  ){
+    return 0;
+  }
+  pRes = pSub->u.simple.pRes;
+  pWhere = pSub->u.simple.pWhere;
+  if( pRes==0 || pRes->eType!=TK_JVALUE ) return 0;
+  if( pWhere && pWhere->eType!=TK_JVALUE ) return 0;
+
+  /* The query returns one row, the value of pRes, unless the WHERE clause
+  ** is false. If it returns no rows the value is NULL. */
+  if( pWhere && !exprConstTrue(pWhere) ){
+    memset(&sNull, 0, sizeof(sNull));
+    sNull.eJType = XJD1_NULL;
+    pVal = &sNull;
+  }else{
+    pVal = pRes->u.json.p;
+  }
+  if( pVal==0 ) return 0;
+
+  xjd1QueryClose(pSub);
+  xjd1SubqueryCacheFree(p->u.subq.pCache);
+  p->u.subq.pCache = 0;
+  if( exprSetValue(p, pVal) ) return 1;
+
+  /* pSub has been closed, so p may not be left as a subquery. */
+  p->eType = TK_JVALUE;
+  p->eClass = XJD1_EXPR_JSON;
+  p->u.json.p = 0;
+  return 1;
+}
+
+/*
+** Fold the constant subexpressions of expression p. If p is itself
+** constant, replace it with a TK_JVALUE node and return true. Parameter
+** bBool is true if p is in a boolean context.
+*/
+static int exprFold(Expr *p, int bBool){
+  int bConst = 1;
+  int i;
+
+  if( p==0 ) return 0;
+  switch( p->eClass ){
+    case XJD1_EXPR_JSON: {
+      return 1;
+    }
+
+    case XJD1_EXPR_Q: {
+      return exprFoldSubquery(p);
+    }
+
+    case XJD1_EXPR_FUNC: {
+      ExprList *pArgs = p->u.func.args;
+      for(i=0; pArgs && i<pArgs->nEItem; i++){
+        if( !exprFold(pArgs->apEItem[i].pExpr, 0) ) bConst = 0;
+      }
+      if( !xjd1FunctionIsScalar(p) ) bConst = 0;
+      break;
+    }
+
+    case XJD1_EXPR_ARRAY:
+    case XJD1_EXPR_STRUCT: {
+      ExprList *pList = p->u.st;
+      for(i=0; i<pList->nEItem; i++){
+        if( !exprFold(pList->apEItem[i].pExpr, 0) ) bConst = 0;
+      }
+      break;
+    }
+
+    case XJD1_EXPR_LVALUE: {
+      if( p->eType!=TK_DOT || !exprFold(p->u.lvalue.pLeft, 0) ) bConst = 0;
+      break;
+    }
+
+    case XJD1_EXPR_TRI: {
+      Expr *pTest = p->u.tri.pTest;
+      Expr *pIfTrue = p->u.tri.pIfTrue;
+      Expr *pIfFalse = p->u.tri.pIfFalse;
+      if( !exprFold(pTest, 1) ){
+        exprFold(pIfTrue, bBool);
+        exprFold(pIfFalse, bBool);
+        return 0;
+      }
+      if( exprConstTrue(pTest) ){
+        exprReplace(p, pIfTrue, pIfFalse);
+      }else{
+        exprReplace(p, pIfFalse, pIfTrue);
+      }
+      return exprFold(p, bBool);
+    }
+
+    case XJD1_EXPR_BI: {
+      Expr *pLeft = p->u.bi.pLeft;
+      Expr *pRight = p->u.bi.pRight;
+      if( p->eType==TK_AND || p->eType==TK_OR ){
+        int isOr = (p->eType==TK_OR);
+        if( exprFold(pLeft, bBool) ){
+          /* "x AND y" is "x ? y : x" and "x OR y" is "x ? x : y". */
+          if( exprConstTrue(pLeft)==isOr ){
+            exprReplace(p, pLeft, pRight);
+            return 1;
+          }
+          exprReplace(p, pRight, 0);
+          return exprFold(p, bBool);
+        }
+        if( exprFold(pRight, bBool) && bBool ){
+          /* "x AND false" and "x OR true" have the truth value of y. The
+          ** truth value of "x AND true" and "x OR false" is that of x. */
+          if( exprConstTrue(pRight)==isOr ){
+            exprReplace(p, pRight, pLeft);
+            return 1;
+          }
+          exprReplace(p, pLeft, 0);
+        }
+        return 0;
+      }
+      if( p->eType==TK_BANG ){
+        bConst = exprFold(pLeft, 1);
+      }else if( p->eType==TK_BITNOT || p->eType==TK_MINUS
+             || vmBinaryOp(p->eType)
+      ){
+        if( !exprFold(pLeft, 0) ) bConst = 0;
+        if( pRight && !exprFold(pRight, 0) ) bConst = 0;
+      }else{
+        bConst = 0;
+      }
+      break;
+    }
+
+    default: {
+      bConst = 0;
+      break;
+    }
+  }
+
+  if( bConst ){
+    JsonNode *pVal;
+    if( exprMayTrap(p) ) return 0;
+    pVal = xjd1ExprEval(p);
+    bConst = pVal && exprSetValue(p, pVal);
+    xjd1JsonFree(pVal);
+  }
+  return bConst;
+}
+
+/*
+** Fold the constant subexpressions of each expression in a list.
+*/
+static void exprListFold(ExprList *p){
+  if( p ){
+    int i;
+    for(i=0; i<p->nEItem; i++){
+      exprFold(p->apEItem[i].pExpr, 0);
+    }
+  }
+}
 
 /*
 ** Evaluate an expression.  Return the result as a JSON object.
@@ -459,6 +1544,7 @@ JsonNode *xjd1ExprEval(Expr *p){
   JsonNode *pJLeft, *pJRight;
 
   if( p==0 ) return nullJson();
+  if( p->pProg && !p->pProg->isRunning ) return exprProgEval(p->pProg);
   switch( p->eType ){
     case TK_JVALUE: {
       return xjd1JsonRef(p->u.json.p);
@@ -466,78 +1552,15 @@ JsonNode *xjd1ExprEval(Expr *p){
 
     case TK_DOT: {
       JsonNode *pBase = xjd1ExprEval(p->u.lvalue.pLeft);
-      pRes = getProperty(pBase, p->u.lvalue.zId);
+      pRes = getProperty(pBase, p->u.lvalue.zId, &p->u.lvalue.iSlot);
       xjd1JsonFree(pBase);
       return pRes;
     }
 
-    /* The x[y] operator. The result depends on the type of value x.
-    **
-    ** If x is of type XJD1_STRUCT, then expression y is converted to
-    ** a string. The value returned is the value of property y of
-    ** object x.
-    **
-    ** If x is of type XJD1_ARRAY, then expression y is converted to
-    ** a number. If that number is an integer, then it is the index of
-    ** the array element to return.
-    **
-    ** If x is of type XJD1_STRING, then it is treated as an array of
-    ** characters. Processing proceeds as for XJD1_ARRAY.
-    */
     case TK_LB: {
       pJLeft = xjd1ExprEval(p->u.bi.pLeft);
       pJRight = xjd1ExprEval(p->u.bi.pRight);
-      pRes = 0;
-
-      switch( pJLeft->eJType ){
-        case XJD1_STRUCT: {
-          String idx;
-          xjd1StringInit(&idx, 0, 0);
-          xjd1JsonToString(pJRight, &idx);
-          pRes = getProperty(pJLeft, idx.zBuf);
-          xjd1StringClear(&idx);
-          break;
-        }
-
-        case XJD1_ARRAY: {
-          int iIdx;
-          if( xjd1JsonToReal(pJRight, &rRight) ) break;
-          iIdx = (int)rRight;
-          if( (double)iIdx==rRight && iIdx>=0 && iIdx<pJLeft->u.ar.nElem ){
-            pRes = xjd1JsonRef(pJLeft->u.ar.apElem[iIdx]);
-          }
-          break;
-        }
-
-        case XJD1_STRING: {
-          int iIdx;
-          if( xjd1JsonToReal(pJRight, &rRight) ) break;
-          iIdx = (int)rRight;
-          if( (double)iIdx==rRight && iIdx>=0 ){
-            unsigned char *z = (unsigned char*)pJLeft->u.z;
-            for(; *z && iIdx!=0; iIdx--){
-              XJD1_SKIP_UTF8(z);
-            }
-            if( *z ){
-              String x;
-              unsigned char *zEnd = (unsigned char*)z;
-              pRes = xjd1JsonNew(0);
-              if( pRes ){
-                XJD1_SKIP_UTF8(zEnd);
-                xjd1StringInit(&x, 0, 0);
-                xjd1StringAppend(&x, (char*)z, zEnd-(unsigned char*)z);
-                pRes->eJType = XJD1_STRING;
-                pRes->u.z = xjd1StringGet(&x);
-              }
-            }
-          }
-          break;
-        }
-
-        default:
-          break;
-      }
-
+      pRes = indexOperator(pJLeft, pJRight);
       xjd1JsonFree(pJLeft);
       xjd1JsonFree(pJRight);
       if( pRes==0 ) pRes = nullJson();
@@ -581,13 +1604,17 @@ JsonNode *xjd1ExprEval(Expr *p){
 
     /* A scalar sub-query. The result of this is the first object
     ** returned by executing the query. Or, if the query returns zero
-    ** rows, a NULL value.
-    **
-    ** TODO: Handle correlated and uncorrelated sub-queries differently.
+    ** rows, a NULL value. Results are cached where possible, so that the
+    ** query is not run again for the same values of its references to
+    ** outer queries. See subquery.c.
     */
     case TK_SELECT: {
       Query *pQuery = p->u.subq.p;
+      SubqueryCache *pCache = p->u.subq.pCache;
       int rc;
+      if( pCache && xjd1SubqueryCacheLookup(pCache, &pRes) ){
+        return pRes;
+      }
       rc = xjd1QueryStep(pQuery);
       if( rc==XJD1_ROW ){
         pRes = xjd1QueryDoc(pQuery, 0);
@@ -596,6 +1623,7 @@ JsonNode *xjd1ExprEval(Expr *p){
         if( pRes ) pRes->eJType = XJD1_NULL;
       }
       xjd1QueryRewind(pQuery);
+      if( pCache ) xjd1SubqueryCacheStore(pCache, pRes);
       return pRes;
     }
   }
@@ -618,7 +1646,7 @@ JsonNode *xjd1ExprEval(Expr *p){
         *ppPrev = pRes->u.st.pLast = pElem;
         ppPrev = &pElem->pNext;
         memset(pElem, 0, sizeof(*pElem));
-        pElem->zLabel = xjd1PoolDup(0, pItem->zAs, -1);
+        pElem->zLabel = xjd1LabelDup(0, pItem->zAs);
         pElem->pValue = xjd1ExprEval(pItem->pExpr);
       }
       break;
@@ -791,6 +1819,7 @@ JsonNode *xjd1ExprEval(Expr *p){
     }
 
     case TK_QM: {
+      xjd1JsonFree(pRes);
       if( xjd1ExprTrue(p->u.tri.pTest) ){
         pRes = xjd1ExprEval(p->u.tri.pIfTrue);
       }else{
@@ -832,7 +1861,9 @@ JsonNode *xjd1ExprEval(Expr *p){
 */
 int xjd1ExprTrue(Expr *p){
   int rc = 0;
-  JsonNode *pValue = xjd1ExprEval(p);
+  JsonNode *pValue;
+  if( p && p->pProg && !p->pProg->isRunning ) return exprProgTrue(p->pProg);
+  pValue = xjd1ExprEval(p);
   if( pValue ){
     rc = isTrue(pValue);
     assert( rc==1 || rc==0 );
@@ -840,4 +1871,3 @@ int xjd1ExprTrue(Expr *p){
   }
   return rc;
 }
-
@@ -461,6 +461,16 @@ void xjd1AggregateClear(Query *pQuery){
   }
 }
 
+/*
+** Return true if expression p, of type TK_FUNCTION, calls a scalar
+** function rather than an aggregate. The result of a scalar function
+** depends only on its arguments.
+*/
+int xjd1FunctionIsScalar(Expr *p){
+  assert( p->eType==TK_FUNCTION && p->eClass==XJD1_EXPR_FUNC );
+  return p->u.func.pFunction && p->u.func.pFunction->xFunc!=0;
+}
+
 JsonNode *xjd1FunctionEval(Expr *p){
   JsonNode *pRet;
   Function *pFunc = p->u.func.pFunction;
@@ -0,0 +1,251 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains code used to aggregate the rows of a GROUP BY query
+** in a hash table.
+**
+** Each group holds the values of the GROUP BY expressions, the context
+** of each aggregate function and one document from each FROM clause term.
+** The documents are those of the last row for which an aggregate asked
+** for the row to be saved (for example, the row that holds the max()
+** value), or of the last row of the group if none did. Other rows are
+** discarded as soon as their aggregates have been stepped.
+*/
+#include "xjd1Int.h"
+
+/*
+** A single group.
+*/
+typedef struct Group Group;
+struct Group {
+  unsigned int h;                 /* Hash of the GROUP BY values */
+  int hasNaN;                     /* True if the GROUP BY values hold a NaN */
+  int isSaved;                    /* True if apVal[] is from a saved row */
+  Group *pHash;                   /* Next group in the same bucket */
+  Group *pNext;                   /* Next group in order of creation */
+  void **apCtx;                   /* Aggregate contexts */
+  JsonNode **apVal;               /* GROUP BY values, then documents */
+};
+
+/*
+** A hash table of groups.
+*/
+struct GroupTable {
+  Query *pQuery;                  /* The GROUP BY query */
+  int nKey;                       /* Number of GROUP BY expressions */
+  int nSrc;                       /* Number of FROM clause documents */
+  int nAgg;                       /* Number of aggregate functions */
+  int nGroup;                     /* Number of groups */
+  int nBucket;                    /* Size of aBucket[], a power of two */
+  Group **aBucket;                /* Hash buckets */
+  Group *pFirst;                  /* First group created */
+  Group **ppLast;                 /* Where to link the next group */
+  JsonNode **apKey;               /* GROUP BY values of the current row */
+};
+
+/*
+** Return a new, empty, group table for GROUP BY query pQuery.
+*/
+GroupTable *xjd1GroupTableNew(Query *pQuery){
+  GroupTable *p;
+  assert( pQuery->eQType==TK_SELECT && pQuery->u.simple.pGroupBy );
+  p = xjd1MallocZero(sizeof(*p));
+  if( p==0 ) return 0;
+  p->pQuery = pQuery;
+  p->nKey = pQuery->u.simple.pGroupBy->nEItem;
+  p->nSrc = xjd1DataSrcCount(pQuery->u.simple.pFrom);
+  p->nAgg = pQuery->u.simple.pAgg->nExpr;
+  p->ppLast = &p->pFirst;
+  p->nBucket = 64;
+  p->aBucket = xjd1MallocZero(p->nBucket*sizeof(Group*));
+  p->apKey = xjd1MallocZero(p->nKey*sizeof(JsonNode*));
+  if( p->aBucket==0 || p->apKey==0 ){
+    xjd1GroupTableFree(p);
+    return 0;
+  }
+  return p;
+}
+
+/*
+** Exchange the contexts of the aggregate functions of the query with
+** those in apCtx[].
+*/
+static void groupSwapContexts(GroupTable *p, void **apCtx){
+  Aggregate *pAgg = p->pQuery->u.simple.pAgg;
+  int i;
+  for(i=0; i<p->nAgg; i++){
+    void *pCtx = pAgg->aAggExpr[i].pAggCtx;
+    pAgg->aAggExpr[i].pAggCtx = apCtx[i];
+    apCtx[i] = pCtx;
+  }
+}
+
+/*
+** Double the number of buckets in the hash table.
+*/
+static int groupRehash(GroupTable *p){
+  int nNew = p->nBucket*2;
+  Group **aNew = xjd1MallocZero(nNew*sizeof(Group*));
+  Group *pGroup;
+  if( aNew==0 ) return XJD1_NOMEM;
+  for(pGroup=p->pFirst; pGroup; pGroup=pGroup->pNext){
+    int iBucket = pGroup->h & (nNew-1);
+    pGroup->pHash = aNew[iBucket];
+    aNew[iBucket] = pGroup;
+  }
+  xjd1_free(p->aBucket);
+  p->aBucket = aNew;
+  p->nBucket = nNew;
+  return XJD1_OK;
+}
+
+/*
+** Find the group for the GROUP BY values in p->apKey[], creating it if
+** it does not exist. On success, the values belong to the group.
+**
+** A NaN compares equal to every number, so values that hold a NaN are
+** only matched with other values that hold a NaN.
+*/
+static Group *groupFind(GroupTable *p){
+  Group *pGroup;
+  unsigned int h = 0;
+  int hasNaN = 0;
+  int nByte;
+  int i;
+
+  for(i=0; i<p->nKey; i++){
+    h = h*1000003 + xjd1JsonHash(p->apKey[i], &hasNaN);
+  }
+  for(pGroup=p->aBucket[h & (p->nBucket-1)]; pGroup; pGroup=pGroup->pHash){
+    if( pGroup->h!=h || pGroup->hasNaN!=hasNaN ) continue;
+    for(i=0; i<p->nKey; i++){
+      if( xjd1JsonCompare(pGroup->apVal[i], p->apKey[i], 0)!=0 ) break;
+    }
+    if( i==p->nKey ){
+      for(i=0; i<p->nKey; i++){
+        xjd1JsonFree(p->apKey[i]);
+        p->apKey[i] = 0;
+      }
+      return pGroup;
+    }
+  }
+
+  if( p->nGroup>=p->nBucket && groupRehash(p)!=XJD1_OK ) return 0;
+  nByte = sizeof(Group) + p->nAgg*sizeof(void*)
+        + (p->nKey+p->nSrc)*sizeof(JsonNode*);
+  pGroup = xjd1MallocZero(nByte);
+  if( pGroup==0 ) return 0;
+  pGroup->h = h;
+  pGroup->hasNaN = hasNaN;
+  pGroup->apCtx = (void**)&pGroup[1];
+  pGroup->apVal = (JsonNode**)&pGroup->apCtx[p->nAgg];
+  memcpy(pGroup->apVal, p->apKey, p->nKey*sizeof(JsonNode*));
+  memset(p->apKey, 0, p->nKey*sizeof(JsonNode*));
+  pGroup->pHash = p->aBucket[h & (p->nBucket-1)];
+  p->aBucket[h & (p->nBucket-1)] = pGroup;
+  *p->ppLast = pGroup;
+  p->ppLast = &pGroup->pNext;
+  p->nGroup++;
+  return pGroup;
+}
+
+/*
+** Add the current row of the query to its group, and step the aggregate
+** functions of the group.
+*/
+int xjd1GroupTableStep(GroupTable *p){
+  ExprList *pGroupBy = p->pQuery->u.simple.pGroupBy;
+  Group *pGroup;
+  int saveThisRow = 0;
+  int rc;
+  int i;
+
+  for(i=0; i<p->nKey; i++){
+    p->apKey[i] = xjd1ExprEval(pGroupBy->apEItem[i].pExpr);
+  }
+  pGroup = groupFind(p);
+  if( pGroup==0 ) return XJD1_NOMEM;
+
+  groupSwapContexts(p, pGroup->apCtx);
+  rc = xjd1AggregateStep(p->pQuery->u.simple.pAgg, &saveThisRow);
+  groupSwapContexts(p, pGroup->apCtx);
+
+  if( saveThisRow || pGroup->isSaved==0 ){
+    xjd1DataSrcCacheSave(p->pQuery->u.simple.pFrom, &pGroup->apVal[p->nKey]);
+    if( saveThisRow ) pGroup->isSaved = 1;
+  }
+  return rc;
+}
+
+/*
+** Remove the first group from the table. Fill apOut[] with its GROUP BY
+** values, its documents and the final value of each aggregate function,
+** in that order. The caller takes ownership of them. Return XJD1_DONE if
+** the table is empty.
+*/
+int xjd1GroupTableNext(GroupTable *p, JsonNode **apOut){
+  Aggregate *pAgg = p->pQuery->u.simple.pAgg;
+  Group *pGroup = p->pFirst;
+  int nVal = p->nKey + p->nSrc;
+  int i;
+
+  if( pGroup==0 ) return XJD1_DONE;
+  p->pFirst = pGroup->pNext;
+  if( p->pFirst==0 ) p->ppLast = &p->pFirst;
+
+  /* The group is no longer in the table, so the hash chains are not
+  ** walked again. Drop them rather than unlink the group. */
+  if( p->aBucket ){
+    xjd1_free(p->aBucket);
+    p->aBucket = 0;
+  }
+
+  memcpy(apOut, pGroup->apVal, nVal*sizeof(JsonNode*));
+  groupSwapContexts(p, pGroup->apCtx);
+  xjd1AggregateFinalize(pAgg);
+  for(i=0; i<p->nAgg; i++){
+    apOut[nVal+i] = pAgg->aAggExpr[i].pValue;
+    pAgg->aAggExpr[i].pValue = 0;
+  }
+  xjd1_free(pGroup);
+  p->nGroup--;
+  return XJD1_OK;
+}
+
+/*
+** Free a group table, including any groups that remain in it.
+*/
+void xjd1GroupTableFree(GroupTable *p){
+  if( p ){
+    Aggregate *pAgg = p->pQuery->u.simple.pAgg;
+    Group *pGroup, *pNext;
+    int i;
+    for(pGroup=p->pFirst; pGroup; pGroup=pNext){
+      pNext = pGroup->pNext;
+      groupSwapContexts(p, pGroup->apCtx);
+      xjd1AggregateFinalize(pAgg);
+      groupSwapContexts(p, pGroup->apCtx);
+      for(i=0; i<p->nKey+p->nSrc; i++) xjd1JsonFree(pGroup->apVal[i]);
+      xjd1_free(pGroup);
+    }
+    if( p->apKey ){
+      for(i=0; i<p->nKey; i++) xjd1JsonFree(p->apKey[i]);
+    }
+    xjd1_free(p->apKey);
+    xjd1_free(p->aBucket);
+    xjd1_free(p);
+  }
+}
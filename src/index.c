@@ -0,0 +1,527 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains code used to implement indices on collections.
+**
+** Each index is recorded as a row of the "xjd1_index" catalog table:
+**
+**     CREATE TABLE xjd1_index(name TEXT PRIMARY KEY, coll TEXT, path TEXT);
+**
+** where path is a JSON array of the labels leading from the root of
+** each document to the indexed value. The content of the index is
+** held in a side table with one row for each document in the collection:
+**
+**     CREATE TABLE "xjd1_idx_NAME"(docid INTEGER PRIMARY KEY, t INTEGER, v);
+**     CREATE INDEX "xjd1_idx_NAME_tv" ON "xjd1_idx_NAME"(t, v);
+**
+** Column docid is the rowid of the document, t is the JSON type of the
+** indexed value (one of the XJD1_* type codes, XJD1_NULL if the document
+** does not have the path) and v is the value itself for numbers and
+** strings, or NULL for all other types. Because xjd1JsonCompare() orders
+** values first by type and then by value, an (t, v) range on the side
+** table finds exactly the documents that satisfy a comparison against
+** a number or string.
+*/
+#include "xjd1Int.h"
+
+/*
+** An index on a collection, as loaded from the catalog by xjd1IndexLoad().
+*/
+struct Index {
+  char *zName;              /* Name of the index */
+  JsonNode *pPath;          /* Array of labels leading to the indexed value */
+  sqlite3_stmt *pWrite;     /* Insert or replace an entry.  Lazily prepared */
+  sqlite3_stmt *pErase;     /* Remove an entry.  Lazily prepared */
+  sqlite3 *db;              /* Database holding the index */
+  Index *pNext;             /* Next index on the same collection */
+};
+
+/*
+** Make sure the index catalog exists.
+*/
+static int indexCatalogInit(sqlite3 *db){
+  return sqlite3_exec(db,
+     "CREATE TABLE IF NOT EXISTS xjd1_index("
+     "name TEXT PRIMARY KEY, coll TEXT, path TEXT)", 0, 0, 0);
+}
+
+/*
+** Convert the path of a CREATE INDEX statement into an array of labels.
+** Return 0 on OOM.
+*/
+static JsonNode *indexPathToJson(Expr *p){
+  JsonNode *pRet;
+  JsonNode *pLabel;
+  JsonNode **apNew;
+  const char *zLabel;
+
+  if( p->eType==TK_DOT ){
+    pRet = indexPathToJson(p->u.lvalue.pLeft);
+    zLabel = p->u.lvalue.zId;
+  }else{
+    assert( p->eType==TK_ID );
+    pRet = xjd1JsonNew(0);
+    if( pRet ) pRet->eJType = XJD1_ARRAY;
+    zLabel = p->u.id.zId;
+  }
+  if( pRet==0 ) return 0;
+
+  pLabel = xjd1JsonNew(0);
+  apNew = xjd1_realloc(pRet->u.ar.apElem,
+                       sizeof(JsonNode*)*(pRet->u.ar.nElem+1));
+  if( pLabel==0 || apNew==0 ){
+    xjd1_free(pLabel);
+    if( apNew ) pRet->u.ar.apElem = apNew;
+    xjd1JsonFree(pRet);
+    return 0;
+  }
+  pLabel->eJType = XJD1_STRING;
+  pLabel->u.z = xjd1PoolDup(0, zLabel, -1);
+  pRet->u.ar.apElem = apNew;
+  apNew[pRet->u.ar.nElem++] = pLabel;
+  return pRet;
+}
+
+/*
+** Return the value that index pIdx holds for document pDoc. If the
+** document does not contain the indexed path, return 0.
+*/
+static const JsonNode *indexKey(Index *pIdx, const JsonNode *pDoc){
+  int i;
+  for(i=0; pDoc && i<pIdx->pPath->u.ar.nElem; i++){
+    const char *zLabel = pIdx->pPath->u.ar.apElem[i]->u.z;
+    JsonStructElem *pElem = 0;
+    if( pDoc->eJType==XJD1_STRUCT ){
+      for(pElem=pDoc->u.st.pFirst; pElem; pElem=pElem->pNext){
+        if( strcmp(pElem->zLabel, zLabel)==0 ) break;
+      }
+    }
+    pDoc = pElem ? pElem->pValue : 0;
+  }
+  return pDoc;
+}
+
+/*
+** Write the entry for document pDoc with rowid iRowid into index pIdx,
+** replacing any existing entry for the same document.
+*/
+static int indexWriteOne(Index *pIdx, sqlite3_int64 iRowid, const JsonNode *pDoc){
+  const JsonNode *pKey;
+  int eType;
+
+  if( pIdx->pWrite==0 ){
+    char *zSql = sqlite3_mprintf(
+        "INSERT OR REPLACE INTO \"xjd1_idx_%w\"(docid, t, v) VALUES(?1,?2,?3)",
+        pIdx->zName
+    );
+    sqlite3_prepare_v2(pIdx->db, zSql, -1, &pIdx->pWrite, 0);
+    sqlite3_free(zSql);
+    if( pIdx->pWrite==0 ) return XJD1_ERROR;
+  }
+
+  pKey = indexKey(pIdx, pDoc);
+  eType = pKey ? pKey->eJType : XJD1_NULL;
+  sqlite3_bind_int64(pIdx->pWrite, 1, iRowid);
+  sqlite3_bind_int(pIdx->pWrite, 2, eType);
+  switch( eType ){
+    case XJD1_REAL:
+      sqlite3_bind_double(pIdx->pWrite, 3, pKey->u.r);
+      break;
+    case XJD1_STRING:
+      sqlite3_bind_text(pIdx->pWrite, 3, pKey->u.z, -1, SQLITE_STATIC);
+      break;
+    default:
+      sqlite3_bind_null(pIdx->pWrite, 3);
+      break;
+  }
+  sqlite3_step(pIdx->pWrite);
+  return (sqlite3_reset(pIdx->pWrite)==SQLITE_OK ? XJD1_OK : XJD1_ERROR);
+}
+
+/*
+** Load the list of all indices on collection zColl. Return NULL if
+** there are no such indices.
+**
+** The list must eventually be freed using xjd1IndexListFree(). Most
+** callers use the list cached by xjd1CatalogIndices() instead.
+*/
+Index *xjd1IndexLoad(xjd1 *pConn, const char *zColl){
+  Index *pList = 0;
+  sqlite3_stmt *pStmt = 0;
+
+  sqlite3_prepare_v2(pConn->db,
+      "SELECT name, path FROM xjd1_index WHERE coll=?1 ORDER BY name",
+      -1, &pStmt, 0);
+  if( pStmt==0 ) return 0;
+  sqlite3_bind_text(pStmt, 1, zColl, -1, SQLITE_STATIC);
+  while( SQLITE_ROW==sqlite3_step(pStmt) ){
+    const char *zName = (const char*)sqlite3_column_text(pStmt, 0);
+    const char *zPath = (const char*)sqlite3_column_text(pStmt, 1);
+    Index *pNew = xjd1MallocZero(sizeof(*pNew));
+    if( pNew==0 ) break;
+    pNew->zName = xjd1PoolDup(0, zName, -1);
+    pNew->pPath = xjd1JsonParse(zPath, -1);
+    pNew->db = pConn->db;
+    if( pNew->pPath==0 || pNew->pPath->eJType!=XJD1_ARRAY ){
+      xjd1IndexListFree(pNew);
+      continue;
+    }
+    pNew->pNext = pList;
+    pList = pNew;
+  }
+  sqlite3_finalize(pStmt);
+  return pList;
+}
+
+/*
+** Free a list of indices obtained from xjd1IndexLoad().
+*/
+void xjd1IndexListFree(Index *pList){
+  while( pList ){
+    Index *pNext = pList->pNext;
+    sqlite3_finalize(pList->pWrite);
+    sqlite3_finalize(pList->pErase);
+    xjd1JsonFree(pList->pPath);
+    xjd1_free(pList->zName);
+    xjd1_free(pList);
+    pList = pNext;
+  }
+}
+
+/*
+** Record document pDoc, with rowid iRowid, in every index on the list.
+** Return XJD1_ERROR if an index cannot be written.
+*/
+int xjd1IndexWrite(Index *pList, sqlite3_int64 iRowid, const JsonNode *pDoc){
+  int rc = XJD1_OK;
+  for(; pList && rc==XJD1_OK; pList=pList->pNext){
+    rc = indexWriteOne(pList, iRowid, pDoc);
+  }
+  return rc;
+}
+
+/*
+** Remove the document with rowid iRowid from every index on the list.
+** Return XJD1_ERROR if an index cannot be written.
+*/
+int xjd1IndexErase(Index *pList, sqlite3_int64 iRowid){
+  for(; pList; pList=pList->pNext){
+    if( pList->pErase==0 ){
+      char *zSql = sqlite3_mprintf(
+          "DELETE FROM \"xjd1_idx_%w\" WHERE docid=?1", pList->zName
+      );
+      sqlite3_prepare_v2(pList->db, zSql, -1, &pList->pErase, 0);
+      sqlite3_free(zSql);
+      if( pList->pErase==0 ) return XJD1_ERROR;
+    }
+    sqlite3_bind_int64(pList->pErase, 1, iRowid);
+    sqlite3_step(pList->pErase);
+    if( sqlite3_reset(pList->pErase)!=SQLITE_OK ) return XJD1_ERROR;
+  }
+  return XJD1_OK;
+}
+
+/*
+** Remove all entries from every index on the list. Return XJD1_ERROR if
+** an index cannot be written.
+*/
+int xjd1IndexClear(xjd1 *pConn, Index *pList){
+  int rc = XJD1_OK;
+  for(; pList && rc==XJD1_OK; pList=pList->pNext){
+    char *zSql = sqlite3_mprintf("DELETE FROM \"xjd1_idx_%w\"", pList->zName);
+    if( sqlite3_exec(pConn->db, zSql, 0, 0, 0)!=SQLITE_OK ) rc = XJD1_ERROR;
+    sqlite3_free(zSql);
+  }
+  return rc;
+}
+
+/*
+** Return true if index zName exists.
+*/
+static int indexExists(sqlite3 *db, const char *zName){
+  sqlite3_stmt *pStmt = 0;
+  int bExists = 0;
+  sqlite3_prepare_v2(db, "SELECT 1 FROM xjd1_index WHERE name=?1", -1,&pStmt,0);
+  if( pStmt ){
+    sqlite3_bind_text(pStmt, 1, zName, -1, SQLITE_STATIC);
+    bExists = (sqlite3_step(pStmt)==SQLITE_ROW);
+    sqlite3_finalize(pStmt);
+  }
+  return bExists;
+}
+
+/*
+** Evaluate a CREATE INDEX statement. The new index is populated from the
+** current content of the collection.
+*/
+int xjd1IndexCreate(xjd1_stmt *pStmt){
+  Command *pCmd = pStmt->pCmd;
+  xjd1 *pConn = pStmt->pConn;
+  sqlite3 *db = pConn->db;
+  int inAutocommit = sqlite3_get_autocommit(db);
+  const char *zName = pCmd->u.crix.zName;
+  sqlite3_stmt *pScan = 0;
+  JsonNode *pPath;
+  Index sIdx;
+  String path;
+  char *zSql;
+  char *zErr = 0;
+  int rc = XJD1_DONE;
+
+  assert( pCmd->eCmdType==TK_CREATEINDEX );
+  indexCatalogInit(db);
+  if( indexExists(db, zName) ){
+    if( pCmd->u.crix.ifExists ) return XJD1_DONE;
+    xjd1Error(pConn, XJD1_ERROR, "index %s already exists", zName);
+    return XJD1_ERROR;
+  }
+
+  zSql = sqlite3_mprintf("SELECT rowid, x FROM \"%w\"", pCmd->u.crix.zColl);
+  sqlite3_prepare_v2(db, zSql, -1, &pScan, 0);
+  sqlite3_free(zSql);
+  if( pScan==0 ){
+    xjd1Error(pConn, XJD1_ERROR, "no such collection: %s", pCmd->u.crix.zColl);
+    return XJD1_ERROR;
+  }
+
+  pPath = indexPathToJson(pCmd->u.crix.pPath);
+  if( pPath==0 ){
+    sqlite3_finalize(pScan);
+    xjd1Error(pConn, XJD1_NOMEM, 0);
+    return XJD1_NOMEM;
+  }
+  xjd1StringInit(&path, 0, 0);
+  xjd1JsonRender(&path, pPath);
+
+  if( inAutocommit ) sqlite3_exec(db, "BEGIN", 0, 0, 0);
+  zSql = sqlite3_mprintf(
+      "INSERT INTO xjd1_index(name, coll, path) VALUES(%Q, %Q, %Q);"
+      "CREATE TABLE \"xjd1_idx_%w\"(docid INTEGER PRIMARY KEY, t INTEGER, v);"
+      "CREATE INDEX \"xjd1_idx_%w_tv\" ON \"xjd1_idx_%w\"(t, v);",
+      zName, pCmd->u.crix.zColl, xjd1StringText(&path),
+      zName, zName, zName
+  );
+  sqlite3_exec(db, zSql, 0, 0, &zErr);
+  sqlite3_free(zSql);
+
+  if( zErr==0 ){
+    memset(&sIdx, 0, sizeof(sIdx));
+    sIdx.zName = (char*)zName;
+    sIdx.pPath = pPath;
+    sIdx.db = db;
+    while( rc==XJD1_DONE && SQLITE_ROW==sqlite3_step(pScan) ){
+      JsonNode *pDoc = xjd1StorageColumn(pScan, 1, 0, pConn->pLabels, 0);
+      if( indexWriteOne(&sIdx, sqlite3_column_int64(pScan, 0), pDoc) ){
+        xjd1Error(pConn, XJD1_ERROR, "%s", sqlite3_errmsg(db));
+        rc = XJD1_ERROR;
+      }
+      xjd1JsonFree(pDoc);
+    }
+    sqlite3_finalize(sIdx.pWrite);
+  }else{
+    xjd1Error(pConn, XJD1_ERROR, "%s", zErr);
+    sqlite3_free(zErr);
+    rc = XJD1_ERROR;
+  }
+  sqlite3_finalize(pScan);
+  if( inAutocommit ){
+    sqlite3_exec(db, rc==XJD1_DONE ? "COMMIT" : "ROLLBACK", 0, 0, 0);
+    if( rc==XJD1_DONE ) xjd1DocCacheCommit(pConn);
+  }
+
+  xjd1StringClear(&path);
+  xjd1JsonFree(pPath);
+  return rc;
+}
+
+/*
+** Drop index zName and remove it from the catalog.
+*/
+static void indexDropOne(sqlite3 *db, const char *zName){
+  char *zSql = sqlite3_mprintf(
+      "DROP TABLE IF EXISTS \"xjd1_idx_%w\";"
+      "DELETE FROM xjd1_index WHERE name=%Q;", zName, zName
+  );
+  sqlite3_exec(db, zSql, 0, 0, 0);
+  sqlite3_free(zSql);
+}
+
+/*
+** Evaluate a DROP INDEX statement.
+*/
+int xjd1IndexDrop(xjd1_stmt *pStmt){
+  Command *pCmd = pStmt->pCmd;
+  sqlite3 *db = pStmt->pConn->db;
+
+  assert( pCmd->eCmdType==TK_DROPINDEX );
+  if( !indexExists(db, pCmd->u.crix.zName) ){
+    if( pCmd->u.crix.ifExists ) return XJD1_DONE;
+    xjd1Error(pStmt->pConn, XJD1_ERROR, "no such index: %s",
+              pCmd->u.crix.zName);
+    return XJD1_ERROR;
+  }
+  indexDropOne(db, pCmd->u.crix.zName);
+  return XJD1_DONE;
+}
+
+/*
+** Drop all indices on collection zColl. This is called when the
+** collection itself is dropped.
+*/
+void xjd1IndexDropAll(xjd1 *pConn, const char *zColl){
+  Index *pList = xjd1IndexLoad(pConn, zColl);
+  Index *p;
+  for(p=pList; p; p=p->pNext){
+    indexDropOne(pConn->db, p->zName);
+  }
+  xjd1IndexListFree(pList);
+}
+
+/*
+** Return true if expression p is the path of index pIdx applied to the
+** document that data source pSrc is currently pointing to. The nPath
+** argument is the number of labels of the index path still to match.
+*/
+static int indexPathMatch(Index *pIdx, int nPath, Expr *p, DataSrc *pSrc){
+  if( p->eType==TK_DOT ){
+    return nPath>0
+        && strcmp(p->u.lvalue.zId, pIdx->pPath->u.ar.apElem[nPath-1]->u.z)==0
+        && indexPathMatch(pIdx, nPath-1, p->u.lvalue.pLeft, pSrc);
+  }
+  return nPath==0 && xjd1PushdownIsDoc(p, pSrc);
+}
+
+/*
+** Search the WHERE clause pWhere for a term of the form:
+**
+**     <path> <op> <literal>
+**
+** where <path> is the path of an index in pList applied to data source
+** pSrc, <op> is one of ==, <, <=, > or >= and <literal> is a number,
+** string, boolean or null. Equality terms are preferred over ranges.
+**
+** If such a term is found, return an SQL expression, obtained from
+** sqlite3_mprintf(), that restricts a scan of the collection to the
+** rowids the index says may match. If the literal is a number or string,
+** it must be bound to parameter ?1 of the scan and *ppVal is set to
+** point to it. Return NULL if no index is usable.
+**
+** The WHERE clause is still evaluated against every row the scan returns,
+** so the SQL expression may select a superset of the matching rows.
+*/
+char *xjd1IndexScan(Index *pList, DataSrc *pSrc, Expr *pWhere, JsonNode **ppVal){
+  Expr *aTerm[2];                 /* Best equality and range terms */
+  Expr *apStack[40];              /* Stack of AND terms still to visit */
+  int nStack = 0;
+  Index *apIdx[2];
+  Expr *pTerm;
+  Index *pIdx;
+  JsonNode *pVal;
+  int eOp;
+  const char *zCmp;
+  int eType;
+
+  *ppVal = 0;
+  if( pList==0 || pWhere==0 ) return 0;
+  aTerm[0] = aTerm[1] = 0;
+  apIdx[0] = apIdx[1] = 0;
+
+  apStack[nStack++] = pWhere;
+  while( nStack>0 && aTerm[0]==0 ){
+    Expr *p = apStack[--nStack];
+    Expr *pPath, *pLit;
+    int iSlot;
+    if( p->eType==TK_AND ){
+      if( nStack+2<=ArraySize(apStack) ){
+        apStack[nStack++] = p->u.bi.pRight;
+        apStack[nStack++] = p->u.bi.pLeft;
+      }
+      continue;
+    }
+    switch( p->eType ){
+      case TK_EQEQ: iSlot = 0; break;
+      case TK_LT: case TK_LE: case TK_GT: case TK_GE: iSlot = 1; break;
+      default: continue;
+    }
+    if( aTerm[iSlot] ) continue;
+    pPath = p->u.bi.pLeft;
+    pLit = p->u.bi.pRight;
+    if( pPath->eType==TK_JVALUE ){
+      pPath = p->u.bi.pRight;
+      pLit = p->u.bi.pLeft;
+    }
+    if( pLit->eType!=TK_JVALUE || pPath->eType!=TK_DOT ) continue;
+    if( pLit->u.json.p->eJType==XJD1_ARRAY ) continue;
+    if( pLit->u.json.p->eJType==XJD1_STRUCT ) continue;
+    for(pIdx=pList; pIdx; pIdx=pIdx->pNext){
+      if( indexPathMatch(pIdx, pIdx->pPath->u.ar.nElem, pPath, pSrc) ){
+        aTerm[iSlot] = p;
+        apIdx[iSlot] = pIdx;
+        break;
+      }
+    }
+  }
+
+  if( aTerm[0] ){
+    pTerm = aTerm[0];
+    pIdx = apIdx[0];
+  }else if( aTerm[1] ){
+    pTerm = aTerm[1];
+    pIdx = apIdx[1];
+  }else{
+    return 0;
+  }
+
+  /* Normalize the comparison so that the path is on the left. */
+  eOp = pTerm->eType;
+  pVal = pTerm->u.bi.pRight->u.json.p;
+  if( pTerm->u.bi.pLeft->eType==TK_JVALUE ){
+    pVal = pTerm->u.bi.pLeft->u.json.p;
+    switch( eOp ){
+      case TK_LT: eOp = TK_GT; break;
+      case TK_LE: eOp = TK_GE; break;
+      case TK_GT: eOp = TK_LT; break;
+      case TK_GE: eOp = TK_LE; break;
+    }
+  }
+
+  switch( eOp ){
+    case TK_LT: zCmp = "<";  break;
+    case TK_LE: zCmp = "<="; break;
+    case TK_GT: zCmp = ">";  break;
+    case TK_GE: zCmp = ">="; break;
+    default:    zCmp = "=";  break;
+  }
+  eType = pVal->eJType;
+  if( eType!=XJD1_REAL && eType!=XJD1_STRING ){
+    return sqlite3_mprintf(
+        "rowid IN (SELECT docid FROM \"xjd1_idx_%w\" WHERE t%s%d)",
+        pIdx->zName, zCmp, eType
+    );
+  }
+  *ppVal = pVal;
+  if( eOp==TK_EQEQ ){
+    return sqlite3_mprintf(
+        "rowid IN (SELECT docid FROM \"xjd1_idx_%w\" WHERE t=%d AND v=?1)",
+        pIdx->zName, eType
+    );
+  }
+  return sqlite3_mprintf(
+      "rowid IN (SELECT docid FROM \"xjd1_idx_%w\" "
+      "WHERE t%c%d OR (t=%d AND v%s?1))",
+      pIdx->zName, zCmp[0], eType, eType, zCmp
+  );
+}
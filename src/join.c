@@ -0,0 +1,579 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains code used to buffer the right-hand side of a join.
+**
+** A join "FROM a, b" is normally a nested loop that rewinds and rescans
+** b for every row of a. Instead, the rows of b are read once and kept
+** in a JoinBuffer, which the join then iterates for each row of a.
+**
+** If the WHERE clause contains terms of the form
+**
+**     <expr-on-a> == <expr-on-b>
+**
+** joined to the rest of the clause by AND, then all of b is read the
+** first time the join needs it, into a hash table keyed on the values of
+** the <expr-on-b> expressions. Each row of a then probes the table with
+** the values of its <expr-on-a> expressions, and only the rows of b with
+** equal keys are returned.
+**
+** Otherwise, if b is a collection, a subquery or a FLATTEN or EACH, the
+** rows of b are saved as they are returned for the first row of a. Once
+** the saved rows use more than XJD1_CONFIG_JOINBUFFER bytes of memory,
+** any further rows are written to a temporary table instead, from which
+** they are read back for each later row of a.
+**
+** Either way, rows are returned in the same order as by the nested loop.
+** The WHERE clause must still be evaluated for each row returned.
+*/
+#include "xjd1Int.h"
+
+/*
+** Values returned by joinExprSide().
+*/
+#define JOIN_LEFT    0x01         /* Refers to the left side of the join */
+#define JOIN_RIGHT   0x02         /* Refers to the right side of the join */
+#define JOIN_OTHER   0x04         /* Cannot be evaluated on either side */
+
+/*
+** The buffered rows of the right-hand side of a join.
+*/
+struct JoinBuffer {
+  int nKey;                       /* Number of equality terms */
+  Expr **apProbe;                 /* Key expressions on the left side */
+  Expr **apBuild;                 /* Key expressions on the right side */
+  int nLeaf;                      /* Number of leaves on the right side */
+  int mxByte;                     /* Memory limit before rows are spilled */
+  int isBuilding;                 /* True while rows are being saved */
+  int isBuilt;                    /* True once every row has been saved */
+  int isScan;                     /* True to probe by scanning every row */
+  int nRow;                       /* Number of rows in memory */
+  int nAlloc;                     /* Allocated size of aRow[] */
+  int nByte;                      /* Approximate memory used by the rows */
+  struct JoinBufferRow {
+    unsigned int h;               /* Hash of the key values */
+    int iNext;                    /* Next row in the same bucket, or -1 */
+  } *aRow;                        /* Rows of the right side, in order */
+  JsonNode **apVal;               /* nKey key values, nLeaf docs per row */
+  int nBucket;                    /* Number of hash buckets */
+  int *aBucket;                   /* First row of each bucket, or -1 */
+  JsonNode **apKey;               /* Key values of the current left row */
+  unsigned int hProbe;            /* Hash of apKey[] */
+  int probeScan;                  /* True if apKey[] is compared to all rows */
+  int iNext;                      /* Next row to try, or -1 */
+  sqlite3 *db;                    /* Database holding the temporary table */
+  sqlite3_int64 iSpill;           /* Spilled rows have buf=iSpill, or 0 */
+  sqlite3_stmt *pSpillWrite;      /* Writes a spilled row */
+  sqlite3_stmt *pSpillRead;       /* Reads back the spilled rows */
+  int readSpill;                  /* True if pSpillRead has more rows */
+};
+
+/*
+** Return true if pLeaf is one of the data sources in tree p.
+*/
+static int joinContains(DataSrc *p, DataSrc *pLeaf){
+  if( p==pLeaf ) return 1;
+  if( p->eDSType!=TK_COMMA ) return 0;
+  return joinContains(p->u.join.pLeft, pLeaf)
+      || joinContains(p->u.join.pRight, pLeaf);
+}
+
+static int joinListSide(ExprList*, DataSrc*);
+
+/*
+** Return a mask of JOIN_LEFT, JOIN_RIGHT and JOIN_OTHER indicating the
+** sides of join pJoin that expression p refers to. Documents of outer
+** queries do not change while the join runs, so references to them are
+** ignored.
+*/
+static int joinExprSide(Expr *p, DataSrc *pJoin){
+  int m = 0;
+  if( p==0 ) return 0;
+  switch( p->eClass ){
+    case XJD1_EXPR_BI: {
+      m = joinExprSide(p->u.bi.pLeft, pJoin)
+        | joinExprSide(p->u.bi.pRight, pJoin);
+      break;
+    }
+    case XJD1_EXPR_TRI: {
+      m = joinExprSide(p->u.tri.pTest, pJoin)
+        | joinExprSide(p->u.tri.pIfTrue, pJoin)
+        | joinExprSide(p->u.tri.pIfFalse, pJoin);
+      break;
+    }
+    case XJD1_EXPR_TK: {
+      if( p->eType==TK_ID && p->u.id.pQuery==pJoin->pQuery ){
+        DataSrc *pLeaf = 0;
+        if( p->u.id.iDatasrc>0 ){
+          pLeaf = xjd1DataSrcLeaf(pJoin->pQuery->u.simple.pFrom,
+                                  p->u.id.iDatasrc);
+        }
+        if( pLeaf && joinContains(pJoin->u.join.pLeft, pLeaf) ){
+          m = JOIN_LEFT;
+        }else if( pLeaf && joinContains(pJoin->u.join.pRight, pLeaf) ){
+          m = JOIN_RIGHT;
+        }else{
+          m = JOIN_OTHER;
+        }
+      }
+      break;
+    }
+    case XJD1_EXPR_LVALUE: {
+      m = joinExprSide(p->u.lvalue.pLeft, pJoin);
+      break;
+    }
+    case XJD1_EXPR_FUNC: {
+      m = joinListSide(p->u.func.args, pJoin);
+      break;
+    }
+    case XJD1_EXPR_ARRAY: {
+      m = joinListSide(p->u.ar, pJoin);
+      break;
+    }
+    case XJD1_EXPR_STRUCT: {
+      m = joinListSide(p->u.st, pJoin);
+      break;
+    }
+    case XJD1_EXPR_Q: {
+      m = JOIN_OTHER;
+      break;
+    }
+  }
+  return m;
+}
+static int joinListSide(ExprList *pList, DataSrc *pJoin){
+  int m = 0;
+  if( pList ){
+    int i;
+    for(i=0; i<pList->nEItem; i++){
+      m |= joinExprSide(pList->apEItem[i].pExpr, pJoin);
+    }
+  }
+  return m;
+}
+
+/*
+** Find the equality terms of WHERE clause pWhere that join the two
+** sides of pJoin. If p is not NULL, add them to p. Return the number
+** found.
+*/
+static int joinFindTerms(JoinBuffer *p, Expr *pWhere, DataSrc *pJoin){
+  Expr *pL, *pR;
+  int mL, mR;
+  if( pWhere==0 ) return 0;
+  if( pWhere->eType==TK_AND ){
+    return joinFindTerms(p, pWhere->u.bi.pLeft, pJoin)
+         + joinFindTerms(p, pWhere->u.bi.pRight, pJoin);
+  }
+  if( pWhere->eType!=TK_EQEQ ) return 0;
+  pL = pWhere->u.bi.pLeft;
+  pR = pWhere->u.bi.pRight;
+  mL = joinExprSide(pL, pJoin);
+  mR = joinExprSide(pR, pJoin);
+  if( mL==JOIN_RIGHT && mR==JOIN_LEFT ){
+    Expr *pTmp = pL;
+    pL = pR;
+    pR = pTmp;
+  }else if( mL!=JOIN_LEFT || mR!=JOIN_RIGHT ){
+    return 0;
+  }
+  if( p ){
+    p->apProbe[p->nKey] = pL;
+    p->apBuild[p->nKey] = pR;
+    p->nKey++;
+  }
+  return 1;
+}
+
+/*
+** Return a new JoinBuffer object for join pJoin, or NULL if the rows of
+** its right-hand side should not be buffered.
+*/
+JoinBuffer *xjd1JoinBufferNew(DataSrc *pJoin){
+  Expr *pWhere = pJoin->pQuery->u.simple.pWhere;
+  int mxByte = pJoin->pQuery->pStmt->pConn->mxJoinBuffer;
+  int eType = pJoin->u.join.pRight->eDSType;
+  JoinBuffer *p;
+  int nKey;
+
+  assert( pJoin->eDSType==TK_COMMA );
+  nKey = joinFindTerms(0, pWhere, pJoin);
+  if( nKey==0 ){
+    if( mxByte<0 ) return 0;
+    if( eType!=TK_ID && eType!=TK_SELECT && eType!=TK_FLATTENOP ) return 0;
+  }
+  p = xjd1MallocZero(sizeof(*p));
+  if( p==0 ) return 0;
+  if( nKey ){
+    p->apProbe = xjd1MallocZero(nKey*sizeof(Expr*));
+    p->apBuild = xjd1MallocZero(nKey*sizeof(Expr*));
+    p->apKey = xjd1MallocZero(nKey*sizeof(JsonNode*));
+    if( p->apProbe==0 || p->apBuild==0 || p->apKey==0 ){
+      xjd1JoinBufferFree(p);
+      return 0;
+    }
+    joinFindTerms(p, pWhere, pJoin);
+    assert( p->nKey==nKey );
+  }
+  p->nLeaf = xjd1DataSrcCount(pJoin->u.join.pRight);
+  p->mxByte = mxByte;
+  p->db = pJoin->pQuery->pStmt->pConn->db;
+  p->iNext = -1;
+  return p;
+}
+
+/*
+** Evaluate the expressions in apExpr[] and write the values to apVal[].
+** Return the hash of the values. Set *pHasNaN if any value contains a
+** NaN.
+*/
+static unsigned int joinEvalKey(
+  JoinBuffer *p,
+  Expr **apExpr,
+  JsonNode **apVal,
+  int *pHasNaN
+){
+  unsigned int h = 0;
+  int i;
+  for(i=0; i<p->nKey; i++){
+    apVal[i] = xjd1ExprEval(apExpr[i]);
+    h = h*1000003 + xjd1JsonHash(apVal[i], pHasNaN);
+  }
+  return h;
+}
+
+/*
+** Create the temporary table that holds spilled rows, if it does not
+** already exist, and prepare the statements that write and read the
+** rows of buffer p.
+*/
+static int joinSpillOpen(JoinBuffer *p, xjd1 *pConn){
+  static const char zSchema[] =
+    "CREATE TEMP TABLE IF NOT EXISTS xjd1_join_spill(buf INTEGER, x);"
+    "CREATE INDEX IF NOT EXISTS temp.xjd1_join_spill_buf"
+    " ON xjd1_join_spill(buf);";
+  sqlite3 *db = p->db;
+  if( sqlite3_exec(db, zSchema, 0, 0, 0)!=SQLITE_OK ) return XJD1_ERROR;
+  sqlite3_prepare_v2(db,
+      "INSERT INTO temp.xjd1_join_spill(buf, x) VALUES(?1, ?2)", -1,
+      &p->pSpillWrite, 0);
+  sqlite3_prepare_v2(db,
+      "SELECT x FROM temp.xjd1_join_spill WHERE buf=?1 ORDER BY rowid", -1,
+      &p->pSpillRead, 0);
+  if( p->pSpillWrite==0 || p->pSpillRead==0 ) return XJD1_ERROR;
+  p->iSpill = ++pConn->nJoinSpill;
+  sqlite3_bind_int64(p->pSpillWrite, 1, p->iSpill);
+  sqlite3_bind_int64(p->pSpillRead, 1, p->iSpill);
+  return XJD1_OK;
+}
+
+/*
+** Write the current documents of pRight, the right-hand side of the
+** join, to the temporary table as a single array.
+*/
+static int joinSpillRow(JoinBuffer *p, DataSrc *pRight){
+  JsonNode **apDoc;
+  JsonNode sRow;
+  String out;
+  int rc = XJD1_OK;
+  int i;
+
+  if( p->pSpillWrite==0 ){
+    rc = joinSpillOpen(p, pRight->pQuery->pStmt->pConn);
+    if( rc!=XJD1_OK ) return rc;
+  }
+  apDoc = xjd1MallocZero(p->nLeaf*sizeof(JsonNode*));
+  if( apDoc==0 ) return XJD1_NOMEM;
+  xjd1DataSrcCacheSave(pRight, apDoc);
+  memset(&sRow, 0, sizeof(sRow));
+  sRow.eJType = XJD1_ARRAY;
+  sRow.u.ar.nElem = p->nLeaf;
+  sRow.u.ar.apElem = apDoc;
+  xjd1StringInit(&out, 0, 0);
+  xjd1StorageEncode(&out, &sRow);
+  sqlite3_bind_blob(p->pSpillWrite, 2, xjd1StringText(&out),
+                    xjd1StringLen(&out), SQLITE_STATIC);
+  sqlite3_step(p->pSpillWrite);
+  if( sqlite3_reset(p->pSpillWrite)!=SQLITE_OK ) rc = XJD1_ERROR;
+  xjd1StringClear(&out);
+  for(i=0; i<p->nLeaf; i++) xjd1JsonFree(apDoc[i]);
+  xjd1_free(apDoc);
+  return rc;
+}
+
+/*
+** Read the next spilled row of buffer p into pRight, the right-hand side
+** of the join. Return XJD1_DONE if there are no more rows.
+*/
+static int joinSpillRead(JoinBuffer *p, DataSrc *pRight){
+  JsonNode *pRow;
+  int rc;
+  rc = sqlite3_step(p->pSpillRead);
+  if( rc!=SQLITE_ROW ){
+    p->readSpill = 0;
+    return rc==SQLITE_DONE ? XJD1_DONE : XJD1_ERROR;
+  }
+  pRow = xjd1StorageDecode(sqlite3_column_blob(p->pSpillRead, 0),
+                           sqlite3_column_bytes(p->pSpillRead, 0),
+                           pRight->pQuery->pStmt->pConn->pLabels);
+  if( pRow==0 || pRow->eJType!=XJD1_ARRAY || pRow->u.ar.nElem!=p->nLeaf ){
+    xjd1JsonFree(pRow);
+    return XJD1_ERROR;
+  }
+  xjd1DataSrcCacheRestore(pRight, pRow->u.ar.apElem);
+  xjd1JsonFree(pRow);
+  return XJD1_ROW;
+}
+
+/*
+** Save the current row of pRight, the right-hand side of the join, in
+** buffer p. The row is written to the temporary table instead if p has
+** no equality terms and its rows already use too much memory.
+*/
+static int joinSaveRow(JoinBuffer *p, DataSrc *pRight, int *pHasNaN){
+  int nVal = p->nKey + p->nLeaf;
+  JsonNode **apVal;
+  int i;
+
+  if( p->nKey==0 && (p->iSpill || p->nByte>p->mxByte) ){
+    return joinSpillRow(p, pRight);
+  }
+  if( p->nRow==p->nAlloc ){
+    int nNew = p->nAlloc ? p->nAlloc*2 : 16;
+    struct JoinBufferRow *aNew;
+    JsonNode **apNew;
+    aNew = xjd1_realloc(p->aRow, nNew*sizeof(aNew[0]));
+    if( aNew==0 ) return XJD1_NOMEM;
+    p->aRow = aNew;
+    apNew = xjd1_realloc(p->apVal, nNew*nVal*sizeof(JsonNode*));
+    if( apNew==0 ) return XJD1_NOMEM;
+    p->apVal = apNew;
+    p->nAlloc = nNew;
+  }
+  apVal = &p->apVal[p->nRow*nVal];
+  memset(apVal, 0, nVal*sizeof(JsonNode*));
+  p->aRow[p->nRow].h = joinEvalKey(p, p->apBuild, apVal, pHasNaN);
+  xjd1DataSrcCacheSave(pRight, &apVal[p->nKey]);
+  p->nByte += sizeof(p->aRow[0]) + nVal*sizeof(JsonNode*);
+  for(i=0; i<nVal; i++){
+    apVal[i] = xjd1JsonPromote(apVal[i]);
+    p->nByte += xjd1JsonSizeof(apVal[i]);
+  }
+  p->nRow++;
+  return XJD1_OK;
+}
+
+/*
+** Read every row of pRight, the right-hand side of the join, into the
+** hash table.
+*/
+static int joinBuild(JoinBuffer *p, DataSrc *pRight){
+  int hasNaN = 0;
+  int rc;
+  int i;
+
+  while( XJD1_ROW==(rc = xjd1DataSrcStep(pRight)) ){
+    rc = joinSaveRow(p, pRight, &hasNaN);
+    if( rc!=XJD1_OK ) return rc;
+  }
+  if( rc!=XJD1_DONE ) return rc;
+
+  /* A NaN key value is equal to every number, so if there is one, every
+  ** row is a candidate for each probe. Otherwise, link the rows of each
+  ** bucket together in order. */
+  p->isScan = hasNaN;
+  if( hasNaN==0 ){
+    p->nBucket = 16;
+    while( p->nBucket<p->nRow ) p->nBucket *= 2;
+    p->aBucket = xjd1_malloc(p->nBucket*sizeof(int));
+    if( p->aBucket==0 ) return XJD1_NOMEM;
+    for(i=0; i<p->nBucket; i++) p->aBucket[i] = -1;
+    for(i=p->nRow-1; i>=0; i--){
+      int iBucket = p->aRow[i].h & (p->nBucket-1);
+      p->aRow[i].iNext = p->aBucket[iBucket];
+      p->aBucket[iBucket] = i;
+    }
+  }
+  p->isBuilt = 1;
+  return XJD1_OK;
+}
+
+/*
+** Free the key values of the current left row.
+*/
+static void joinClearKey(JoinBuffer *p){
+  int i;
+  for(i=0; i<p->nKey; i++){
+    xjd1JsonFree(p->apKey[i]);
+    p->apKey[i] = 0;
+  }
+  p->iNext = -1;
+}
+
+/*
+** Advance join pJoin, which has equality terms, to its next row.
+*/
+static int joinHashStep(DataSrc *pJoin){
+  JoinBuffer *p = pJoin->u.join.pBuffer;
+  int nVal = p->nKey + p->nLeaf;
+  int rc;
+
+  while( 1 ){
+    while( p->iNext>=0 ){
+      int iRow = p->iNext;
+      JsonNode **apVal = &p->apVal[iRow*nVal];
+      int i;
+      if( p->isScan || p->probeScan ){
+        p->iNext = iRow+1<p->nRow ? iRow+1 : -1;
+      }else{
+        p->iNext = p->aRow[iRow].iNext;
+        if( p->aRow[iRow].h!=p->hProbe ) continue;
+      }
+      for(i=0; i<p->nKey; i++){
+        if( xjd1JsonCompare(p->apKey[i], apVal[i], 0)!=0 ) break;
+      }
+      if( i==p->nKey ){
+        xjd1DataSrcCacheRestore(pJoin->u.join.pRight, &apVal[p->nKey]);
+        return XJD1_ROW;
+      }
+    }
+
+    rc = xjd1DataSrcStep(pJoin->u.join.pLeft);
+    if( rc!=XJD1_ROW ) return rc;
+    if( p->isBuilt==0 ){
+      rc = joinBuild(p, pJoin->u.join.pRight);
+      if( rc!=XJD1_OK ) return rc;
+    }
+
+    joinClearKey(p);
+    p->probeScan = 0;
+    p->hProbe = joinEvalKey(p, p->apProbe, p->apKey, &p->probeScan);
+    if( p->nRow==0 ){
+      p->iNext = -1;
+    }else if( p->isScan || p->probeScan ){
+      p->iNext = 0;
+    }else{
+      p->iNext = p->aBucket[p->hProbe & (p->nBucket-1)];
+    }
+  }
+}
+
+/*
+** Advance join pJoin, which has no equality terms, to its next row.
+** For the first row of the left-hand side, the right-hand side is read
+** as usual and each of its rows is saved as it is returned.
+*/
+static int joinScanStep(DataSrc *pJoin){
+  JoinBuffer *p = pJoin->u.join.pBuffer;
+  DataSrc *pRight = pJoin->u.join.pRight;
+  int rc;
+
+  while( 1 ){
+    if( p->isBuilding ){
+      rc = xjd1DataSrcStep(pRight);
+      if( rc==XJD1_ROW ){
+        rc = joinSaveRow(p, pRight, 0);
+        return rc==XJD1_OK ? XJD1_ROW : rc;
+      }
+      if( rc!=XJD1_DONE ) return rc;
+      p->isBuilding = 0;
+      p->isBuilt = 1;
+    }else if( p->iNext>=0 ){
+      int iRow = p->iNext;
+      p->iNext = iRow+1<p->nRow ? iRow+1 : -1;
+      xjd1DataSrcCacheRestore(pRight, &p->apVal[iRow*p->nLeaf]);
+      return XJD1_ROW;
+    }else if( p->readSpill ){
+      rc = joinSpillRead(p, pRight);
+      if( rc!=XJD1_DONE ) return rc;
+    }
+
+    rc = xjd1DataSrcStep(pJoin->u.join.pLeft);
+    if( rc!=XJD1_ROW ) return rc;
+    if( p->isBuilt==0 ){
+      p->isBuilding = 1;
+    }else{
+      p->iNext = p->nRow>0 ? 0 : -1;
+      if( p->iSpill ){
+        sqlite3_reset(p->pSpillRead);
+        p->readSpill = 1;
+      }
+    }
+  }
+}
+
+/*
+** Advance join pJoin, which has a JoinBuffer object, to its next row.
+*/
+int xjd1JoinBufferStep(DataSrc *pJoin){
+  if( pJoin->u.join.pBuffer->nKey ){
+    return joinHashStep(pJoin);
+  }
+  return joinScanStep(pJoin);
+}
+
+/*
+** Discard the buffered rows, so that they are read again the next time
+** the join is stepped.
+*/
+void xjd1JoinBufferRewind(JoinBuffer *p){
+  if( p ){
+    int nVal = p->nKey + p->nLeaf;
+    int i;
+    joinClearKey(p);
+    for(i=0; i<p->nRow*nVal; i++){
+      xjd1JsonFree(p->apVal[i]);
+    }
+    xjd1_free(p->aRow);
+    xjd1_free(p->apVal);
+    xjd1_free(p->aBucket);
+    p->aRow = 0;
+    p->apVal = 0;
+    p->aBucket = 0;
+    p->nRow = 0;
+    p->nAlloc = 0;
+    p->nByte = 0;
+    p->nBucket = 0;
+    p->isBuilding = 0;
+    p->isBuilt = 0;
+    p->isScan = 0;
+    sqlite3_finalize(p->pSpillRead);
+    sqlite3_finalize(p->pSpillWrite);
+    if( p->iSpill ){
+      char *zSql = sqlite3_mprintf(
+          "DELETE FROM temp.xjd1_join_spill WHERE buf=%lld", p->iSpill);
+      sqlite3_exec(p->db, zSql, 0, 0, 0);
+      sqlite3_free(zSql);
+      p->iSpill = 0;
+    }
+    p->pSpillRead = 0;
+    p->pSpillWrite = 0;
+    p->readSpill = 0;
+  }
+}
+
+/*
+** Free a JoinBuffer object.
+*/
+void xjd1JoinBufferFree(JoinBuffer *p){
+  if( p ){
+    xjd1JoinBufferRewind(p);
+    xjd1_free(p->apProbe);
+    xjd1_free(p->apBuild);
+    xjd1_free(p->apKey);
+    xjd1_free(p);
+  }
+}
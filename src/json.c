@@ -18,6 +18,9 @@
 */
 #include "xjd1Int.h"
 #include <ctype.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 /*
@@ -42,7 +45,7 @@ void xjd1JsonToNull(JsonNode *p){
       JsonStructElem *pElem, *pNext;
       for(pElem=p->u.st.pFirst; pElem; pElem=pNext){
         pNext = pElem->pNext;
-        xjd1_free(pElem->zLabel);
+        xjd1LabelFree(pElem->zLabel);
         xjd1JsonFree(pElem->pValue);
         xjd1_free(pElem);
       }
@@ -68,8 +71,8 @@ void xjd1JsonFree(JsonNode *p){
 JsonNode *xjd1JsonNew(Pool *pPool){
   JsonNode *p;
   if( pPool ){
-    p = xjd1PoolMalloc(pPool, sizeof(*p));
-    if( p ) p->nRef = 10000;
+    p = xjd1PoolMallocZero(pPool, sizeof(*p));
+    if( p ) p->nRef = XJD1_POOL_NREF;
   }else{
     p = xjd1_malloc( sizeof(*p) );
     if( p ){
@@ -131,7 +134,7 @@ JsonNode *xjd1JsonDeepCopy(JsonNode *p){
         memset(pDest, 0, sizeof(*pDest));
         *ppPrev = pDest;
         ppPrev = &pDest->pNext;
-        pDest->zLabel = xjd1PoolDup(0, pSrc->zLabel, -1);
+        pDest->zLabel = xjd1LabelDup(0, pSrc->zLabel);
         pDest->pValue = xjd1JsonDeepCopy(pSrc->pValue);
       }
       break;
@@ -140,81 +143,277 @@ JsonNode *xjd1JsonDeepCopy(JsonNode *p){
   return pNew;
 }
 
+/*
+** Make sure that no part of JSON object p was allocated from a pool. If p
+** itself was, release the reference to it and return a reference to a
+** copy obtained from xjd1_malloc(). Otherwise replace any parts of p that
+** were with such copies, and return p. Code that holds on to a value for
+** longer than the row it came from uses this so that the memory of the
+** row can be reused. See arena.c.
+*/
+JsonNode *xjd1JsonPromote(JsonNode *p){
+  if( p==0 ) return 0;
+  if( p->nRef>XJD1_POOL_NREF/2 ){
+    JsonNode *pNew = xjd1JsonDeepCopy(p);
+    if( pNew ){
+      xjd1JsonFree(p);
+      p = pNew;
+    }
+    return p;
+  }
+  switch( p->eJType ){
+    case XJD1_ARRAY: {
+      int i;
+      for(i=0; i<p->u.ar.nElem; i++){
+        p->u.ar.apElem[i] = xjd1JsonPromote(p->u.ar.apElem[i]);
+      }
+      break;
+    }
+    case XJD1_STRUCT: {
+      JsonStructElem *pElem;
+      for(pElem=p->u.st.pFirst; pElem; pElem=pElem->pNext){
+        pElem->pValue = xjd1JsonPromote(pElem->pValue);
+      }
+      break;
+    }
+  }
+  return p;
+}
+
+/*
+** Return a deep copy of a JSON object allocated from memory pool pPool, in
+** the same way as the literals of a parsed statement. The copy is freed
+** along with the pool. Return NULL if a memory allocation fails.
+*/
+JsonNode *xjd1JsonPoolCopy(Pool *pPool, const JsonNode *p){
+  JsonNode *pNew;
+  if( p==0 ) return 0;
+  pNew = xjd1JsonNew(pPool);
+  if( pNew==0 ) return 0;
+  pNew->eJType = p->eJType;
+  pNew->u = p->u;
+  switch( pNew->eJType ){
+    case XJD1_STRING: {
+      pNew->u.z = xjd1PoolDup(pPool, p->u.z, -1);
+      if( pNew->u.z==0 ) return 0;
+      break;
+    }
+    case XJD1_ARRAY: {
+      int i;
+      pNew->u.ar.apElem = 0;
+      if( p->u.ar.nElem>0 ){
+        pNew->u.ar.apElem = xjd1PoolMalloc(pPool,
+                                           sizeof(JsonNode*)*p->u.ar.nElem);
+        if( pNew->u.ar.apElem==0 ) return 0;
+      }
+      for(i=0; i<p->u.ar.nElem; i++){
+        JsonNode *pElem = p->u.ar.apElem[i];
+        pNew->u.ar.apElem[i] = xjd1JsonPoolCopy(pPool, pElem);
+        if( pElem && pNew->u.ar.apElem[i]==0 ) return 0;
+      }
+      break;
+    }
+    case XJD1_STRUCT: {
+      JsonStructElem *pSrc, *pDest, **ppPrev;
+      ppPrev = &pNew->u.st.pFirst;
+      pNew->u.st.pFirst = pNew->u.st.pLast = 0;
+      for(pSrc=p->u.st.pFirst; pSrc; pSrc=pSrc->pNext){
+        pDest = xjd1PoolMallocZero(pPool, sizeof(*pDest));
+        if( pDest==0 ) return 0;
+        *ppPrev = pNew->u.st.pLast = pDest;
+        ppPrev = &pDest->pNext;
+        pDest->zLabel = xjd1LabelDup(pPool, pSrc->zLabel);
+        pDest->pValue = xjd1JsonPoolCopy(pPool, pSrc->pValue);
+        if( pDest->zLabel==0 ) return 0;
+        if( pSrc->pValue && pDest->pValue==0 ) return 0;
+      }
+      break;
+    }
+  }
+  return pNew;
+}
+
+/*
+** Return the approximate number of bytes of memory used by value p.
+*/
+int xjd1JsonSizeof(const JsonNode *p){
+  int n;
+  if( p==0 ) return 0;
+  n = sizeof(*p);
+  switch( p->eJType ){
+    case XJD1_STRING: {
+      n += xjd1Strlen30(p->u.z) + 1;
+      break;
+    }
+    case XJD1_ARRAY: {
+      int i;
+      n += p->u.ar.nElem*sizeof(JsonNode*);
+      for(i=0; i<p->u.ar.nElem; i++){
+        n += xjd1JsonSizeof(p->u.ar.apElem[i]);
+      }
+      break;
+    }
+    case XJD1_STRUCT: {
+      JsonStructElem *pElem;
+      for(pElem=p->u.st.pFirst; pElem; pElem=pElem->pNext){
+        n += sizeof(*pElem) + xjd1Strlen30(pElem->zLabel) + 1;
+        n += xjd1JsonSizeof(pElem->pValue);
+      }
+      break;
+    }
+  }
+  return n;
+}
+
 /*
 ** Return an editable JSON object.  A JSON object is editable if its
 ** reference count is exactly 1.  If the input JSON object has a reference
-** count greater than 1, then make a copy and return the copy.
+** count greater than 1, then make a copy, release the reference to the
+** input, and return the copy.
 */
 JsonNode *xjd1JsonEdit(JsonNode *p){
+  JsonNode *pCopy;
   if( p==0 ) return 0;
   if( p->nRef==1 ) return p;
-  return xjd1JsonDeepCopy(p);
+  pCopy = xjd1JsonDeepCopy(p);
+  xjd1JsonFree(p);
+  return pCopy;
+}
+
+/*
+** Return the first element of structure p labelled zLabel, or NULL if p
+** is not a structure or has no such element.
+**
+** If piSlot is not NULL, *piSlot is an inline cache of the position at
+** which the label was found the last time it was looked up through the
+** same pointer. The documents of a collection usually list their labels
+** in the same order, so the element at that position is checked before
+** any later element. A structure may have several elements with the
+** same label, so the labels ahead of it are still compared on the way
+** to it, and an earlier match is returned instead. *piSlot is updated
+** when the label is found elsewhere.
+**
+** An interned label is the same pointer as every copy of it, so labels
+** are first compared as pointers.
+*/
+JsonStructElem *xjd1JsonFindElem(
+  const JsonNode *p,
+  const char *zLabel,
+  int *piSlot
+){
+  JsonStructElem *pElem;
+  int i;
+  if( p==0 || p->eJType!=XJD1_STRUCT ) return 0;
+  for(pElem=p->u.st.pFirst, i=0; pElem; pElem=pElem->pNext, i++){
+    if( pElem->zLabel==zLabel || strcmp(pElem->zLabel, zLabel)==0 ){
+      if( piSlot ) *piSlot = i;
+      return pElem;
+    }
+    if( piSlot && i+1==*piSlot ){
+      /* The next element is at the cached position. Check it, then go
+      ** on with the elements after it. */
+      JsonStructElem *pSlot = pElem->pNext;
+      if( pSlot==0 ) return 0;
+      if( pSlot->zLabel==zLabel || strcmp(pSlot->zLabel, zLabel)==0 ){
+        return pSlot;
+      }
+      pElem = pSlot;
+      i++;
+    }
+  }
+  return 0;
 }
 
 
-/* Render a string as a string literal.
+/*
+** Return the offset of the first byte of z[0..n-1] that may need to be
+** escaped in a string literal: a '"', a '\\' or a control character
+** below 0x20. Return n if there is none.
+**
+** Like findStringSpecial() below, this looks at 16 bytes at a time
+** with SSE2 and at 8 bytes at a time otherwise. The 8-byte test may
+** report a byte that does not need escaping, so the bytes of the word
+** that fails it are checked one by one.
 */
-void renderString(String *pOut, const char *z){
-  int n, i, j, c;
-  char *zOut;
-  for(i=n=0; (c=z[i])!=0; i++, n++){
-    switch(c)
-    {
-    case '"':
-    case '\\':
-    case '\n':
-    case '\r':
-    case '\t':
-    case '\f':
-    case '\b':
-        ++n;
-        break;
+static int findRenderSpecial(const char *z, int n){
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i vQuote = _mm_set1_epi8('"');
+  const __m128i vSlash = _mm_set1_epi8('\\');
+  const __m128i vCtrl = _mm_set1_epi8(0x1f);
+  for(; i+16<=n; i+=16){
+    __m128i v = _mm_loadu_si128((const __m128i*)&z[i]);
+    int m = _mm_movemask_epi8(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, vQuote),
+                                  _mm_cmpeq_epi8(v, vSlash)),
+                     _mm_cmpeq_epi8(_mm_max_epu8(v, vCtrl), vCtrl)));
+    if( m ) return i + __builtin_ctz(m);
+  }
+#else
+  const sqlite3_uint64 ones = 0x0101010101010101ULL;
+  const sqlite3_uint64 highs = 0x8080808080808080ULL;
+  for(; i+8<=n; i+=8){
+    sqlite3_uint64 x, xQuote, xSlash;
+    memcpy(&x, &z[i], 8);
+    xQuote = x ^ (ones*'"');
+    xSlash = x ^ (ones*'\\');
+    if( ((x-ones*0x20) & ~x & highs) | ((xQuote-ones) & ~xQuote & highs)
+      | ((xSlash-ones) & ~xSlash & highs) ){
+      break;
     }
   }
-  xjd1StringAppend(pOut, 0, n+3);
-  zOut = xjd1StringText(pOut);
-  if( zOut ){
-    zOut += xjd1StringLen(pOut);
+#endif
+  for(; i<n; i++){
+    unsigned char c = (unsigned char)z[i];
+    if( c=='"' || c=='\\' || c<0x20 ) break;
+  }
+  return i;
+}
+
+/* Render a string as a string literal.
+**
+** Space for the whole literal, as if nothing needed escaping, is reserved
+** first. A string with no escapes, which is most of them, is then copied
+** straight into that space. Otherwise runs of bytes that need no escape
+** are copied with a single append each.
+*/
+static void renderString(String *pOut, const char *z){
+  int n = xjd1Strlen30(z);
+  int i, j;
+  xjd1StringAppend(pOut, 0, n+2);
+  j = findRenderSpecial(z, n);
+  if( j==n && pOut->nUsed+n+2<pOut->nAlloc ){
+    char *zOut = &pOut->zBuf[pOut->nUsed];
     zOut[0] = '"';
-    for(i=0, j=1; (c=z[i])!=0; i++){
-      switch(c)
-      {
-        case '"':
-        case '\\':
-          zOut[j++] = '\\';
-          break;
-        case '\n':
-          zOut[j++] = '\\';
-          zOut[j++] = 'n';
-          continue;
-          break;
-        case '\r':
-          zOut[j++] = '\\';
-          zOut[j++] = 'r';
-          continue;
-          break;
-        case '\t':
-          zOut[j++] = '\\';
-          zOut[j++] = 't';
-          continue;
-          break;
-        case '\f':
-          zOut[j++] = '\\';
-          zOut[j++] = 'f';
-          continue;
-          break;
-        case '\b':
-          zOut[j++] = '\\';
-          zOut[j++] = 'b';
-          continue;
-          break;
+    memcpy(&zOut[1], z, n);
+    zOut[n+1] = '"';
+    zOut[n+2] = 0;
+    pOut->nUsed += n+2;
+    return;
+  }
+  xjd1StringAppend(pOut, "\"", 1);
+  for(i=0; i<n; i=j+1){
+    const char *zEsc;
+    if( i>0 ) j = i + findRenderSpecial(&z[i], n-i);
+    if( j>i ) xjd1StringAppend(pOut, &z[i], j-i);
+    if( j>=n ) break;
+    switch( z[j] ){
+      case '"':   zEsc = "\\\"";  break;
+      case '\\':  zEsc = "\\\\"; break;
+      case '\n':  zEsc = "\\n";  break;
+      case '\r':  zEsc = "\\r";  break;
+      case '\t':  zEsc = "\\t";  break;
+      case '\f':  zEsc = "\\f";  break;
+      case '\b':  zEsc = "\\b";  break;
+      default: {
+        /* Other control characters are copied as they are */
+        xjd1StringAppend(pOut, &z[j], 1);
+        continue;
       }
-      zOut[j++] = c;
     }
-    zOut[j++] = '"';
-    zOut[j] = 0;
-    pOut->nUsed += j;
+    xjd1StringAppend(pOut, zEsc, 2);
   }
+  xjd1StringAppend(pOut, "\"", 1);
 }
 
 
@@ -239,7 +438,7 @@ void xjd1JsonRender(String *pOut, const JsonNode *p){
         break;
       }
       case XJD1_REAL: {
-        xjd1StringAppendF(pOut, "%.17g", p->u.r);
+        xjd1RealRender(pOut, p->u.r);
         break;
       }
       case XJD1_STRING: {
@@ -332,7 +531,7 @@ int xjd1JsonToString(const JsonNode *p, String *pOut){
       break;
     }
     case XJD1_REAL: {
-      xjd1StringAppendF(pOut, "%.17g", p->u.r);
+      xjd1RealRender(pOut, p->u.r);
       break;
     }
     case XJD1_NULL: {
@@ -398,7 +597,7 @@ int xjd1JsonCompare(const JsonNode *pLeft, const JsonNode *pRight, int insensiti
       JsonStructElem *pB = pRight->u.st.pFirst;
       int c = 0;
       while( pA && pB ){
-        c = strcmp(pA->zLabel, pB->zLabel);
+        c = pA->zLabel==pB->zLabel ? 0 : strcmp(pA->zLabel, pB->zLabel);
         if( c ) return c;
         c = xjd1JsonCompare(pA->pValue, pB->pValue, 0);
         if( c ) return c;
@@ -417,6 +616,152 @@ int xjd1JsonCompare(const JsonNode *pLeft, const JsonNode *pRight, int insensiti
   return 0;
 }
 
+/*
+** Mix the n bytes of a[] into hash h.
+*/
+static unsigned int hashBytes(unsigned int h, const void *a, int n){
+  const unsigned char *z = (const unsigned char*)a;
+  int i;
+  for(i=0; i<n; i++){
+    h = (h ^ z[i])*16777619;
+  }
+  return h;
+}
+
+/*
+** Mix a hash of JSON value p into hash h.  See xjd1JsonHash().
+*/
+static unsigned int jsonHash(unsigned int h, const JsonNode *p, int *pHasNaN){
+  if( p==0 ) return hashBytes(h, "", 1);
+  h = hashBytes(h, &p->eJType, sizeof(p->eJType));
+  switch( p->eJType ){
+    case XJD1_REAL: {
+      double r = p->u.r;
+      if( r!=r ) *pHasNaN = 1;
+      if( r==0.0 ) r = 0.0;             /* So that -0.0 hashes as 0.0 */
+      h = hashBytes(h, &r, sizeof(r));
+      break;
+    }
+    case XJD1_STRING: {
+      h = hashBytes(h, p->u.z, (int)strlen(p->u.z)+1);
+      break;
+    }
+    case XJD1_ARRAY: {
+      int i;
+      for(i=0; i<p->u.ar.nElem; i++){
+        h = jsonHash(h, p->u.ar.apElem[i], pHasNaN);
+      }
+      h = hashBytes(h, &p->u.ar.nElem, sizeof(p->u.ar.nElem));
+      break;
+    }
+    case XJD1_STRUCT: {
+      JsonStructElem *pElem;
+      for(pElem=p->u.st.pFirst; pElem; pElem=pElem->pNext){
+        h = hashBytes(h, pElem->zLabel, (int)strlen(pElem->zLabel)+1);
+        h = jsonHash(h, pElem->pValue, pHasNaN);
+      }
+      break;
+    }
+  }
+  return h;
+}
+
+/*
+** Compute a hash of JSON value p.  Values that xjd1JsonCompare() reports
+** as equal (with insensitive==0) have equal hashes, with one exception:
+** a NaN compares equal to every number.  If p is or contains a NaN, set
+** *pHasNaN to true.
+*/
+unsigned int xjd1JsonHash(const JsonNode *p, int *pHasNaN){
+  return jsonHash(2166136261u, p, pHasNaN);
+}
+
+/*
+** Append the sort key of JSON value p to pOut.  See xjd1JsonSortKey().
+*/
+static void jsonSortKey(String *pOut, const JsonNode *p){
+  char c;
+  if( p==0 ){
+    xjd1StringAppend(pOut, "\001", 1);
+    return;
+  }
+  c = (char)(p->eJType + 2);
+  xjd1StringAppend(pOut, &c, 1);
+  switch( p->eJType ){
+    case XJD1_REAL: {
+      /* Map the bits of the number to an unsigned integer that sorts in
+      ** the same order, and write it big-endian. -0.0 is written as 0.0,
+      ** and a NaN as all zeros, before every other number. */
+      double r = p->u.r;
+      sqlite3_uint64 x = 0;
+      unsigned char a[8];
+      int i;
+      if( r==0.0 ) r = 0.0;
+      if( r==r ){
+        memcpy(&x, &r, sizeof(x));
+        if( x & ((sqlite3_uint64)1<<63) ){
+          x = ~x;
+        }else{
+          x |= ((sqlite3_uint64)1<<63);
+        }
+      }
+      for(i=7; i>=0; i--){
+        a[i] = (unsigned char)x;
+        x >>= 8;
+      }
+      xjd1StringAppend(pOut, (const char*)a, 8);
+      break;
+    }
+    case XJD1_STRING: {
+      xjd1StringAppend(pOut, p->u.z, (int)strlen(p->u.z)+1);
+      break;
+    }
+    case XJD1_ARRAY: {
+      int i;
+      for(i=0; i<p->u.ar.nElem; i++){
+        jsonSortKey(pOut, p->u.ar.apElem[i]);
+      }
+      xjd1StringAppend(pOut, "", 1);
+      break;
+    }
+    case XJD1_STRUCT: {
+      JsonStructElem *pElem;
+      for(pElem=p->u.st.pFirst; pElem; pElem=pElem->pNext){
+        xjd1StringAppend(pOut, "\001", 1);
+        xjd1StringAppend(pOut, pElem->zLabel, (int)strlen(pElem->zLabel)+1);
+        jsonSortKey(pOut, pElem->pValue);
+      }
+      xjd1StringAppend(pOut, "", 1);
+      break;
+    }
+  }
+}
+
+/*
+** Append a sort key for JSON value p to pOut.  The sort keys of two
+** values compare with memcmp() in the same order as the values compare
+** with xjd1JsonCompare() (with insensitive==0), except that a NaN sorts
+** before every other number.  If isDesc is true, the order is reversed.
+**
+** A value is written as a byte for its type (one more than that of a
+** NULL pointer, which comes first) followed by 8 bytes for a number,
+** the text and a 0x00 for a string, or the elements and a 0x00 for an
+** array.  Each element of a structure is written as a 0x01, the label,
+** a 0x00 and the value, and the structure is ended by another 0x00.  No
+** key is a prefix of another, so the keys of several values may be
+** appended one after another and still compare correctly.
+*/
+void xjd1JsonSortKey(String *pOut, const JsonNode *p, int isDesc){
+  int iStart = xjd1StringLen(pOut);
+  jsonSortKey(pOut, p);
+  if( isDesc ){
+    int i;
+    for(i=iStart; i<xjd1StringLen(pOut); i++){
+      pOut->zBuf[i] = ~pOut->zBuf[i];
+    }
+  }
+}
+
 
 /* JSON parser token types */
 #define JSON_FALSE          XJD1_FALSE
@@ -442,6 +787,8 @@ struct JsonStr {
   int iCur;               /* First character of current token */
   int n;                  /* Number of charaters in current token */
   int eType;              /* Type of current token */
+  LabelTable *pLabels;    /* Table to intern labels in, or NULL */
+  Pool *pPool;            /* Memory for the parsed value, or NULL */
 };
 
 /* Return the type of the current token */
@@ -463,6 +810,68 @@ static int isExp(const char *z, int n){
   return 0;
 }
 
+/*
+** Return the offset of the first '"', '\\' or nul byte in z[0..n-1], or n
+** if there is none.
+**
+** Most of the input of the parser is the body of strings, so this loop
+** is unrolled to look at several bytes at once. With SSE2, which every
+** x86-64 processor has, 16 bytes are compared at a time. Otherwise 8
+** bytes at a time are loaded into a 64-bit integer and tested for the
+** three byte values with the usual carry tricks.
+*/
+static int findStringSpecial(const char *z, int n){
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i vQuote = _mm_set1_epi8('"');
+  const __m128i vSlash = _mm_set1_epi8('\\');
+  const __m128i vZero = _mm_setzero_si128();
+  for(; i+16<=n; i+=16){
+    __m128i v = _mm_loadu_si128((const __m128i*)&z[i]);
+    int m = _mm_movemask_epi8(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, vQuote),
+                                  _mm_cmpeq_epi8(v, vSlash)),
+                     _mm_cmpeq_epi8(v, vZero)));
+    if( m ) return i + __builtin_ctz(m);
+  }
+#else
+  const sqlite3_uint64 ones = 0x0101010101010101ULL;
+  const sqlite3_uint64 highs = 0x8080808080808080ULL;
+  for(; i+8<=n; i+=8){
+    sqlite3_uint64 x, xQuote, xSlash;
+    memcpy(&x, &z[i], 8);
+    xQuote = x ^ (ones*'"');
+    xSlash = x ^ (ones*'\\');
+    if( ((x-ones) & ~x & highs) | ((xQuote-ones) & ~xQuote & highs)
+      | ((xSlash-ones) & ~xSlash & highs) ){
+      break;
+    }
+  }
+#endif
+  for(; i<n; i++){
+    char c = z[i];
+    if( c=='"' || c=='\\' || c==0 ) break;
+  }
+  return i;
+}
+
+#ifndef NDEBUG
+/*
+** Return the length of the string token that starts at z[0], with n bytes
+** of input available, scanning one byte at a time. This is used by an
+** assert() to check the result of findStringSpecial().
+*/
+static int tokenStringLength(const char *z, int n){
+  int i;
+  char c = 0;
+  for(i=1; i<n && (c = z[i])!=0 && c!='"'; i++){
+    if( c=='\\' ) i++;
+  }
+  if( i<n && c=='"' ) i++;
+  return i>n ? n : i;
+}
+#endif
+
 /* Advance to the next token */
 static void tokenNext(JsonStr *p){
   int i, n;
@@ -479,11 +888,16 @@ static void tokenNext(JsonStr *p){
       goto token_eof;
     }
     case '"': {
-     for(n=1; i+n<mx && (c = z[i+n])!=0 && c!='"'; n++){
-        if( c=='\\' ) n++;
+      n = 1;
+      while( i+n<mx ){
+        n += findStringSpecial(&z[i+n], mx-(i+n));
+        if( i+n>=mx || z[i+n]!='\\' ) break;
+        n += 2;
       }
+      c = i+n<mx ? z[i+n] : 0;
       if( c=='"' ) n++;
-      if( i+n>mx ){ n = mx - i; c = 0; }
+      if( i+n>mx ) n = mx - i;
+      assert( n==tokenStringLength(&z[i], mx-i) );
       p->n = n;
       p->eType = (c=='"' ? JSON_STRING : JSON_ERROR);
       break;
@@ -633,14 +1047,19 @@ void xjd1DequoteString(char *z, int n){
 
 /* Convert the current token (which must be a string) into a true
 ** string (resolving all of the backslash escapes) and return a pointer
-** to the true string.  Space is obtained from xjd1_malloc().
+** to the true string.  Space is obtained from pPool or, if pPool is NULL,
+** from xjd1_malloc().
 */
-static char *tokenDequoteString(JsonStr *pIn){
+static char *tokenDequoteString(JsonStr *pIn, Pool *pPool){
   const char *zIn;
   char *zOut;
   //int n;
   zIn = &pIn->zIn[pIn->iCur];
-  zOut = xjd1_malloc( pIn->n );
+  if( pPool ){
+    zOut = xjd1PoolMalloc(pPool, pIn->n);
+  }else{
+    zOut = xjd1_malloc( pIn->n );
+  }
   if( zOut==0 ) return 0;
   assert( zIn[0]=='"' && zIn[pIn->n-1]=='"' );
   //n = pIn->n-1;
@@ -649,6 +1068,32 @@ static char *tokenDequoteString(JsonStr *pIn){
   return zOut;
 }
 
+/* Convert the current token (which must be a string) into a structure
+** label. See xjd1LabelNew().
+*/
+static char *tokenLabel(JsonStr *pIn){
+  const char *zIn = &pIn->zIn[pIn->iCur];
+  char *zOut;
+  char *zBuf;
+  assert( zIn[0]=='"' && zIn[pIn->n-1]=='"' );
+  if( memchr(zIn, '\\', pIn->n)==0 ){
+    return xjd1LabelNew(pIn->pPool, pIn->pLabels, &zIn[1], pIn->n-2);
+  }
+  zBuf = tokenDequoteString(pIn, 0);
+  if( zBuf==0 ) return 0;
+  zOut = xjd1LabelNew(pIn->pPool, pIn->pLabels, zBuf, -1);
+  xjd1_free(zBuf);
+  return zOut;
+}
+
+
+/*
+** Allocate n bytes of zeroed memory for the value being parsed by pIn.
+*/
+static void *jsonMallocZero(JsonStr *pIn, int n){
+  if( pIn->pPool ) return xjd1PoolMallocZero(pIn->pPool, n);
+  return xjd1MallocZero(n);
+}
 
 /* Enter point to the first token of the JSON object.
 ** Exit pointing to the first token past end end of the
@@ -656,27 +1101,29 @@ static char *tokenDequoteString(JsonStr *pIn){
 */
 static JsonNode *parseJson(JsonStr *pIn){
   JsonNode *pNew;
-  pNew = xjd1JsonNew(0);
+  pNew = xjd1JsonNew(pIn->pPool);
   if( pNew==0 ) return 0;
   pNew->eJType = tokenType(pIn);
   switch( pNew->eJType ){
     case JSON_BEGIN_STRUCT: {
       JsonStructElem **ppTail;
       tokenNext(pIn);
-      if( tokenType(pIn)==JSON_END_STRUCT ) break;
+      if( tokenType(pIn)==JSON_END_STRUCT ){
+        tokenNext(pIn);
+        break;
+      }
       ppTail = &pNew->u.st.pFirst;
       while( 1 ){
         JsonStructElem *pElem;
         if( tokenType(pIn)!=JSON_STRING ){
           goto json_error;
         }
-        pElem = xjd1_malloc( sizeof(*pElem) );
+        pElem = jsonMallocZero(pIn, sizeof(*pElem));
         if( pElem==0 ) goto json_error;
-        memset(pElem, 0, sizeof(*pElem));
         *ppTail = pElem;
         pNew->u.st.pLast = pElem;
         ppTail = &pElem->pNext;
-        pElem->zLabel = tokenDequoteString(pIn);
+        pElem->zLabel = tokenLabel(pIn);
         tokenNext(pIn);
         if( tokenType(pIn)!=JSON_COLON ){
           goto json_error;
@@ -705,8 +1152,16 @@ static JsonNode *parseJson(JsonStr *pIn){
         if( pNew->u.ar.nElem>=nAlloc ){
           JsonNode **pNewArray;
           nAlloc = nAlloc*2 + 5;
-          pNewArray = xjd1_realloc(pNew->u.ar.apElem,
-                              sizeof(JsonNode*)*nAlloc);
+          if( pIn->pPool ){
+            pNewArray = xjd1PoolMalloc(pIn->pPool, sizeof(JsonNode*)*nAlloc);
+            if( pNewArray && pNew->u.ar.nElem ){
+              memcpy(pNewArray, pNew->u.ar.apElem,
+                     sizeof(JsonNode*)*pNew->u.ar.nElem);
+            }
+          }else{
+            pNewArray = xjd1_realloc(pNew->u.ar.apElem,
+                                sizeof(JsonNode*)*nAlloc);
+          }
           if( pNewArray==0 ) goto json_error;
           pNew->u.ar.apElem = pNewArray;
         }
@@ -723,12 +1178,12 @@ static JsonNode *parseJson(JsonStr *pIn){
       break;
     }
     case JSON_STRING: {
-      pNew->u.z = tokenDequoteString(pIn);
+      pNew->u.z = tokenDequoteString(pIn, pIn->pPool);
       tokenNext(pIn);
       break;
     }
     case JSON_REAL: {
-      pNew->u.r = atof(tokenString(pIn));
+      pNew->u.r = xjd1RealParse(tokenString(pIn), pIn->n);
       tokenNext(pIn);
       break;
     }
@@ -739,7 +1194,7 @@ static JsonNode *parseJson(JsonStr *pIn){
       break;
     }
     default: {
-      xjd1_free(pNew);
+      if( pIn->pPool==0 ) xjd1_free(pNew);
       pNew = 0;
       break;
     }
@@ -761,10 +1216,231 @@ JsonNode *xjd1JsonParse(const char *zIn, int mxIn){
   x.iCur = 0;
   x.n = 0;
   x.eType = 0;
+  x.pLabels = 0;
+  x.pPool = 0;
+  tokenNext(&x);
+  return parseJson(&x);
+}
+
+/*
+** Enter pointing to the first token of a JSON value.  Exit pointing to
+** the first token past the end of that value.  No memory is allocated.
+** Return non-zero if the value is malformed.
+*/
+static int skipJson(JsonStr *pIn){
+  int nDepth = 0;
+  do{
+    switch( tokenType(pIn) ){
+      case JSON_BEGIN_STRUCT:
+      case JSON_BEGIN_ARRAY:
+        nDepth++;
+        break;
+      case JSON_END_STRUCT:
+      case JSON_END_ARRAY:
+        nDepth--;
+        break;
+      case JSON_EOF:
+      case JSON_ERROR:
+        return 1;
+    }
+    tokenNext(pIn);
+  }while( nDepth>0 );
+  return nDepth<0;
+}
+
+/*
+** Return true if the current token, which must be a string, is the
+** label zLabel.
+*/
+static int tokenIsLabel(JsonStr *pIn, const char *zLabel){
+  const char *z = tokenString(pIn);
+  int n = pIn->n-2;
+  int res;
+  char *zDequoted;
+  if( memchr(&z[1], '\\', n)==0 ){
+    return strncmp(&z[1], zLabel, n)==0 && zLabel[n]==0;
+  }
+  zDequoted = tokenDequoteString(pIn, 0);
+  res = (zDequoted && strcmp(zDequoted, zLabel)==0);
+  xjd1_free(zDequoted);
+  return res;
+}
+
+/*
+** Parse only the part of JSON string zIn identified by the nPath steps
+** of a path.  Step i is the label azPath[i] or, if aiPath[i] is not
+** negative, the subscript aiPath[i], in which case azPath[i] is its
+** text.  For example, if azPath[] is {"a","b"} and aiPath[] is {-1,-1},
+** the value returned is the same as the value of the "b" property of
+** the "a" property of the complete document.  A subscript selects an
+** element of an array, or the property whose label is its text in a
+** struct.  Sibling values are skipped over without being parsed.
+**
+** NULL is returned if the path does not exist in the document.  If a
+** subscript is applied to a string, NULL is returned and *pbUnknown is
+** set to true.
+*/
+JsonNode *xjd1JsonExtract(
+  const char *zIn,                /* JSON text */
+  int mxIn,                       /* Length of zIn, or -1 */
+  int nPath,                      /* Number of steps in the path */
+  const char **azPath,            /* Labels to follow */
+  const int *aiPath,              /* Subscripts to follow, or -1 */
+  int *pbUnknown                  /* OUT: True if the result is unknown */
+){
+  JsonStr x;
+  int i;
+  x.zIn = zIn;
+  x.mxIn = mxIn>0 ? mxIn : xjd1Strlen30(zIn);
+  x.iCur = 0;
+  x.n = 0;
+  x.eType = 0;
+  x.pLabels = 0;
+  x.pPool = 0;
+  *pbUnknown = 0;
   tokenNext(&x);
+  for(i=0; i<nPath; i++){
+    if( tokenType(&x)==JSON_BEGIN_ARRAY && aiPath[i]>=0 ){
+      int j;
+      tokenNext(&x);
+      if( tokenType(&x)==JSON_END_ARRAY ) return 0;
+      for(j=0; j<aiPath[i]; j++){
+        if( skipJson(&x) ) return 0;
+        if( tokenType(&x)!=JSON_COMMA ) return 0;
+        tokenNext(&x);
+      }
+      continue;
+    }
+    if( tokenType(&x)==JSON_STRING && aiPath[i]>=0 ){
+      *pbUnknown = 1;
+      return 0;
+    }
+    if( tokenType(&x)!=JSON_BEGIN_STRUCT ) return 0;
+    tokenNext(&x);
+    while( 1 ){
+      int isMatch;
+      if( tokenType(&x)!=JSON_STRING ) return 0;
+      isMatch = tokenIsLabel(&x, azPath[i]);
+      tokenNext(&x);
+      if( tokenType(&x)!=JSON_COLON ) return 0;
+      tokenNext(&x);
+      if( isMatch ) break;
+      if( skipJson(&x) ) return 0;
+      if( tokenType(&x)!=JSON_COMMA ) return 0;
+      tokenNext(&x);
+    }
+  }
   return parseJson(&x);
 }
 
+/*
+** Return the sub-projection of projection pProj for the label that is
+** the current token of pIn, or NULL if that label is not projected.
+*/
+static const JsonNode *projectionFind(const JsonNode *pProj, JsonStr *pIn){
+  JsonStructElem *pElem;
+  for(pElem=pProj->u.st.pFirst; pElem; pElem=pElem->pNext){
+    if( tokenIsLabel(pIn, pElem->zLabel) ) return pElem->pValue;
+  }
+  return 0;
+}
+
+/*
+** Like parseJson() except that if the value is a struct, only those
+** elements named by projection pProj are parsed.  The others are
+** skipped.  See xjd1JsonParseProjection() for a description of pProj.
+*/
+static JsonNode *parseProjection(JsonStr *pIn, const JsonNode *pProj){
+  JsonNode *pNew;
+  JsonStructElem **ppTail;
+
+  if( pProj==0 || pProj->eJType!=XJD1_STRUCT
+   || tokenType(pIn)!=JSON_BEGIN_STRUCT
+  ){
+    return parseJson(pIn);
+  }
+  pNew = xjd1JsonNew(pIn->pPool);
+  if( pNew==0 ) return 0;
+  pNew->eJType = XJD1_STRUCT;
+  ppTail = &pNew->u.st.pFirst;
+  tokenNext(pIn);
+  if( tokenType(pIn)==JSON_END_STRUCT ){
+    tokenNext(pIn);
+    return pNew;
+  }
+  while( 1 ){
+    const JsonNode *pSub;
+    if( tokenType(pIn)!=JSON_STRING ) goto json_error;
+    pSub = projectionFind(pProj, pIn);
+    if( pSub ){
+      JsonStructElem *pElem = jsonMallocZero(pIn, sizeof(*pElem));
+      if( pElem==0 ) goto json_error;
+      *ppTail = pElem;
+      pNew->u.st.pLast = pElem;
+      ppTail = &pElem->pNext;
+      pElem->zLabel = tokenLabel(pIn);
+      tokenNext(pIn);
+      if( tokenType(pIn)!=JSON_COLON ) goto json_error;
+      tokenNext(pIn);
+      pElem->pValue = parseProjection(pIn, pSub);
+    }else{
+      tokenNext(pIn);
+      if( tokenType(pIn)!=JSON_COLON ) goto json_error;
+      tokenNext(pIn);
+      if( skipJson(pIn) ) goto json_error;
+    }
+    if( tokenType(pIn)==JSON_COMMA ){
+      tokenNext(pIn);
+    }else if( tokenType(pIn)==JSON_END_STRUCT ){
+      tokenNext(pIn);
+      break;
+    }else{
+      goto json_error;
+    }
+  }
+  return pNew;
+
+json_error:
+  xjd1JsonFree(pNew);
+  return 0;
+}
+
+/*
+** Parse the parts of JSON string zIn that are named by projection pProj.
+**
+** A projection is a struct whose labels are the properties of the
+** document that are required. The value of each label is either TRUE,
+** meaning that the whole property value is required, or another
+** projection for the parts of the property that are required. A NULL
+** or TRUE pProj means the whole document is required.
+**
+** The value returned is the same as xjd1JsonParse() would return except
+** that struct elements not named by the projection are omitted. A value
+** that is not a struct is always parsed in full. If pLabels is not NULL,
+** labels are interned in it. See xjd1LabelNew().
+**
+** If pPool is not NULL, the value is allocated from it, and is freed
+** along with the pool rather than by xjd1JsonFree().
+*/
+JsonNode *xjd1JsonParseProjection(
+  const char *zIn,                /* JSON text */
+  int mxIn,                       /* Length of zIn, or -1 */
+  const JsonNode *pProj,          /* Projection, or NULL */
+  LabelTable *pLabels,            /* Table to intern labels in, or NULL */
+  Pool *pPool                     /* Memory for the value, or NULL */
+){
+  JsonStr x;
+  x.zIn = zIn;
+  x.mxIn = mxIn>0 ? mxIn : xjd1Strlen30(zIn);
+  x.iCur = 0;
+  x.n = 0;
+  x.eType = 0;
+  x.pLabels = pLabels;
+  x.pPool = pPool;
+  tokenNext(&x);
+  return parseProjection(&x, pProj);
+}
+
 /*
 ** This function is used by the XJD1 shell in test mode. It assumes that
 ** the string zIn contains a list of white-space separated JSON values.
@@ -798,6 +1474,8 @@ int xjd1JsonTidy(String *pOut, const char *zIn){
   x.iCur = 0;
   x.n = 0;
   x.eType = 0;
+  x.pLabels = 0;
+  x.pPool = 0;
 
   while( 1 ){
     int ePrev = x.eType;
@@ -839,11 +1517,8 @@ int xjd1JsonInsert(JsonNode *p, const char *zLabel, JsonNode *pVal){
   JsonStructElem *pElem;
 
   assert( p && p->eJType==XJD1_STRUCT && p->nRef==1 );
-  for(pElem=p->u.st.pFirst; pElem; pElem=pElem->pNext){
-    if( strcmp(zLabel, pElem->zLabel)==0 ) break;
-  }
+  pElem = xjd1JsonFindElem(p, zLabel, 0);
   if( pElem ){
-    xjd1_free(pElem->zLabel);
     xjd1JsonFree(pElem->pValue);
   }else{
     pElem = xjd1_malloc(sizeof(*pElem));
@@ -859,10 +1534,10 @@ int xjd1JsonInsert(JsonNode *p, const char *zLabel, JsonNode *pVal){
     }
     pElem->pNext = 0;
     p->u.st.pLast = pElem;
+    pElem->zLabel = xjd1LabelNew(0, 0, zLabel, -1);
   }
 
   pElem->pValue = pVal;
-  pElem->zLabel = xjd1PoolDup(0, zLabel, -1);
   return (pElem->zLabel ? XJD1_OK : XJD1_NOMEM);
 }
 
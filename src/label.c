@@ -0,0 +1,215 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains code used to allocate the labels of JSON structures.
+**
+** A label is a nul-terminated string. The byte before the first byte of
+** the string records who owns it:
+**
+**     LABEL_OWNED       The label was obtained from xjd1_malloc(), and
+**                       is freed by xjd1LabelFree().
+**     LABEL_POOL        The label belongs to a memory pool.
+**     LABEL_INTERNED    The label belongs to the LabelTable of a database
+**                       connection.
+**
+** Every string that may become a label is made by xjd1LabelNew(). That
+** includes the names in the text of a statement, which the parser makes
+** LABEL_POOL labels of before xjd1ExprInit() interns them. The byte
+** before a label can therefore always be read.
+**
+** The documents of a collection use the same few labels over and over.
+** Each connection interns the labels of the documents it reads in a
+** LabelTable, so that all copies of a label are a single pointer. This
+** saves an allocation for each label of each document, and lets a label
+** lookup succeed on a pointer compare. Long labels, and new labels once
+** the table is full, are allocated one by one instead.
+**
+** The table is frozen while worker threads are running. Labels already
+** in the table are still shared, but no new labels are added, so the
+** table may be read by all threads at once without a lock.
+*/
+#include "xjd1Int.h"
+
+/*
+** Values for the byte before the first byte of a label.
+*/
+#define LABEL_OWNED     0
+#define LABEL_POOL      1
+#define LABEL_INTERNED  2
+
+/*
+** Labels longer than LABEL_MX_LEN bytes are not interned, and a table
+** holds no more than LABEL_MX_COUNT labels.
+*/
+#define LABEL_MX_LEN    64
+#define LABEL_MX_COUNT  8192
+
+/*
+** A table of interned labels.
+*/
+struct LabelTable {
+  int isFrozen;                   /* True while labels may not be added */
+  int nLabel;                     /* Number of labels in the table */
+  int nSlot;                      /* Size of azSlot[], a power of two */
+  char **azSlot;                  /* Open-addressing hash table of labels */
+  Pool sPool;                     /* Memory for the labels */
+};
+
+/*
+** Return a new, empty, label table.
+*/
+LabelTable *xjd1LabelTableNew(void){
+  LabelTable *p = xjd1MallocZero(sizeof(*p));
+  if( p==0 ) return 0;
+  p->nSlot = 256;
+  p->azSlot = xjd1MallocZero(p->nSlot*sizeof(char*));
+  if( p->azSlot==0 ){
+    xjd1_free(p);
+    return 0;
+  }
+  return p;
+}
+
+/*
+** Free a label table and all the labels in it.
+*/
+void xjd1LabelTableFree(LabelTable *p){
+  if( p ){
+    xjd1PoolClear(&p->sPool);
+    xjd1_free(p->azSlot);
+    xjd1_free(p);
+  }
+}
+
+/*
+** Freeze or thaw table p. See the comment at the top of this file.
+*/
+void xjd1LabelTableFreeze(LabelTable *p, int isFrozen){
+  if( p ) p->isFrozen = isFrozen;
+}
+
+/*
+** Hash the n bytes of label z.
+*/
+static unsigned int labelHash(const char *z, int n){
+  unsigned int h = 2166136261u;
+  int i;
+  for(i=0; i<n; i++){
+    h = (h ^ (unsigned char)z[i])*16777619u;
+  }
+  return h;
+}
+
+/*
+** Return a pointer to the slot of table p that holds the n-byte label z,
+** or to the empty slot where it would be added.
+*/
+static char **labelFind(LabelTable *p, const char *z, int n, unsigned int h){
+  int i = h & (p->nSlot-1);
+  while( p->azSlot[i] ){
+    const char *zSlot = p->azSlot[i];
+    if( memcmp(zSlot, z, n)==0 && zSlot[n]==0 ) break;
+    i = (i+1) & (p->nSlot-1);
+  }
+  return &p->azSlot[i];
+}
+
+/*
+** Double the number of slots in table p.
+*/
+static int labelRehash(LabelTable *p){
+  int nNew = p->nSlot*2;
+  char **azNew = xjd1MallocZero(nNew*sizeof(char*));
+  int i;
+  if( azNew==0 ) return XJD1_NOMEM;
+  for(i=0; i<p->nSlot; i++){
+    char *z = p->azSlot[i];
+    if( z ){
+      int j = labelHash(z, (int)strlen(z)) & (nNew-1);
+      while( azNew[j] ) j = (j+1) & (nNew-1);
+      azNew[j] = z;
+    }
+  }
+  xjd1_free(p->azSlot);
+  p->azSlot = azNew;
+  p->nSlot = nNew;
+  return XJD1_OK;
+}
+
+/*
+** Allocate space for an n-byte label with owner eOwner, and copy z into
+** it. The memory comes from pPool, or from xjd1_malloc() if pPool is
+** NULL.
+*/
+static char *labelAlloc(Pool *pPool, const char *z, int n, int eOwner){
+  char *zOut;
+  if( pPool ){
+    zOut = xjd1PoolMalloc(pPool, n+2);
+  }else{
+    zOut = xjd1_malloc(n+2);
+  }
+  if( zOut==0 ) return 0;
+  zOut[0] = (char)eOwner;
+  memcpy(&zOut[1], z, n);
+  zOut[n+1] = 0;
+  return &zOut[1];
+}
+
+/*
+** Return a label holding the first n bytes of z, or all of z if n is
+** negative. If possible, the label is interned in table pTab. Otherwise
+** it is allocated from pPool or, if pPool is NULL, from xjd1_malloc().
+** pTab may be NULL. Return NULL if a memory allocation fails.
+*/
+char *xjd1LabelNew(Pool *pPool, LabelTable *pTab, const char *z, int n){
+  if( n<0 ) n = xjd1Strlen30(z);
+  if( pTab && n<=LABEL_MX_LEN ){
+    unsigned int h = labelHash(z, n);
+    char **pz = labelFind(pTab, z, n, h);
+    if( *pz ) return *pz;
+    if( pTab->isFrozen==0 && pTab->nLabel<LABEL_MX_COUNT
+     && pTab->nLabel*2<pTab->nSlot
+    ){
+      char *zNew = labelAlloc(&pTab->sPool, z, n, LABEL_INTERNED);
+      if( zNew==0 ) return 0;
+      *pz = zNew;
+      pTab->nLabel++;
+      if( pTab->nLabel*2>=pTab->nSlot ) labelRehash(pTab);
+      return zNew;
+    }
+  }
+  return labelAlloc(pPool, z, n, pPool ? LABEL_POOL : LABEL_OWNED);
+}
+
+/*
+** Return a copy of label zLabel, which must have been obtained from
+** xjd1LabelNew(). An interned label is its own copy. Other labels are
+** copied to pPool or, if pPool is NULL, to memory obtained from
+** xjd1_malloc().
+*/
+char *xjd1LabelDup(Pool *pPool, const char *zLabel){
+  if( zLabel[-1]==LABEL_INTERNED ) return (char*)zLabel;
+  return labelAlloc(pPool, zLabel, xjd1Strlen30(zLabel),
+                    pPool ? LABEL_POOL : LABEL_OWNED);
+}
+
+/*
+** Free a label. Only labels obtained from xjd1_malloc() are freed. The
+** others belong to a pool or a label table.
+*/
+void xjd1LabelFree(char *zLabel){
+  if( zLabel && zLabel[-1]==LABEL_OWNED ) xjd1_free(&zLabel[-1]);
+}
@@ -17,6 +17,9 @@
 ** Pooled memory allocation
 */
 #include "xjd1Int.h"
+#ifdef XJD1_ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 static void *dflt_malloc(int N){ return malloc(N); }
 static void dflt_free(void *p){ free(p); }
@@ -59,6 +62,352 @@ void *xjd1MallocZero(int N){
   return pRet;
 }
 
+/*
+** The built-in size-class allocator, installed by passing
+** xjd1_memsys_malloc(), xjd1_memsys_realloc() and xjd1_memsys_free() to
+** xjd1_configure_malloc().
+**
+** Most allocations are small and of a few fixed sizes: JSON nodes,
+** struct elements, short labels and strings. A request for up to
+** MEMSYS_MX_SMALL bytes is rounded up to a multiple of 16 and served from
+** the freelist for that size class. Larger requests go straight to
+** malloc().
+**
+** Each thread has a MemsysCache of its own: a freelist for each size
+** class and a MEMSYS_SLAB byte slab obtained from malloc() that new
+** blocks are carved from. A freed block goes on the freelist of the
+** thread that frees it. Threads allocate and free small blocks without
+** taking any lock. A thread that holds more than MEMSYS_MX_CACHE free
+** blocks of one class moves half of them to the shared freelists, and a
+** thread that has used up its slab takes blocks back from the shared
+** freelists before it starts a new slab. When a thread exits, its free
+** blocks and the unused part of its slab are given to the shared lists.
+** The shared lists are protected by a mutex. Slabs are never returned to
+** the system.
+**
+** Without XJD1_ENABLE_THREADS there is a single cache and no mutex.
+**
+** Each block is preceded by a MEMSYS_HDR byte header that records its
+** size class, or 0 for a block from malloc(), and the number of bytes
+** requested. The header is padded so that blocks have the same 16-byte
+** alignment as those returned by malloc().
+*/
+#define MEMSYS_HDR       16
+#define MEMSYS_MX_SMALL  64
+#define MEMSYS_NCLASS    (MEMSYS_MX_SMALL/16)
+#define MEMSYS_SLAB      65536
+#define MEMSYS_MX_CACHE  256
+#define MEMSYS_BATCH     64
+#define MEMSYS_FLUSH     65536
+
+typedef struct MemsysHdr MemsysHdr;
+typedef struct MemsysFree MemsysFree;
+typedef struct MemsysSpare MemsysSpare;
+typedef struct MemsysCache MemsysCache;
+struct MemsysHdr {
+  int iClass;                     /* Size class, or 0 for a large block */
+  int nByte;                      /* Bytes requested */
+};
+struct MemsysFree {
+  MemsysFree *pNext;              /* Next block on the same freelist */
+};
+struct MemsysSpare {
+  MemsysSpare *pNext;             /* Next unused part of a slab */
+  int nByte;                      /* Size of this part, in bytes */
+};
+
+/*
+** The allocator state private to one thread. The statistics count the
+** activity of the thread since they were last added to the shared
+** totals. nPeak is the largest value nDelta has had since then.
+*/
+struct MemsysCache {
+  MemsysFree *apFree[MEMSYS_NCLASS+1];  /* Freelist for each size class */
+  int anFree[MEMSYS_NCLASS+1];    /* Number of blocks on each freelist */
+  char *pSpace;                   /* Unused space in the current slab */
+  int nSpace;                     /* Bytes of space at pSpace */
+  sqlite3_int64 nMalloc;          /* Number of allocations */
+  sqlite3_int64 nHit;             /* Allocations served from a freelist */
+  sqlite3_int64 nDelta;           /* Change in the bytes allocated */
+  sqlite3_int64 nPeak;            /* Largest value of nDelta */
+};
+
+static struct {
+  MemsysFree *apFree[MEMSYS_NCLASS+1];  /* Shared freelist for each class */
+  MemsysSpare *pSpare;            /* Unused parts of slabs */
+  sqlite3_int64 nMalloc;          /* Number of allocations */
+  sqlite3_int64 nHit;             /* Allocations served from a freelist */
+  sqlite3_int64 nCurrent;         /* Bytes currently allocated */
+  sqlite3_int64 nHighwater;       /* Largest value of nCurrent */
+#ifdef XJD1_ENABLE_THREADS
+  pthread_mutex_t mutex;          /* Protects all fields above */
+  pthread_once_t once;            /* Creates key */
+  pthread_key_t key;              /* The MemsysCache of each thread */
+#else
+  MemsysCache cache;              /* The only cache */
+#endif
+} memsys = {
+  {0}, 0, 0, 0, 0, 0,
+#ifdef XJD1_ENABLE_THREADS
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT
+#endif
+};
+
+#ifdef XJD1_ENABLE_THREADS
+# define memsysEnter()  pthread_mutex_lock(&memsys.mutex)
+# define memsysLeave()  pthread_mutex_unlock(&memsys.mutex)
+#else
+# define memsysEnter()
+# define memsysLeave()
+#endif
+
+/*
+** Return the header of the block that begins at p.
+*/
+#define memsysHdr(p)  ((MemsysHdr*)&((char*)(p))[-MEMSYS_HDR])
+
+/*
+** Add the statistics of cache p to the shared totals. The caller holds
+** the mutex.
+*/
+static void memsysFlush(MemsysCache *p){
+  if( memsys.nCurrent+p->nPeak>memsys.nHighwater ){
+    memsys.nHighwater = memsys.nCurrent + p->nPeak;
+  }
+  memsys.nCurrent += p->nDelta;
+  memsys.nMalloc += p->nMalloc;
+  memsys.nHit += p->nHit;
+  p->nDelta = p->nPeak = p->nMalloc = p->nHit = 0;
+}
+
+/*
+** Record that nByte more bytes are in use. nByte may be negative.
+*/
+static void memsysAccount(MemsysCache *p, int nByte){
+  p->nDelta += nByte;
+  if( p->nDelta>p->nPeak ) p->nPeak = p->nDelta;
+  if( p->nDelta>=MEMSYS_FLUSH || p->nDelta<=-MEMSYS_FLUSH ){
+    memsysEnter();
+    memsysFlush(p);
+    memsysLeave();
+  }
+}
+
+/*
+** Move all the free blocks of cache p of size class iClass, except for
+** nKeep of them, to the shared freelist. The caller holds the mutex.
+*/
+static void memsysSpill(MemsysCache *p, int iClass, int nKeep){
+  while( p->anFree[iClass]>nKeep ){
+    MemsysFree *pFree = p->apFree[iClass];
+    p->apFree[iClass] = pFree->pNext;
+    p->anFree[iClass]--;
+    pFree->pNext = memsys.apFree[iClass];
+    memsys.apFree[iClass] = pFree;
+  }
+}
+
+#ifdef XJD1_ENABLE_THREADS
+/*
+** Give everything held by the cache of a thread that is exiting to the
+** shared lists.
+*/
+static void memsysThreadExit(void *pArg){
+  MemsysCache *p = (MemsysCache*)pArg;
+  int i;
+  memsysEnter();
+  memsysFlush(p);
+  for(i=1; i<=MEMSYS_NCLASS; i++) memsysSpill(p, i, 0);
+  if( p->nSpace>=(int)sizeof(MemsysSpare) ){
+    MemsysSpare *pSpare = (MemsysSpare*)p->pSpace;
+    pSpare->nByte = p->nSpace;
+    pSpare->pNext = memsys.pSpare;
+    memsys.pSpare = pSpare;
+  }
+  memsysLeave();
+  free(p);
+}
+
+static void memsysKeyInit(void){
+  pthread_key_create(&memsys.key, memsysThreadExit);
+}
+
+/*
+** Return the cache of the calling thread, or NULL on OOM.
+*/
+static MemsysCache *memsysCache(void){
+  MemsysCache *p;
+  pthread_once(&memsys.once, memsysKeyInit);
+  p = (MemsysCache*)pthread_getspecific(memsys.key);
+  if( p==0 ){
+    p = malloc(sizeof(*p));
+    if( p==0 ) return 0;
+    memset(p, 0, sizeof(*p));
+    if( pthread_setspecific(memsys.key, p) ){
+      free(p);
+      return 0;
+    }
+  }
+  return p;
+}
+#else
+# define memsysCache()  (&memsys.cache)
+#endif
+
+/*
+** Return a block of size class iClass from cache p, or NULL on OOM.
+*/
+static MemsysHdr *memsysSmall(MemsysCache *p, int iClass){
+  int sz = MEMSYS_HDR + iClass*16;
+  MemsysHdr *pHdr;
+  if( p->apFree[iClass]==0 && p->nSpace<sz ){
+    /* Take free blocks from the shared freelist or, if there are none,
+    ** start another slab. */
+    int i;
+    memsysEnter();
+    memsysFlush(p);
+    for(i=0; i<MEMSYS_BATCH && memsys.apFree[iClass]; i++){
+      MemsysFree *pFree = memsys.apFree[iClass];
+      memsys.apFree[iClass] = pFree->pNext;
+      pFree->pNext = p->apFree[iClass];
+      p->apFree[iClass] = pFree;
+      p->anFree[iClass]++;
+    }
+    if( p->apFree[iClass]==0 && memsys.pSpare ){
+      MemsysSpare *pSpare = memsys.pSpare;
+      memsys.pSpare = pSpare->pNext;
+      p->pSpace = (char*)pSpare;
+      p->nSpace = pSpare->nByte;
+    }
+    memsysLeave();
+    if( p->apFree[iClass]==0 && p->nSpace<sz ){
+      p->pSpace = malloc(MEMSYS_SLAB);
+      if( p->pSpace==0 ){
+        p->nSpace = 0;
+        return 0;
+      }
+      p->nSpace = MEMSYS_SLAB;
+    }
+  }
+  if( p->apFree[iClass] ){
+    MemsysFree *pFree = p->apFree[iClass];
+    p->apFree[iClass] = pFree->pNext;
+    p->anFree[iClass]--;
+    p->nHit++;
+    return memsysHdr(pFree);
+  }
+  pHdr = (MemsysHdr*)p->pSpace;
+  p->pSpace += sz;
+  p->nSpace -= sz;
+  return pHdr;
+}
+
+void *xjd1_memsys_malloc(int N){
+  MemsysCache *p = memsysCache();
+  MemsysHdr *pHdr;
+  if( N<0 || p==0 ) return 0;
+  if( N<=MEMSYS_MX_SMALL ){
+    int iClass = N>0 ? (N+15)/16 : 1;
+    pHdr = memsysSmall(p, iClass);
+    if( pHdr ) pHdr->iClass = iClass;
+  }else{
+    pHdr = malloc(MEMSYS_HDR + N);
+    if( pHdr ) pHdr->iClass = 0;
+  }
+  if( pHdr==0 ) return 0;
+  pHdr->nByte = N;
+  p->nMalloc++;
+  memsysAccount(p, N);
+  return &((char*)pHdr)[MEMSYS_HDR];
+}
+
+void xjd1_memsys_free(void *pOld){
+  MemsysCache *p;
+  MemsysHdr *pHdr;
+  if( pOld==0 ) return;
+  pHdr = memsysHdr(pOld);
+  p = memsysCache();
+  if( p==0 ){
+    /* The thread has no cache. Return the block to the shared lists. */
+    memsysEnter();
+    memsys.nCurrent -= pHdr->nByte;
+    if( pHdr->iClass ){
+      ((MemsysFree*)pOld)->pNext = memsys.apFree[pHdr->iClass];
+      memsys.apFree[pHdr->iClass] = (MemsysFree*)pOld;
+    }
+    memsysLeave();
+    if( pHdr->iClass==0 ) free(pHdr);
+    return;
+  }
+  memsysAccount(p, -pHdr->nByte);
+  if( pHdr->iClass ){
+    int iClass = pHdr->iClass;
+    MemsysFree *pFree = (MemsysFree*)pOld;
+    pFree->pNext = p->apFree[iClass];
+    p->apFree[iClass] = pFree;
+    if( ++p->anFree[iClass]>MEMSYS_MX_CACHE ){
+      memsysEnter();
+      memsysSpill(p, iClass, MEMSYS_MX_CACHE/2);
+      memsysLeave();
+    }
+  }else{
+    free(pHdr);
+  }
+}
+
+void *xjd1_memsys_realloc(void *pOld, int N){
+  MemsysHdr *pHdr;
+  void *pNew;
+  if( pOld==0 ) return xjd1_memsys_malloc(N);
+  pHdr = memsysHdr(pOld);
+  if( pHdr->iClass ? N<=pHdr->iClass*16 : N>MEMSYS_MX_SMALL ){
+    /* The block stays in the same kind of memory */
+    MemsysCache *p = memsysCache();
+    if( p==0 ) return 0;
+    if( pHdr->iClass==0 ){
+      MemsysHdr *pResized = realloc(pHdr, MEMSYS_HDR + N);
+      if( pResized==0 ) return 0;
+      pHdr = pResized;
+    }
+    memsysAccount(p, N - pHdr->nByte);
+    pHdr->nByte = N;
+    return &((char*)pHdr)[MEMSYS_HDR];
+  }
+  pNew = xjd1_memsys_malloc(N);
+  if( pNew ){
+    memcpy(pNew, pOld, pHdr->nByte<N ? pHdr->nByte : N);
+    xjd1_memsys_free(pOld);
+  }
+  return pNew;
+}
+
+/*
+** Report the statistics of the built-in allocator: the number of
+** allocations made, how many of them were served from a freelist, the
+** number of bytes now allocated and the largest number of bytes ever
+** allocated at once.
+**
+** The statistics of the calling thread are exact. Each other thread may
+** have made allocations that are not yet counted, up to MEMSYS_FLUSH
+** bytes of them. The reported high-water mark can be too low by the same
+** amount.
+*/
+void xjd1_memsys_stats(
+  xjd1_int64 *pnMalloc,
+  xjd1_int64 *pnHit,
+  xjd1_int64 *pnCurrent,
+  xjd1_int64 *pnHigh
+){
+  MemsysCache *p = memsysCache();
+  memsysEnter();
+  if( p ) memsysFlush(p);
+  *pnMalloc = memsys.nMalloc;
+  *pnHit = memsys.nHit;
+  *pnCurrent = memsys.nCurrent;
+  *pnHigh = memsys.nHighwater;
+  memsysLeave();
+}
+
 
 /*
 ** Create a new memory allocation pool.  Return a pointer to the
@@ -95,12 +444,30 @@ void xjd1PoolClear(Pool *p){
 }
 
 /*
-** Allocate N bytes of memory from the memory allocation pool.
+** Free all the memory allocations of a pool, except that if the pool
+** has a single chunk it is kept and reused by later allocations.
 */
 #define POOL_CHUNK_SIZE 3000
+void xjd1PoolRewind(Pool *p){
+  int szChunk = p->szChunk ? p->szChunk : POOL_CHUNK_SIZE;
+  PoolChunk *pChunk = p->pChunk;
+  if( pChunk && pChunk->pNext==0 && p->pSpace ){
+    p->pSpace = &((char*)pChunk)[8];
+    p->nSpace = szChunk;
+  }else{
+    szChunk = p->szChunk;
+    xjd1PoolClear(p);
+    p->szChunk = szChunk;
+  }
+}
+
+/*
+** Allocate N bytes of memory from the memory allocation pool.
+*/
 void *xjd1PoolMalloc(Pool *p, int N){
+  int szChunk = p->szChunk ? p->szChunk : POOL_CHUNK_SIZE;
   N = (N+7)&~7;
-  if( N>POOL_CHUNK_SIZE/4 ){
+  if( N>szChunk/4 ){
     PoolChunk *pChunk = xjd1_malloc( N + 8 );
     if( pChunk==0 ) return 0;
     pChunk->pNext = p->pChunk;
@@ -109,13 +476,13 @@ void *xjd1PoolMalloc(Pool *p, int N){
   }else{
     void *x;
     if( p->nSpace<N ){
-      PoolChunk *pChunk = xjd1_malloc( POOL_CHUNK_SIZE + 8 );
+      PoolChunk *pChunk = xjd1_malloc( szChunk + 8 );
       if( pChunk==0 ) return 0;
       pChunk->pNext = p->pChunk;
       p->pChunk = pChunk;
       p->pSpace = (char*)pChunk;
       p->pSpace += 8;
-      p->nSpace = POOL_CHUNK_SIZE;
+      p->nSpace = szChunk;
     }
     x = p->pSpace;
     p->pSpace += N;
@@ -0,0 +1,443 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains code used to convert numbers to and from text.
+**
+** Text is converted to a double by xjd1RealParse(). Most numbers have
+** few enough digits that the decimal significand is exactly representable
+** as a double, and a small enough exponent that the power of ten is too.
+** The result is then a single correctly rounded multiply or divide. Where
+** the compiler has 128-bit integers, longer significands are converted
+** with integer arithmetic. Other numbers are passed to strtod().
+**
+** A double is converted to text by xjd1RealRender(), using the fewest
+** significant digits that convert back to the same double. Integers are
+** written directly. For other values, the 17 significant digits of the
+** exact value are found, and rounded to 15 and then 16 digits until the
+** result converts back to the same double.
+*/
+#include "xjd1Int.h"
+#include <stdio.h>
+#include <float.h>
+#include <math.h>
+
+/*
+** Powers of ten that are exactly representable as doubles.
+*/
+static const double aPow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define MX_POW10   22
+
+/*
+** Integers no larger than REAL_MX_EXACT are exactly representable as
+** doubles.
+*/
+#define REAL_MX_EXACT  ((sqlite3_uint64)1<<53)
+
+#ifdef __SIZEOF_INT128__
+/*
+** Return the number of significant bits in N.
+*/
+static int realBitLen(unsigned __int128 N){
+  sqlite3_uint64 hi = (sqlite3_uint64)(N>>64);
+  if( hi ) return 128 - __builtin_clzll(hi);
+  if( N ) return 64 - __builtin_clzll((sqlite3_uint64)N);
+  return 0;
+}
+
+/*
+** Set *pR to m*10^e10, correctly rounded, and return true, if that can
+** be done using 128-bit integers. Otherwise return false.
+**
+** For e10>=0, m*10^e10 is formed exactly. For e10<0, m is shifted left
+** as far as it goes and divided by 10^-e10, which leaves at least 55
+** bits of quotient and a remainder that says whether anything was lost.
+** The result is then rounded to 53 bits, to nearest and ties to even.
+*/
+static int realExactWide(sqlite3_uint64 m, int e10, double *pR){
+  unsigned __int128 N;
+  sqlite3_uint64 mant;
+  int s = 0;                      /* The value is N*2^-s */
+  int isInexact = 0;              /* True if bits below N are non-zero */
+  int nBit, nDrop;
+
+  if( e10>=0 ){
+    if( e10>19 ) return 0;
+    N = (unsigned __int128)m * (sqlite3_uint64)aPow10[e10];
+  }else{
+    unsigned __int128 P;
+    if( e10<-21 ) return 0;
+    P = (sqlite3_uint64)aPow10[-e10<19 ? -e10 : 19];
+    if( e10<-19 ) P *= (sqlite3_uint64)aPow10[-e10-19];
+    s = 127 - realBitLen(m);
+    N = (unsigned __int128)m << s;
+    isInexact = (N % P)!=0;
+    N /= P;
+  }
+  nBit = realBitLen(N);
+  if( nBit<=53 ){
+    *pR = ldexp((double)(sqlite3_uint64)N, -s);
+    return 1;
+  }
+  nDrop = nBit - 53;
+  mant = (sqlite3_uint64)(N >> nDrop);
+  N -= (unsigned __int128)mant << nDrop;
+  if( N>((unsigned __int128)1<<(nDrop-1)) ){
+    mant++;
+  }else if( N==((unsigned __int128)1<<(nDrop-1)) && (isInexact || (mant&1)) ){
+    mant++;
+  }
+  *pR = ldexp((double)mant, nDrop - s);
+  return 1;
+}
+#endif
+
+/*
+** Set *pR to m*10^e10 and return true if that can be done exactly, that
+** is, with a single correctly rounded multiply or divide of two exactly
+** representable values, or else with 128-bit integers. Otherwise return
+** false.
+*/
+static int realExact(sqlite3_uint64 m, int e10, double *pR){
+  if( m<=REAL_MX_EXACT && e10>=-MX_POW10 ){
+    if( e10<0 ){
+      *pR = (double)m / aPow10[-e10];
+      return 1;
+    }else if( e10<=MX_POW10 ){
+      *pR = (double)m * aPow10[e10];
+      return 1;
+    }else{
+      /* Move the excess of the exponent into the significand, if the
+      ** significand is still exact afterwards. */
+      int eExtra = e10 - MX_POW10;
+      if( eExtra<=15 && m<=REAL_MX_EXACT/(sqlite3_uint64)aPow10[eExtra] ){
+        *pR = (double)(m*(sqlite3_uint64)aPow10[eExtra]) * aPow10[MX_POW10];
+        return 1;
+      }
+    }
+  }
+#ifdef __SIZEOF_INT128__
+  return realExactWide(m, e10, pR);
+#else
+  return 0;
+#endif
+}
+
+/*
+** Convert the n bytes of text at z into a double using strtod(). The
+** text need not be followed by a nul terminator, so it is copied first.
+*/
+static double realParseSlow(const char *z, int n){
+  char zBuf[100];
+  char *zCopy;
+  double r;
+  if( n<(int)sizeof(zBuf) ){
+    memcpy(zBuf, z, n);
+    zBuf[n] = 0;
+    return strtod(zBuf, 0);
+  }
+  zCopy = sqlite3_mprintf("%.*s", n, z);
+  if( zCopy==0 ) return 0.0;
+  r = strtod(zCopy, 0);
+  sqlite3_free(zCopy);
+  return r;
+}
+
+/*
+** Return the double value of the n bytes of number text at z. The text
+** is a number as recognized by the JSON tokenizer or by the tokenizer
+** for statements:
+**
+**     [-][digits][.digits][(e|E)[+|-]digits]
+*/
+double xjd1RealParse(const char *z, int n){
+  sqlite3_uint64 m = 0;           /* Decimal significand */
+  int nDigit = 0;                 /* Significant digits in m */
+  int e10 = 0;                    /* Decimal exponent */
+  int isNeg = 0;
+  int i = 0;
+  double r;
+
+  if( i<n && (z[i]=='-' || z[i]=='+') ){
+    isNeg = z[i]=='-';
+    i++;
+  }
+  for(; i<n && xjd1Isdigit(z[i]); i++){
+    if( nDigit<19 ){
+      m = m*10 + (z[i]-'0');
+      if( m ) nDigit++;
+    }else{
+      if( z[i]!='0' ) return realParseSlow(z, n);
+      e10++;
+    }
+  }
+  if( i<n && z[i]=='.' ){
+    for(i++; i<n && xjd1Isdigit(z[i]); i++){
+      if( nDigit<19 ){
+        m = m*10 + (z[i]-'0');
+        if( m ) nDigit++;
+        e10--;
+      }else if( z[i]!='0' ){
+        return realParseSlow(z, n);
+      }
+    }
+  }
+  if( i<n && (z[i]=='e' || z[i]=='E') ){
+    int eSign = 1;
+    int x = 0;
+    i++;
+    if( i<n && (z[i]=='-' || z[i]=='+') ){
+      if( z[i]=='-' ) eSign = -1;
+      i++;
+    }
+    for(; i<n && xjd1Isdigit(z[i]); i++){
+      if( x<10000 ) x = x*10 + (z[i]-'0');
+    }
+    e10 += eSign*x;
+  }
+  if( i<n ) return realParseSlow(z, n);
+  if( m==0 ){
+    r = 0.0;
+  }else if( realExact(m, e10, &r)==0 ){
+    return realParseSlow(z, n);
+  }
+  return isNeg ? -r : r;
+}
+
+/*
+** Return true if m*10^e10 converts to the double r.
+*/
+static int realIsEqual(sqlite3_uint64 m, int e10, double r){
+  char zBuf[40];
+  double x;
+  if( realExact(m, e10, &x) ) return x==r;
+  sqlite3_snprintf(sizeof(zBuf), zBuf, "%llue%d", m, e10);
+  return strtod(zBuf, 0)==r;
+}
+
+/*
+** Write the decimal digits of m to zOut, without a terminator. Return
+** the number of digits written.
+*/
+static int realPutDigits(char *zOut, sqlite3_uint64 m){
+  static const char zPair[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+  char zTmp[24];
+  int i = sizeof(zTmp);
+  int n;
+  while( m>=100 ){
+    int d = (int)(m%100)*2;
+    m /= 100;
+    zTmp[--i] = zPair[d+1];
+    zTmp[--i] = zPair[d];
+  }
+  if( m>=10 ){
+    zTmp[--i] = zPair[m*2+1];
+    zTmp[--i] = zPair[m*2];
+  }else{
+    zTmp[--i] = (char)('0' + m);
+  }
+  n = sizeof(zTmp) - i;
+  memcpy(zOut, &zTmp[i], n);
+  return n;
+}
+
+/*
+** Return the 17 significant digits of the positive double r, correctly
+** rounded, as an integer. Write the exponent of the first digit to *pExp.
+**
+** Where the compiler has a 128-bit integer type, a double in the range
+** [1e-5, 1e19) is written exactly as m*2^q, with m<2^53. The digits of
+** m*2^q*10^k, for k chosen so that there are 17 of them, are found using
+** integer arithmetic with no more than 127 bits. Other values are printed
+** with snprintf(). Not with sqlite3_snprintf(), which does not compute
+** more than 16 significant digits.
+*/
+static sqlite3_uint64 realDigits17(double r, int *pExp){
+  static const sqlite3_uint64 mn17 = 10000000000000000ULL;   /* 10^16 */
+  sqlite3_uint64 D = 0;
+  char zBuf[40];
+  int i;
+#ifdef __SIZEOF_INT128__
+  if( r>=1e-5 && r<1e19 ){
+    unsigned __int128 N, Q;
+    sqlite3_uint64 x, m;
+    int q, e, k;
+    memcpy(&x, &r, sizeof(x));
+    m = (x & (((sqlite3_uint64)1<<52)-1)) | ((sqlite3_uint64)1<<52);
+    q = (int)((x>>52) & 0x7ff) - 1075;
+    e = (int)floor(log10(r));
+    while( 1 ){
+      k = 16 - e;
+      if( q>=0 ){
+        /* r is an integer of up to 20 digits */
+        N = (unsigned __int128)m << q;
+        if( k>=0 ){
+          Q = N * (sqlite3_uint64)aPow10[k];
+        }else{
+          unsigned __int128 P = (sqlite3_uint64)aPow10[-k];
+          Q = N / P;
+          N -= Q*P;
+          if( N*2>P || (N*2==P && (Q&1)) ) Q++;
+        }
+      }else{
+        unsigned __int128 half = (unsigned __int128)1 << (-q-1);
+        N = (unsigned __int128)m * (sqlite3_uint64)aPow10[k<19 ? k : 19];
+        if( k>19 ) N *= (sqlite3_uint64)aPow10[k-19];
+        Q = N >> -q;
+        N -= Q << -q;
+        if( N>half || (N==half && (Q&1)) ) Q++;
+      }
+      if( Q<mn17 ){
+        e--;
+      }else if( Q>mn17*10 ){
+        e++;
+      }else{
+        break;
+      }
+    }
+    D = (sqlite3_uint64)Q;
+    if( D==mn17*10 ){
+      D = mn17;
+      e++;
+    }
+    *pExp = e;
+    return D;
+  }
+#endif
+  snprintf(zBuf, sizeof(zBuf), "%.16e", r);
+  for(i=0; zBuf[i]!='e'; i++){
+    if( zBuf[i]!='.' ) D = D*10 + (zBuf[i]-'0');
+  }
+  *pExp = atoi(&zBuf[i+1]);
+  return D;
+}
+
+/*
+** Find the shortest decimal that converts back to the positive, finite,
+** double r. Write its significant digits to zDigit, without trailing
+** zeros or a terminator, and the exponent of the first digit to *pExp.
+** Return the number of digits.
+*/
+static int realShortest(double r, char *zDigit, int *pExp){
+  sqlite3_uint64 D;
+  int nDigit;
+  int e;
+
+  /* Find the 17 significant digits of r, which always convert back to
+  ** r, and try them rounded to 15 and then 16 digits. Any decimal of 15
+  ** or fewer digits that converts back to r is what r rounds to at 15
+  ** digits, so the first that converts back is the shortest. That is
+  ** not so for subnormal numbers, which have fewer bits of precision, so
+  ** they start from a single digit.
+  **
+  ** Rounding the 17 digits again gives the same result as rounding r,
+  ** unless the digits dropped are exactly half a unit. Then r itself
+  ** may be on either side, so it is rounded by snprintf() instead. */
+  D = realDigits17(r, &e);
+  for(nDigit=(r<DBL_MIN ? 1 : 15); nDigit<17; nDigit++){
+    sqlite3_uint64 p = (sqlite3_uint64)aPow10[17-nDigit];
+    sqlite3_uint64 m = D/p;
+    sqlite3_uint64 rem = D%p;
+    int eDigit = e;
+    if( rem*2==p ){
+      /* Half a unit is dropped, so r may round either way */
+      char zBuf[40];
+      int i;
+      snprintf(zBuf, sizeof(zBuf), "%.*e", nDigit-1, r);
+      for(i=0, m=0; zBuf[i]!='e'; i++){
+        if( zBuf[i]!='.' ) m = m*10 + (zBuf[i]-'0');
+      }
+      eDigit = atoi(&zBuf[i+1]);
+    }else{
+      if( rem*2>p ) m++;
+      if( m==(sqlite3_uint64)aPow10[nDigit] ){
+        m /= 10;
+        eDigit++;
+      }
+    }
+    if( realIsEqual(m, eDigit-nDigit+1, r) ){
+      D = m;
+      e = eDigit;
+      break;
+    }
+  }
+  while( D%10==0 ) D /= 10;
+  *pExp = e;
+  return realPutDigits(zDigit, D);
+}
+
+/*
+** Append the shortest text that converts back to r to pOut. Values
+** with an exponent below -4 or above 16 are written in exponential
+** notation, like "%.17g".
+*/
+void xjd1RealRender(String *pOut, double r){
+  char zOut[40];
+  char zDigit[24];
+  int nDigit;
+  int e;
+  int n = 0;
+  int i;
+
+  if( r!=r || r-r!=0.0 ){
+    /* NaN or an infinity */
+    xjd1StringAppendF(pOut, "%.17g", r);
+    return;
+  }
+  if( r<0.0 ){
+    zOut[n++] = '-';
+    r = -r;
+  }
+  if( r<(double)REAL_MX_EXACT && r==(double)(sqlite3_uint64)r ){
+    /* An integer, including zero */
+    n += realPutDigits(&zOut[n], (sqlite3_uint64)r);
+    xjd1StringAppend(pOut, zOut, n);
+    return;
+  }
+
+  nDigit = realShortest(r, zDigit, &e);
+  if( e<-4 || e>16 ){
+    zOut[n++] = zDigit[0];
+    if( nDigit>1 ){
+      zOut[n++] = '.';
+      memcpy(&zOut[n], &zDigit[1], nDigit-1);
+      n += nDigit-1;
+    }
+    zOut[n++] = 'e';
+    zOut[n++] = e<0 ? '-' : '+';
+    if( e<0 ) e = -e;
+    if( e<10 ) zOut[n++] = '0';
+    n += realPutDigits(&zOut[n], (sqlite3_uint64)e);
+  }else if( e<0 ){
+    zOut[n++] = '0';
+    zOut[n++] = '.';
+    for(i=e+1; i<0; i++) zOut[n++] = '0';
+    memcpy(&zOut[n], zDigit, nDigit);
+    n += nDigit;
+  }else{
+    for(i=0; i<=e || i<nDigit; i++){
+      if( i==e+1 ) zOut[n++] = '.';
+      zOut[n++] = i<nDigit ? zDigit[i] : '0';
+    }
+  }
+  xjd1StringAppend(pOut, zOut, n);
+}
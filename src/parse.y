@@ -73,16 +73,18 @@ input ::= cmd(X) SEMI.   {p->pCmd = X;}
     JsonNode *pNew = xjd1JsonNew(p->pPool);
     if( pNew ){
       pNew->eJType = XJD1_REAL;
-      pNew->u.r = atof(pTok->z);
+      pNew->u.r = xjd1RealParse(pTok->z, pTok->n);
     }
     return pNew;
   }
 
-  /* Convert a token into a zero-terminated string */
+  /* Convert a token into a zero-terminated string. The string is made
+  ** a label, so that it may be used as one whether or not it is
+  ** interned later. See xjd1LabelNew(). */
   static char *tokenStr(Parse *p, Token *pTok){
     char *z;
     if( pTok ){
-      z = xjd1PoolDup(p->pPool, pTok->z, pTok->n);
+      z = xjd1LabelNew(p->pPool, 0, pTok->z, pTok->n);
       if( z && z[0]=='"' ) xjd1DequoteString(z, pTok->n);
     }else{
       z = 0;
@@ -589,12 +591,13 @@ cmd ::= COMMIT ID.
 
 ///////////////////// The CREATE COLLECTION statement ////////////////////////
 //
-cmd(A) ::= CREATE COLLECTION ifnotexists(B) tabname(N). {
-  Command *pNew = xjd1PoolMalloc(p->pPool, sizeof(*pNew));
+cmd(A) ::= CREATE COLLECTION ifnotexists(B) tabname(N) options_opt(O). {
+  Command *pNew = xjd1PoolMallocZero(p->pPool, sizeof(*pNew));
   if( pNew ){
     pNew->eCmdType = TK_CREATECOLLECTION;
     pNew->u.crtab.ifExists = B;
     pNew->u.crtab.zName = tokenStr(p, &N);
+    pNew->u.crtab.pOptions = O;
   }
   A = pNew;
 }
@@ -602,6 +605,9 @@ cmd(A) ::= CREATE COLLECTION ifnotexists(B) tabname(N). {
 ifnotexists(A) ::= .                    {A = 0;}
 ifnotexists(A) ::= IF NOT EXISTS.       {A = 1;}
 tabname(A) ::= ID(X).                   {A = X;}
+%type options_opt {Expr*}
+options_opt(A) ::= .                    {A = 0;}
+options_opt(A) ::= OPTIONS expr(X).     {A = X;}
 
 ////////////////////////// The DROP COLLECTION ///////////////////////////////
 //
@@ -618,6 +624,32 @@ cmd(A) ::= DROP COLLECTION ifexists(B) tabname(N). {
 ifexists(A) ::= IF EXISTS.  {A = 1;}
 ifexists(A) ::= .           {A = 0;}
 
+///////////////////// The CREATE INDEX statement /////////////////////////////
+//
+cmd(A) ::= CREATE INDEX ifnotexists(B) ID(I) ON tabname(N) LP path(X) RP. {
+  Command *pNew = xjd1PoolMallocZero(p->pPool, sizeof(*pNew));
+  if( pNew ){
+    pNew->eCmdType = TK_CREATEINDEX;
+    pNew->u.crix.ifExists = B;
+    pNew->u.crix.zName = tokenStr(p, &I);
+    pNew->u.crix.zColl = tokenStr(p, &N);
+    pNew->u.crix.pPath = X;
+  }
+  A = pNew;
+}
+
+////////////////////////// The DROP INDEX ////////////////////////////////////
+//
+cmd(A) ::= DROP INDEX ifexists(B) ID(I). {
+  Command *pNew = xjd1PoolMallocZero(p->pPool, sizeof(*pNew));
+  if( pNew ){
+    pNew->eCmdType = TK_DROPINDEX;
+    pNew->u.crix.ifExists = B;
+    pNew->u.crix.zName = tokenStr(p, &I);
+  }
+  A = pNew;
+}
+
 
 /////////////////////////// The DELETE statement /////////////////////////////
 //
@@ -0,0 +1,281 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains code used to push terms of a WHERE clause down into
+** the SQL statements that scan collections, so that documents which
+** cannot match are rejected by SQLite before they are parsed.
+**
+** A term of the form "<path> <op> <literal>" is translated into a call
+** to the xjd1_compare() SQL function:
+**
+**     xjd1_compare(OP, TYPE, VALUE, x, LABEL1, LABEL2, ...)
+**
+** OP is the comparison operator as text and TYPE is the JSON type of the
+** literal (one of the XJD1_* type codes). VALUE is the text of a string
+** literal, the IEEE-754 bit pattern of a numeric literal as an integer
+** (so that the value survives the trip through SQL exactly), or NULL.
+**
+** The function extracts the value at the path LABEL1.LABEL2... from
+** document x, in either storage format, without decoding the rest of the
+** document, and compares it against the literal exactly as the expression
+** evaluator would. A LABEL that is an SQL integer rather than text is a
+** constant subscript, as in "c.a[2]". If a subscript is applied to a
+** string, the function returns true and leaves the test to the WHERE
+** clause.
+*/
+#include "xjd1Int.h"
+
+/*
+** Maximum number of labels in a path that can be pushed down.
+*/
+#define PUSHDOWN_MX_PATH 20
+
+/*
+** Implementation of the xjd1_compare() SQL function.
+*/
+static void compareFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  const char *zOp = (const char*)sqlite3_value_text(argv[0]);
+  const char *azPath[PUSHDOWN_MX_PATH];
+  int aiPath[PUSHDOWN_MX_PATH];
+  JsonNode sLit;
+  JsonNode sNull;
+  JsonNode *pVal = 0;
+  int nPath = argc-4;
+  int bUnknown = 0;
+  int i, c;
+
+  if( zOp==0 || nPath<1 || nPath>PUSHDOWN_MX_PATH ){
+    sqlite3_result_error(context, "bad arguments to xjd1_compare()", -1);
+    return;
+  }
+  memset(&sLit, 0, sizeof(sLit));
+  memset(&sNull, 0, sizeof(sNull));
+  sNull.eJType = XJD1_NULL;
+  sLit.eJType = sqlite3_value_int(argv[1]);
+  if( sLit.eJType==XJD1_REAL ){
+    sqlite3_int64 iBits = sqlite3_value_int64(argv[2]);
+    memcpy(&sLit.u.r, &iBits, sizeof(sLit.u.r));
+  }else if( sLit.eJType==XJD1_STRING ){
+    sLit.u.z = (char*)sqlite3_value_text(argv[2]);
+  }
+  for(i=0; i<nPath; i++){
+    if( sqlite3_value_type(argv[i+4])==SQLITE_INTEGER ){
+      aiPath[i] = sqlite3_value_int(argv[i+4]);
+    }else{
+      aiPath[i] = -1;
+    }
+    azPath[i] = (const char*)sqlite3_value_text(argv[i+4]);
+    if( azPath[i]==0 ) azPath[i] = "";
+  }
+
+  if( sqlite3_value_type(argv[3])==SQLITE_BLOB ){
+    pVal = xjd1StorageExtract(sqlite3_value_blob(argv[3]),
+                              sqlite3_value_bytes(argv[3]), nPath, azPath,
+                              aiPath, &bUnknown);
+  }else{
+    const char *zDoc = (const char*)sqlite3_value_text(argv[3]);
+    if( zDoc ) pVal = xjd1JsonExtract(zDoc, sqlite3_value_bytes(argv[3]),
+                                      nPath, azPath, aiPath, &bUnknown);
+  }
+  if( bUnknown ){
+    sqlite3_result_int(context, 1);
+    return;
+  }
+  c = xjd1JsonCompare(pVal ? pVal : &sNull, &sLit, 0);
+  xjd1JsonFree(pVal);
+
+  switch( zOp[0] ){
+    case '=': c = c==0;                          break;
+    case '!': c = c!=0;                          break;
+    case '<': c = (zOp[1]=='=' ? c<=0 : c<0);    break;
+    default:  c = (zOp[1]=='=' ? c>=0 : c>0);    break;
+  }
+  sqlite3_result_int(context, c);
+}
+
+/*
+** Append text generated by sqlite3_mprintf() to pOut.  The SQL quoting
+** conversions %Q and %w are not available from xjd1StringAppendF().
+*/
+static void appendSql(String *pOut, const char *zFormat, ...){
+  va_list ap;
+  char *z;
+  va_start(ap, zFormat);
+  z = sqlite3_vmprintf(zFormat, ap);
+  va_end(ap);
+  xjd1StringAppend(pOut, z, -1);
+  sqlite3_free(z);
+}
+
+/*
+** Register the SQL functions used by pushed-down WHERE terms with
+** database connection db.
+*/
+int xjd1PushdownRegister(sqlite3 *db){
+  int rc;
+  rc = sqlite3_create_function(db, "xjd1_compare", -1, SQLITE_UTF8, 0,
+                               compareFunc, 0, 0);
+  return rc==SQLITE_OK ? XJD1_OK : XJD1_ERROR;
+}
+
+/*
+** Return true if pId refers to the document read by data source pSrc.
+** If pSrc is NULL, return true if pId refers to the document being
+** modified by an UPDATE or DELETE statement.
+*/
+int xjd1PushdownIsDoc(Expr *pId, DataSrc *pSrc){
+  if( pId->eType!=TK_ID ) return 0;
+  if( pSrc==0 ) return pId->u.id.pQuery==0;
+  return pId->u.id.pQuery==pSrc->pQuery
+      && pId->u.id.iDatasrc>0
+      && xjd1DataSrcLeaf(pSrc->pQuery->u.simple.pFrom,
+                         pId->u.id.iDatasrc)==pSrc;
+}
+
+/*
+** If expression p is a path of one or more labels and constant integer
+** subscripts applied to the document identified by pSrc (see
+** xjd1PushdownIsDoc()), append the labels to pOut as a list of SQL
+** string literals, and the subscripts as SQL integers, and return the
+** number of steps in the path. Otherwise, return 0.
+*/
+static int pushdownPath(String *pOut, Expr *p, DataSrc *pSrc){
+  Expr *pLeft;
+  int n;
+  if( p->eType==TK_DOT ){
+    pLeft = p->u.lvalue.pLeft;
+  }else if( p->eType==TK_LB ){
+    JsonNode *pIdx;
+    if( p->u.bi.pRight->eType!=TK_JVALUE ) return 0;
+    pIdx = p->u.bi.pRight->u.json.p;
+    if( pIdx->eJType!=XJD1_REAL
+     || !(pIdx->u.r>=0.0 && pIdx->u.r<=2147483647.0)
+     || (double)(int)pIdx->u.r!=pIdx->u.r
+    ){
+      return 0;
+    }
+    pLeft = p->u.bi.pLeft;
+  }else{
+    return 0;
+  }
+  if( pLeft->eType==TK_DOT || pLeft->eType==TK_LB ){
+    n = pushdownPath(pOut, pLeft, pSrc);
+    if( n==0 || n>=PUSHDOWN_MX_PATH ) return 0;
+  }else if( xjd1PushdownIsDoc(pLeft, pSrc) ){
+    n = 0;
+  }else{
+    return 0;
+  }
+  if( p->eType==TK_DOT ){
+    appendSql(pOut, ",%Q", p->u.lvalue.zId);
+  }else{
+    appendSql(pOut, ",%d", (int)p->u.bi.pRight->u.json.p->u.r);
+  }
+  return n+1;
+}
+
+/*
+** Append the translation of WHERE clause term p to pOut, preceded by
+** " AND " if pOut is not empty. Terms that cannot be translated are
+** ignored.
+*/
+static void pushdownTerm(String *pOut, Expr *p, DataSrc *pSrc){
+  const char *zOp;
+  Expr *pPath;
+  JsonNode *pLit;
+  String path;
+
+  switch( p->eType ){
+    case TK_AND:
+      pushdownTerm(pOut, p->u.bi.pLeft, pSrc);
+      pushdownTerm(pOut, p->u.bi.pRight, pSrc);
+      return;
+    case TK_EQEQ: zOp = "==";  break;
+    case TK_NE:   zOp = "!=";  break;
+    case TK_LT:   zOp = "<";   break;
+    case TK_LE:   zOp = "<=";  break;
+    case TK_GT:   zOp = ">";   break;
+    case TK_GE:   zOp = ">=";  break;
+    default:      return;
+  }
+
+  /* Normalize the comparison so that the path is on the left. */
+  pPath = p->u.bi.pLeft;
+  if( p->u.bi.pRight->eType==TK_JVALUE ){
+    pLit = p->u.bi.pRight->u.json.p;
+  }else if( pPath->eType==TK_JVALUE ){
+    pLit = pPath->u.json.p;
+    pPath = p->u.bi.pRight;
+    switch( p->eType ){
+      case TK_LT: zOp = ">";  break;
+      case TK_LE: zOp = ">="; break;
+      case TK_GT: zOp = "<";  break;
+      case TK_GE: zOp = "<="; break;
+    }
+  }else{
+    return;
+  }
+  if( pLit->eJType==XJD1_ARRAY || pLit->eJType==XJD1_STRUCT ) return;
+
+  xjd1StringInit(&path, 0, 0);
+  if( pushdownPath(&path, pPath, pSrc) ){
+    if( xjd1StringLen(pOut) ) xjd1StringAppend(pOut, " AND ", 5);
+    appendSql(pOut, "xjd1_compare('%s',%d,", zOp, pLit->eJType);
+    switch( pLit->eJType ){
+      case XJD1_REAL: {
+        sqlite3_int64 iBits;
+        memcpy(&iBits, &pLit->u.r, sizeof(iBits));
+        appendSql(pOut, "%lld", iBits);
+        break;
+      }
+      case XJD1_STRING:
+        appendSql(pOut, "%Q", pLit->u.z);
+        break;
+      default:
+        xjd1StringAppend(pOut, "NULL", 4);
+        break;
+    }
+    appendSql(pOut, ",x%s)", xjd1StringText(&path));
+  }
+  xjd1StringClear(&path);
+}
+
+/*
+** Return an SQL expression, obtained from sqlite3_mprintf(), that is
+** true for every document read by data source pSrc (or modified by the
+** current UPDATE or DELETE if pSrc is NULL) for which WHERE clause
+** pWhere might be true. Return NULL if no part of the WHERE clause can
+** be pushed down.
+**
+** The WHERE clause must still be evaluated against every document that
+** the SQL expression accepts.
+*/
+char *xjd1PushdownWhere(Expr *pWhere, DataSrc *pSrc){
+  String sql;
+  char *zRet = 0;
+  if( pWhere==0 ) return 0;
+  xjd1StringInit(&sql, 0, 0);
+  pushdownTerm(&sql, pWhere, pSrc);
+  if( xjd1StringLen(&sql) ){
+    zRet = sqlite3_mprintf("%s", xjd1StringText(&sql));
+  }
+  xjd1StringClear(&sql);
+  return zRet;
+}
@@ -22,18 +22,219 @@
 struct ResultItem {
   JsonNode **apKey;               /* Array of JSON objects */
   ResultItem *pNext;              /* Next element in list */
+  int nSortKey;                   /* Size of aSortKey[] in bytes */
+  unsigned char *aSortKey;        /* Sort key. See buildSortKey() */
 };
 
+/*
+** When the items of a ResultList use more than XJD1_CONFIG_SORTBUFFER
+** bytes of memory, they are sorted and written to a temporary table as
+** a run. Once all items have been added, the runs are merged. Items are
+** read from the runs as they are needed, so that the pItem list holds
+** only the current item and the one after it.
+*/
+struct ResultSpill {
+  sqlite3_stmt *pWrite;           /* Writes an item to the temporary table */
+  int isMerging;                  /* True once the last run is written */
+  int nRun;                       /* Number of runs */
+  struct ResultRun {
+    sqlite3_int64 iRun;           /* Value of the "run" column */
+    sqlite3_stmt *pRead;          /* Reads the items of the run in order */
+    ResultItem *pHead;            /* Next item of the run, or NULL */
+  } *aRun;
+};
+
+/*
+** Prepare ResultList pList to hold items of nKey values each. The items
+** are sorted according to pEList, or on their first value if pEList is
+** NULL. If pConn is not NULL, sorted runs are written to a temporary
+** table as the memory limit of pConn is reached.
+*/
+static int initResultList(
+  ResultList *pList,              /* List to initialize */
+  int nKey,                       /* Number of values in each item */
+  ExprList *pEList,               /* Sort order */
+  xjd1 *pConn                     /* Connection, or NULL to never spill */
+){
+  memset(pList, 0, sizeof(ResultList));
+  pList->pPool = xjd1PoolNew();
+  if( !pList->pPool ) return XJD1_NOMEM;
+  pList->nKey = nKey;
+  pList->pEList = pEList;
+  pList->pConn = pConn;
+  xjd1StringInit(&pList->sortKey, 0, 0);
+  return XJD1_OK;
+}
+
+static void freeResultListItem(ResultList *pList, ResultItem *pItem){
+  int i;
+  for(i=0; i<pList->nKey; i++){
+    xjd1JsonFree(pItem->apKey[i]);
+  }
+  xjd1_free(pItem);
+}
+
+/*
+** Write the sort key of an item with values apKey[] to pList->sortKey.
+** The sort keys of the values sorted on are appended one after another,
+** inverted for DESC, so that items sort in the order of their sort keys
+** compared with memcmp().
+*/
+static void buildSortKey(ResultList *pList, JsonNode **apKey){
+  ExprList *pEList = pList->pEList;
+  xjd1StringTruncate(&pList->sortKey);
+  if( pEList ){
+    int i;
+    for(i=0; i<pEList->nEItem; i++){
+      char const *zDir = pEList->apEItem[i].zAs;
+      xjd1JsonSortKey(&pList->sortKey, apKey[i], zDir && zDir[0]=='D');
+    }
+  }else if( pList->nKey>0 ){
+    xjd1JsonSortKey(&pList->sortKey, apKey[0], 0);
+  }
+}
+
+/*
+** Allocate a new item for pList, holding values apKey[] and the sort key
+** in pList->sortKey. The item takes ownership of the values.
+*/
+static ResultItem *newResultListItem(ResultList *pList, JsonNode **apKey){
+  int nSortKey = xjd1StringLen(&pList->sortKey);
+  int nByte = sizeof(ResultItem) + sizeof(JsonNode*) * pList->nKey + nSortKey;
+  ResultItem *pNew = (ResultItem *)xjd1_malloc(nByte);
+  if( pNew ){
+    pNew->apKey = (JsonNode **)&pNew[1];
+    pNew->pNext = 0;
+    pNew->nSortKey = nSortKey;
+    pNew->aSortKey = (unsigned char *)&pNew->apKey[pList->nKey];
+    memcpy(pNew->apKey, apKey, pList->nKey * sizeof(JsonNode *));
+    if( nSortKey ){
+      memcpy(pNew->aSortKey, xjd1StringText(&pList->sortKey), nSortKey);
+    }
+  }
+  return pNew;
+}
+
+/*
+** The items of a ResultList share equal strings of no more than
+** XJD1_CONFIG_INTERNSTRINGS bytes. The strings seen so far are kept in
+** the open-addressing hash table pList->apStr[], which holds at most
+** RESULT_MX_STR strings.
+*/
+#define RESULT_MX_STR 4096
+
+/*
+** Return a hash of string z.
+*/
+static unsigned int resultStrHash(const char *z){
+  unsigned int h = 0;
+  while( *z ) h = (h ^ (unsigned char)*(z++))*16777619;
+  return h;
+}
+
+/*
+** Return the slot of pList->apStr[] that holds a string equal to z, or
+** the empty slot where it would be added. Return NULL if the string is
+** not there and there is no room to add it.
+*/
+static JsonNode **resultStrFind(ResultList *pList, const char *z){
+  int i;
+  if( pList->nStr*2>=pList->nStrSlot ){
+    int nNew = pList->nStrSlot ? pList->nStrSlot*2 : 64;
+    JsonNode **apNew;
+    if( pList->nStr>=RESULT_MX_STR ) return 0;
+    apNew = xjd1MallocZero(nNew*sizeof(JsonNode*));
+    if( apNew==0 ) return 0;
+    for(i=0; i<pList->nStrSlot; i++){
+      JsonNode *pStr = pList->apStr[i];
+      if( pStr ){
+        int j = resultStrHash(pStr->u.z) & (nNew-1);
+        while( apNew[j] ) j = (j+1) & (nNew-1);
+        apNew[j] = pStr;
+      }
+    }
+    xjd1_free(pList->apStr);
+    pList->apStr = apNew;
+    pList->nStrSlot = nNew;
+  }
+  i = resultStrHash(z) & (pList->nStrSlot-1);
+  while( pList->apStr[i] && strcmp(pList->apStr[i]->u.z, z)!=0 ){
+    i = (i+1) & (pList->nStrSlot-1);
+  }
+  return &pList->apStr[i];
+}
+
+/*
+** Replace the short strings within *ppVal with references to equal
+** strings held by earlier items of pList. Only values that no other
+** object refers to are changed. Return the number of bytes of memory
+** released.
+*/
+static int resultShareStrings(ResultList *pList, JsonNode **ppVal){
+  JsonNode *p = *ppVal;
+  int nByte = 0;
+  if( p==0 || p->nRef!=1 ) return 0;
+  switch( p->eJType ){
+    case XJD1_STRING: {
+      int n = xjd1Strlen30(p->u.z);
+      JsonNode **pp;
+      if( n>pList->pConn->mxInternString ) break;
+      pp = resultStrFind(pList, p->u.z);
+      if( pp==0 ) break;
+      if( *pp ){
+        *ppVal = xjd1JsonRef(*pp);
+        xjd1JsonFree(p);
+        nByte = sizeof(JsonNode) + n + 1;
+      }else{
+        *pp = xjd1JsonRef(p);
+        pList->nStr++;
+      }
+      break;
+    }
+    case XJD1_ARRAY: {
+      int i;
+      for(i=0; i<p->u.ar.nElem; i++){
+        nByte += resultShareStrings(pList, &p->u.ar.apElem[i]);
+      }
+      break;
+    }
+    case XJD1_STRUCT: {
+      JsonStructElem *pElem;
+      for(pElem=p->u.st.pFirst; pElem; pElem=pElem->pNext){
+        nByte += resultShareStrings(pList, &pElem->pValue);
+      }
+      break;
+    }
+  }
+  return nByte;
+}
+
+/*
+** Release the strings in pList->apStr[].
+*/
+static void clearResultStrings(ResultList *pList){
+  int i;
+  for(i=0; i<pList->nStrSlot; i++){
+    xjd1JsonFree(pList->apStr[i]);
+  }
+  xjd1_free(pList->apStr);
+  pList->apStr = 0;
+  pList->nStr = 0;
+  pList->nStrSlot = 0;
+}
+
+static int spillResultList(ResultList*);
+
 static int addToResultList(
   ResultList *pList,              /* List to append to */
   JsonNode **apKey                /* Array of values to add to list */
 ){
   ResultItem *pNew;               /* Newly allocated ResultItem */
-  int nByte;                      /* Bytes to allocate for new node */
+  int nShared = 0;                /* Bytes released by sharing strings */
   int i;                          /* Used to iterate through apKey[] */
 
-  nByte = sizeof(ResultItem) + sizeof(JsonNode*) * pList->nKey;
-  pNew = (ResultItem *)xjd1PoolMalloc(pList->pPool, nByte);
+  buildSortKey(pList, apKey);
+  pNew = newResultListItem(pList, apKey);
   if( !pNew ){
     for(i=0; i<pList->nKey; i++){
       xjd1JsonFree(apKey[i]);
@@ -41,115 +242,456 @@ static int addToResultList(
     return XJD1_NOMEM;
   }
 
-  pNew->apKey = (JsonNode **)&pNew[1];
-  memcpy(pNew->apKey, apKey, pList->nKey * sizeof(JsonNode *));
   pNew->pNext = pList->pItem;
   pList->pItem = pNew;
+  for(i=0; i<pList->nKey; i++){
+    pNew->apKey[i] = xjd1JsonPromote(pNew->apKey[i]);
+  }
 
-  return XJD1_OK;
-}
-
-static int cmpResultItem(ResultItem *p1, ResultItem *p2, ExprList *pEList){
-  int i;
-  int c = 0;
-  int nEItem = (pEList ? pEList->nEItem : 1);
-  for(i=0; i<nEItem; i++){
-    if( 0!=(c=xjd1JsonCompare(p1->apKey[i], p2->apKey[i], 0)) ) break;
+  if( pList->pConn && pList->pConn->mxInternString>0 ){
+    for(i=0; i<pList->nKey; i++){
+      nShared += resultShareStrings(pList, &pNew->apKey[i]);
+    }
   }
-  if( c && pEList ){
-    char const *zDir = pEList->apEItem[i].zAs;
-    if( zDir && zDir[0]=='D' ){
-      c = c*-1;
+  if( pList->pConn && pList->pConn->mxSortBuffer>=0 ){
+    pList->nByte += sizeof(ResultItem) + sizeof(JsonNode*) * pList->nKey;
+    pList->nByte += pNew->nSortKey;
+    for(i=0; i<pList->nKey; i++){
+      pList->nByte += xjd1JsonSizeof(pNew->apKey[i]);
+    }
+    pList->nByte -= nShared;
+    if( pList->nByte>pList->pConn->mxSortBuffer ){
+      return spillResultList(pList);
     }
   }
+  return XJD1_OK;
+}
+
+/*
+** Compare the sort keys of two items.
+*/
+static int cmpResultItem(ResultItem *p1, ResultItem *p2){
+  int n = p1->nSortKey<p2->nSortKey ? p1->nSortKey : p2->nSortKey;
+  int c = memcmp(p1->aSortKey, p2->aSortKey, n);
+  if( c==0 ) c = p1->nSortKey - p2->nSortKey;
   return c;
 }
 
-static ResultItem *mergeResultItems(
-  ExprList *pEList,              /* Used for ASC/DESC of each key */
-  ResultItem *p1,                /* First list to merge */
-  ResultItem *p2                 /* Second list to merge */
+/*
+** An entry in the array sorted by sortResultItems(). iPrefix holds the
+** first 8 bytes of the sort key of the item, so that most comparisons
+** do not need to look at the item itself.
+*/
+typedef struct SortEntry SortEntry;
+struct SortEntry {
+  sqlite3_uint64 iPrefix;         /* First 8 bytes of the sort key */
+  ResultItem *pItem;              /* The item */
+};
+
+/*
+** Compare two entries of the sorted array.
+*/
+static int cmpSortEntry(SortEntry *p1, SortEntry *p2){
+  if( p1->iPrefix!=p2->iPrefix ) return p1->iPrefix<p2->iPrefix ? -1 : 1;
+  return cmpResultItem(p1->pItem, p2->pItem);
+}
+
+/*
+** Write entries iStart to iEnd-1 of the merge of sorted arrays aA[] and
+** aB[] to aOut[iStart..iEnd-1]. Entries of aA[] come before equal
+** entries of aB[].
+*/
+static void sortMerge(
+  SortEntry *aA, int nA,          /* First sorted array */
+  SortEntry *aB, int nB,          /* Second sorted array */
+  int iStart, int iEnd,           /* Range of the merge to write */
+  SortEntry *aOut                 /* Output array */
 ){
-  ResultItem *pRet = 0;
-  ResultItem **ppNext;
+  int iA, iB;
+
+  /* Find the number of entries of aA[] among the first iStart entries
+  ** of the merge. This allows a merge to be split between threads. */
+  int lo = iStart>nB ? iStart-nB : 0;
+  int hi = iStart<nA ? iStart : nA;
+  while( lo<hi ){
+    int i = (lo+hi)/2;
+    if( cmpSortEntry(&aA[i], &aB[iStart-i-1])<=0 ){
+      lo = i+1;
+    }else{
+      hi = i;
+    }
+  }
+  iA = lo;
+  iB = iStart - lo;
 
-  ppNext = &pRet;
-  while( p1 || p2 ){
-    if( !p1 ){
-      *ppNext = p2;
-      p2 = 0;
-    }else if( !p2 ){
-      *ppNext = p1;
-      p1 = 0;
+  while( iStart<iEnd ){
+    if( iA<nA && (iB>=nB || cmpSortEntry(&aB[iB], &aA[iA])>=0) ){
+      aOut[iStart++] = aA[iA++];
     }else{
-      int c = cmpResultItem(p1, p2, pEList);
-      if( c<=0 ){
-        *ppNext = p1;
-        ppNext = &p1->pNext;
-        p1 = p1->pNext;
-      }else{
-        *ppNext = p2;
-        ppNext = &p2->pNext;
-        p2 = p2->pNext;
-      }
+      aOut[iStart++] = aB[iB++];
+    }
+  }
+}
+
+/*
+** Merge sort the nEntry entries of aEntry[], using aTmp[] as space for
+** merging. Return a pointer to whichever of the two arrays holds the
+** sorted entries.
+*/
+static SortEntry *sortEntries(SortEntry *aEntry, SortEntry *aTmp, int nEntry){
+  int nRun;                       /* Length of the sorted runs in aEntry[] */
+  for(nRun=1; nRun<nEntry; nRun*=2){
+    SortEntry *aSwap;
+    int i;
+    for(i=0; i<nEntry; i+=nRun*2){
+      int nA = i+nRun<nEntry ? nRun : nEntry-i;
+      int nB = i+nRun*2<nEntry ? nRun : nEntry-i-nA;
+      sortMerge(&aEntry[i], nA, &aEntry[i+nA], nB, 0, nA+nB, &aTmp[i]);
     }
+    aSwap = aEntry;
+    aEntry = aTmp;
+    aTmp = aSwap;
+  }
+  return aEntry;
+}
+
+/*
+** The state of a sort that is split between the worker threads. The
+** entries are divided into one sorted run for each task. Then pairs of
+** adjacent runs are merged until a single run remains, with each task
+** writing an equal part of the output of each round.
+*/
+typedef struct SortTask SortTask;
+struct SortTask {
+  SortEntry *aIn;                 /* Entries to sort or merge */
+  SortEntry *aOut;                /* Space for merging */
+  int nEntry;                     /* Number of entries */
+  int nTask;                      /* Number of tasks */
+  int nRun;                       /* Number of runs in aIn[] */
+  int *aRun;                      /* Run i is aIn[aRun[i]..aRun[i+1]-1] */
+};
+
+/*
+** Task iTask of a parallel sort: sort run iTask in place.
+*/
+static void sortRunTask(void *pArg, int iTask){
+  SortTask *p = (SortTask*)pArg;
+  int iFirst = p->aRun[iTask];
+  int n = p->aRun[iTask+1] - iFirst;
+  SortEntry *a = sortEntries(&p->aIn[iFirst], &p->aOut[iFirst], n);
+  if( a!=&p->aIn[iFirst] ){
+    memcpy(&p->aIn[iFirst], a, n*sizeof(SortEntry));
   }
+}
 
-  return pRet;
+/*
+** Task iTask of a parallel sort: write part iTask of the output of the
+** merge of each pair of runs.
+*/
+static void sortMergeTask(void *pArg, int iTask){
+  SortTask *p = (SortTask*)pArg;
+  int iStart = (int)((sqlite3_int64)p->nEntry*iTask/p->nTask);
+  int iEnd = (int)((sqlite3_int64)p->nEntry*(iTask+1)/p->nTask);
+  int i;
+  for(i=0; i<p->nRun; i+=2){
+    int iFirst = p->aRun[i];
+    int iMid = p->aRun[i+1];
+    int iLast = i+2<=p->nRun ? p->aRun[i+2] : iMid;
+    if( iLast<=iStart || iFirst>=iEnd ) continue;
+    sortMerge(&p->aIn[iFirst], iMid-iFirst, &p->aIn[iMid], iLast-iMid,
+        (iStart>iFirst ? iStart : iFirst) - iFirst,
+        (iEnd<iLast ? iEnd : iLast) - iFirst, &p->aOut[iFirst]
+    );
+  }
 }
 
-static void sortResultList(ResultList *pList, ExprList *pEList, int uniq){
-  int i;                          /* Used to iterate through aList[] */
-  ResultItem *aList[40];          /* Array of slots for merge sort */
-  ResultItem *pHead;
+/*
+** Sort the nEntry entries of aEntry[] using the worker threads of pConn,
+** with aTmp[] as space for merging. Return a pointer to whichever of the
+** two arrays holds the sorted entries. The result is the same as that of
+** sortEntries().
+*/
+static SortEntry *sortEntriesParallel(
+  xjd1 *pConn,
+  SortEntry *aEntry,
+  SortEntry *aTmp,
+  int nEntry
+){
+  SortTask sTask;
+  int i;
+
+  sTask.nTask = xjd1ThreadCount(pConn);
+  sTask.aRun = xjd1_malloc((sTask.nTask+1)*sizeof(int));
+  if( sTask.aRun==0 ) return sortEntries(aEntry, aTmp, nEntry);
+  sTask.aIn = aEntry;
+  sTask.aOut = aTmp;
+  sTask.nEntry = nEntry;
+  sTask.nRun = sTask.nTask;
+  for(i=0; i<=sTask.nRun; i++){
+    sTask.aRun[i] = (int)((sqlite3_int64)nEntry*i/sTask.nRun);
+  }
+  xjd1ThreadRun(pConn, sTask.nTask, sortRunTask, (void*)&sTask);
+
+  while( sTask.nRun>1 ){
+    SortEntry *aSwap;
+    xjd1ThreadRun(pConn, sTask.nTask, sortMergeTask, (void*)&sTask);
+    for(i=0; i*2<sTask.nRun; i++){
+      sTask.aRun[i] = sTask.aRun[i*2];
+    }
+    sTask.aRun[i] = nEntry;
+    sTask.nRun = i;
+    aSwap = sTask.aIn;
+    sTask.aIn = sTask.aOut;
+    sTask.aOut = aSwap;
+  }
+  xjd1_free(sTask.aRun);
+  return sTask.aIn;
+}
 
-  memset(aList, 0, sizeof(aList));
-  pHead = pList->pItem;
+/*
+** Sort the items in the pItem list of pList. Items that compare equal
+** are kept in the order in which they were added.
+**
+** The items are copied to an array with the prefixes of their sort
+** keys, which is then merge sorted. If there are XJD1_CONFIG_PARALLELSORT
+** items or more, the sort is split between the worker threads.
+*/
+static int sortResultItems(ResultList *pList){
+  xjd1 *pConn = pList->pConn;
+  SortEntry *aEntry;              /* The items to sort */
+  SortEntry *aSorted;             /* The sorted items */
+  ResultItem *pItem;
+  ResultItem **ppNext;
+  int nItem = 0;
+  int i;
 
-  while( pHead ){
-    ResultItem *pNext = pHead->pNext;
-    pHead->pNext = 0;
-    for(i=0; aList[i]; i++){
-      assert( i<ArraySize(aList) );
-      pHead = mergeResultItems(pEList, pHead, aList[i]);
-      aList[i] = 0;
+  for(pItem=pList->pItem; pItem; pItem=pItem->pNext) nItem++;
+  if( nItem<2 ) return XJD1_OK;
+  aEntry = xjd1_malloc(2 * nItem * sizeof(SortEntry));
+  if( aEntry==0 ) return XJD1_NOMEM;
+
+  /* The pItem list holds the most recently added item first. */
+  i = nItem;
+  for(pItem=pList->pItem; pItem; pItem=pItem->pNext){
+    sqlite3_uint64 iPrefix = 0;
+    int j;
+    for(j=0; j<8; j++){
+      iPrefix = (iPrefix<<8) + (j<pItem->nSortKey ? pItem->aSortKey[j] : 0);
     }
-    aList[i] = pHead;
-    pHead = pNext;
+    i--;
+    aEntry[i].iPrefix = iPrefix;
+    aEntry[i].pItem = pItem;
   }
 
-  pHead = aList[0];
-  for(i=1; i<ArraySize(aList); i++){
-    pHead = mergeResultItems(pEList, pHead, aList[i]);
+  if( pConn && pConn->nParallelSort>=0 && nItem>=pConn->nParallelSort
+   && xjd1ThreadCount(pConn)>1
+  ){
+    aSorted = sortEntriesParallel(pConn, aEntry, &aEntry[nItem], nItem);
+  }else{
+    aSorted = sortEntries(aEntry, &aEntry[nItem], nItem);
   }
-  pList->pItem = pHead;
 
-  if( uniq && pHead ){
-    ResultItem *pPrev = pHead;
-    ResultItem *p;
-    for(p=pPrev->pNext; p; p=p->pNext){
-      if( cmpResultItem(pPrev, p, pEList)==0 ){
-        pPrev->pNext = p->pNext;
-      }else{
-        pPrev = p;
+  ppNext = &pList->pItem;
+  for(i=0; i<nItem; i++){
+    *ppNext = aSorted[i].pItem;
+    ppNext = &aSorted[i].pItem->pNext;
+  }
+  *ppNext = 0;
+  xjd1_free(aEntry);
+  return XJD1_OK;
+}
+
+/*
+** Sort the items in the pItem list of pList and write them to the
+** temporary table as a new run. The pItem list is left empty.
+*/
+static int spillResultList(ResultList *pList){
+  static const char zSchema[] =
+    "CREATE TEMP TABLE IF NOT EXISTS xjd1_sort_spill(run INTEGER, x, nulls);"
+    "CREATE INDEX IF NOT EXISTS temp.xjd1_sort_spill_run"
+    " ON xjd1_sort_spill(run);";
+  xjd1 *pConn = pList->pConn;
+  ResultSpill *pSpill = pList->pSpill;
+  struct ResultRun *aNew;
+  JsonNode sRow;
+  String out;                     /* Encoded values of an item */
+  String nulls;                   /* Value for the "nulls" column */
+  int rc = XJD1_OK;
+
+  if( pSpill==0 ){
+    pSpill = pList->pSpill = xjd1MallocZero(sizeof(ResultSpill));
+    if( pSpill==0 ) return XJD1_NOMEM;
+    if( sqlite3_exec(pConn->db, zSchema, 0, 0, 0)!=SQLITE_OK ){
+      return XJD1_ERROR;
+    }
+    sqlite3_prepare_v2(pConn->db,
+        "INSERT INTO temp.xjd1_sort_spill(run, x, nulls) VALUES(?1,?2,?3)",-1,
+        &pSpill->pWrite, 0);
+    if( pSpill->pWrite==0 ) return XJD1_ERROR;
+  }
+  aNew = xjd1_realloc(pSpill->aRun, (pSpill->nRun+1)*sizeof(aNew[0]));
+  if( aNew==0 ) return XJD1_NOMEM;
+  pSpill->aRun = aNew;
+  memset(&aNew[pSpill->nRun], 0, sizeof(aNew[0]));
+  aNew[pSpill->nRun].iRun = ++pConn->nSortSpill;
+  sqlite3_bind_int64(pSpill->pWrite, 1, aNew[pSpill->nRun].iRun);
+  pSpill->nRun++;
+
+  /* Each item is stored as an array of its values. A NULL pointer cannot
+  ** be told apart from a JSON null once stored, so if there are any, the
+  ** "nulls" column holds a string with a '1' for each NULL value. */
+  rc = sortResultItems(pList);
+  memset(&sRow, 0, sizeof(sRow));
+  sRow.eJType = XJD1_ARRAY;
+  sRow.u.ar.nElem = pList->nKey;
+  xjd1StringInit(&out, 0, 0);
+  xjd1StringInit(&nulls, 0, 0);
+  while( rc==XJD1_OK && pList->pItem ){
+    ResultItem *pItem = pList->pItem;
+    int i;
+    xjd1StringTruncate(&out);
+    xjd1StringTruncate(&nulls);
+    sRow.u.ar.apElem = pItem->apKey;
+    xjd1StorageEncode(&out, &sRow);
+    for(i=0; i<pList->nKey; i++){
+      if( pItem->apKey[i]==0 ){
+        while( xjd1StringLen(&nulls)<i ) xjd1StringAppend(&nulls, "0", 1);
+        xjd1StringAppend(&nulls, "1", 1);
       }
     }
+    sqlite3_bind_blob(pSpill->pWrite, 2, xjd1StringText(&out),
+                      xjd1StringLen(&out), SQLITE_STATIC);
+    if( xjd1StringLen(&nulls) ){
+      sqlite3_bind_text(pSpill->pWrite, 3, xjd1StringText(&nulls),
+                        xjd1StringLen(&nulls), SQLITE_STATIC);
+    }else{
+      sqlite3_bind_null(pSpill->pWrite, 3);
+    }
+    sqlite3_step(pSpill->pWrite);
+    if( sqlite3_reset(pSpill->pWrite)!=SQLITE_OK ) rc = XJD1_ERROR;
+    pList->pItem = pItem->pNext;
+    freeResultListItem(pList, pItem);
   }
+  xjd1StringClear(&nulls);
+  xjd1StringClear(&out);
+  clearResultStrings(pList);
+  pList->nByte = 0;
+  return rc;
+}
 
-#if 1
-  while( pHead ){
-    ResultItem *pNext = pHead->pNext;
-    assert( pNext==0 || cmpResultItem(pHead, pNext, pEList)<=(uniq?-1:0) );
-    pHead = pNext;
+/*
+** Read the next item of run pRun of ResultList pList into pRun->pHead.
+** Set pRun->pHead to NULL at the end of the run.
+*/
+static void readResultRun(ResultList *pList, struct ResultRun *pRun){
+  sqlite3_stmt *pRead = pRun->pRead;
+  JsonNode *pRow;
+  ResultItem *pItem;
+  const char *zNulls;
+  int nNulls;
+  int i;
+
+  pRun->pHead = 0;
+  if( pRead==0 || sqlite3_step(pRead)!=SQLITE_ROW ) return;
+  pRow = xjd1StorageDecode(sqlite3_column_blob(pRead, 0),
+                           sqlite3_column_bytes(pRead, 0),
+                           pList->pConn->pLabels);
+  if( pRow==0
+   || pRow->eJType!=XJD1_ARRAY || pRow->u.ar.nElem!=pList->nKey
+  ){
+    xjd1JsonFree(pRow);
+    return;
   }
-#endif
+  zNulls = (const char*)sqlite3_column_text(pRead, 1);
+  nNulls = sqlite3_column_bytes(pRead, 1);
+  for(i=0; i<nNulls && i<pList->nKey; i++){
+    if( zNulls[i]=='1' ){
+      xjd1JsonFree(pRow->u.ar.apElem[i]);
+      pRow->u.ar.apElem[i] = 0;
+    }
+  }
+
+  /* The sort key is not stored, so build it again. If the item is
+  ** allocated, the values belong to it and not to pRow. */
+  buildSortKey(pList, pRow->u.ar.apElem);
+  pItem = newResultListItem(pList, pRow->u.ar.apElem);
+  if( pItem ) pRow->u.ar.nElem = 0;
+  xjd1JsonFree(pRow);
+  pRun->pHead = pItem;
 }
 
-static void freeResultListItem(ResultList *pList, ResultItem *pItem){
+/*
+** Remove and return the first item of the merged runs of pList, or
+** return NULL if there are no more. Rows that compare equal are taken
+** from the earlier run first, so that the merge is stable.
+*/
+static ResultItem *mergeResultRuns(ResultList *pList){
+  ResultSpill *pSpill = pList->pSpill;
+  struct ResultRun *pMin = 0;
+  ResultItem *pItem;
   int i;
-  for(i=0; i<pList->nKey; i++){
-    xjd1JsonFree(pItem->apKey[i]);
+
+  for(i=0; i<pSpill->nRun; i++){
+    struct ResultRun *pRun = &pSpill->aRun[i];
+    if( pRun->pHead && (pMin==0
+          || cmpResultItem(pRun->pHead, pMin->pHead)<0)
+    ){
+      pMin = pRun;
+    }
+  }
+  if( pMin==0 ) return 0;
+  pItem = pMin->pHead;
+  readResultRun(pList, pMin);
+  return pItem;
+}
+
+/*
+** If the runs of pList are being merged, make sure that the item after
+** the current one is in the pItem list, if there is such an item.
+*/
+static void fillResultList(ResultList *pList){
+  ResultItem **pp = &pList->pItem;
+  int n = 0;
+  if( pList->pSpill==0 || pList->pSpill->isMerging==0 ) return;
+  while( *pp ){
+    pp = &(*pp)->pNext;
+    n++;
+  }
+  while( n<2 && (*pp = mergeResultRuns(pList))!=0 ){
+    pp = &(*pp)->pNext;
+    n++;
+  }
+}
+
+/*
+** Sort the items of pList, once they have all been added. If any runs
+** have been written to the temporary table, the remaining items are
+** written as a final run and the merge of the runs is started.
+*/
+static int sortResultList(ResultList *pList){
+  ResultSpill *pSpill = pList->pSpill;
+  int rc = XJD1_OK;
+  int i;
+
+  if( pSpill==0 ){
+    return sortResultItems(pList);
   }
+  if( pList->pItem ) rc = spillResultList(pList);
+  for(i=0; rc==XJD1_OK && i<pSpill->nRun; i++){
+    struct ResultRun *pRun = &pSpill->aRun[i];
+    sqlite3_prepare_v2(pList->pConn->db,
+        "SELECT x, nulls FROM temp.xjd1_sort_spill WHERE run=?1 ORDER BY rowid",
+        -1, &pRun->pRead, 0);
+    if( pRun->pRead==0 ){
+      rc = XJD1_ERROR;
+    }else{
+      sqlite3_bind_int64(pRun->pRead, 1, pRun->iRun);
+      readResultRun(pList, pRun);
+    }
+  }
+  pSpill->isMerging = 1;
+  fillResultList(pList);
+  return rc;
 }
 
 static void popResultList(ResultList *pList){
@@ -158,35 +700,100 @@ static void popResultList(ResultList *pList){
   if( pItem ){
     pList->pItem = pItem->pNext;
     freeResultListItem(pList, pItem);
+    fillResultList(pList);
   }
 }
 
 /*
-** These two are used GROUP BY processing.
+** Free the runs of pList and delete them from the temporary table.
 */
-static void saveResultList(ResultList *pList){
-  if( pList->pSaved ){
-    freeResultListItem(pList, pList->pSaved);
-  }
-  pList->pSaved = pList->pItem;
-  pList->pItem = pList->pItem->pNext;
-}
-static void restoreResultList(ResultList *pList){
-  if( pList->pSaved ){
-    popResultList(pList);
-    pList->pSaved->pNext = pList->pItem;
-    pList->pItem = pList->pSaved;
-    pList->pSaved = 0;
+static void clearResultSpill(ResultList *pList){
+  ResultSpill *pSpill = pList->pSpill;
+  int i;
+  if( pSpill==0 ) return;
+  for(i=0; i<pSpill->nRun; i++){
+    struct ResultRun *pRun = &pSpill->aRun[i];
+    char *zSql;
+    if( pRun->pHead ) freeResultListItem(pList, pRun->pHead);
+    sqlite3_finalize(pRun->pRead);
+    zSql = sqlite3_mprintf(
+        "DELETE FROM temp.xjd1_sort_spill WHERE run=%lld", pRun->iRun);
+    sqlite3_exec(pList->pConn->db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
   }
+  sqlite3_finalize(pSpill->pWrite);
+  xjd1_free(pSpill->aRun);
+  xjd1_free(pSpill);
+  pList->pSpill = 0;
 }
 
-
 static void clearResultList(ResultList *pList){
+  clearResultStrings(pList);
+  clearResultSpill(pList);
   while( pList->pItem ) popResultList(pList);
+  xjd1StringClear(&pList->sortKey);
   xjd1PoolDelete(pList->pPool);
   memset(pList, 0, sizeof(ResultList));
 }
 
+/*
+** A heap of the rows of an ORDER BY query that sort first, used when the
+** query has a LIMIT clause. The root of the heap is the row that sorts
+** last. Rows that compare equal are ordered as sortResultList() would
+** order them - in the order in which they were added.
+*/
+typedef struct TopItem TopItem;
+struct TopItem {
+  ResultItem *pItem;              /* Row */
+  int iSeq;                       /* Order in which rows were added */
+};
+
+/*
+** Return true if row p1 sorts after row p2.
+*/
+static int topAfter(TopItem *p1, TopItem *p2){
+  int c = cmpResultItem(p1->pItem, p2->pItem);
+  return c>0 || (c==0 && p1->iSeq>p2->iSeq);
+}
+
+/*
+** Restore the heap property of the nHeap entries of aHeap[] after the
+** entry at iHole has been replaced.
+*/
+static void topSiftDown(
+  TopItem *aHeap,                 /* The heap */
+  int nHeap,                      /* Number of entries in aHeap[] */
+  int iHole                       /* Entry that has been replaced */
+){
+  TopItem sHole = aHeap[iHole];
+  while( 1 ){
+    int iChild = iHole*2 + 1;
+    if( iChild>=nHeap ) break;
+    if( iChild+1<nHeap && topAfter(&aHeap[iChild+1], &aHeap[iChild]) ){
+      iChild++;
+    }
+    if( !topAfter(&aHeap[iChild], &sHole) ) break;
+    aHeap[iHole] = aHeap[iChild];
+    iHole = iChild;
+  }
+  aHeap[iHole] = sHole;
+}
+
+/*
+** Restore the heap property of aHeap[] after an entry has been added at
+** iHole.
+*/
+static void topSiftUp(TopItem *aHeap, int iHole){
+  TopItem sHole = aHeap[iHole];
+  while( iHole>0 ){
+    int iParent = (iHole-1)/2;
+    if( !topAfter(&sHole, &aHeap[iParent]) ) break;
+    aHeap[iHole] = aHeap[iParent];
+    iHole = iParent;
+  }
+  aHeap[iHole] = sHole;
+}
+
 /*
 ** Called after statement parsing to initalize every Query object
 ** within the statement.
@@ -202,10 +809,12 @@ int xjd1QueryInit(
   if( p->eQType==TK_SELECT ){
     rc = xjd1ExprInit(p->u.simple.pRes, pStmt, p, XJD1_EXPR_RESULT, pCtx);
     if( !rc ){
-      rc = xjd1DataSrcInit(p->u.simple.pFrom, p, pCtx);
+      /* The WHERE clause is resolved before the FROM clause is initialized
+      ** so that the collection scans can use it to select an index. */
+      rc = xjd1ExprInit(p->u.simple.pWhere, pStmt, p, XJD1_EXPR_WHERE, pCtx);
     }
     if( !rc ){
-      rc = xjd1ExprInit(p->u.simple.pWhere, pStmt, p, XJD1_EXPR_WHERE, pCtx);
+      rc = xjd1DataSrcInit(p->u.simple.pFrom, p, pCtx);
     }
     if( !rc ){
       rc = xjd1ExprListInit(
@@ -232,9 +841,55 @@ int xjd1QueryInit(
   if( !rc ){
     rc = xjd1ExprInit(p->pOffset, pStmt, p, XJD1_EXPR_OFFSET, pCtx);
   }
+  if( !rc && p->eQType==TK_SELECT ){
+    /* Work out which parts of the documents in each collection scanned
+    ** by this query are used, so that the rest need not be parsed. */
+    xjd1DataSrcProjectStart(p->u.simple.pFrom);
+    if( p->u.simple.pRes==0 ){
+      xjd1DataSrcProjectPath(p->u.simple.pFrom, 1, 0);
+    }
+    xjd1QueryProject(p, p);
+  }
   return rc;
 }
 
+/*
+** Record in the projections of the collections scanned by query pQuery
+** the parts of their documents that are used by query p, which is either
+** pQuery itself or a subquery nested within it.
+*/
+void xjd1QueryProject(Query *p, Query *pQuery){
+  if( p==0 ) return;
+  if( p->eQType==TK_SELECT ){
+    xjd1ExprProject(p->u.simple.pRes, pQuery);
+    xjd1DataSrcProject(p->u.simple.pFrom, pQuery);
+    xjd1ExprProject(p->u.simple.pWhere, pQuery);
+    xjd1ExprListProject(p->u.simple.pGroupBy, pQuery);
+    xjd1ExprProject(p->u.simple.pHaving, pQuery);
+  }else{
+    xjd1QueryProject(p->u.compound.pLeft, pQuery);
+    xjd1QueryProject(p->u.compound.pRight, pQuery);
+  }
+  xjd1ExprListProject(p->pOrderBy, pQuery);
+  xjd1ExprProject(p->pLimit, pQuery);
+  xjd1ExprProject(p->pOffset, pQuery);
+}
+
+/*
+** Expression pPath, a document reference optionally followed by one or
+** more labels, refers to the iDoc'th document of query pQuery, or to the
+** result of pQuery if iDoc is zero.  Arrange for the value at that path
+** to be available when the document is read.
+*/
+void xjd1QueryProjectPath(Query *pQuery, int iDoc, Expr *pPath){
+  if( pQuery->eQType!=TK_SELECT ) return;
+  if( iDoc==0 ){
+    if( pQuery->u.simple.pRes ) return;
+    iDoc = 1;
+  }
+  xjd1DataSrcProjectPath(pQuery->u.simple.pFrom, iDoc, pPath);
+}
+
 /*
 ** Rewind a query so that it is pointing at the first row.
 */
@@ -243,14 +898,19 @@ int xjd1QueryRewind(Query *p){
   if( p->eQType==TK_SELECT ){
     xjd1DataSrcRewind(p->u.simple.pFrom);
     clearResultList(&p->u.simple.grouped);
-    clearResultList(&p->u.simple.distincted);
+    xjd1ValueSetFree(p->u.simple.pDistinct);
+    p->u.simple.pDistinct = 0;
+    xjd1JsonFree(p->u.simple.pDistinctDoc);
+    p->u.simple.pDistinctDoc = 0;
     xjd1AggregateClear(p);
   }else{
     xjd1QueryRewind(p->u.compound.pLeft);
     xjd1QueryRewind(p->u.compound.pRight);
     p->u.compound.doneLeft = 0;
-    clearResultList(&p->u.compound.left);
-    clearResultList(&p->u.compound.right);
+    xjd1ValueSetFree(p->u.compound.pSeen);
+    xjd1ValueSetFree(p->u.compound.pRightSet);
+    p->u.compound.pSeen = 0;
+    p->u.compound.pRightSet = 0;
     xjd1JsonFree(p->u.compound.pOut);
     p->u.compound.pOut = 0;
   }
@@ -301,10 +961,10 @@ static int selectStepGrouped(Query *p){
         int saved = 0;
         Pool *pPool;
 
-        pPool = p->u.simple.grouped.pPool = xjd1PoolNew();
-        if( !pPool ) return XJD1_NOMEM;
-
-        p->u.simple.grouped.nKey = nSrc = xjd1DataSrcCount(p->u.simple.pFrom);
+        nSrc = xjd1DataSrcCount(p->u.simple.pFrom);
+        rc = initResultList(&p->u.simple.grouped, nSrc, 0, 0);
+        if( rc!=XJD1_OK ) return rc;
+        pPool = p->u.simple.grouped.pPool;
         apSrc = (JsonNode **)xjd1PoolMallocZero(pPool, nSrc*sizeof(JsonNode *));
         if( !apSrc ) return XJD1_NOMEM;
 
@@ -347,38 +1007,46 @@ static int selectStepGrouped(Query *p){
       /* An aggregate with a GROUP BY clause. There may also be a DISTINCT
       ** qualifier.
       **
-      ** Use a ResultList to sort all the rows matched by the WHERE
-      ** clause. The apKey[] array consists of each of the expressions
-      ** in the GROUP BY clause, followed by each document in the FROM
-      ** clause. */
+      ** Aggregate the rows matched by the WHERE clause in a GroupTable,
+      ** then use a ResultList to sort the groups. The apKey[] array of
+      ** each item consists of each of the expressions in the GROUP BY
+      ** clause, followed by each document in the FROM clause, followed
+      ** by the final value of each aggregate function. */
       do {
         ResultItem *pItem;
+        int nKey = pGroupBy->nEItem + xjd1DataSrcCount(p->u.simple.pFrom);
 
         if( p->u.simple.grouped.pPool==0 ){
-          DataSrc *pFrom = p->u.simple.pFrom;
+          GroupTable *pTab;
           JsonNode **apKey;
-          int nByte;
           Pool *pPool;
 
           /* Allocate the memory pool for this ResultList. And apKey. */
-          pPool = p->u.simple.grouped.pPool = xjd1PoolNew();
-          p->u.simple.grouped.nKey = pGroupBy->nEItem + xjd1DataSrcCount(pFrom);
-          if( !pPool ) return XJD1_NOMEM;
-          nByte = p->u.simple.grouped.nKey * sizeof(JsonNode *);
-          apKey = (JsonNode **)xjd1PoolMallocZero(pPool, nByte);
+          rc = initResultList(&p->u.simple.grouped, nKey + pAgg->nExpr,
+              pGroupBy, p->pStmt->pConn
+          );
+          if( rc!=XJD1_OK ) return rc;
+          pPool = p->u.simple.grouped.pPool;
+          apKey = (JsonNode **)xjd1PoolMallocZero(pPool,
+              p->u.simple.grouped.nKey * sizeof(JsonNode *)
+          );
           if( !apKey ) return XJD1_NOMEM;
+          pTab = xjd1GroupTableNew(p);
+          if( !pTab ) return XJD1_NOMEM;
 
           while( rc==XJD1_OK && XJD1_ROW==(rc = selectStepWhered(p) ) ){
-            int i;
-            for(i=0; i<pGroupBy->nEItem; i++){
-              apKey[i] = xjd1ExprEval(pGroupBy->apEItem[i].pExpr);
+            rc = xjd1GroupTableStep(pTab);
+          }
+          if( rc==XJD1_DONE ){
+            rc = XJD1_OK;
+            while( rc==XJD1_OK && xjd1GroupTableNext(pTab, apKey)==XJD1_OK ){
+              rc = addToResultList(&p->u.simple.grouped, apKey);
             }
-            xjd1DataSrcCacheSave(pFrom, &apKey[i]);
-            rc = addToResultList(&p->u.simple.grouped, apKey);
-            memset(apKey, 0, nByte);
           }
-          if( rc!=XJD1_DONE ) return rc;
-          sortResultList(&p->u.simple.grouped, pGroupBy, 0);
+          xjd1GroupTableFree(pTab);
+          if( rc!=XJD1_OK ) return rc;
+          rc = sortResultList(&p->u.simple.grouped);
+          if( rc!=XJD1_OK ) return rc;
         }else{
           popResultList(&p->u.simple.grouped);
         }
@@ -388,22 +1056,13 @@ static int selectStepGrouped(Query *p){
         if( pItem==0 ){
           rc = XJD1_DONE;
         }else{
-          while( 1 ){
-            int saveThisRow = 0;
-            ResultItem *pNext = pItem->pNext;
-            rc = xjd1AggregateStep(pAgg, &saveThisRow);
-            if( saveThisRow ) saveResultList(&p->u.simple.grouped);
-            if( rc || !pNext || cmpResultItem(pItem, pNext, pGroupBy) ){
-              restoreResultList(&p->u.simple.grouped);
-              break;
-            }
-            if( !saveThisRow ) popResultList(&p->u.simple.grouped);
-            pItem = p->u.simple.grouped.pItem;
-          }
-
-          if( XJD1_OK==rc && XJD1_OK==(rc = xjd1AggregateFinalize(pAgg)) ){
-            rc = XJD1_ROW;
+          int i;
+          for(i=0; i<pAgg->nExpr; i++){
+            AggExpr *pAggExpr = &pAgg->aAggExpr[i];
+            xjd1JsonFree(pAggExpr->pValue);
+            pAggExpr->pValue = xjd1JsonRef(pItem->apKey[nKey+i]);
           }
+          rc = XJD1_ROW;
         }
 
       }while( rc==XJD1_ROW
@@ -419,65 +1078,58 @@ static int selectStepGrouped(Query *p){
   return rc;
 }
 
+/*
+** Step a query that may have a DISTINCT qualifier. Each result of a
+** DISTINCT query is returned the first time it is seen, and saved in
+** p->u.simple.pDistinctDoc.
+*/
 static int selectStepDistinct(Query *p){
   int rc;
   if( p->u.simple.isDistinct ){
-    if( p->u.simple.distincted.pPool==0 ){
-      Pool *pPool;
-      JsonNode **apKey;
-      int nKey;
-
-      nKey = 1 + xjd1DataSrcCount(p->u.simple.pFrom);
-      pPool = p->u.simple.distincted.pPool = xjd1PoolNew();
-      if( !pPool ) return XJD1_NOMEM;
-      p->u.simple.distincted.nKey = nKey;
-      apKey = xjd1PoolMallocZero(pPool, nKey * sizeof(JsonNode *));
-      if( !apKey ) return XJD1_NOMEM;
-
-      while( XJD1_ROW==(rc = selectStepGrouped(p) ) ){
-        apKey[0] = xjd1QueryDoc(p, 0);
-        xjd1DataSrcCacheSave(p->u.simple.pFrom, &apKey[1]);
-        rc = addToResultList(&p->u.simple.distincted, apKey);
-        memset(apKey, 0, nKey * sizeof(JsonNode *));
-        if( rc!=XJD1_OK ) break;
-      }
-      if( rc==XJD1_DONE ){
-        sortResultList(&p->u.simple.distincted, 0, 1);
-        p->eDocFrom = XJD1_FROM_DISTINCTED;
-        rc = XJD1_ROW;
+    if( p->u.simple.pDistinct==0 ){
+      p->u.simple.pDistinct = xjd1ValueSetNew(p->pStmt->pConn);
+      if( p->u.simple.pDistinct==0 ) return XJD1_NOMEM;
+    }
+    xjd1JsonFree(p->u.simple.pDistinctDoc);
+    p->u.simple.pDistinctDoc = 0;
+    while( XJD1_ROW==(rc = selectStepGrouped(p) ) ){
+      JsonNode *pDoc = xjd1QueryDoc(p, 0);
+      int isNew;
+      rc = xjd1ValueSetInsert(p->u.simple.pDistinct, pDoc, &isNew);
+      if( rc==XJD1_OK && isNew ){
+        p->u.simple.pDistinctDoc = pDoc;
+        return XJD1_ROW;
       }
-    }else{
-      popResultList(&p->u.simple.distincted);
-      rc = p->u.simple.distincted.pItem ? XJD1_ROW : XJD1_DONE;
+      xjd1JsonFree(pDoc);
+      if( rc!=XJD1_OK ) break;
     }
   }else{
     rc = selectStepGrouped(p);
-
-
   }
   return rc;
 }
 
 
 static int selectStepCompounded(Query *);
-static int cacheQuery(ResultList *pList, Query *p){
-  Pool *pPool;
+
+/*
+** Add each result of query p to a new ValueSet. Write the set to *ppSet.
+*/
+static int cacheQuery(ValueSet **ppSet, Query *p){
   int rc;
 
-  pList->nKey = 1;
-  pPool = pList->pPool = xjd1PoolNew();
-  if( !pPool ) return XJD1_NOMEM;
+  *ppSet = xjd1ValueSetNew(p->pStmt->pConn);
+  if( *ppSet==0 ) return XJD1_NOMEM;
 
   while( XJD1_ROW==(rc = selectStepCompounded(p) ) ){
     JsonNode *pDoc = xjd1QueryDoc(p, 0);
-    rc = addToResultList(pList, &pDoc);
+    int isNew;
+    rc = xjd1ValueSetInsert(*ppSet, pDoc, &isNew);
+    xjd1JsonFree(pDoc);
     if( rc!=XJD1_OK ) break;
   }
 
-  if( rc==XJD1_DONE ){
-    sortResultList(pList, 0, 1);
-    rc = XJD1_OK;
-  }
+  if( rc==XJD1_DONE ) rc = XJD1_OK;
   return rc;
 }
 
@@ -504,76 +1156,185 @@ static int selectStepCompounded(Query *p){
         }
       }
     }else{
-
-      ResultList *p1;
-      ResultList *p2;
-
-      if( p->u.compound.left.pPool==0 ){
-        rc = cacheQuery(&p->u.compound.left, p->u.compound.pLeft);
-        if( rc!=XJD1_OK ) return rc;
-        rc = cacheQuery(&p->u.compound.right, p->u.compound.pRight);
-        if( rc!=XJD1_OK ) return rc;
+      /* UNION returns each result of pLeft and then of pRight the first
+      ** time it is seen. INTERSECT and EXCEPT read all of pRight into a
+      ** set first, then return each result of pLeft that is (or is not)
+      ** in the set the first time it is seen. */
+      int isIntersect = (p->eQType==TK_INTERSECT);
+
+      if( p->u.compound.pSeen==0 ){
+        p->u.compound.pSeen = xjd1ValueSetNew(p->pStmt->pConn);
+        if( p->u.compound.pSeen==0 ) return XJD1_NOMEM;
+        if( p->eQType!=TK_UNION ){
+          rc = cacheQuery(&p->u.compound.pRightSet, p->u.compound.pRight);
+          if( rc!=XJD1_OK ) return rc;
+        }
       }
 
-      p1 = &p->u.compound.left;
-      p2 = &p->u.compound.right;
-      rc = XJD1_DONE;
+      while( 1 ){
+        Query *pSub = p->u.compound.pLeft;
+        int isNew = 0;
 
-      switch( p->eQType ){
-        case TK_UNION: {
-          if( (p1->pItem || p2->pItem) ){
-            int c;
-            if( p1->pItem==0 ){
-              c = 1;
-            }else if( p2->pItem==0 ){
-              c = -1;
-            }else{
-              c = cmpResultItem(p1->pItem, p2->pItem, 0);
-            }
-
-            if( c<0 ){
-              pOut = xjd1JsonRef(p1->pItem->apKey[0]);
-            }else{
-              pOut = xjd1JsonRef(p2->pItem->apKey[0]);
-            }
-            if( c<=0 ) popResultList(p1);
-            if( c>=0 ) popResultList(p2);
-            rc = XJD1_ROW;
+        if( p->u.compound.doneLeft ){
+          pSub = p->u.compound.pRight;
+        }
+        rc = selectStepCompounded(pSub);
+        if( rc==XJD1_DONE && p->eQType==TK_UNION
+         && p->u.compound.doneLeft==0
+        ){
+          p->u.compound.doneLeft = 1;
+          continue;
+        }
+        if( rc!=XJD1_ROW ) break;
+
+        pOut = xjd1QueryDoc(pSub, 0);
+        if( p->eQType!=TK_UNION ){
+          int found;
+          rc = xjd1ValueSetContains(p->u.compound.pRightSet, pOut, &found);
+          if( rc!=XJD1_OK ) break;
+          if( found!=isIntersect ){
+            xjd1JsonFree(pOut);
+            pOut = 0;
+            continue;
           }
+        }
+        rc = xjd1ValueSetInsert(p->u.compound.pSeen, pOut, &isNew);
+        if( rc!=XJD1_OK ) break;
+        if( isNew ){
+          rc = XJD1_ROW;
           break;
         }
+        xjd1JsonFree(pOut);
+        pOut = 0;
+      }
+    }
 
-        case TK_INTERSECT:
-          while( rc==XJD1_DONE && p1->pItem && p2->pItem ){
-            int c = cmpResultItem(p1->pItem, p2->pItem, 0);
-            if( c==0 ){
-              pOut = xjd1JsonRef(p1->pItem->apKey[0]);
-              rc = XJD1_ROW;
-            }
-            if( c<=0 ) popResultList(p1);
-            if( c>=0 ) popResultList(p2);
-          }
-          break;
+    xjd1JsonFree(p->u.compound.pOut);
+    p->u.compound.pOut = pOut;
+  }
+  return rc;
+}
 
-        case TK_EXCEPT:
-          while( rc==XJD1_DONE && p1->pItem ){
-            int c = p2->pItem ? cmpResultItem(p1->pItem, p2->pItem, 0) : -1;
-            if( c<=0 ){
-              if( c ){
-                pOut = xjd1JsonRef(p1->pItem->apKey[0]);
-                rc = XJD1_ROW;
-              }
-              popResultList(p1);
-            }else{
-              popResultList(p2);
-            }
-          }
+/*
+** Load the first p->nSorted rows of ORDER BY query p, in sorted order,
+** into p->ordered. apKey[] is a buffer with space for the ORDER BY keys
+** and the result document of a row.
+**
+** Only p->nSorted rows are held at any time. The result document of a
+** row is not built unless the row is one of them.
+**
+** Return XJD1_DONE if successful, or an error code otherwise.
+*/
+static int sortTopRows(Query *p, JsonNode **apKey){
+  ExprList *pOrderBy = p->pOrderBy;
+  ResultList *pList = &p->ordered;
+  int nKey = pList->nKey;
+  TopItem *aHeap = 0;             /* The heap */
+  int nHeap = 0;                  /* Number of entries in aHeap[] */
+  int nAlloc = 0;                 /* Allocated size of aHeap[] */
+  int iSeq = 0;                   /* Number of rows seen so far */
+  ResultItem sNew;                /* Candidate row */
+  TopItem sTop;                   /* Candidate row as a heap entry */
+  int rc;
+  int i;
+
+  sNew.apKey = apKey;
+  sNew.pNext = 0;
+  sTop.pItem = &sNew;
+  while( XJD1_ROW==(rc = selectStepCompounded(p) ) ){
+    for(i=0; i<pOrderBy->nEItem; i++){
+      apKey[i] = xjd1ExprEval(pOrderBy->apEItem[i].pExpr);
+    }
+    apKey[i] = 0;
+    buildSortKey(pList, apKey);
+    sNew.nSortKey = xjd1StringLen(&pList->sortKey);
+    sNew.aSortKey = (unsigned char *)xjd1StringText(&pList->sortKey);
+    sTop.iSeq = iSeq++;
+
+    if( nHeap<p->nSorted ){
+      /* The heap is not yet full. Add the row to it. */
+      if( nHeap==nAlloc ){
+        int nNew = nAlloc ? nAlloc*2 : 16;
+        TopItem *aNew;
+        if( nNew>p->nSorted ) nNew = p->nSorted;
+        aNew = xjd1_realloc(aHeap, nNew*sizeof(TopItem));
+        if( aNew==0 ){
+          for(i=0; i<nKey; i++) xjd1JsonFree(apKey[i]);
+          rc = XJD1_NOMEM;
           break;
+        }
+        aHeap = aNew;
+        nAlloc = nNew;
+      }
+      apKey[i] = xjd1QueryDoc(p, 0);
+      aHeap[nHeap].pItem = newResultListItem(pList, apKey);
+      if( aHeap[nHeap].pItem==0 ){
+        for(i=0; i<nKey; i++) xjd1JsonFree(apKey[i]);
+        rc = XJD1_NOMEM;
+        break;
       }
+      aHeap[nHeap].iSeq = sTop.iSeq;
+      topSiftUp(aHeap, nHeap++);
+    }else if( nHeap>0 && topAfter(&aHeap[0], &sTop) ){
+      /* The row sorts before the last row in the heap. Replace it. */
+      ResultItem *pItem;
+      apKey[i] = xjd1QueryDoc(p, 0);
+      pItem = newResultListItem(pList, apKey);
+      if( pItem==0 ){
+        for(i=0; i<nKey; i++) xjd1JsonFree(apKey[i]);
+        rc = XJD1_NOMEM;
+        break;
+      }
+      freeResultListItem(pList, aHeap[0].pItem);
+      aHeap[0].pItem = pItem;
+      aHeap[0].iSeq = sTop.iSeq;
+      topSiftDown(aHeap, nHeap, 0);
+    }else{
+      for(i=0; i<nKey; i++) xjd1JsonFree(apKey[i]);
     }
+  }
 
-    xjd1JsonFree(p->u.compound.pOut);
-    p->u.compound.pOut = pOut;
+  /* Remove rows from the heap, last first, to build the sorted list. */
+  while( nHeap>0 ){
+    ResultItem *pItem = aHeap[0].pItem;
+    pItem->pNext = pList->pItem;
+    pList->pItem = pItem;
+    aHeap[0] = aHeap[--nHeap];
+    topSiftDown(aHeap, nHeap, 0);
+  }
+  xjd1_free(aHeap);
+  return rc;
+}
+
+/*
+** Advance query p past the next *pnSkip rows, disregarding any ORDER BY,
+** OFFSET or LIMIT clause, and decrement *pnSkip for each. The result
+** documents of the skipped rows are not built. Return XJD1_OK if all the
+** rows were skipped, XJD1_DONE if EOF was reached first, or an error code.
+*/
+static int selectSkipCompounded(Query *p, int *pnSkip){
+  int rc = XJD1_OK;
+  if( p->eQType==TK_SELECT
+   && p->u.simple.pWhere==0
+   && p->u.simple.pAgg==0
+   && p->u.simple.isDistinct==0
+  ){
+    /* Each row of the FROM clause is a row of the query. */
+    rc = xjd1DataSrcSkip(p->u.simple.pFrom, pnSkip);
+  }else if( p->eQType==TK_ALL ){
+    if( p->u.compound.doneLeft==0 ){
+      rc = selectSkipCompounded(p->u.compound.pLeft, pnSkip);
+      if( rc!=XJD1_DONE ) return rc;
+      p->u.compound.doneLeft = 1;
+    }
+    rc = selectSkipCompounded(p->u.compound.pRight, pnSkip);
+  }else{
+    while( *pnSkip>0 ){
+      rc = selectStepCompounded(p);
+      if( rc!=XJD1_ROW ) break;
+      (*pnSkip)--;
+      rc = XJD1_OK;
+    }
   }
   return rc;
 }
@@ -594,28 +1355,31 @@ static int selectStepOrdered(Query *p){
     /* A non-aggregate with an ORDER BY clause. */
     if( p->ordered.pPool==0 ){
       int nKey = pOrderBy->nEItem + 1;
-      Pool *pPool;
       JsonNode **apKey;
 
-      p->ordered.nKey = nKey;
-      pPool = p->ordered.pPool = xjd1PoolNew();
-      if( !pPool ) return XJD1_NOMEM;
-      apKey = xjd1PoolMallocZero(pPool, nKey * sizeof(JsonNode *));
+      rc = initResultList(&p->ordered, nKey, pOrderBy, p->pStmt->pConn);
+      if( rc!=XJD1_OK ) return rc;
+      apKey = xjd1PoolMallocZero(p->ordered.pPool, nKey * sizeof(JsonNode *));
       if( !apKey ) return XJD1_NOMEM;
 
-      while( XJD1_ROW==(rc = selectStepCompounded(p) ) ){
-        int i;
-        for(i=0; i<pOrderBy->nEItem; i++){
-          apKey[i] = xjd1ExprEval(pOrderBy->apEItem[i].pExpr);
-        }
-        apKey[i] = xjd1QueryDoc(p, 0);
+      if( p->nSorted>=0 ){
+        rc = sortTopRows(p, apKey);
+        if( rc!=XJD1_DONE ) return rc;
+      }else{
+        while( XJD1_ROW==(rc = selectStepCompounded(p) ) ){
+          int i;
+          for(i=0; i<pOrderBy->nEItem; i++){
+            apKey[i] = xjd1ExprEval(pOrderBy->apEItem[i].pExpr);
+          }
+          apKey[i] = xjd1QueryDoc(p, 0);
 
-        rc = addToResultList(&p->ordered, apKey);
-        if( rc!=XJD1_OK ) break;
+          rc = addToResultList(&p->ordered, apKey);
+          if( rc!=XJD1_OK ) break;
+        }
+        if( rc!=XJD1_DONE ) return rc;
+        rc = sortResultList(&p->ordered);
+        if( rc!=XJD1_OK ) return rc;
       }
-      if( rc!=XJD1_DONE ) return rc;
-
-      sortResultList(&p->ordered, pOrderBy, 0);
       p->eDocFrom = XJD1_FROM_ORDERED;
     }else{
       assert( p->eDocFrom==XJD1_FROM_ORDERED );
@@ -652,6 +1416,7 @@ int xjd1QueryStep(Query *p){
     */
     Expr *pLimit = p->pLimit;     /* The LIMIT expression, or NULL */
     Expr *pOffset = p->pOffset;   /* The OFFSET expression, or NULL */
+    int nOffset = 0;              /* Number of rows to skip */
 
     if( pOffset ){
       JsonNode *pVal;             /* Result of evaluating expression pOffset */
@@ -659,11 +1424,8 @@ int xjd1QueryStep(Query *p){
 
       pVal = xjd1ExprEval(pOffset);
       if( 0==xjd1JsonToReal(pVal, &rOffset) ){
-        int nOffset;
-        for(nOffset=(int)rOffset; nOffset>0; nOffset--){
-          rc = selectStepOrdered(p);
-          if( rc!=XJD1_ROW ) break;
-        }
+        nOffset = (int)rOffset;
+        if( nOffset<0 ) nOffset = 0;
       }
       xjd1JsonFree(pVal);
     }
@@ -679,6 +1441,26 @@ int xjd1QueryStep(Query *p){
       }
       xjd1JsonFree(pVal);
     }
+
+    /* If there is a LIMIT, an ORDER BY query need only sort the rows
+    ** that are skipped by OFFSET or returned. */
+    p->nSorted = -1;
+    if( p->nLimit>=0 && p->nLimit<=0x7fffffff-nOffset ){
+      p->nSorted = nOffset + p->nLimit;
+    }
+
+    /* Skip the first nOffset rows. The sorted rows of an ORDER BY query
+    ** are discarded from the front of the list. Otherwise, the rows are
+    ** skipped as early as possible, without building their documents. */
+    if( p->pOrderBy ){
+      for(; nOffset>0; nOffset--){
+        rc = selectStepOrdered(p);
+        if( rc!=XJD1_ROW ) break;
+      }
+    }else if( nOffset>0 ){
+      rc = selectSkipCompounded(p, &nOffset);
+      if( rc==XJD1_OK ) rc = XJD1_ROW;
+    }
     p->bLimitValid = 1;
   }
 
@@ -706,12 +1488,12 @@ JsonNode *xjd1QueryDoc(Query *p, int iDoc){
     if( p->eDocFrom==XJD1_FROM_ORDERED ){
       assert( iDoc==0 && p->ordered.pItem );
       pOut = xjd1JsonRef(p->ordered.pItem->apKey[p->ordered.nKey-1]);
+    }else if( p->eQType==TK_SELECT
+           && iDoc==0 && p->u.simple.pDistinctDoc
+    ){
+      pOut = xjd1JsonRef(p->u.simple.pDistinctDoc);
     }else if( p->eQType==TK_SELECT ){
       switch( p->eDocFrom ){
-        case XJD1_FROM_DISTINCTED:
-          pOut = xjd1JsonRef(p->u.simple.distincted.pItem->apKey[iDoc]);
-          break;
-
         case XJD1_FROM_GROUPED:
           if( iDoc==0 && p->u.simple.pRes ){
             pOut = xjd1ExprEval(p->u.simple.pRes);
@@ -749,20 +1531,22 @@ JsonNode *xjd1QueryDoc(Query *p, int iDoc){
 int xjd1QueryClose(Query *pQuery){
   int rc = XJD1_OK;
   if( pQuery==0 ) return rc;
+  clearResultList(&pQuery->ordered);
   if( pQuery->eQType==TK_SELECT ){
-    clearResultList(&pQuery->ordered);
     clearResultList(&pQuery->u.simple.grouped);
-    clearResultList(&pQuery->u.simple.distincted);
+    xjd1ValueSetFree(pQuery->u.simple.pDistinct);
+    xjd1JsonFree(pQuery->u.simple.pDistinctDoc);
     xjd1ExprClose(pQuery->u.simple.pRes);
     xjd1DataSrcClose(pQuery->u.simple.pFrom);
     xjd1ExprClose(pQuery->u.simple.pWhere);
     xjd1ExprListClose(pQuery->u.simple.pGroupBy);
     xjd1ExprClose(pQuery->u.simple.pHaving);
+    xjd1AggregateClear(pQuery);
   }else{
     xjd1QueryClose(pQuery->u.compound.pLeft);
     xjd1QueryClose(pQuery->u.compound.pRight);
-    clearResultList(&pQuery->u.compound.left);
-    clearResultList(&pQuery->u.compound.right);
+    xjd1ValueSetFree(pQuery->u.compound.pSeen);
+    xjd1ValueSetFree(pQuery->u.compound.pRightSet);
     xjd1JsonFree(pQuery->u.compound.pOut);
     pQuery->u.compound.pOut = 0;
   }
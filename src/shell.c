@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #ifndef _WIN32
 #include <unistd.h>
@@ -113,6 +114,8 @@ struct Shell {
   int nCase;           /* Number of --testcase commands seen */
   int nTest;           /* Number of tests performed */
   int nErr;            /* Number of test errors */
+  int nSkip;           /* Number of files skipped */
+  xjd1_int64 aMemStat[3];  /* Allocator counts at the last .memstats */
 };
 
 /*
@@ -122,6 +125,7 @@ struct Shell {
 #define SHELL_CMD_TRACE        0x00002
 #define SHELL_ECHO             0x00004
 #define SHELL_TEST_MODE        0x00008
+#define SHELL_TIMER            0x00010
 static const struct {
   const char *zName;
   int iValue;
@@ -130,6 +134,7 @@ static const struct {
   {  "cmd-trace",      SHELL_CMD_TRACE    },
   {  "echo",           SHELL_ECHO         },
   {  "test-mode",      SHELL_TEST_MODE    },
+  {  "timer",          SHELL_TIMER        },
 };
 
 /*
@@ -375,8 +380,137 @@ static int shellNewDB(Shell *p, int argc, char **argv){
   return 0;
 }
 
-/* Forward declaration */
+/* Forward declarations */
 static void processOneFile(Shell*, const char*);
+static void appendTestOut(Shell*, const char*, int);
+
+/*
+** Command:  .threads N
+** Set the number of threads used to decode documents in collection scans.
+**
+** A build without XJD1_ENABLE_THREADS cannot use more than one thread.
+** The rest of the current file is then skipped, since the tests in it
+** are meant to run on several threads, and the skip is reported.
+*/
+static int shellThreads(Shell *p, int argc, char **argv){
+  if( p->pDb && argc>=2 ){
+    int nThread = atoi(argv[1]);
+    if( xjd1_config(p->pDb, XJD1_CONFIG_THREADS, nThread)!=XJD1_OK ){
+      fprintf(stderr, "%s:%d: cannot use %d threads, skipping the rest "
+              "of the file\n", p->zFile, p->nLine, nThread);
+      p->nSkip++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+** Command:  .joinbuffer SIZE
+** Set the memory used to buffer the right-hand side of a join in bytes.
+** A negative SIZE turns off buffering of joins without equality terms.
+*/
+static int shellJoinBuffer(Shell *p, int argc, char **argv){
+  if( p->pDb && argc>=2 ){
+    xjd1_config(p->pDb, XJD1_CONFIG_JOINBUFFER, atoi(argv[1]));
+  }
+  return 0;
+}
+
+/*
+** Command:  .sortbuffer SIZE
+** Set the memory a sort may use in bytes. Larger sorts are written to
+** a temporary table in sorted runs. A negative SIZE means no limit.
+*/
+static int shellSortBuffer(Shell *p, int argc, char **argv){
+  if( p->pDb && argc>=2 ){
+    xjd1_config(p->pDb, XJD1_CONFIG_SORTBUFFER, atoi(argv[1]));
+  }
+  return 0;
+}
+
+/*
+** Command:  .parallelsort N
+** Sort in parallel on the worker threads once there are N rows to sort.
+** A negative N turns off parallel sorting.
+*/
+static int shellParallelSort(Shell *p, int argc, char **argv){
+  if( p->pDb && argc>=2 ){
+    xjd1_config(p->pDb, XJD1_CONFIG_PARALLELSORT, atoi(argv[1]));
+  }
+  return 0;
+}
+
+/*
+** Command:  .internstrings N
+** Let the rows of a sort share equal strings of up to N bytes. Zero
+** turns off sharing.
+*/
+static int shellInternStrings(Shell *p, int argc, char **argv){
+  if( p->pDb && argc>=2 ){
+    xjd1_config(p->pDb, XJD1_CONFIG_INTERNSTRINGS, atoi(argv[1]));
+  }
+  return 0;
+}
+
+/*
+** Command:  .doccache ?SIZE?
+** Set the size of the parsed document cache in bytes.  Or, with no
+** argument, show the number of cache hits and misses.
+*/
+static int shellDocCache(Shell *p, int argc, char **argv){
+  if( p->pDb==0 ) return 0;
+  if( argc>=2 ){
+    xjd1_config(p->pDb, XJD1_CONFIG_DOCCACHE, atoi(argv[1]));
+  }else{
+    int nHit, nMiss;
+    char zBuf[50];
+    xjd1_config(p->pDb, XJD1_CONFIG_DOCCACHE_STATS, &nHit, &nMiss);
+    sprintf(zBuf, "%d %d", nHit, nMiss);
+    if( p->shellFlags & SHELL_TEST_MODE ){
+      appendTestOut(p, zBuf, -1);
+    }else{
+      printf("%s\n", zBuf);
+    }
+  }
+  return 0;
+}
+
+/*
+** Command:  .memstats
+** Show the statistics of the built-in allocator: allocations, freelist
+** hits, bytes in use and the most bytes ever in use. All are zero unless
+** the shell was started with the --memsys option.
+**
+** The exact counts depend on too many details to be tested. In test mode
+** they are compared with the counts at the previous .memstats instead,
+** and the test output gets: 1 if allocations have been made since then,
+** 1 if any have been served from a freelist, 1 if the bytes in use do not
+** exceed the most ever in use, and, with the argument "delta", the change
+** in the bytes in use.
+*/
+static int shellMemStats(Shell *p, int argc, char **argv){
+  xjd1_int64 nMalloc, nHit, nCurrent, nHigh;
+  char zBuf[100];
+  xjd1_memsys_stats(&nMalloc, &nHit, &nCurrent, &nHigh);
+  if( p->shellFlags & SHELL_TEST_MODE ){
+    sprintf(zBuf, "%d %d %d",
+            nMalloc>p->aMemStat[0], nHit>p->aMemStat[1], nCurrent<=nHigh);
+    if( argc>=2 && strcmp(argv[1], "delta")==0 ){
+      sprintf(&zBuf[strlen(zBuf)], " %lld",
+              (long long int)(nCurrent - p->aMemStat[2]));
+    }
+    appendTestOut(p, zBuf, -1);
+  }else{
+    sprintf(zBuf, "%lld %lld %lld %lld", (long long int)nMalloc,
+            (long long int)nHit, (long long int)nCurrent, (long long int)nHigh);
+    printf("%s\n", zBuf);
+  }
+  p->aMemStat[0] = nMalloc;
+  p->aMemStat[1] = nHit;
+  p->aMemStat[2] = nCurrent;
+  return 0;
+}
 
 /*
 ** Command:  .read FILENAME
@@ -459,6 +593,13 @@ static int processMetaCommand(Shell *p){ char *z;
     { "set",        shellSet,         ".set FLAG"           },
     { "clear",      shellClear,       ".clear FLAG"         },
     { "breakpoint", shellBreakpoint,  ".breakpoint"         },
+    { "doccache",   shellDocCache,    ".doccache ?SIZE?"    },
+    { "memstats",   shellMemStats,    ".memstats ?delta?"    },
+    { "threads",    shellThreads,     ".threads N"          },
+    { "joinbuffer", shellJoinBuffer,  ".joinbuffer SIZE"    },
+    { "sortbuffer", shellSortBuffer,  ".sortbuffer SIZE"    },
+    { "parallelsort", shellParallelSort, ".parallelsort N"     },
+    { "internstrings", shellInternStrings, ".internstrings N"  },
   };
 
   /* Remove trailing whitespace from the command */
@@ -529,6 +670,22 @@ static void appendTestOut(Shell *p, const char *z, int n){
   xjd1StringAppend(&p->testOut, z, n);
 }
 
+/*
+** Return the wall-clock time in seconds since some fixed point. Unlike
+** clock(), which counts the CPU time of this thread only, this includes
+** the time spent in worker threads and waiting for I/O. The clock()
+** of the Windows C runtime already measures wall-clock time.
+*/
+static double shellTime(void){
+#ifdef _WIN32
+  return (double)clock()/CLOCKS_PER_SEC;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+#endif
+}
+
 /*
 ** Run a single statment.
 */
@@ -536,6 +693,7 @@ static void processOneStatement(Shell *p, const char *zCmd){
   xjd1_stmt *pStmt;
   int N, rc;
   int once = 0;
+  double rStart = shellTime();
   if( p->shellFlags & SHELL_ECHO ){
     fprintf(stdout, "%s\n", zCmd);
   }
@@ -565,7 +723,8 @@ static void processOneStatement(Shell *p, const char *zCmd){
       }
     }while( rc==XJD1_ROW );
     xjd1_stmt_delete(pStmt);
-  }else{
+  }
+  if( rc!=XJD1_OK && rc!=XJD1_DONE ){
     if( p->shellFlags & SHELL_TEST_MODE ){
       appendTestOut(p, xjd1_errcode_name(p->pDb), -1);
       appendTestOut(p, xjd1_errmsg(p->pDb), -1);
@@ -577,6 +736,9 @@ static void processOneStatement(Shell *p, const char *zCmd){
     }
   }
   if( once ) printf("---------------------------------\n");
+  if( p->shellFlags & SHELL_TIMER ){
+    printf("Run Time: %.3f\n", shellTime() - rStart);
+  }
 }
 
 /*
@@ -687,6 +849,11 @@ int main(int argc, char **argv){
   Shell s;
 
   memset(&s, 0, sizeof(s));
+  if( find_option(argv, &argc, "memsys", 0, 0) ){
+    /* Use the built-in allocator instead of the system malloc() */
+    xjd1_configure_malloc(xjd1_memsys_malloc, xjd1_memsys_realloc,
+                          xjd1_memsys_free);
+  }
   if( argc>1 ){
     for(i=1; i<argc; i++){
       processOneFile(&s, argv[i]);
@@ -697,6 +864,9 @@ int main(int argc, char **argv){
   if( s.nTest ){
     printf("%d errors from %d tests\n", s.nErr, s.nTest);
   }
+  if( s.nSkip ){
+    printf("%d files skipped\n", s.nSkip);
+  }
   if( s.pDb ) xjd1_close(s.pDb);
   xjd1StringClear(&s.inBuf);
   xjd1StringClear(&s.testOut);
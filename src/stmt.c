@@ -47,12 +47,17 @@ int xjd1_stmt_new(xjd1 *pConn, const char *zStmt, xjd1_stmt **ppNew, int *pN){
 
   if( pCmd ){
     switch( pCmd->eCmdType ){
+      case TK_CREATECOLLECTION: {
+        rc = xjd1ExprInit(pCmd->u.crtab.pOptions, p, 0, 0, 0);
+        break;
+      }
       case TK_SELECT: {
         rc = xjd1QueryInit(pCmd->u.q.pQuery, p, 0);
         break;
       }
       case TK_INSERT: {
         xjd1QueryInit(pCmd->u.ins.pQuery, p, 0);
+        rc = xjd1ExprInit(pCmd->u.ins.pValue, p, 0, 0, 0);
         break;
       }
       case TK_DELETE: {
@@ -101,12 +106,17 @@ int xjd1_stmt_delete(xjd1_stmt *pStmt){
   pCmd = pStmt->pCmd;
   if( pCmd ){
     switch( pCmd->eCmdType ){
+      case TK_CREATECOLLECTION: {
+        xjd1ExprClose(pCmd->u.crtab.pOptions);
+        break;
+      }
       case TK_SELECT: {
         xjd1QueryClose(pCmd->u.q.pQuery);
         break;
       }
       case TK_INSERT: {
         xjd1QueryClose(pCmd->u.ins.pQuery);
+        xjd1ExprClose(pCmd->u.ins.pValue);
         break;
       }
       case TK_DELETE: {
@@ -122,6 +132,8 @@ int xjd1_stmt_delete(xjd1_stmt *pStmt){
     }
   }
 
+  xjd1ArenaSweep(pStmt->pConn, 0);
+
   if( pStmt->pPrev ){
     pStmt->pPrev->pNext = pStmt->pNext;
   }else{
@@ -138,6 +150,38 @@ int xjd1_stmt_delete(xjd1_stmt *pStmt){
   return XJD1_OK;
 }
 
+/*
+** Evaluate the OPTIONS clause of a CREATE COLLECTION statement and return
+** the storage format it asks for: 1 for binary or 0 for JSON text. Return
+** -1 and leave an error in the connection if the options are invalid.
+*/
+static int collectionFormat(xjd1_stmt *pStmt, Expr *pOptions){
+  JsonNode *pOpt = xjd1ExprEval(pOptions);
+  JsonStructElem *pElem;
+  int eFormat = 0;
+  if( pOpt==0 || pOpt->eJType!=XJD1_STRUCT ){
+    xjd1Error(pStmt->pConn, XJD1_ERROR, "OPTIONS must be a structure");
+    eFormat = -1;
+  }else{
+    for(pElem=pOpt->u.st.pFirst; pElem; pElem=pElem->pNext){
+      if( strcmp(pElem->zLabel, "format")!=0 ) continue;
+      if( pElem->pValue->eJType==XJD1_STRING
+       && strcmp(pElem->pValue->u.z, "binary")==0
+      ){
+        eFormat = 1;
+      }else if( pElem->pValue->eJType!=XJD1_STRING
+       || strcmp(pElem->pValue->u.z, "text")!=0
+      ){
+        xjd1Error(pStmt->pConn, XJD1_ERROR, "unknown collection format");
+        eFormat = -1;
+      }
+      break;
+    }
+  }
+  xjd1JsonFree(pOpt);
+  return eFormat;
+}
+
 /*
 ** Execute a prepared statement up to its next return value or until
 ** it completes.
@@ -153,9 +197,17 @@ int xjd1_stmt_step(xjd1_stmt *pStmt){
       char *zSql;
       int res;
       char *zErr = 0;
-      zSql = sqlite3_mprintf("CREATE TABLE %s \"%w\"(x)",
+      int isBinary = 0;
+      if( pCmd->u.crtab.pOptions ){
+        isBinary = collectionFormat(pStmt, pCmd->u.crtab.pOptions);
+        if( isBinary<0 ){
+          rc = XJD1_ERROR;
+          break;
+        }
+      }
+      zSql = sqlite3_mprintf("CREATE TABLE %s \"%w\"(x%s)",
                  pCmd->u.crtab.ifExists ? "IF NOT EXISTS" : "",
-                 pCmd->u.crtab.zName);
+                 pCmd->u.crtab.zName, isBinary ? " BLOB" : "");
       res = sqlite3_exec(pStmt->pConn->db, zSql, 0, 0, &zErr);
       if( zErr ){
         xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", zErr);
@@ -177,16 +229,26 @@ int xjd1_stmt_step(xjd1_stmt *pStmt){
         xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", zErr);
         sqlite3_free(zErr);
         rc = XJD1_ERROR;
+      }else{
+        xjd1DocCacheInvalidate(pStmt->pConn, pCmd->u.crtab.zName, 0);
+        xjd1IndexDropAll(pStmt->pConn, pCmd->u.crtab.zName);
       }
       sqlite3_free(zSql);
       break;
     }
+    case TK_CREATEINDEX: {
+      rc = xjd1IndexCreate(pStmt);
+      break;
+    }
+    case TK_DROPINDEX: {
+      rc = xjd1IndexDrop(pStmt);
+      break;
+    }
     case TK_INSERT: {
+      sqlite3 *db = pStmt->pConn->db;
+      int inAutocommit = sqlite3_get_autocommit(db);
       JsonNode *pNode;
-      String json;
-      int res;
-      char *zErr;
-      char *zSql;
+      sqlite3_int64 iRowid;
       if( pCmd->u.ins.pQuery ){
         xjd1Error(pStmt->pConn, XJD1_ERROR, 
                  "INSERT INTO ... SELECT not yet implemented");
@@ -194,20 +256,30 @@ int xjd1_stmt_step(xjd1_stmt *pStmt){
       }
       pNode = xjd1ExprEval(pCmd->u.ins.pValue);
       if( pNode==0 ) break;
-      xjd1StringInit(&json,0,0);
-      xjd1JsonRender(&json, pNode);
-      xjd1JsonFree(pNode);
-      zSql = sqlite3_mprintf("INSERT INTO \"%w\" VALUES('%q')",
-                  pCmd->u.ins.zName,
-                  xjd1StringText(&json));
-      xjd1StringClear(&json);
-      res = sqlite3_exec(pStmt->pConn->db, zSql, 0, 0, &zErr);
-      if( zErr ){
-        xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", zErr);
-        sqlite3_free(zErr);
+
+      /* The document and its index entries are written in a single
+      ** transaction, so that no index misses a document */
+      if( inAutocommit ) sqlite3_exec(db, "BEGIN", 0, 0, 0);
+      iRowid = xjd1StorageInsert(pStmt->pConn, pCmd->u.ins.zName, pNode);
+      if( iRowid==0 ){
         rc = XJD1_ERROR;
+      }else{
+        Index *pIdx = xjd1CatalogIndices(pStmt->pConn, pCmd->u.ins.zName);
+        xjd1DocCacheInvalidate(pStmt->pConn, pCmd->u.ins.zName, iRowid);
+        rc = xjd1IndexWrite(pIdx, iRowid, pNode);
       }
-      sqlite3_free(zSql);
+      if( rc==XJD1_OK && inAutocommit
+       && sqlite3_exec(db, "COMMIT", 0, 0, 0)!=SQLITE_OK
+      ){
+        rc = XJD1_ERROR;
+      }
+      if( rc!=XJD1_OK ){
+        xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", sqlite3_errmsg(db));
+        if( inAutocommit ) sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+      }else if( inAutocommit ){
+        xjd1DocCacheCommit(pStmt->pConn);
+      }
+      xjd1JsonFree(pNode);
       break;
     }
     case TK_SELECT: {
@@ -245,6 +317,7 @@ int xjd1_stmt_step(xjd1_stmt *pStmt){
 */
 int xjd1_stmt_rewind(xjd1_stmt *pStmt){
   Command *pCmd = pStmt->pCmd;
+  pStmt->nRewind++;
   if( pCmd ){
     switch( pCmd->eCmdType ){
       case TK_SELECT: {
@@ -0,0 +1,605 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains code used to move documents in and out of the
+** column "x" of the SQLite table that holds a collection.
+**
+** A collection is stored either as JSON text (the default) or, if it was
+** created with OPTIONS {format:"binary"}, in the binary format described
+** below. A binary collection is created as "CREATE TABLE c(x BLOB)", so
+** the format of a collection can be found from the declared type of its
+** column. Readers do not need to know the format: BLOB values are decoded
+** as binary and everything else is parsed as JSON text.
+**
+** In the binary format each value begins with a single byte holding its
+** XJD1_* type code, followed by:
+**
+**     XJD1_FALSE, XJD1_TRUE, XJD1_NULL:   nothing
+**     XJD1_REAL:     8-byte little-endian IEEE-754 double
+**     STORAGE_INT:   varint V holding an integer-valued XJD1_REAL, with
+**                    zig-zag sign encoding (V is 2*N for N>=0, -2*N-1
+**                    for N<0)
+**     XJD1_STRING:   varint N, then N bytes of UTF-8 (no terminator)
+**     XJD1_ARRAY:    4-byte size S, varint count N, N 4-byte offsets
+**                    of each element from the end of the offset table,
+**                    then the N elements
+**     XJD1_STRUCT:   4-byte size S, varint count N, then N times:
+**                    varint L, L bytes of label, value
+**
+** Fixed-size integers are little-endian. The size S of an array or struct
+** is the number of bytes that follow the size field, so that a whole
+** container can be skipped without looking inside it. Varints use seven
+** bits per byte, least significant group first, with the high bit set on
+** all but the last byte.
+*/
+#include "xjd1Int.h"
+
+/*
+** Type code used in place of XJD1_REAL for small integer values.
+*/
+#define STORAGE_INT   (XJD1_REAL|0x10)
+
+/*
+** Append a varint to pOut.
+*/
+static void putVarint(String *pOut, unsigned int v){
+  char a[5];
+  int n = 0;
+  do{
+    a[n] = (char)(v & 0x7f);
+    v >>= 7;
+    if( v ) a[n] |= 0x80;
+    n++;
+  }while( v );
+  xjd1StringAppend(pOut, a, n);
+}
+
+/*
+** Store a 4-byte little-endian integer at a[].
+*/
+static void put4(unsigned char *a, unsigned int v){
+  a[0] = (unsigned char)v;
+  a[1] = (unsigned char)(v>>8);
+  a[2] = (unsigned char)(v>>16);
+  a[3] = (unsigned char)(v>>24);
+}
+
+/*
+** Append n bytes of zero to pOut and return the offset of the first.
+*/
+static int reserveBytes(String *pOut, int n){
+  static const char aZero[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  int iOfst = xjd1StringLen(pOut);
+  while( n>0 ){
+    int nChunk = n>8 ? 8 : n;
+    xjd1StringAppend(pOut, aZero, nChunk);
+    n -= nChunk;
+  }
+  return iOfst;
+}
+
+/*
+** Append the binary encoding of pNode to pOut.
+*/
+void xjd1StorageEncode(String *pOut, const JsonNode *pNode){
+  char cType;
+  if( pNode==0 ){
+    cType = XJD1_NULL;
+    xjd1StringAppend(pOut, &cType, 1);
+    return;
+  }
+  cType = (char)pNode->eJType;
+  if( cType==XJD1_REAL
+   && pNode->u.r>=-1073741824.0 && pNode->u.r<=1073741823.0
+  ){
+    int i = (int)pNode->u.r;
+    if( (double)i==pNode->u.r && (i!=0 || 1.0/pNode->u.r>0.0) ){
+      cType = STORAGE_INT;
+      xjd1StringAppend(pOut, &cType, 1);
+      putVarint(pOut, i<0 ? (unsigned int)(-(i+1))*2+1 : (unsigned int)i*2);
+      return;
+    }
+  }
+  xjd1StringAppend(pOut, &cType, 1);
+  switch( pNode->eJType ){
+    case XJD1_REAL: {
+      sqlite3_uint64 x;
+      unsigned char a[8];
+      int i;
+      memcpy(&x, &pNode->u.r, sizeof(x));
+      for(i=0; i<8; i++){
+        a[i] = (unsigned char)x;
+        x >>= 8;
+      }
+      xjd1StringAppend(pOut, (const char*)a, 8);
+      break;
+    }
+    case XJD1_STRING: {
+      int n = xjd1Strlen30(pNode->u.z);
+      putVarint(pOut, n);
+      xjd1StringAppend(pOut, pNode->u.z, n);
+      break;
+    }
+    case XJD1_ARRAY: {
+      int iSize = reserveBytes(pOut, 4);
+      int iOfst, iStart, i;
+      putVarint(pOut, pNode->u.ar.nElem);
+      iOfst = reserveBytes(pOut, 4*pNode->u.ar.nElem);
+      iStart = xjd1StringLen(pOut);
+      for(i=0; i<pNode->u.ar.nElem; i++){
+        int iElem = xjd1StringLen(pOut) - iStart;
+        xjd1StorageEncode(pOut, pNode->u.ar.apElem[i]);
+        if( pOut->zBuf ){
+          put4((unsigned char*)&pOut->zBuf[iOfst+4*i], iElem);
+        }
+      }
+      if( pOut->zBuf ){
+        put4((unsigned char*)&pOut->zBuf[iSize],
+             xjd1StringLen(pOut) - (iSize+4));
+      }
+      break;
+    }
+    case XJD1_STRUCT: {
+      int iSize = reserveBytes(pOut, 4);
+      JsonStructElem *pElem;
+      int nElem = 0;
+      for(pElem=pNode->u.st.pFirst; pElem; pElem=pElem->pNext) nElem++;
+      putVarint(pOut, nElem);
+      for(pElem=pNode->u.st.pFirst; pElem; pElem=pElem->pNext){
+        int n = xjd1Strlen30(pElem->zLabel);
+        putVarint(pOut, n);
+        xjd1StringAppend(pOut, pElem->zLabel, n);
+        xjd1StorageEncode(pOut, pElem->pValue);
+      }
+      if( pOut->zBuf ){
+        put4((unsigned char*)&pOut->zBuf[iSize],
+             xjd1StringLen(pOut) - (iSize+4));
+      }
+      break;
+    }
+  }
+}
+
+/*
+** A cursor for reading a binary encoded value.
+*/
+typedef struct BinReader BinReader;
+struct BinReader {
+  const unsigned char *a;     /* The encoded value */
+  int n;                      /* Number of bytes in a[] */
+  int i;                      /* Offset of the next byte to read */
+  LabelTable *pLabels;        /* Table to intern labels in, or NULL */
+  Pool *pPool;                /* Memory for the decoded value, or NULL */
+};
+
+/*
+** Read a varint.  Return -1 if the input is malformed.
+*/
+static int getVarint(BinReader *p){
+  unsigned int v = 0;
+  int iShift = 0;
+  while( p->i<p->n && iShift<32 ){
+    unsigned char c = p->a[p->i++];
+    v |= (unsigned int)(c & 0x7f) << iShift;
+    if( (c & 0x80)==0 ) return (v>0x7fffffff ? -1 : (int)v);
+    iShift += 7;
+  }
+  return -1;
+}
+
+/*
+** Read a 4-byte integer.  Return -1 if the input is malformed.
+*/
+static int get4(BinReader *p){
+  unsigned int v;
+  if( p->i+4>p->n ) return -1;
+  v = p->a[p->i] | (p->a[p->i+1]<<8) | (p->a[p->i+2]<<16)
+      | ((unsigned int)p->a[p->i+3]<<24);
+  p->i += 4;
+  return (v>0x7fffffff ? -1 : (int)v);
+}
+
+/*
+** Read n bytes into a new nul-terminated string obtained from p->pPool
+** or, if that is NULL, from xjd1_malloc().
+*/
+static char *getString(BinReader *p, int n){
+  char *z;
+  if( n<0 || p->i+n>p->n ) return 0;
+  z = xjd1PoolDup(p->pPool, (const char*)&p->a[p->i], n);
+  p->i += n;
+  return z;
+}
+
+/*
+** Read an n-byte structure label. See xjd1LabelNew().
+*/
+static char *getLabel(BinReader *p, int n){
+  char *z;
+  if( n<0 || p->i+n>p->n ) return 0;
+  z = xjd1LabelNew(p->pPool, p->pLabels, (const char*)&p->a[p->i], n);
+  p->i += n;
+  return z;
+}
+
+/*
+** Advance past the value that begins at the current offset.  Return
+** non-zero if the input is malformed.
+*/
+static int skipValue(BinReader *p){
+  int n;
+  if( p->i>=p->n ) return 1;
+  switch( p->a[p->i++] ){
+    case XJD1_FALSE:
+    case XJD1_TRUE:
+    case XJD1_NULL:
+      return 0;
+    case XJD1_REAL:
+      n = 8;
+      break;
+    case STORAGE_INT:
+      return getVarint(p)<0;
+    case XJD1_STRING:
+      n = getVarint(p);
+      break;
+    case XJD1_ARRAY:
+    case XJD1_STRUCT:
+      n = get4(p);
+      break;
+    default:
+      return 1;
+  }
+  if( n<0 || p->i+n>p->n ) return 1;
+  p->i += n;
+  return 0;
+}
+
+/*
+** Return the sub-projection of struct projection pProj for the label
+** held in the nLabel bytes at zLabel, or NULL if that label is not
+** projected.
+*/
+static const JsonNode *projectionFind(
+  const JsonNode *pProj,
+  const unsigned char *zLabel,
+  int nLabel
+){
+  JsonStructElem *pElem;
+  for(pElem=pProj->u.st.pFirst; pElem; pElem=pElem->pNext){
+    if( strncmp(pElem->zLabel, (const char*)zLabel, nLabel)==0
+     && pElem->zLabel[nLabel]==0
+    ){
+      return pElem->pValue;
+    }
+  }
+  return 0;
+}
+
+/*
+** Allocate n bytes of zeroed memory for the value being decoded by p.
+*/
+static void *binMallocZero(BinReader *p, int n){
+  if( p->pPool ) return xjd1PoolMallocZero(p->pPool, n);
+  return xjd1MallocZero(n);
+}
+
+/*
+** Decode the value that begins at the current offset.  Return NULL if
+** the input is malformed or on OOM.
+**
+** If pProj is a struct, then it is a projection as described under
+** xjd1JsonParseProjection() and struct elements that it does not name
+** are skipped.
+*/
+static JsonNode *decodeValue(BinReader *p, const JsonNode *pProj){
+  JsonNode *pNew;
+  if( p->i>=p->n ) return 0;
+  pNew = xjd1JsonNew(p->pPool);
+  if( pNew==0 ) return 0;
+  pNew->eJType = p->a[p->i++];
+  switch( pNew->eJType ){
+    case XJD1_FALSE:
+    case XJD1_TRUE:
+    case XJD1_NULL:
+      break;
+    case XJD1_REAL: {
+      sqlite3_uint64 x = 0;
+      int i;
+      if( p->i+8>p->n ) goto decode_error;
+      for(i=7; i>=0; i--) x = (x<<8) | p->a[p->i+i];
+      memcpy(&pNew->u.r, &x, sizeof(x));
+      p->i += 8;
+      break;
+    }
+    case STORAGE_INT: {
+      int v = getVarint(p);
+      if( v<0 ) goto decode_error;
+      pNew->eJType = XJD1_REAL;
+      pNew->u.r = (v & 1) ? -(double)(v>>1) - 1.0 : (double)(v>>1);
+      break;
+    }
+    case XJD1_STRING: {
+      pNew->u.z = getString(p, getVarint(p));
+      if( pNew->u.z==0 ) goto decode_error;
+      break;
+    }
+    case XJD1_ARRAY: {
+      int nElem, i;
+      if( get4(p)<0 ) goto decode_error;
+      nElem = getVarint(p);
+      if( nElem<0 || nElem>(p->n-p->i)/4 ) goto decode_error;
+      p->i += 4*nElem;
+      if( nElem>0 ){
+        pNew->u.ar.apElem = binMallocZero(p, sizeof(JsonNode*)*nElem);
+        if( pNew->u.ar.apElem==0 ) goto decode_error;
+      }
+      for(i=0; i<nElem; i++){
+        pNew->u.ar.apElem[i] = decodeValue(p, 0);
+        if( pNew->u.ar.apElem[i]==0 ) goto decode_error;
+        pNew->u.ar.nElem++;
+      }
+      break;
+    }
+    case XJD1_STRUCT: {
+      JsonStructElem **ppTail = &pNew->u.st.pFirst;
+      int nElem, i;
+      if( get4(p)<0 ) goto decode_error;
+      nElem = getVarint(p);
+      if( nElem<0 ) goto decode_error;
+      if( pProj && pProj->eJType!=XJD1_STRUCT ) pProj = 0;
+      for(i=0; i<nElem; i++){
+        JsonStructElem *pElem;
+        const JsonNode *pSub = 0;
+        if( pProj ){
+          int nLabel = getVarint(p);
+          if( nLabel<0 || p->i+nLabel>p->n ) goto decode_error;
+          pSub = projectionFind(pProj, &p->a[p->i], nLabel);
+          if( pSub==0 ){
+            p->i += nLabel;
+            if( skipValue(p) ) goto decode_error;
+            continue;
+          }
+          pElem = binMallocZero(p, sizeof(*pElem));
+          if( pElem==0 ) goto decode_error;
+          pElem->zLabel = getLabel(p, nLabel);
+        }else{
+          pElem = binMallocZero(p, sizeof(*pElem));
+          if( pElem==0 ) goto decode_error;
+          pElem->zLabel = getLabel(p, getVarint(p));
+        }
+        *ppTail = pElem;
+        pNew->u.st.pLast = pElem;
+        ppTail = &pElem->pNext;
+        if( pElem->zLabel==0 ) goto decode_error;
+        pElem->pValue = decodeValue(p, pSub);
+        if( pElem->pValue==0 ) goto decode_error;
+      }
+      break;
+    }
+    default: {
+      if( p->pPool==0 ) xjd1_free(pNew);
+      return 0;
+    }
+  }
+  return pNew;
+
+decode_error:
+  xjd1JsonFree(pNew);
+  return 0;
+}
+
+/*
+** Decode the binary value in the n bytes at a[]. If pLabels is not NULL,
+** labels are interned in it.
+*/
+JsonNode *xjd1StorageDecode(const void *a, int n, LabelTable *pLabels){
+  BinReader x;
+  x.a = (const unsigned char*)a;
+  x.n = n;
+  x.i = 0;
+  x.pLabels = pLabels;
+  x.pPool = 0;
+  return decodeValue(&x, 0);
+}
+
+/*
+** Decode only the part of the binary value in the n bytes at a[] that
+** is identified by the nPath steps of a path, as described under
+** xjd1JsonExtract(). This is the binary equivalent of that routine. An
+** array subscript is found with the offset table of the array, without
+** looking at the elements before it. Return NULL if the path does not
+** exist.
+*/
+JsonNode *xjd1StorageExtract(
+  const void *a,
+  int n,
+  int nPath,
+  const char **azPath,
+  const int *aiPath,
+  int *pbUnknown
+){
+  BinReader x;
+  int i;
+  x.a = (const unsigned char*)a;
+  x.n = n;
+  x.i = 0;
+  x.pLabels = 0;
+  x.pPool = 0;
+  *pbUnknown = 0;
+  for(i=0; i<nPath; i++){
+    int nElem, j;
+    int nLabel;
+    if( x.i>=x.n ) return 0;
+    if( x.a[x.i]==XJD1_ARRAY && aiPath[i]>=0 ){
+      int iTable, iElem;
+      x.i++;
+      if( get4(&x)<0 ) return 0;
+      nElem = getVarint(&x);
+      if( nElem<=aiPath[i] || nElem>(x.n-x.i)/4 ) return 0;
+      iTable = x.i;
+      x.i = iTable + 4*aiPath[i];
+      iElem = get4(&x);
+      if( iElem<0 || iElem>x.n-(iTable+4*nElem) ) return 0;
+      x.i = iTable + 4*nElem + iElem;
+      continue;
+    }
+    if( x.a[x.i]==XJD1_STRING && aiPath[i]>=0 ){
+      *pbUnknown = 1;
+      return 0;
+    }
+    if( x.a[x.i]!=XJD1_STRUCT ) return 0;
+    x.i++;
+    if( get4(&x)<0 ) return 0;
+    nElem = getVarint(&x);
+    nLabel = xjd1Strlen30(azPath[i]);
+    for(j=0; j<nElem; j++){
+      int nLen = getVarint(&x);
+      if( nLen<0 || x.i+nLen>x.n ) return 0;
+      x.i += nLen;
+      if( nLen==nLabel && memcmp(&x.a[x.i-nLen], azPath[i], nLen)==0 ) break;
+      if( skipValue(&x) ) return 0;
+    }
+    if( j>=nElem ) return 0;
+  }
+  return decodeValue(&x, 0);
+}
+
+/*
+** Return the document stored in the n bytes at a[]. If isBinary is true
+** the document is in the binary format. Otherwise it is nul-terminated
+** JSON text. If pProj is not NULL, only the parts of the document named
+** by projection pProj are decoded.  See xjd1JsonParseProjection().
+** If pLabels is not NULL, labels are interned in it. If pPool is not
+** NULL, the document is allocated from it, and is freed along with the
+** pool rather than by xjd1JsonFree().
+**
+** This routine uses no SQLite interfaces and may be called from any
+** thread.
+*/
+JsonNode *xjd1StorageRead(
+  const void *a,
+  int n,
+  int isBinary,
+  const JsonNode *pProj,
+  LabelTable *pLabels,
+  Pool *pPool
+){
+  if( isBinary ){
+    BinReader x;
+    x.a = (const unsigned char*)a;
+    x.n = n;
+    x.i = 0;
+    x.pLabels = pLabels;
+    x.pPool = pPool;
+    return decodeValue(&x, pProj);
+  }else{
+    return xjd1JsonParseProjection((const char*)a, n, pProj, pLabels, pPool);
+  }
+}
+
+/*
+** Return the document held in column iCol of the current row of pStmt.
+** See xjd1StorageRead() for the meaning of pProj, pLabels and pPool.
+*/
+JsonNode *xjd1StorageColumn(
+  sqlite3_stmt *pStmt,
+  int iCol,
+  const JsonNode *pProj,
+  LabelTable *pLabels,
+  Pool *pPool
+){
+  int n;
+  if( sqlite3_column_type(pStmt, iCol)==SQLITE_BLOB ){
+    const void *a = sqlite3_column_blob(pStmt, iCol);
+    n = sqlite3_column_bytes(pStmt, iCol);
+    return xjd1StorageRead(a, n, 1, pProj, pLabels, pPool);
+  }else{
+    const char *zJson = (const char*)sqlite3_column_text(pStmt, iCol);
+    n = sqlite3_column_bytes(pStmt, iCol);
+    return xjd1StorageRead(zJson, n, 0, pProj, pLabels, pPool);
+  }
+}
+
+/*
+** Return true if column iCol of pStmt is the x column of a collection
+** that uses the binary storage format.
+*/
+int xjd1StorageIsBinary(sqlite3_stmt *pStmt, int iCol){
+  const char *zType = sqlite3_column_decltype(pStmt, iCol);
+  return zType && strcmp(zType, "BLOB")==0;
+}
+
+/*
+** Return true if collection zColl uses the binary storage format.
+*/
+int xjd1StorageCollIsBinary(sqlite3 *db, const char *zColl){
+  sqlite3_stmt *pStmt = 0;
+  char *zSql = sqlite3_mprintf("SELECT x FROM \"%w\"", zColl);
+  int isBinary = 0;
+  sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if( pStmt ){
+    isBinary = xjd1StorageIsBinary(pStmt, 0);
+    sqlite3_finalize(pStmt);
+  }
+  return isBinary;
+}
+
+/*
+** Bind document pDoc to parameter iParam of pStmt, in the binary format
+** if isBinary is true or as JSON text otherwise.
+*/
+int xjd1StorageBind(
+  sqlite3_stmt *pStmt,
+  int iParam,
+  const JsonNode *pDoc,
+  int isBinary
+){
+  String x;
+  int rc;
+  xjd1StringInit(&x, 0, 0);
+  if( isBinary ){
+    xjd1StorageEncode(&x, pDoc);
+    rc = sqlite3_bind_blob(pStmt, iParam, xjd1StringText(&x),
+                           xjd1StringLen(&x), SQLITE_TRANSIENT);
+  }else{
+    xjd1JsonRender(&x, (JsonNode*)pDoc);
+    rc = sqlite3_bind_text(pStmt, iParam, xjd1StringText(&x),
+                           xjd1StringLen(&x), SQLITE_TRANSIENT);
+  }
+  xjd1StringClear(&x);
+  return rc==SQLITE_OK ? XJD1_OK : XJD1_ERROR;
+}
+
+/*
+** Insert document pDoc into collection zColl.  Return the rowid of the
+** new row, or 0 if the insert fails, in which case an error is left in
+** the SQLite database connection.
+*/
+sqlite3_int64 xjd1StorageInsert(xjd1 *pConn, const char *zColl, const JsonNode *pDoc){
+  int isBinary;
+  sqlite3_stmt *pIns = xjd1CatalogInsertStmt(pConn, zColl, &isBinary);
+  sqlite3_int64 iRowid = 0;
+  if( pIns ){
+    xjd1StorageBind(pIns, 1, pDoc, isBinary);
+    if( sqlite3_step(pIns)==SQLITE_DONE ){
+      iRowid = sqlite3_last_insert_rowid(pConn->db);
+    }
+    sqlite3_reset(pIns);
+    sqlite3_clear_bindings(pIns);
+  }
+  return iRowid;
+}
@@ -0,0 +1,420 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains code used to cache the results of scalar subqueries.
+**
+** A subquery used as an expression is normally run again each time the
+** expression is evaluated. The result of a subquery depends only on the
+** values of its references to the documents of outer queries, as the
+** database does not change while a SELECT statement runs. So results are
+** saved in a hash table keyed on those values. An uncorrelated subquery,
+** which has no outer references, is run once.
+**
+** The table holds at most SUBQUERY_MX_ENTRY results. It is emptied when
+** full, and each time the statement is rewound.
+*/
+#include "xjd1Int.h"
+
+/*
+** Maximum number of results in a cache, and number of hash buckets.
+*/
+#define SUBQUERY_MX_ENTRY  1024
+#define SUBQUERY_NHASH     1024
+
+/*
+** A cached subquery result.
+*/
+typedef struct SubqueryEntry SubqueryEntry;
+struct SubqueryEntry {
+  unsigned int h;                 /* Hash of the key values */
+  JsonNode **apKey;               /* Values of the outer references */
+  JsonNode *pRes;                 /* Result of the subquery */
+  SubqueryEntry *pNext;           /* Next entry in the same bucket */
+};
+
+/*
+** The result cache of a subquery.
+*/
+struct SubqueryCache {
+  Query *pQuery;                  /* The subquery */
+  int nKey;                       /* Number of outer references */
+  int nAlloc;                     /* Allocated size of apKey[] */
+  Expr **apKey;                   /* Outer references */
+  int nRewind;                    /* Statement nRewind when entries added */
+  int nEntry;                     /* Number of cached results */
+  SubqueryEntry **aHash;          /* Hash table of results, or NULL */
+  JsonNode **apPending;           /* Key values of the last miss */
+  unsigned int hPending;          /* Hash of apPending[] */
+  int isPending;                  /* True if apPending[] may be stored */
+};
+
+/*
+** Return true if query pTarget is query p or is nested within it.
+*/
+static int queryContains(Query *p, Query *pTarget);
+static int datasrcContains(DataSrc *p, Query *pTarget){
+  if( p==0 ) return 0;
+  switch( p->eDSType ){
+    case TK_COMMA:
+      return datasrcContains(p->u.join.pLeft, pTarget)
+          || datasrcContains(p->u.join.pRight, pTarget);
+    case TK_SELECT:
+      return queryContains(p->u.subq.q, pTarget);
+    case TK_FLATTENOP:
+      return datasrcContains(p->u.flatten.pNext, pTarget);
+  }
+  return 0;
+}
+static int exprContains(Expr*, Query*);
+static int listContains(ExprList *pList, Query *pTarget){
+  int i;
+  if( pList==0 ) return 0;
+  for(i=0; i<pList->nEItem; i++){
+    if( exprContains(pList->apEItem[i].pExpr, pTarget) ) return 1;
+  }
+  return 0;
+}
+static int exprContains(Expr *p, Query *pTarget){
+  if( p==0 ) return 0;
+  switch( p->eClass ){
+    case XJD1_EXPR_BI:
+      return exprContains(p->u.bi.pLeft, pTarget)
+          || exprContains(p->u.bi.pRight, pTarget);
+    case XJD1_EXPR_TRI:
+      return exprContains(p->u.tri.pTest, pTarget)
+          || exprContains(p->u.tri.pIfTrue, pTarget)
+          || exprContains(p->u.tri.pIfFalse, pTarget);
+    case XJD1_EXPR_LVALUE:
+      return exprContains(p->u.lvalue.pLeft, pTarget);
+    case XJD1_EXPR_FUNC:
+      return listContains(p->u.func.args, pTarget);
+    case XJD1_EXPR_ARRAY:
+      return listContains(p->u.ar, pTarget);
+    case XJD1_EXPR_STRUCT:
+      return listContains(p->u.st, pTarget);
+    case XJD1_EXPR_Q:
+      return queryContains(p->u.subq.p, pTarget);
+  }
+  return 0;
+}
+static int queryContains(Query *p, Query *pTarget){
+  if( p==0 ) return 0;
+  if( p==pTarget ) return 1;
+  if( p->eQType!=TK_SELECT ){
+    return queryContains(p->u.compound.pLeft, pTarget)
+        || queryContains(p->u.compound.pRight, pTarget);
+  }
+  return exprContains(p->u.simple.pRes, pTarget)
+      || datasrcContains(p->u.simple.pFrom, pTarget)
+      || exprContains(p->u.simple.pWhere, pTarget)
+      || listContains(p->u.simple.pGroupBy, pTarget)
+      || exprContains(p->u.simple.pHaving, pTarget)
+      || listContains(p->pOrderBy, pTarget)
+      || exprContains(p->pLimit, pTarget)
+      || exprContains(p->pOffset, pTarget);
+}
+
+/*
+** Add expression pExpr to the outer references of cache p.
+*/
+static int subqueryAddKey(SubqueryCache *p, Expr *pExpr){
+  if( p->nKey==p->nAlloc ){
+    int nNew = p->nAlloc ? p->nAlloc*2 : 4;
+    Expr **apNew = xjd1_realloc(p->apKey, nNew*sizeof(Expr*));
+    if( apNew==0 ) return XJD1_NOMEM;
+    p->apKey = apNew;
+    p->nAlloc = nNew;
+  }
+  p->apKey[p->nKey++] = pExpr;
+  return XJD1_OK;
+}
+
+/*
+** Add the references to documents of outer queries made by expression
+** pExpr to cache p. A path such as "a.b.c" is added as a whole.
+*/
+static int subqueryFindQuery(SubqueryCache*, Query*);
+static int subqueryFindList(SubqueryCache*, ExprList*);
+static int subqueryFindExpr(SubqueryCache *p, Expr *pExpr){
+  int rc = XJD1_OK;
+  if( pExpr==0 ) return XJD1_OK;
+  switch( pExpr->eClass ){
+    case XJD1_EXPR_BI: {
+      rc = subqueryFindExpr(p, pExpr->u.bi.pLeft);
+      if( rc==XJD1_OK ) rc = subqueryFindExpr(p, pExpr->u.bi.pRight);
+      break;
+    }
+    case XJD1_EXPR_TRI: {
+      rc = subqueryFindExpr(p, pExpr->u.tri.pTest);
+      if( rc==XJD1_OK ) rc = subqueryFindExpr(p, pExpr->u.tri.pIfTrue);
+      if( rc==XJD1_OK ) rc = subqueryFindExpr(p, pExpr->u.tri.pIfFalse);
+      break;
+    }
+    case XJD1_EXPR_TK:
+    case XJD1_EXPR_LVALUE: {
+      Expr *pBase = pExpr;
+      while( pBase->eType==TK_DOT ) pBase = pBase->u.lvalue.pLeft;
+      if( pBase->eType==TK_ID ){
+        Query *pRef = pBase->u.id.pQuery;
+        if( pRef==0 || !queryContains(p->pQuery, pRef) ){
+          rc = subqueryAddKey(p, pExpr);
+        }
+      }else if( pBase!=pExpr ){
+        rc = subqueryFindExpr(p, pBase);
+      }
+      break;
+    }
+    case XJD1_EXPR_FUNC: {
+      rc = subqueryFindList(p, pExpr->u.func.args);
+      break;
+    }
+    case XJD1_EXPR_ARRAY: {
+      rc = subqueryFindList(p, pExpr->u.ar);
+      break;
+    }
+    case XJD1_EXPR_STRUCT: {
+      rc = subqueryFindList(p, pExpr->u.st);
+      break;
+    }
+    case XJD1_EXPR_Q: {
+      rc = subqueryFindQuery(p, pExpr->u.subq.p);
+      break;
+    }
+  }
+  return rc;
+}
+static int subqueryFindList(SubqueryCache *p, ExprList *pList){
+  int rc = XJD1_OK;
+  int i;
+  for(i=0; pList && rc==XJD1_OK && i<pList->nEItem; i++){
+    rc = subqueryFindExpr(p, pList->apEItem[i].pExpr);
+  }
+  return rc;
+}
+static int subqueryFindDataSrc(SubqueryCache *p, DataSrc *pSrc){
+  int rc = XJD1_OK;
+  if( pSrc==0 ) return XJD1_OK;
+  switch( pSrc->eDSType ){
+    case TK_COMMA: {
+      rc = subqueryFindDataSrc(p, pSrc->u.join.pLeft);
+      if( rc==XJD1_OK ) rc = subqueryFindDataSrc(p, pSrc->u.join.pRight);
+      break;
+    }
+    case TK_SELECT: {
+      rc = subqueryFindQuery(p, pSrc->u.subq.q);
+      break;
+    }
+    case TK_FLATTENOP: {
+      /* The FLATTEN or EACH path is relative to the document of pNext */
+      rc = subqueryFindDataSrc(p, pSrc->u.flatten.pNext);
+      break;
+    }
+    case TK_DOT: {
+      rc = subqueryFindExpr(p, pSrc->u.path.pPath);
+      break;
+    }
+  }
+  return rc;
+}
+static int subqueryFindQuery(SubqueryCache *p, Query *pQuery){
+  int rc = XJD1_OK;
+  if( pQuery==0 ) return XJD1_OK;
+  if( pQuery->eQType!=TK_SELECT ){
+    rc = subqueryFindQuery(p, pQuery->u.compound.pLeft);
+    if( rc==XJD1_OK ) rc = subqueryFindQuery(p, pQuery->u.compound.pRight);
+  }else{
+    rc = subqueryFindExpr(p, pQuery->u.simple.pRes);
+    if( rc==XJD1_OK ) rc = subqueryFindDataSrc(p, pQuery->u.simple.pFrom);
+    if( rc==XJD1_OK ) rc = subqueryFindExpr(p, pQuery->u.simple.pWhere);
+    if( rc==XJD1_OK ) rc = subqueryFindList(p, pQuery->u.simple.pGroupBy);
+    if( rc==XJD1_OK ) rc = subqueryFindExpr(p, pQuery->u.simple.pHaving);
+  }
+  if( rc==XJD1_OK ) rc = subqueryFindList(p, pQuery->pOrderBy);
+  if( rc==XJD1_OK ) rc = subqueryFindExpr(p, pQuery->pLimit);
+  if( rc==XJD1_OK ) rc = subqueryFindExpr(p, pQuery->pOffset);
+  return rc;
+}
+
+/*
+** Return a new result cache for subquery expression pExpr, which has
+** already been initialized. Return NULL if the results should not be
+** cached.
+*/
+SubqueryCache *xjd1SubqueryCacheNew(Expr *pExpr){
+  Query *pQuery = pExpr->u.subq.p;
+  SubqueryCache *p;
+
+  assert( pExpr->eType==TK_SELECT );
+  if( pQuery==0 || pQuery->pStmt->pCmd->eCmdType!=TK_SELECT ) return 0;
+  p = xjd1MallocZero(sizeof(*p));
+  if( p==0 ) return 0;
+  p->pQuery = pQuery;
+  if( subqueryFindQuery(p, pQuery)!=XJD1_OK ){
+    xjd1SubqueryCacheFree(p);
+    return 0;
+  }
+  if( p->nKey ){
+    p->apPending = xjd1MallocZero(p->nKey*sizeof(JsonNode*));
+    if( p->apPending==0 ){
+      xjd1SubqueryCacheFree(p);
+      return 0;
+    }
+  }
+  p->nRewind = pQuery->pStmt->nRewind;
+  return p;
+}
+
+/*
+** Remove all results from cache p.
+*/
+static void subqueryClear(SubqueryCache *p){
+  if( p->aHash ){
+    int i, j;
+    for(i=0; i<SUBQUERY_NHASH; i++){
+      SubqueryEntry *pEntry, *pNext;
+      for(pEntry=p->aHash[i]; pEntry; pEntry=pNext){
+        pNext = pEntry->pNext;
+        for(j=0; j<p->nKey; j++) xjd1JsonFree(pEntry->apKey[j]);
+        xjd1JsonFree(pEntry->pRes);
+        xjd1_free(pEntry);
+      }
+      p->aHash[i] = 0;
+    }
+  }
+  p->nEntry = 0;
+}
+
+/*
+** Free the key values saved by the last call to xjd1SubqueryCacheLookup().
+*/
+static void subqueryClearPending(SubqueryCache *p){
+  int i;
+  for(i=0; i<p->nKey; i++){
+    xjd1JsonFree(p->apPending[i]);
+    p->apPending[i] = 0;
+  }
+  p->isPending = 0;
+}
+
+/*
+** Return true if value p contains no NaN and no negative zero. Values
+** that xjd1JsonCompare() finds equal to such a value are identical to it.
+*/
+static int subqueryIsExact(const JsonNode *p){
+  if( p==0 ) return 1;
+  switch( p->eJType ){
+    case XJD1_REAL:
+      return p->u.r==p->u.r && (p->u.r!=0.0 || 1.0/p->u.r>0.0);
+    case XJD1_ARRAY: {
+      int i;
+      for(i=0; i<p->u.ar.nElem; i++){
+        if( !subqueryIsExact(p->u.ar.apElem[i]) ) return 0;
+      }
+      break;
+    }
+    case XJD1_STRUCT: {
+      JsonStructElem *pElem;
+      for(pElem=p->u.st.pFirst; pElem; pElem=pElem->pNext){
+        if( !subqueryIsExact(pElem->pValue) ) return 0;
+      }
+      break;
+    }
+  }
+  return 1;
+}
+
+/*
+** Look up the result of the subquery for the current values of its outer
+** references. If it is cached, set *ppRes to a new reference to it and
+** return true. Otherwise, return false. The result should then be passed
+** to xjd1SubqueryCacheStore() once the subquery has been run.
+*/
+int xjd1SubqueryCacheLookup(SubqueryCache *p, JsonNode **ppRes){
+  int nRewind = p->pQuery->pStmt->nRewind;
+  SubqueryEntry *pEntry;
+  unsigned int h = 0;
+  int i;
+
+  if( p->nRewind!=nRewind ){
+    subqueryClear(p);
+    p->nRewind = nRewind;
+  }
+  subqueryClearPending(p);
+  for(i=0; i<p->nKey; i++){
+    int dummy = 0;
+    p->apPending[i] = xjd1ExprEval(p->apKey[i]);
+    if( !subqueryIsExact(p->apPending[i]) ) return 0;
+    h = h*1000003 + xjd1JsonHash(p->apPending[i], &dummy);
+  }
+  p->hPending = h;
+  p->isPending = 1;
+  if( p->aHash==0 ) return 0;
+  for(pEntry=p->aHash[h%SUBQUERY_NHASH]; pEntry; pEntry=pEntry->pNext){
+    if( pEntry->h!=h ) continue;
+    for(i=0; i<p->nKey; i++){
+      if( xjd1JsonCompare(pEntry->apKey[i], p->apPending[i], 0)!=0 ) break;
+    }
+    if( i==p->nKey ){
+      subqueryClearPending(p);
+      *ppRes = xjd1JsonRef(pEntry->pRes);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+** Save pRes as the result of the subquery for the key values of the last
+** call to xjd1SubqueryCacheLookup().
+*/
+void xjd1SubqueryCacheStore(SubqueryCache *p, JsonNode *pRes){
+  SubqueryEntry *pEntry;
+  int iHash;
+  if( p->isPending==0 || pRes==0 ) return;
+  if( p->aHash==0 ){
+    p->aHash = xjd1MallocZero(SUBQUERY_NHASH*sizeof(SubqueryEntry*));
+    if( p->aHash==0 ) return;
+  }
+  if( p->nEntry>=SUBQUERY_MX_ENTRY ) subqueryClear(p);
+  pEntry = xjd1MallocZero(sizeof(*pEntry) + p->nKey*sizeof(JsonNode*));
+  if( pEntry==0 ) return;
+  pEntry->apKey = (JsonNode**)&pEntry[1];
+  if( p->nKey ){
+    memcpy(pEntry->apKey, p->apPending, p->nKey*sizeof(JsonNode*));
+    memset(p->apPending, 0, p->nKey*sizeof(JsonNode*));
+  }
+  p->isPending = 0;
+  pEntry->h = p->hPending;
+  pEntry->pRes = xjd1JsonRef(pRes);
+  iHash = pEntry->h%SUBQUERY_NHASH;
+  pEntry->pNext = p->aHash[iHash];
+  p->aHash[iHash] = pEntry;
+  p->nEntry++;
+}
+
+/*
+** Free a result cache.
+*/
+void xjd1SubqueryCacheFree(SubqueryCache *p){
+  if( p ){
+    if( p->apPending ) subqueryClearPending(p);
+    subqueryClear(p);
+    xjd1_free(p->aHash);
+    xjd1_free(p->apPending);
+    xjd1_free(p->apKey);
+    xjd1_free(p);
+  }
+}
@@ -0,0 +1,198 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains the pool of worker threads that a database
+** connection uses to run CPU-bound work, such as parsing documents, in
+** parallel.
+**
+** The only interface is xjd1ThreadRun(), which calls a function once for
+** each of a number of tasks and returns when all of them are complete.
+** The calling thread runs tasks too. Only the task functions run on the
+** worker threads. They must not use SQLite or any xjd1 object that is
+** not private to the task, and any xjd1_malloc() replacement must be
+** threadsafe.
+**
+** Threads are only available if the library is compiled with
+** XJD1_ENABLE_THREADS. Otherwise, and until XJD1_CONFIG_THREADS sets the
+** number of threads to more than one, tasks run one after another on the
+** calling thread.
+*/
+#include "xjd1Int.h"
+
+#ifdef XJD1_ENABLE_THREADS
+#include <pthread.h>
+
+/*
+** Maximum number of threads in a pool, including the calling thread.
+*/
+#define XJD1_MX_THREAD 64
+
+/*
+** A pool of worker threads.
+*/
+struct ThreadPool {
+  int nThread;                    /* Number of threads, including caller */
+  pthread_mutex_t mutex;          /* Protects all fields below */
+  pthread_cond_t cWork;           /* Signalled when work is available */
+  pthread_cond_t cDone;           /* Signalled when work is complete */
+  int iGeneration;                /* Incremented for each xjd1ThreadRun() */
+  int isShutdown;                 /* True to make the workers exit */
+  void (*xTask)(void*,int);       /* Function for the current tasks */
+  void *pArg;                     /* First argument to xTask */
+  int nTask;                      /* Number of tasks */
+  int iNext;                      /* Next task to start */
+  int nRunning;                   /* Number of workers still busy */
+  pthread_t aThread[1];           /* Worker threads.  Extra space follows */
+};
+
+/*
+** Run tasks from the current batch of pool p until there are none left.
+** The mutex must be held on entry.  It is held on exit.
+*/
+static void threadRunTasks(ThreadPool *p){
+  while( p->iNext<p->nTask ){
+    int iTask = p->iNext++;
+    pthread_mutex_unlock(&p->mutex);
+    p->xTask(p->pArg, iTask);
+    pthread_mutex_lock(&p->mutex);
+  }
+}
+
+/*
+** The main routine of a worker thread.
+*/
+static void *threadMain(void *pArg){
+  ThreadPool *p = (ThreadPool*)pArg;
+  int iGeneration = 0;
+  pthread_mutex_lock(&p->mutex);
+  while( 1 ){
+    while( p->isShutdown==0 && p->iGeneration==iGeneration ){
+      pthread_cond_wait(&p->cWork, &p->mutex);
+    }
+    if( p->isShutdown ) break;
+    iGeneration = p->iGeneration;
+    threadRunTasks(p);
+    p->nRunning--;
+    if( p->nRunning==0 ) pthread_cond_signal(&p->cDone);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+
+/*
+** Stop the worker threads of connection pConn and free the pool.
+*/
+void xjd1ThreadFree(xjd1 *pConn){
+  ThreadPool *p = pConn->pThreadPool;
+  if( p ){
+    int i;
+    pthread_mutex_lock(&p->mutex);
+    p->isShutdown = 1;
+    pthread_cond_broadcast(&p->cWork);
+    pthread_mutex_unlock(&p->mutex);
+    for(i=0; i<p->nThread-1; i++){
+      pthread_join(p->aThread[i], 0);
+    }
+    pthread_cond_destroy(&p->cWork);
+    pthread_cond_destroy(&p->cDone);
+    pthread_mutex_destroy(&p->mutex);
+    xjd1_free(p);
+    pConn->pThreadPool = 0;
+  }
+}
+
+/*
+** Set the number of threads, including the calling thread, used by
+** connection pConn to nThread.
+*/
+int xjd1ThreadConfig(xjd1 *pConn, int nThread){
+  ThreadPool *p;
+  int i;
+  xjd1ThreadFree(pConn);
+  if( nThread>XJD1_MX_THREAD ) nThread = XJD1_MX_THREAD;
+  if( nThread<=1 ) return XJD1_OK;
+  p = xjd1MallocZero(sizeof(*p) + (nThread-2)*sizeof(pthread_t));
+  if( p==0 ) return XJD1_NOMEM;
+  pthread_mutex_init(&p->mutex, 0);
+  pthread_cond_init(&p->cWork, 0);
+  pthread_cond_init(&p->cDone, 0);
+  pConn->pThreadPool = p;
+  for(i=0; i<nThread-1; i++){
+    if( pthread_create(&p->aThread[i], 0, threadMain, (void*)p) ) break;
+    p->nThread = i+2;
+  }
+  if( p->nThread==0 ){
+    xjd1ThreadFree(pConn);
+    return XJD1_ERROR;
+  }
+  return XJD1_OK;
+}
+
+/*
+** Return the number of threads, including the calling thread, that
+** xjd1ThreadRun() uses on connection pConn.
+*/
+int xjd1ThreadCount(xjd1 *pConn){
+  return pConn->pThreadPool ? pConn->pThreadPool->nThread : 1;
+}
+
+/*
+** Call xTask(pArg, i) for each i from 0 to nTask-1, using the worker
+** threads of connection pConn. Return when all calls have returned.
+**
+** The label table of the connection is frozen while the tasks run, so
+** that they may all read it at once.
+*/
+void xjd1ThreadRun(xjd1 *pConn, int nTask, void (*xTask)(void*,int), void *pArg){
+  ThreadPool *p = pConn->pThreadPool;
+  int i;
+  if( p==0 || nTask<=1 ){
+    for(i=0; i<nTask; i++) xTask(pArg, i);
+    return;
+  }
+  xjd1LabelTableFreeze(pConn->pLabels, 1);
+  pthread_mutex_lock(&p->mutex);
+  p->xTask = xTask;
+  p->pArg = pArg;
+  p->nTask = nTask;
+  p->iNext = 0;
+  p->nRunning = p->nThread-1;
+  p->iGeneration++;
+  pthread_cond_broadcast(&p->cWork);
+  threadRunTasks(p);
+  while( p->nRunning>0 ){
+    pthread_cond_wait(&p->cDone, &p->mutex);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  xjd1LabelTableFreeze(pConn->pLabels, 0);
+}
+
+#else /* XJD1_ENABLE_THREADS */
+
+/*
+** Without XJD1_ENABLE_THREADS all tasks run on the calling thread.
+*/
+void xjd1ThreadFree(xjd1 *pConn){ }
+int xjd1ThreadConfig(xjd1 *pConn, int nThread){
+  return nThread<=1 ? XJD1_OK : XJD1_ERROR;
+}
+int xjd1ThreadCount(xjd1 *pConn){ return 1; }
+void xjd1ThreadRun(xjd1 *pConn, int nTask, void (*xTask)(void*,int), void *pArg){
+  int i;
+  for(i=0; i<nTask; i++) xTask(pArg, i);
+}
+
+#endif /* XJD1_ENABLE_THREADS */
@@ -86,68 +86,71 @@ const unsigned char xjd1CtypeMap[256] = {
 ** The following code is automatically generated
 ** by ../tool/mkkeywordhash.c
 */
-/* Hash score: 61 */
+/* Hash score: 64 */
 static int keywordCode(const char *z, int n){
-  /* zText[] encodes 333 bytes of keywords in 224 bytes */
-  /*   BEGINTORDEROLLBACKELSELECTGROUPDATEACHAVINGLOBYWITHINSERTALL       */
-  /*   IMITASCENDINGASYNCHRONOUSCOLLATEXISTSCOLLECTIONULLCREATEXCEPT      */
-  /*   DELETEDESCENDINGDROPRAGMAFLATTENOTIFROMILIKEUNIONVALUEWHEREin      */
-  /*   ullCOMMITDISTINCTINTERSECTOFFSETfalsetrue                          */
-  static const char zText[223] = {
-    'B','E','G','I','N','T','O','R','D','E','R','O','L','L','B','A','C','K',
-    'E','L','S','E','L','E','C','T','G','R','O','U','P','D','A','T','E','A',
-    'C','H','A','V','I','N','G','L','O','B','Y','W','I','T','H','I','N','S',
-    'E','R','T','A','L','L','I','M','I','T','A','S','C','E','N','D','I','N',
-    'G','A','S','Y','N','C','H','R','O','N','O','U','S','C','O','L','L','A',
-    'T','E','X','I','S','T','S','C','O','L','L','E','C','T','I','O','N','U',
-    'L','L','C','R','E','A','T','E','X','C','E','P','T','D','E','L','E','T',
-    'E','D','E','S','C','E','N','D','I','N','G','D','R','O','P','R','A','G',
-    'M','A','F','L','A','T','T','E','N','O','T','I','F','R','O','M','I','L',
-    'I','K','E','U','N','I','O','N','V','A','L','U','E','W','H','E','R','E',
-    'i','n','u','l','l','C','O','M','M','I','T','D','I','S','T','I','N','C',
-    'T','I','N','T','E','R','S','E','C','T','O','F','F','S','E','T','f','a',
-    'l','s','e','t','r','u','e',
+  /* zText[] encodes 350 bytes of keywords in 234 bytes */
+  /*   BEGINDEXISTSELECTDROPTIONSELSEACHAVINGROUPDATEXCEPTWITHINTO        */
+  /*   RDEROLLBACKALLIMITASCENDINGLOBYASYNCHRONOUSCOLLATECOLLECTION       */
+  /*   ULLCREATEDELETEDESCENDINGFLATTENOTIFROMILIKEPRAGMAUNIONVALUE       */
+  /*   WHEREinullCOMMITDISTINCTINSERTINTERSECTOFFSETfalsetrue             */
+  static const char zText[233] = {
+    'B','E','G','I','N','D','E','X','I','S','T','S','E','L','E','C','T','D',
+    'R','O','P','T','I','O','N','S','E','L','S','E','A','C','H','A','V','I',
+    'N','G','R','O','U','P','D','A','T','E','X','C','E','P','T','W','I','T',
+    'H','I','N','T','O','R','D','E','R','O','L','L','B','A','C','K','A','L',
+    'L','I','M','I','T','A','S','C','E','N','D','I','N','G','L','O','B','Y',
+    'A','S','Y','N','C','H','R','O','N','O','U','S','C','O','L','L','A','T',
+    'E','C','O','L','L','E','C','T','I','O','N','U','L','L','C','R','E','A',
+    'T','E','D','E','L','E','T','E','D','E','S','C','E','N','D','I','N','G',
+    'F','L','A','T','T','E','N','O','T','I','F','R','O','M','I','L','I','K',
+    'E','P','R','A','G','M','A','U','N','I','O','N','V','A','L','U','E','W',
+    'H','E','R','E','i','n','u','l','l','C','O','M','M','I','T','D','I','S',
+    'T','I','N','C','T','I','N','S','E','R','T','I','N','T','E','R','S','E',
+    'C','T','O','F','F','S','E','T','f','a','l','s','e','t','r','u','e',
   };
   static const unsigned char aHash[97] = {
-       0,  34,   1,   0,   7,   0,  25,  26,   0,  39,   0,   0,  20,
-       0,  42,  37,  35,  46,  43,   0,   0,   0,  40,   0,   0,   8,
-      21,   0,   0,   4,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-       0,   0,   0,  44,   0,  13,   0,   0,  50,   0,   0,   6,   0,
-       0,   0,  45,  41,   0,  52,  22,   0,   0,   0,   0,   0,  24,
-      28,  49,  36,  19,  16,   0,   0,   0,   2,  17,  32,   0,  48,
-       0,   0,   0,  51,   0,   0,  27,  30,   0,   0,   0,  31,  14,
-       5,   0,   0,  23,  15,  47,
+       0,  42,   1,   0,  10,   0,   3,  30,   0,  40,   0,   0,  24,
+       0,  44,  38,  36,  48,  45,   0,   0,   0,  41,   0,   0,  11,
+      25,   0,   0,  16,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+       0,   0,   2,  46,   0,  13,   0,   0,  53,   0,   0,   4,   0,
+       0,   0,  47,  43,   0,  55,  26,   0,   0,   0,   6,   0,  29,
+      32,  52,  37,  23,  18,   0,   0,   0,  14,  19,  35,   0,  51,
+       0,   0,  28,  54,   0,   0,  31,  33,   0,   0,   0,  34,  50,
+       7,   0,   0,  27,  17,  49,
   };
-  static const unsigned char aNext[52] = {
+  static const unsigned char aNext[55] = {
        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      11,   0,   0,   0,   0,   9,   0,   0,   0,   0,   0,   0,   0,
-      18,   0,   0,   0,   0,   3,   0,  12,   0,   0,   0,   0,  29,
-      38,   0,  10,   0,   0,   0,   0,  33,   0,   0,   0,   0,   0,
+       0,   0,   0,   0,   0,   0,   0,   0,   0,   8,   0,   0,   0,
+       0,   0,   0,   0,  20,   0,   0,   0,  15,   0,   0,   0,   0,
+      12,  39,  22,   0,   9,   0,   0,   0,   0,   5,  21,   0,   0,
+       0,   0,   0,
   };
-  static const unsigned char aLen[52] = {
-       5,   4,   5,   8,   4,   6,   5,   6,   4,   6,   4,   2,   6,
-       6,   3,   5,   3,   9,   5,  12,   2,  11,   4,   7,   6,  10,
-       4,   6,   6,   6,   4,  10,   4,   6,   7,   3,   2,   4,   5,
-       4,   5,   5,   5,   2,   4,   6,   8,   9,   6,   3,   5,   4,
+  static const unsigned char aLen[55] = {
+       5,   5,   6,   6,   4,   7,   4,   4,   6,   5,   6,   6,   6,
+       4,   5,   8,   3,   5,   3,   9,   4,   2,   5,  12,   2,  11,
+       4,   2,   7,  10,   4,   6,   6,   4,  10,   7,   3,   2,   4,
+       5,   4,   6,   5,   5,   5,   2,   4,   6,   8,   6,   9,   6,
+       3,   5,   4,
   };
-  static const unsigned short int aOffset[52] = {
-       0,   3,   6,  10,  18,  20,  26,  29,  34,  37,  42,  45,  47,
-      51,  57,  59,  64,  64,  73,  73,  73,  74,  74,  85,  91,  97,
-     106, 110, 115, 121, 127, 127, 137, 140, 146, 152, 155, 156, 160,
-     161, 165, 170, 175, 180, 181, 185, 191, 199, 208, 211, 214, 219,
+  static const unsigned short int aOffset[55] = {
+       0,   3,   6,  11,  17,  19,  26,  29,  32,  37,  40,  45,  51,
+      55,  58,  62,  70,  72,  77,  77,  85,  88,  90,  90,  90,  91,
+      91,  97, 102, 109, 118, 122, 128, 134, 134, 144, 150, 153, 154,
+     158, 159, 163, 169, 174, 179, 184, 185, 189, 195, 203, 209, 218,
+     221, 224, 229,
   };
-  static const unsigned char aCode[52] = {
-    TK_BEGIN,      TK_INTO,       TK_ORDER,      TK_ROLLBACK,   TK_ELSE,       
-    TK_SELECT,     TK_GROUP,      TK_UPDATE,     TK_FLATTENOP,  TK_HAVING,     
-    TK_LIKEOP,     TK_BY,         TK_WITHIN,     TK_INSERT,     TK_ALL,        
-    TK_LIMIT,      TK_ASCENDING,  TK_ASCENDING,  TK_ASYNC,      TK_ASYNC,      
-    TK_AS,         TK_SYNC,       TK_SYNC,       TK_COLLATE,    TK_EXISTS,     
-    TK_COLLECTION, TK_NULL,       TK_CREATE,     TK_EXCEPT,     TK_DELETE,     
-    TK_DESCENDING, TK_DESCENDING, TK_DROP,       TK_PRAGMA,     TK_FLATTENOP,  
-    TK_NOT,        TK_IF,         TK_FROM,       TK_ILIKEOP,    TK_LIKEOP,     
-    TK_UNION,      TK_VALUE,      TK_WHERE,      TK_IN,         TK_NULL,       
-    TK_COMMIT,     TK_DISTINCT,   TK_INTERSECT,  TK_OFFSET,     TK_SET,        
-    TK_FALSE,      TK_TRUE,       
+  static const unsigned char aCode[55] = {
+    TK_BEGIN,      TK_INDEX,      TK_EXISTS,     TK_SELECT,     TK_DROP,       
+    TK_OPTIONS,    TK_ELSE,       TK_FLATTENOP,  TK_HAVING,     TK_GROUP,      
+    TK_UPDATE,     TK_EXCEPT,     TK_WITHIN,     TK_INTO,       TK_ORDER,      
+    TK_ROLLBACK,   TK_ALL,        TK_LIMIT,      TK_ASCENDING,  TK_ASCENDING,  
+    TK_LIKEOP,     TK_BY,         TK_ASYNC,      TK_ASYNC,      TK_AS,         
+    TK_SYNC,       TK_SYNC,       TK_ON,         TK_COLLATE,    TK_COLLECTION, 
+    TK_NULL,       TK_CREATE,     TK_DELETE,     TK_DESCENDING, TK_DESCENDING, 
+    TK_FLATTENOP,  TK_NOT,        TK_IF,         TK_FROM,       TK_ILIKEOP,    
+    TK_LIKEOP,     TK_PRAGMA,     TK_UNION,      TK_VALUE,      TK_WHERE,      
+    TK_IN,         TK_NULL,       TK_COMMIT,     TK_DISTINCT,   TK_INSERT,     
+    TK_INTERSECT,  TK_OFFSET,     TK_SET,        TK_FALSE,      TK_TRUE,       
   };
   int h, i;
   if( n<2 ) return TK_ID;
@@ -159,7 +162,7 @@ static int keywordCode(const char *z, int n){
   }
   return TK_ID;
 }
-#define XJD1_N_KEYWORD 52
+#define XJD1_N_KEYWORD 55
 
 /* End of the automatically generated hash code
 *********************************************************************/
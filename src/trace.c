@@ -110,6 +110,9 @@ static const struct {
   { TK_ASYNC,            "TK_ASYNC"           },
   { TK_SYNC,             "TK_SYNC"            },
   { TK_PRAGMA,           "TK_PRAGMA"          },
+  { TK_INDEX,            "TK_INDEX"           },
+  { TK_ON,               "TK_ON"              },
+  { TK_OPTIONS,          "TK_OPTIONS"         },
 };
 
 /*
@@ -138,6 +141,11 @@ void xjd1TraceCommand(String *pOut, int indent, const Command *pCmd){
       xjd1StringAppendF(pOut, "%*sCreate-Collection: \"%s\" if-not-exists=%d\n",
          indent, "", pCmd->u.crtab.zName,
          pCmd->u.crtab.ifExists);
+      if( pCmd->u.crtab.pOptions ){
+         xjd1StringAppendF(pOut, "%*s options: ", indent, "");
+         xjd1TraceExpr(pOut, pCmd->u.crtab.pOptions);
+         xjd1StringAppend(pOut, "\n", 1);
+      }
       break;
     }
     case TK_DROPCOLLECTION: {
@@ -146,6 +154,21 @@ void xjd1TraceCommand(String *pOut, int indent, const Command *pCmd){
          pCmd->u.crtab.ifExists);
       break;
     }
+    case TK_CREATEINDEX: {
+      xjd1StringAppendF(pOut, "%*sCreate-Index: \"%s\" on \"%s\" if-not-exists=%d\n",
+         indent, "", pCmd->u.crix.zName, pCmd->u.crix.zColl,
+         pCmd->u.crix.ifExists);
+      xjd1StringAppendF(pOut, "%*s path: ", indent, "");
+      xjd1TraceExpr(pOut, pCmd->u.crix.pPath);
+      xjd1StringAppend(pOut, "\n", 1);
+      break;
+    }
+    case TK_DROPINDEX: {
+      xjd1StringAppendF(pOut, "%*sDrop-Index: \"%s\" if-exists=%d\n",
+         indent, "", pCmd->u.crix.zName,
+         pCmd->u.crix.ifExists);
+      break;
+    }
     case TK_INSERT: {
       xjd1StringAppendF(pOut, "%*sInsert: %s\n",
          indent, "", pCmd->u.ins.zName);
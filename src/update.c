@@ -48,7 +48,7 @@ static JsonNode *findStructElement(JsonNode *pBase, const char *zField){
     pBase->u.st.pLast->pNext = pElem;
   }
   pBase->u.st.pLast = pElem;
-  pElem->zLabel = xjd1PoolDup(0, zField, -1);
+  pElem->zLabel = xjd1LabelNew(0, 0, zField, -1);
   pElem->pValue = xjd1JsonNew(0);
   return pElem->pValue;
 }
@@ -168,29 +168,43 @@ int xjd1UpdateStep(xjd1_stmt *pStmt){
   Command *pCmd = pStmt->pCmd;
   int rc = XJD1_OK;
   int nUpdate = 0;
+  int nRow = 0;
   sqlite3 *db = pStmt->pConn->db;
   sqlite3_stmt *pQuery, *pReplace;
+  DocArena *pArena;
+  int isBinary;
+  Index *pIdx;
   char *zSql;
+  char *zPush;
   int inAutocommit = sqlite3_get_autocommit(db);
+  int nChange = sqlite3_total_changes(db);
 
   assert( pCmd!=0 );
   assert( pCmd->eCmdType==TK_UPDATE );
   if(inAutocommit) sqlite3_exec(db, "BEGIN", 0, 0, 0);
-  zSql = sqlite3_mprintf("SELECT rowid, x FROM \"%w\"", pCmd->u.update.zName);
+  zPush = xjd1PushdownWhere(pCmd->u.update.pWhere, 0);
+  zSql = sqlite3_mprintf("SELECT rowid, x FROM \"%w\"%s%s",
+                         pCmd->u.update.zName,
+                         zPush ? " WHERE " : "", zPush ? zPush : "");
   sqlite3_prepare_v2(db, zSql, -1, &pQuery, 0);
   sqlite3_free(zSql);
+  sqlite3_free(zPush);
   zSql = sqlite3_mprintf("UPDATE \"%w\" SET x=?1 WHERE rowid=?2",
                          pCmd->u.update.zName);
   sqlite3_prepare_v2(db, zSql, -1, &pReplace, 0);
   sqlite3_free(zSql);
+  pIdx = xjd1CatalogIndices(pStmt->pConn, pCmd->u.update.zName);
+  pArena = xjd1ArenaNew();
   if( pQuery && pReplace ){
-    while( SQLITE_ROW==sqlite3_step(pQuery) ){
-      const char *zJson = (const char*)sqlite3_column_text(pQuery, 1);
-      pStmt->pDoc = xjd1JsonParse(zJson, -1);
+    isBinary = xjd1StorageIsBinary(pQuery, 1);
+    while( rc==XJD1_OK && SQLITE_ROW==sqlite3_step(pQuery) ){
+      if( nRow++==0 ) xjd1DocCacheSync(pStmt->pConn);
+      pStmt->pDoc = xjd1DocCacheColumn(pStmt->pConn, pCmd->u.update.zName,
+                                       pQuery, 0, pArena);
       if( pCmd->u.update.pWhere==0 || xjd1ExprTrue(pCmd->u.update.pWhere) ){
         JsonNode *pNewDoc;  /* Revised document content */
         ExprList *pChng;    /* List of changes */
-        String jsonNewDoc;  /* Text rendering of revised document */
+        sqlite3_int64 iRowid = sqlite3_column_int64(pQuery, 0);
         int i, n;
 
         pNewDoc = xjd1JsonEdit(xjd1JsonRef(pStmt->pDoc));
@@ -201,40 +215,54 @@ int xjd1UpdateStep(xjd1_stmt *pStmt){
           Expr *pExpr = pChng->apEItem[i+1].pExpr;
           reviseOneField(pNewDoc, pLvalue, pExpr);
         }
-        xjd1StringInit(&jsonNewDoc, 0, 0);
-        xjd1JsonRender(&jsonNewDoc, pNewDoc);
-        sqlite3_bind_int64(pReplace, 2, sqlite3_column_int64(pQuery, 0));
-        sqlite3_bind_text(pReplace, 1, xjd1StringText(&jsonNewDoc), -1,
-                          SQLITE_STATIC);
+        sqlite3_bind_int64(pReplace, 2, iRowid);
+        xjd1StorageBind(pReplace, 1, pNewDoc, isBinary);
         sqlite3_step(pReplace);
-        sqlite3_reset(pReplace);
-        xjd1StringClear(&jsonNewDoc);
+        xjd1DocCacheInvalidate(pStmt->pConn, pCmd->u.update.zName, iRowid);
+        if( sqlite3_reset(pReplace)!=SQLITE_OK
+         || xjd1IndexWrite(pIdx, iRowid, pNewDoc)!=XJD1_OK
+        ){
+          xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", sqlite3_errmsg(db));
+          rc = XJD1_ERROR;
+        }
         xjd1JsonFree(pNewDoc);
         nUpdate++;
       }
       xjd1JsonFree(pStmt->pDoc);
       pStmt->pDoc = 0;
+      pArena = xjd1ArenaRelease(pStmt->pConn, pArena);
     }
   }
+  xjd1ArenaFree(pArena);
   sqlite3_finalize(pQuery);
   sqlite3_finalize(pReplace);
 
-  if( pCmd->u.update.pUpsert ){
+  if( rc==XJD1_OK && pCmd->u.update.pUpsert ){
     if( nUpdate==0 ){
       JsonNode *pToIns;
-      String jsonToIns;
+      sqlite3_int64 iRowid;
       pToIns = xjd1ExprEval(pCmd->u.update.pUpsert);
-      xjd1StringInit(&jsonToIns, 0, 0);
-      xjd1JsonRender(&jsonToIns, pToIns);
+      iRowid = xjd1StorageInsert(pStmt->pConn, pCmd->u.update.zName, pToIns);
+      if( iRowid ){
+        xjd1DocCacheInvalidate(pStmt->pConn, pCmd->u.update.zName, iRowid);
+      }
+      if( iRowid==0 || xjd1IndexWrite(pIdx, iRowid, pToIns)!=XJD1_OK ){
+        xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", sqlite3_errmsg(db));
+        rc = XJD1_ERROR;
+      }
       xjd1JsonFree(pToIns);
-      zSql = sqlite3_mprintf(
-           "INSERT INTO \"%w\" VALUES('%q')",
-           pCmd->u.update.zName, xjd1StringText(&jsonToIns));
-      xjd1StringClear(&jsonToIns);
-      sqlite3_exec(db, zSql, 0, 0, 0);
-      sqlite3_free(zSql);
     }
   }
-  if(inAutocommit) sqlite3_exec(db, "COMMIT", 0, 0, 0);
+  if( inAutocommit ){
+    if( rc==XJD1_OK && sqlite3_exec(db, "COMMIT", 0, 0, 0)!=SQLITE_OK ){
+      xjd1Error(pStmt->pConn, XJD1_ERROR, "%s", sqlite3_errmsg(db));
+      rc = XJD1_ERROR;
+    }
+    if( rc!=XJD1_OK ){
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    }else if( sqlite3_total_changes(db)!=nChange ){
+      xjd1DocCacheCommit(pStmt->pConn);
+    }
+  }
   return rc;
 }
@@ -0,0 +1,304 @@
+/*
+** Copyright (c) 2011 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*************************************************************************
+** This file contains code used to implement a set of JSON values. Sets
+** are used by DISTINCT queries and by the UNION, INTERSECT and EXCEPT
+** operators to find the values they have already seen.
+**
+** Values are kept in a hash table. Two values are the same if
+** xjd1JsonCompare() reports them as equal. A NaN compares equal to every
+** number, so values that contain a NaN are only matched with other values
+** that contain a NaN.
+**
+** Once the values in memory use more than XJD1_CONFIG_SORTBUFFER bytes,
+** they are written to a temporary table, indexed by their hashes, and
+** the hash table is emptied. Values not found in memory are then looked
+** for in the temporary table.
+*/
+#include "xjd1Int.h"
+
+/*
+** A single value in the hash table.
+*/
+typedef struct ValueSetEntry ValueSetEntry;
+struct ValueSetEntry {
+  unsigned int h;                 /* Hash of pVal */
+  int hasNaN;                     /* True if pVal contains a NaN */
+  JsonNode *pVal;                 /* The value */
+  ValueSetEntry *pNext;           /* Next entry in the same bucket */
+};
+
+/*
+** A set of JSON values.
+*/
+struct ValueSet {
+  xjd1 *pConn;                    /* Connection, or NULL to never spill */
+  int nEntry;                     /* Number of entries in the hash table */
+  int nBucket;                    /* Size of aBucket[], a power of two */
+  ValueSetEntry **aBucket;        /* Hash buckets */
+  int nByte;                      /* Memory used by the entries */
+  sqlite3_int64 iSpill;           /* Value of the "id" column, or 0 */
+  sqlite3_stmt *pWrite;           /* Writes a value to the temporary table */
+  sqlite3_stmt *pRead;            /* Reads values with a given hash */
+};
+
+/*
+** Return a new, empty, set. If pConn is not NULL, values are written
+** to a temporary table as the memory limit of pConn is reached.
+*/
+ValueSet *xjd1ValueSetNew(xjd1 *pConn){
+  ValueSet *p = xjd1MallocZero(sizeof(*p));
+  if( p==0 ) return 0;
+  p->pConn = pConn;
+  p->nBucket = 64;
+  p->aBucket = xjd1MallocZero(p->nBucket*sizeof(ValueSetEntry*));
+  if( p->aBucket==0 ){
+    xjd1_free(p);
+    return 0;
+  }
+  return p;
+}
+
+/*
+** Free all the entries of the hash table.
+*/
+static void valueSetClearEntries(ValueSet *p){
+  int i;
+  for(i=0; i<p->nBucket; i++){
+    ValueSetEntry *pEntry, *pNext;
+    for(pEntry=p->aBucket[i]; pEntry; pEntry=pNext){
+      pNext = pEntry->pNext;
+      xjd1JsonFree(pEntry->pVal);
+      xjd1_free(pEntry);
+    }
+    p->aBucket[i] = 0;
+  }
+  p->nEntry = 0;
+  p->nByte = 0;
+}
+
+/*
+** Double the number of buckets in the hash table.
+*/
+static int valueSetRehash(ValueSet *p){
+  int nNew = p->nBucket*2;
+  ValueSetEntry **aNew = xjd1MallocZero(nNew*sizeof(ValueSetEntry*));
+  int i;
+  if( aNew==0 ) return XJD1_NOMEM;
+  for(i=0; i<p->nBucket; i++){
+    ValueSetEntry *pEntry, *pNext;
+    for(pEntry=p->aBucket[i]; pEntry; pEntry=pNext){
+      int iBucket = pEntry->h & (nNew-1);
+      pNext = pEntry->pNext;
+      pEntry->pNext = aNew[iBucket];
+      aNew[iBucket] = pEntry;
+    }
+  }
+  xjd1_free(p->aBucket);
+  p->aBucket = aNew;
+  p->nBucket = nNew;
+  return XJD1_OK;
+}
+
+/*
+** Return the value of the "h" column for a value with hash h.
+*/
+static sqlite3_int64 valueSetSpillHash(unsigned int h, int hasNaN){
+  return (sqlite3_int64)h*2 + (hasNaN ? 1 : 0);
+}
+
+/*
+** Write all the entries of the hash table to the temporary table, then
+** empty the hash table. A NULL pointer is written as an SQL NULL.
+*/
+static int valueSetSpill(ValueSet *p){
+  static const char zSchema[] =
+    "CREATE TEMP TABLE IF NOT EXISTS xjd1_set_spill(id INTEGER, h INTEGER, x);"
+    "CREATE INDEX IF NOT EXISTS temp.xjd1_set_spill_h"
+    " ON xjd1_set_spill(id, h);";
+  sqlite3 *db = p->pConn->db;
+  String out;
+  int rc = XJD1_OK;
+  int i;
+
+  if( p->iSpill==0 ){
+    if( sqlite3_exec(db, zSchema, 0, 0, 0)!=SQLITE_OK ) return XJD1_ERROR;
+    sqlite3_prepare_v2(db,
+        "INSERT INTO temp.xjd1_set_spill(id, h, x) VALUES(?1,?2,?3)", -1,
+        &p->pWrite, 0);
+    sqlite3_prepare_v2(db,
+        "SELECT x FROM temp.xjd1_set_spill WHERE id=?1 AND h=?2", -1,
+        &p->pRead, 0);
+    if( p->pWrite==0 || p->pRead==0 ) return XJD1_ERROR;
+    p->iSpill = ++p->pConn->nSetSpill;
+    sqlite3_bind_int64(p->pWrite, 1, p->iSpill);
+    sqlite3_bind_int64(p->pRead, 1, p->iSpill);
+  }
+
+  xjd1StringInit(&out, 0, 0);
+  for(i=0; rc==XJD1_OK && i<p->nBucket; i++){
+    ValueSetEntry *pEntry;
+    for(pEntry=p->aBucket[i]; rc==XJD1_OK && pEntry; pEntry=pEntry->pNext){
+      sqlite3_bind_int64(p->pWrite, 2,
+                         valueSetSpillHash(pEntry->h, pEntry->hasNaN));
+      if( pEntry->pVal ){
+        xjd1StringTruncate(&out);
+        xjd1StorageEncode(&out, pEntry->pVal);
+        sqlite3_bind_blob(p->pWrite, 3, xjd1StringText(&out),
+                          xjd1StringLen(&out), SQLITE_STATIC);
+      }else{
+        sqlite3_bind_null(p->pWrite, 3);
+      }
+      sqlite3_step(p->pWrite);
+      if( sqlite3_reset(p->pWrite)!=SQLITE_OK ) rc = XJD1_ERROR;
+    }
+  }
+  xjd1StringClear(&out);
+  valueSetClearEntries(p);
+  return rc;
+}
+
+/*
+** Set *pFound to true if value pVal, with hash h, has been written to
+** the temporary table, or to false otherwise.
+*/
+static int valueSetFindSpilled(
+  ValueSet *p,
+  const JsonNode *pVal,
+  unsigned int h,
+  int hasNaN,
+  int *pFound
+){
+  int rc;
+  *pFound = 0;
+  sqlite3_bind_int64(p->pRead, 2, valueSetSpillHash(h, hasNaN));
+  while( *pFound==0 && SQLITE_ROW==(rc = sqlite3_step(p->pRead)) ){
+    JsonNode *pSpilled = 0;
+    if( sqlite3_column_type(p->pRead, 0)!=SQLITE_NULL ){
+      pSpilled = xjd1StorageDecode(sqlite3_column_blob(p->pRead, 0),
+                                   sqlite3_column_bytes(p->pRead, 0),
+                                   p->pConn->pLabels);
+      if( pSpilled==0 ){
+        sqlite3_reset(p->pRead);
+        return XJD1_NOMEM;
+      }
+    }
+    if( xjd1JsonCompare(pSpilled, pVal, 0)==0 ) *pFound = 1;
+    xjd1JsonFree(pSpilled);
+  }
+  if( sqlite3_reset(p->pRead)!=SQLITE_OK ) return XJD1_ERROR;
+  return XJD1_OK;
+}
+
+/*
+** Look for value pVal in set p. Set *pFound to true if it is found, or to
+** false otherwise. Write the hash of pVal to *pH and *pHasNaN.
+*/
+static int valueSetFind(
+  ValueSet *p,
+  const JsonNode *pVal,
+  unsigned int *pH,
+  int *pHasNaN,
+  int *pFound
+){
+  ValueSetEntry *pEntry;
+  int hasNaN = 0;
+  unsigned int h = xjd1JsonHash(pVal, &hasNaN);
+
+  *pH = h;
+  *pHasNaN = hasNaN;
+  *pFound = 0;
+  for(pEntry=p->aBucket[h & (p->nBucket-1)]; pEntry; pEntry=pEntry->pNext){
+    if( pEntry->h==h && pEntry->hasNaN==hasNaN
+     && xjd1JsonCompare(pEntry->pVal, pVal, 0)==0
+    ){
+      *pFound = 1;
+      return XJD1_OK;
+    }
+  }
+  if( p->iSpill ){
+    return valueSetFindSpilled(p, pVal, h, hasNaN, pFound);
+  }
+  return XJD1_OK;
+}
+
+/*
+** Set *pFound to true if value pVal is in set p, or to false otherwise.
+*/
+int xjd1ValueSetContains(ValueSet *p, const JsonNode *pVal, int *pFound){
+  unsigned int h;
+  int hasNaN;
+  return valueSetFind(p, pVal, &h, &hasNaN, pFound);
+}
+
+/*
+** Add value pVal to set p, unless it is already there. Set *pIsNew to
+** true if the value was added, or to false otherwise. The set takes a
+** new reference to pVal. The caller's reference is unchanged.
+*/
+int xjd1ValueSetInsert(ValueSet *p, JsonNode *pVal, int *pIsNew){
+  ValueSetEntry *pEntry;
+  unsigned int h;
+  int hasNaN;
+  int found;
+  int iBucket;
+  int rc;
+
+  *pIsNew = 0;
+  rc = valueSetFind(p, pVal, &h, &hasNaN, &found);
+  if( rc!=XJD1_OK || found ) return rc;
+  *pIsNew = 1;
+
+  if( p->nEntry>=p->nBucket && valueSetRehash(p)!=XJD1_OK ){
+    return XJD1_NOMEM;
+  }
+  pEntry = xjd1_malloc(sizeof(*pEntry));
+  if( pEntry==0 ) return XJD1_NOMEM;
+  pEntry->h = h;
+  pEntry->hasNaN = hasNaN;
+  pEntry->pVal = xjd1JsonPromote(xjd1JsonRef(pVal));
+  iBucket = h & (p->nBucket-1);
+  pEntry->pNext = p->aBucket[iBucket];
+  p->aBucket[iBucket] = pEntry;
+  p->nEntry++;
+
+  if( p->pConn && p->pConn->mxSortBuffer>=0 ){
+    p->nByte += sizeof(ValueSetEntry) + xjd1JsonSizeof(pVal);
+    if( p->nByte>p->pConn->mxSortBuffer ){
+      return valueSetSpill(p);
+    }
+  }
+  return XJD1_OK;
+}
+
+/*
+** Free a set, and delete any values it wrote to the temporary table.
+*/
+void xjd1ValueSetFree(ValueSet *p){
+  if( p ){
+    valueSetClearEntries(p);
+    if( p->iSpill ){
+      char *zSql = sqlite3_mprintf(
+          "DELETE FROM temp.xjd1_set_spill WHERE id=%lld", p->iSpill);
+      sqlite3_exec(p->pConn->db, zSql, 0, 0, 0);
+      sqlite3_free(zSql);
+    }
+    sqlite3_finalize(p->pWrite);
+    sqlite3_finalize(p->pRead);
+    xjd1_free(p->aBucket);
+    xjd1_free(p);
+  }
+}
@@ -41,6 +41,13 @@ typedef struct xjd1 xjd1;
 /* A prepared statement */
 typedef struct xjd1_stmt xjd1_stmt;
 
+/* A 64-bit signed integer, the same type as sqlite3_int64 */
+#if defined(_MSC_VER) || defined(__BORLANDC__)
+  typedef __int64 xjd1_int64;
+#else
+  typedef long long int xjd1_int64;
+#endif
+
 /* Create, setup, and destroy an execution context */
 int xjd1_context_new(xjd1_context**);
 int xjd1_context_config(xjd1_context*, int, ...);
@@ -60,6 +67,13 @@ int xjd1_open_with_db(xjd1_context*, sqlite3 *db, xjd1**);
 
 /* Operators for xjd1_config() */
 #define XJD1_CONFIG_PARSERTRACE    1
+#define XJD1_CONFIG_DOCCACHE       2   /* int: cache size in bytes */
+#define XJD1_CONFIG_DOCCACHE_STATS 3   /* int *pnHit, int *pnMiss */
+#define XJD1_CONFIG_THREADS        4   /* int: number of scan threads */
+#define XJD1_CONFIG_JOINBUFFER     5   /* int: join buffer size in bytes */
+#define XJD1_CONFIG_SORTBUFFER     6   /* int: sort memory in bytes */
+#define XJD1_CONFIG_PARALLELSORT   7   /* int: rows to sort in parallel */
+#define XJD1_CONFIG_INTERNSTRINGS  8   /* int: longest string rows share */
 
 /* Report on recent errors */
 int xjd1_errcode(xjd1*);
@@ -94,4 +108,13 @@ void *xjd1_malloc(int N);
 void xjd1_free(void *p);
 void *xjd1_realloc(void *p, int N);
 
+/* A size-class allocator for small blocks that may be installed with
+** xjd1_configure_malloc() before any other xjd1 routine is called, and
+** its allocation statistics. */
+void *xjd1_memsys_malloc(int N);
+void xjd1_memsys_free(void *p);
+void *xjd1_memsys_realloc(void *p, int N);
+void xjd1_memsys_stats(xjd1_int64 *pnMalloc, xjd1_int64 *pnHit,
+                       xjd1_int64 *pnCurrent, xjd1_int64 *pnHigh);
+
 #endif /* _XJD1_H */
@@ -42,6 +42,8 @@
 #define TK_ARRAY             105
 #define TK_STRUCT            106
 #define TK_JVALUE            107
+#define TK_CREATEINDEX       108
+#define TK_DROPINDEX         109
 
 /*
 ** A convenience macro for returning the size of an fixed-size array.
@@ -52,27 +54,78 @@
 */
 #define ArraySize(X)    ((int)(sizeof(X)/sizeof(X[0])))
 
+/*
+** Default amount of memory, in bytes, that a join may use to buffer the
+** rows of its right-hand side. See XJD1_CONFIG_JOINBUFFER.
+*/
+#ifndef XJD1_DEFAULT_JOINBUFFER
+# define XJD1_DEFAULT_JOINBUFFER (16*1024*1024)
+#endif
+
+/*
+** Default amount of memory, in bytes, that a sort may use before writing
+** sorted runs to a temporary table. See XJD1_CONFIG_SORTBUFFER.
+*/
+#ifndef XJD1_DEFAULT_SORTBUFFER
+# define XJD1_DEFAULT_SORTBUFFER (16*1024*1024)
+#endif
+
+/*
+** Default number of rows a sort must have before it is split between the
+** worker threads. See XJD1_CONFIG_PARALLELSORT.
+*/
+#ifndef XJD1_DEFAULT_PARALLELSORT
+# define XJD1_DEFAULT_PARALLELSORT 50000
+#endif
+
+/*
+** Default length, in bytes, of the longest string that the rows of a
+** sort share. See XJD1_CONFIG_INTERNSTRINGS.
+*/
+#ifndef XJD1_DEFAULT_INTERNSTRINGS
+# define XJD1_DEFAULT_INTERNSTRINGS 32
+#endif
+
+/*
+** The reference count given to a JsonNode allocated from a Pool. Such
+** nodes are freed with their pool, never by xjd1JsonFree().
+*/
+#define XJD1_POOL_NREF 10000
+
 typedef unsigned char u8;
 typedef unsigned short int u16;
 typedef struct AggExpr AggExpr;
 typedef struct Aggregate Aggregate;
+typedef struct Catalog Catalog;
 typedef struct Command Command;
 typedef struct DataSrc DataSrc;
+typedef struct DocArena DocArena;
+typedef struct DocCache DocCache;
 typedef struct Expr Expr;
 typedef struct ExprItem ExprItem;
 typedef struct ExprList ExprList;
+typedef struct ExprProg ExprProg;
 typedef struct FlattenIter FlattenIter;
 typedef struct Function Function;
+typedef struct GroupTable GroupTable;
+typedef struct Index Index;
+typedef struct JoinBuffer JoinBuffer;
 typedef struct JsonNode JsonNode;
 typedef struct JsonStructElem JsonStructElem;
+typedef struct LabelTable LabelTable;
 typedef struct Parse Parse;
 typedef struct PoolChunk PoolChunk;
 typedef struct Pool Pool;
 typedef struct Query Query;
 typedef struct String String;
+typedef struct SubqueryCache SubqueryCache;
 typedef struct Token Token;
 typedef struct ResultList ResultList;
 typedef struct ResultItem ResultItem;
+typedef struct ResultSpill ResultSpill;
+typedef struct ScanBatch ScanBatch;
+typedef struct ThreadPool ThreadPool;
+typedef struct ValueSet ValueSet;
 
 /* A single allocation from the Pool allocator */
 struct PoolChunk {
@@ -84,6 +137,7 @@ struct Pool {
   PoolChunk *pChunk;                /* List of all memory allocations */
   char *pSpace;                     /* Space available for allocation */
   int nSpace;                       /* Bytes available in pSpace */
+  int szChunk;                      /* Chunk size.  0 for the default */
 };
 
 /* A variable length string */
@@ -114,6 +168,20 @@ struct xjd1 {
   sqlite3 *db;                      /* Storage engine */
   int errCode;                      /* Latest non-zero error code */
   String errMsg;                    /* Latest error message */
+  DocCache *pDocCache;              /* Cache of parsed documents, or NULL */
+  Catalog *pCatalog;                /* Cache of collection metadata */
+  ThreadPool *pThreadPool;          /* Worker threads, or NULL */
+  LabelTable *pLabels;              /* Interned structure labels */
+  int mxJoinBuffer;                 /* Memory for buffering joins, or -1 */
+  int nJoinSpill;                   /* Join buffers spilled to temp table */
+  int mxSortBuffer;                 /* Memory for sorting, or -1 */
+  int nSortSpill;                   /* Sorted runs spilled to temp table */
+  int nParallelSort;                /* Rows to sort in parallel, or -1 */
+  int mxInternString;               /* Longest string sorted rows share */
+  int nSetSpill;                    /* Value sets spilled to temp table */
+  DocArena *pArenaRetained;         /* Released arenas still referenced */
+  int nArenaRetained;               /* Number of arenas on pArenaRetained */
+  int nArenaSweep;                  /* Sweep pArenaRetained at this size */
 };
 
 /* A prepared statement */
@@ -128,6 +196,7 @@ struct xjd1_stmt {
   JsonNode *pDoc;                   /* Current document */
   int okValue;                      /* True if retValue is valid */
   String retValue;                  /* String rendering of return value */
+  int nRewind;                      /* Number of calls to xjd1_stmt_rewind() */
 
   int errCode;                      /* Error code */
   String errMsg;                    /* Error message */
@@ -168,12 +237,17 @@ struct ExprList {
 ** correlated sub-select. If iDatasrc is set to N, where N is 1 or greater,
 ** it refers to the Nth data-source joined together in the FROM clause of
 ** pQuery, counting from left to right.
+**
+** If pProg is not NULL, the expression has been compiled into a program
+** for the virtual machine in expr.c, which is run in place of walking
+** the tree to evaluate it.
 */
 struct Expr {
   u16 eType;                /* Expression node type */
   u16 eClass;               /* Expression class */
   Query *pQuery;            /* Query this expression belongs to.  May be NULL */
   xjd1_stmt *pStmt;         /* Statement this expression belongs to */
+  ExprProg *pProg;          /* Compiled program, or NULL */
   union {
     struct {                /* Binary or unary operator. eClass==XJD1_EXPR_BI */
       Expr *pLeft;             /* Left operand.  Only operand for unary ops */
@@ -182,6 +256,7 @@ struct Expr {
     struct {                /* Substructure nam.  eClass==EXPR_LVALUE */
       Expr *pLeft;             /* Lvalue or id to the left */
       char *zId;               /* ID to the right */
+      int iSlot;               /* Position zId was last found at */
     } lvalue;
     struct {                /* Identifiers */
       char *zId;               /* token value.  eClass=EXPR_TK */
@@ -197,6 +272,7 @@ struct Expr {
     } func;
     struct {                /* Subqueries.  eClass=EXPR_Q */
       Query *p;                /* The subquery */
+      SubqueryCache *pCache;   /* Cache of results, or NULL */
     } subq;
     struct {                /* Literal value.  eClass=EXPR_JSON */
       JsonNode *p;             /* The value */
@@ -269,8 +345,15 @@ struct Parse {
 struct ResultList {
   Pool *pPool;
   int nKey;
-  ResultItem *pSaved;
   ResultItem *pItem;
+  ExprList *pEList;               /* Sort order, or NULL to sort on apKey[0] */
+  xjd1 *pConn;                    /* Connection, or NULL to never spill */
+  int nByte;                      /* Memory used by the pItem list */
+  ResultSpill *pSpill;            /* Runs written to a temp table, or NULL */
+  String sortKey;                 /* Space to build sort keys in */
+  int nStr;                       /* Number of strings in apStr[] */
+  int nStrSlot;                   /* Size of apStr[], a power of two */
+  JsonNode **apStr;               /* Short strings shared by the items */
 };
 
 struct Aggregate {
@@ -291,8 +374,8 @@ struct Query {
       Query *pLeft;               /* Left subquery */
       Query *pRight;              /* Right subquery */
       int doneLeft;               /* True if left has run to completion */
-      ResultList left;            /* Sorted results of pLeft */
-      ResultList right;           /* Sorted results of pRight */
+      ValueSet *pSeen;            /* Results returned so far */
+      ValueSet *pRightSet;        /* Results of pRight, for INTERSECT/EXCEPT */
       JsonNode *pOut;
     } compound;
     struct {                    /* For simple queries */
@@ -304,7 +387,8 @@ struct Query {
       Expr *pHaving;              /* The HAVING clause */
       Aggregate *pAgg;            /* Aggregation info. 0 for non-aggregates */
       ResultList grouped;         /* Grouped results, for GROUP BY queries */
-      ResultList distincted;      /* Distinct results */
+      ValueSet *pDistinct;        /* Results returned so far, for DISTINCT */
+      JsonNode *pDistinctDoc;     /* Current result of a DISTINCT query */
     } simple;
   } u;
   const char *zAs;                /* Alias assigned to result object (if any) */
@@ -315,13 +399,13 @@ struct Query {
   ResultList ordered;             /* Query results in sorted order */
   int bLimitValid;                /* Set to true after nLimit is set */
   int nLimit;                     /* Stop after returning this many more rows */
+  int nSorted;                    /* Sorted rows needed (LIMIT+OFFSET) or -1 */
 };
 
 /* Candidate values for Query.eDocFrom */
 #define XJD1_FROM_DATASRC    0
 #define XJD1_FROM_GROUPED    1
-#define XJD1_FROM_DISTINCTED 2
-#define XJD1_FROM_ORDERED    3
+#define XJD1_FROM_ORDERED    2
 
 /* A Data Source is a representation of a term out of the FROM clause. */
 struct DataSrc {
@@ -335,11 +419,16 @@ struct DataSrc {
       int bStart;              /* True if has already started */
       DataSrc *pLeft;          /* Data source on the left */
       DataSrc *pRight;         /* Data source on the right */
+      JoinBuffer *pBuffer;     /* Buffered rows of pRight, or NULL */
     } join;
     struct {                /* For a named collection.  eDSType==TK_ID */
       char *zName;             /* The collection name */
       sqlite3_stmt *pStmt;     /* Cursor for reading content */
       int eofSeen;             /* True if at EOF */
+      int isStarted;           /* True if a row has been read since rewind */
+      ScanBatch *pBatch;       /* Rows read ahead for parallel decoding */
+      JsonNode *pProj;         /* Parts of each document to parse, or NULL */
+      DocArena *pArena;        /* Memory for the current document */
     } tab;
     struct {                /* For a named collection.  eDSType==TK_ID */
       Expr *pPath;             /* Path to correlated variable */
@@ -372,7 +461,14 @@ struct Command {
     struct {                /* Create or drop table */
       int ifExists;            /* IF [NOT] EXISTS clause */
       char *zName;             /* Name of table */
+      Expr *pOptions;          /* OPTIONS clause.  May be NULL */
     } crtab;
+    struct {                /* Create or drop index */
+      int ifExists;            /* IF [NOT] EXISTS clause */
+      char *zName;             /* Name of index */
+      char *zColl;             /* Collection indexed.  NULL for DROP INDEX */
+      Expr *pPath;             /* Path to the indexed value */
+    } crix;
     struct {                /* Query statement */
       Query *pQuery;           /* The query */
     } q;
@@ -398,6 +494,21 @@ struct Command {
   } u;
 };
 
+/******************************** arena.c ************************************/
+DocArena *xjd1ArenaNew(void);
+void xjd1ArenaFree(DocArena*);
+JsonNode *xjd1ArenaRead(DocArena*,const void*,int,int,const JsonNode*,
+                        LabelTable*);
+JsonNode *xjd1ArenaColumn(DocArena*,sqlite3_stmt*,int,const JsonNode*,
+                          LabelTable*);
+DocArena *xjd1ArenaRelease(xjd1*, DocArena*);
+void xjd1ArenaSweep(xjd1*, int);
+
+/******************************** catalog.c **********************************/
+Index *xjd1CatalogIndices(xjd1*, const char*);
+sqlite3_stmt *xjd1CatalogInsertStmt(xjd1*, const char*, int*);
+void xjd1CatalogFree(xjd1*);
+
 /******************************** context.c **********************************/
 void xjd1ContextUnref(xjd1_context*);
 
@@ -409,18 +520,37 @@ void xjd1Error(xjd1*,int,const char*,...);
 int xjd1DataSrcInit(DataSrc*,Query*,void*);
 int xjd1DataSrcRewind(DataSrc*);
 int xjd1DataSrcStep(DataSrc*);
+int xjd1DataSrcSkip(DataSrc*, int*);
 int xjd1DataSrcClose(DataSrc*);
 int xjd1DataSrcCount(DataSrc*);
 JsonNode *xjd1DataSrcDoc(DataSrc*, const char*);
 int xjd1DataSrcCount(DataSrc *);
 JsonNode *xjd1DataSrcCacheRead(DataSrc *, JsonNode **, const char *zDocname);
 void xjd1DataSrcCacheSave(DataSrc *, JsonNode **);
+void xjd1DataSrcCacheRestore(DataSrc *, JsonNode **);
 int xjd1DataSrcResolve(DataSrc *, const char *zDocname);
 JsonNode *xjd1DataSrcRead(DataSrc *, int);
+DataSrc *xjd1DataSrcLeaf(DataSrc *, int);
+void xjd1DataSrcProjectStart(DataSrc*);
+void xjd1DataSrcProjectPath(DataSrc*, int, Expr*);
+void xjd1DataSrcProject(DataSrc*, Query*);
 
 /******************************** delete.c ***********************************/
 int xjd1DeleteStep(xjd1_stmt*);
 
+/******************************** doccache.c *********************************/
+int xjd1DocCacheConfig(xjd1*, int);
+void xjd1DocCacheStats(xjd1*, int*, int*);
+void xjd1DocCacheInvalidate(xjd1*, const char*, sqlite3_int64);
+void xjd1DocCacheSync(xjd1*);
+void xjd1DocCacheCommit(xjd1*);
+JsonNode *xjd1DocCacheFetch(xjd1*, const char*, sqlite3_int64);
+void xjd1DocCacheStore(xjd1*, const char*, sqlite3_int64, JsonNode*);
+JsonNode *xjd1DocCacheColumn(xjd1*, const char*, sqlite3_stmt*, const JsonNode*,
+                             DocArena*);
+int xjd1DocCacheIsEnabled(xjd1*);
+void xjd1DocCacheFree(xjd1*);
+
 /******************************** expr.c *************************************/
 int xjd1ExprInit(Expr*, xjd1_stmt*, Query*, int, void *);
 int xjd1ExprListInit(ExprList*, xjd1_stmt*, Query*, int, void *);
@@ -428,6 +558,8 @@ JsonNode *xjd1ExprEval(Expr*);
 int xjd1ExprTrue(Expr*);
 int xjd1ExprClose(Expr*);
 int xjd1ExprListClose(ExprList*);
+void xjd1ExprProject(Expr*, Query*);
+void xjd1ExprListProject(ExprList*, Query*);
 
 /* Candidates for the 4th parameter to xjd1ExprInit() */
 #define XJD1_EXPR_RESULT  1
@@ -438,45 +570,112 @@ int xjd1ExprListClose(ExprList*);
 #define XJD1_EXPR_LIMIT   6
 #define XJD1_EXPR_OFFSET  7
 
+/******************************** group.c ************************************/
+GroupTable *xjd1GroupTableNew(Query*);
+int xjd1GroupTableStep(GroupTable*);
+int xjd1GroupTableNext(GroupTable*, JsonNode**);
+void xjd1GroupTableFree(GroupTable*);
+
+/******************************** join.c *************************************/
+JoinBuffer *xjd1JoinBufferNew(DataSrc*);
+int xjd1JoinBufferStep(DataSrc*);
+void xjd1JoinBufferRewind(JoinBuffer*);
+void xjd1JoinBufferFree(JoinBuffer*);
+
 /******************************** json.c *************************************/
 JsonNode *xjd1JsonParse(const char *zIn, int mxIn);
+JsonNode *xjd1JsonExtract(const char *zIn, int mxIn, int, const char**,
+                          const int*, int*);
+JsonNode *xjd1JsonParseProjection(const char*,int,const JsonNode*,LabelTable*,
+                                  Pool*);
 JsonNode *xjd1JsonRef(JsonNode*);
 void xjd1JsonRender(String*, const JsonNode*);
 int xjd1JsonToReal(const JsonNode*, double*);
 int xjd1JsonToString(const JsonNode*, String*);
 int xjd1JsonCompare(const JsonNode*, const JsonNode*, int insensitive);
+unsigned int xjd1JsonHash(const JsonNode*, int*);
+void xjd1JsonSortKey(String*, const JsonNode*, int);
 JsonNode *xjd1JsonNew(Pool*);
 JsonNode *xjd1JsonEdit(JsonNode*);
+JsonStructElem *xjd1JsonFindElem(const JsonNode*, const char*, int*);
 JsonNode *xjd1JsonDeepCopy(JsonNode*);
+JsonNode *xjd1JsonPoolCopy(Pool*, const JsonNode*);
+JsonNode *xjd1JsonPromote(JsonNode*);
 void xjd1JsonFree(JsonNode*);
+int xjd1JsonSizeof(const JsonNode*);
 void xjd1JsonToNull(JsonNode*);
 void xjd1DequoteString(char*,int);
 int xjd1JsonInsert(JsonNode *, const char *, JsonNode *);
 int xjd1JsonTidy(String *, const char *);
 
+/******************************** index.c ************************************/
+int xjd1IndexCreate(xjd1_stmt*);
+int xjd1IndexDrop(xjd1_stmt*);
+void xjd1IndexDropAll(xjd1*, const char *zColl);
+Index *xjd1IndexLoad(xjd1*, const char *zColl);
+void xjd1IndexListFree(Index*);
+int xjd1IndexWrite(Index*, sqlite3_int64, const JsonNode*);
+int xjd1IndexErase(Index*, sqlite3_int64);
+int xjd1IndexClear(xjd1*, Index*);
+char *xjd1IndexScan(Index*, DataSrc*, Expr*, JsonNode**);
+
+/******************************** label.c ************************************/
+LabelTable *xjd1LabelTableNew(void);
+void xjd1LabelTableFree(LabelTable*);
+void xjd1LabelTableFreeze(LabelTable*, int);
+char *xjd1LabelNew(Pool*, LabelTable*, const char*, int);
+char *xjd1LabelDup(Pool*, const char*);
+void xjd1LabelFree(char*);
+
 /******************************** memory.c ***********************************/
 Pool *xjd1PoolNew(void);
 void xjd1PoolClear(Pool*);
+void xjd1PoolRewind(Pool*);
 void xjd1PoolDelete(Pool*);
 void *xjd1PoolMalloc(Pool*, int);
 void *xjd1PoolMallocZero(Pool*, int);
 char *xjd1PoolDup(Pool*, const char *, int);
 void *xjd1MallocZero(int);
 
+/******************************** number.c ***********************************/
+double xjd1RealParse(const char*, int);
+void xjd1RealRender(String*, double);
+
 /******************************** pragma.c ***********************************/
 int xjd1PragmaStep(xjd1_stmt*);
 
+/******************************** pushdown.c *********************************/
+int xjd1PushdownRegister(sqlite3*);
+int xjd1PushdownIsDoc(Expr*, DataSrc*);
+char *xjd1PushdownWhere(Expr*, DataSrc*);
+
 /******************************** query.c ************************************/
 int xjd1QueryInit(Query*,xjd1_stmt*,void*);
 int xjd1QueryRewind(Query*);
 int xjd1QueryStep(Query*);
 int xjd1QueryClose(Query*);
 JsonNode *xjd1QueryDoc(Query*, int);
+void xjd1QueryProject(Query*, Query*);
+void xjd1QueryProjectPath(Query*, int, Expr*);
 
 /******************************** stmt.c *************************************/
 JsonNode *xjd1StmtDoc(xjd1_stmt*);
 void xjd1StmtError(xjd1_stmt *,int,const char*,...);
 
+/******************************** storage.c **********************************/
+void xjd1StorageEncode(String*, const JsonNode*);
+JsonNode *xjd1StorageDecode(const void*, int, LabelTable*);
+JsonNode *xjd1StorageExtract(const void*, int, int, const char**, const int*,
+                             int*);
+JsonNode *xjd1StorageRead(const void*,int,int,const JsonNode*,LabelTable*,
+                          Pool*);
+JsonNode *xjd1StorageColumn(sqlite3_stmt*,int,const JsonNode*,LabelTable*,
+                            Pool*);
+int xjd1StorageIsBinary(sqlite3_stmt*, int);
+int xjd1StorageCollIsBinary(sqlite3*, const char*);
+int xjd1StorageBind(sqlite3_stmt*, int, const JsonNode*, int);
+sqlite3_int64 xjd1StorageInsert(xjd1*, const char*, const JsonNode*);
+
 /******************************** string.c ***********************************/
 int xjd1Strlen30(const char *);
 void xjd1StringInit(String*, Pool*, int);
@@ -492,6 +691,18 @@ void xjd1StringRemovePrefix(String*,int);
 int xjd1StringVAppendF(String*, const char*, va_list);
 int xjd1StringAppendF(String*, const char*, ...);
 
+/******************************** subquery.c *********************************/
+SubqueryCache *xjd1SubqueryCacheNew(Expr*);
+int xjd1SubqueryCacheLookup(SubqueryCache*, JsonNode**);
+void xjd1SubqueryCacheStore(SubqueryCache*, JsonNode*);
+void xjd1SubqueryCacheFree(SubqueryCache*);
+
+
+/******************************** thread.c ***********************************/
+int xjd1ThreadConfig(xjd1*, int);
+int xjd1ThreadCount(xjd1*);
+void xjd1ThreadRun(xjd1*, int, void(*)(void*,int), void*);
+void xjd1ThreadFree(xjd1*);
 
 /******************************** tokenize.c *********************************/
 extern const unsigned char xjd1CtypeMap[];
@@ -515,9 +726,16 @@ void xjd1TraceExprList(String*,int, const ExprList*);
 /******************************** update.c ***********************************/
 int xjd1UpdateStep(xjd1_stmt*);
 
+/******************************** valueset.c *********************************/
+ValueSet *xjd1ValueSetNew(xjd1*);
+int xjd1ValueSetContains(ValueSet*, const JsonNode*, int*);
+int xjd1ValueSetInsert(ValueSet*, JsonNode*, int*);
+void xjd1ValueSetFree(ValueSet*);
+
 /******************************** func.c *************************************/
 int xjd1FunctionInit(Expr *p, xjd1_stmt *pStmt, Query *pQuery, int bAggOk);
 JsonNode *xjd1FunctionEval(Expr *p);
+int xjd1FunctionIsScalar(Expr *p);
 void xjd1FunctionClose(Expr *p);
 
 int xjd1AggregateInit(xjd1_stmt *, Query *, Expr *);
@@ -85,6 +85,7 @@ static Keyword aKeywordTable[] = {
   { "GROUP",        "TK_GROUP",      },
   { "HAVING",       "TK_HAVING",     },
   { "IF",           "TK_IF",         },
+  { "INDEX",        "TK_INDEX",      },
   { "INSERT",       "TK_INSERT",     },
   { "INTERSECT",    "TK_INTERSECT",  },
   { "in",           "TK_IN",         },
@@ -96,6 +97,8 @@ static Keyword aKeywordTable[] = {
   { "NULL",         "TK_NULL",       },
   { "null",         "TK_NULL",       },
   { "OFFSET",       "TK_OFFSET",     },
+  { "ON",           "TK_ON",         },
+  { "OPTIONS",      "TK_OPTIONS",    },
   { "ORDER",        "TK_ORDER",      },
   { "PRAGMA",       "TK_PRAGMA",     },
   { "ROLLBACK",     "TK_ROLLBACK",   },